@@ -20,8 +20,29 @@ include $(CLEAR_VARS)
 
 TARGET_PLATFORM := android-3
 LOCAL_MODULE    := sercd
-LOCAL_SRC_FILES := sercd.c android.c unix.c
+LOCAL_SRC_FILES := sercd.c android.c unix.c history.c pool.c spool.c resume.c control.c timer.c slab.c iosched.c bridge.c modbus.c bus.c baudrate.c logring.c statspage.c latency.c
 LOCAL_CFLAGS    := -DVERSION=\"3.0.0\"
 LOCAL_LDLIBS    := -llog
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    := sercdprobe
+LOCAL_SRC_FILES := sercdprobe.c
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    := sercdstat
+LOCAL_SRC_FILES := sercdstat.c latency.c
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    := sercdcheck
+LOCAL_SRC_FILES := sercdcheck.c baudrate.c logring.c statspage.c latency.c timer.c iosched.c
+
+include $(BUILD_EXECUTABLE)
@@ -26,10 +26,13 @@
 
 #include <jni.h>
 
+/* Returning to Java leaves the process running: commands still
+   queued for the event loop get their error reply here */
 #define exit(code) { \
 	char msg[64]; \
 	sprintf(msg, "Exiting at %d", __LINE__); \
 	LogMsg(LOG_ERR, msg); \
+	CloseControlQueue(); \
 	return code; \
 }
 
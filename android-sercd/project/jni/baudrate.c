@@ -0,0 +1,153 @@
+/*
+ * sercd baud rate support
+ * see file COPYING for license details
+ */
+
+/* The kernel termios, which unlike the C library one carries arbitrary
+   rates; it can't be mixed with <termios.h> */
+#include <sys/ioctl.h>          /* ioctl */
+#include <asm/termbits.h>       /* termios2, BOTHER */
+#include <stddef.h>             /* NULL */
+#include "baudrate.h"
+
+#if defined(TCGETS2) && defined(BOTHER)
+typedef struct termios2 KernelTermios;
+#define GetKernelTermios TCGETS2
+#define SetKernelTermios TCSETSW2
+#else
+typedef struct termios KernelTermios;
+#define GetKernelTermios TCGETS
+#define SetKernelTermios TCSETSW
+#endif
+
+typedef struct
+{
+    unsigned long Rate;
+    unsigned int Code;
+}
+BaudRateType;
+
+/* Standard rates by Rate % BaudHashSize, the smallest size giving every
+   one of them its own slot; a new rate must keep it so */
+#define BaudHashSize 113
+#define BaudSlot(R, C) [(R) % BaudHashSize] = { (R), (C) }
+static const BaudRateType RateSlots[BaudHashSize] = {
+    BaudSlot(0, B0),
+    BaudSlot(50, B50),
+    BaudSlot(75, B75),
+    BaudSlot(110, B110),
+    BaudSlot(134, B134),
+    BaudSlot(150, B150),
+    BaudSlot(200, B200),
+    BaudSlot(300, B300),
+    BaudSlot(600, B600),
+    BaudSlot(1200, B1200),
+    BaudSlot(1800, B1800),
+    BaudSlot(2400, B2400),
+    BaudSlot(4800, B4800),
+    BaudSlot(9600, B9600),
+    BaudSlot(19200, B19200),
+    BaudSlot(38400, B38400),
+    BaudSlot(57600, B57600),
+    BaudSlot(115200, B115200),
+    BaudSlot(230400, B230400),
+    BaudSlot(460800, B460800),
+    BaudSlot(500000, B500000),
+    BaudSlot(576000, B576000),
+    BaudSlot(921600, B921600),
+    BaudSlot(1000000, B1000000),
+    BaudSlot(1152000, B1152000),
+    BaudSlot(1500000, B1500000),
+    BaudSlot(2000000, B2000000),
+    BaudSlot(2500000, B2500000),
+    BaudSlot(3000000, B3000000),
+    BaudSlot(3500000, B3500000),
+    BaudSlot(4000000, B4000000),
+};
+
+/* Standard rates by speed code: B0 to B38400 are 0 to 15, the higher
+   ones follow with CBAUDEX set */
+#define BaudCodeIndex(C) (((C) & CBAUDEX) ? 16 + ((C) & 017) : (C))
+#define BaudCode(R, C) [BaudCodeIndex(C)] = (R)
+static const unsigned long CodeRates[32] = {
+    BaudCode(0, B0),
+    BaudCode(50, B50),
+    BaudCode(75, B75),
+    BaudCode(110, B110),
+    BaudCode(134, B134),
+    BaudCode(150, B150),
+    BaudCode(200, B200),
+    BaudCode(300, B300),
+    BaudCode(600, B600),
+    BaudCode(1200, B1200),
+    BaudCode(1800, B1800),
+    BaudCode(2400, B2400),
+    BaudCode(4800, B4800),
+    BaudCode(9600, B9600),
+    BaudCode(19200, B19200),
+    BaudCode(38400, B38400),
+    BaudCode(57600, B57600),
+    BaudCode(115200, B115200),
+    BaudCode(230400, B230400),
+    BaudCode(460800, B460800),
+    BaudCode(500000, B500000),
+    BaudCode(576000, B576000),
+    BaudCode(921600, B921600),
+    BaudCode(1000000, B1000000),
+    BaudCode(1152000, B1152000),
+    BaudCode(1500000, B1500000),
+    BaudCode(2000000, B2000000),
+    BaudCode(2500000, B2500000),
+    BaudCode(3000000, B3000000),
+    BaudCode(3500000, B3500000),
+    BaudCode(4000000, B4000000),
+};
+
+int
+SetBaudRate(int Fd, unsigned long Rate, unsigned long *Actual)
+{
+    KernelTermios T;
+    const BaudRateType *Slot = &RateSlots[Rate % BaudHashSize];
+
+    if (ioctl(Fd, GetKernelTermios, &T) != 0)
+        return -1;
+
+    /* No separate input rate bits, the input runs at the output rate */
+#ifdef CIBAUD
+    T.c_cflag &= ~(CBAUD | CIBAUD);
+#else
+    T.c_cflag &= ~CBAUD;
+#endif
+    /* Empty slots hold rate 0, whose own slot is taken */
+    if (Slot->Rate == Rate)
+        T.c_cflag |= Slot->Code;
+    else {
+#if defined(TCGETS2) && defined(BOTHER)
+        T.c_cflag |= BOTHER;
+        T.c_ispeed = T.c_ospeed = Rate;
+#else
+        return -1;
+#endif
+    }
+    if (ioctl(Fd, SetKernelTermios, &T) != 0)
+        return -1;
+
+    if (Actual != NULL)
+        *Actual = GetBaudRate(Fd);
+    return 0;
+}
+
+unsigned long
+GetBaudRate(int Fd)
+{
+    KernelTermios T;
+
+    if (ioctl(Fd, GetKernelTermios, &T) != 0)
+        return 0;
+#if defined(TCGETS2) && defined(BOTHER)
+    /* The driver stores the rate it could actually set */
+    if ((T.c_cflag & CBAUD) == BOTHER)
+        return T.c_ospeed;
+#endif
+    return CodeRates[BaudCodeIndex(T.c_cflag & CBAUD)];
+}
@@ -0,0 +1,24 @@
+/*
+ * sercd baud rate support
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_BAUDRATE_H
+#define SERCD_BAUDRATE_H
+
+/* Only plain types here: the kernel termios structures used inside
+   clash with the C library ones of the including files */
+
+/* Set the input and output rate of the port Fd to Rate bps, after
+   pending output was sent, keeping the other settings. Rates without a
+   speed code of their own are set through termios2 where the kernel has
+   it. On success returns 0 and stores the rate the driver actually set
+   in *Actual, if not NULL; returns -1 leaving the port as it was if
+   Rate can't be set. */
+int SetBaudRate(int Fd, unsigned long Rate, unsigned long *Actual);
+
+/* Returns the output rate of the port Fd in bps, 0 if hung up or
+   unknown */
+unsigned long GetBaudRate(int Fd);
+
+#endif /* SERCD_BAUDRATE_H */
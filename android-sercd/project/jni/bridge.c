@@ -0,0 +1,295 @@
+/*
+ * sercd serial to serial bridge
+ * see file COPYING for license details
+ */
+
+#include <stdio.h>              /* snprintf */
+#include <string.h>             /* memcpy */
+#include <unistd.h>             /* write */
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* fcntl */
+#include <sys/select.h>         /* select */
+#include "sercd.h"
+#include "bridge.h"
+#include "control.h"
+
+/* Data read from one device, waiting to be written to the other. A
+   side reads again once all its data is written, so that the read
+   time of the data in flight is known. */
+typedef struct
+{
+    PORTHANDLE Fd;
+    const char *Name;
+    unsigned char Buffer[BridgeBufferSize];
+    size_t Start;
+    size_t End;
+    unsigned long long ReadTime;
+    /* Bytes moved, and read to write latency of the batches */
+    unsigned long long Bytes;
+    unsigned long long Batches;
+    unsigned long long LatencySum;
+    unsigned long long LatencyMax;
+}
+BridgeSideType;
+
+static BridgeSideType Sides[2];
+
+/* Tap records for the monitor session */
+static unsigned char Tap[BridgeTapSize];
+static size_t TapStart = 0;
+static size_t TapEnd = 0;
+static unsigned long TapDropped = 0;
+
+static int Capture = -1;
+static SERCD_SOCKET MonitorSock = -1;
+
+/* Asked to stop once the data in flight is written */
+static Boolean Draining = False;
+
+/* Copy a batch to the capture file and the monitor session */
+static void
+BridgeTap(int Direction, const unsigned char *Data, size_t Len, unsigned long long Time)
+{
+    unsigned char Header[BridgeTapHeader];
+    int i;
+
+    if (Capture < 0 && MonitorSock < 0)
+        return;
+
+    for (i = 7; i >= 0; i--) {
+        Header[i] = (unsigned char) Time;
+        Time >>= 8;
+    }
+    Header[8] = (unsigned char) Direction;
+    Header[9] = (unsigned char) (Len >> 8);
+    Header[10] = (unsigned char) Len;
+
+    if (Capture >= 0 &&
+        (write(Capture, Header, sizeof(Header)) < 0 || write(Capture, Data, Len) < 0)) {
+        LogMsg(LOG_ERR, "Unable to write the capture file, capture stopped.");
+        Capture = -1;
+    }
+
+    if (MonitorSock >= 0) {
+        /* Never let a slow monitor hold the bridge back */
+        if (TapStart == TapEnd)
+            TapStart = TapEnd = 0;
+        if (BridgeTapSize - TapEnd < sizeof(Header) + Len && TapStart > 0) {
+            memmove(Tap, Tap + TapStart, TapEnd - TapStart);
+            TapEnd -= TapStart;
+            TapStart = 0;
+        }
+        if (BridgeTapSize - TapEnd < sizeof(Header) + Len) {
+            TapDropped++;
+            return;
+        }
+        memcpy(Tap + TapEnd, Header, sizeof(Header));
+        memcpy(Tap + TapEnd + sizeof(Header), Data, Len);
+        TapEnd += sizeof(Header) + Len;
+    }
+}
+
+/* Check if a read or write result means the device is gone */
+static Boolean
+BridgeFailed(BridgeSideType * S, ssize_t Result, const char *What)
+{
+    if (Result > 0 || (Result < 0 && (errno == EAGAIN || errno == EINTR)))
+        return False;
+    LogFormat(LOG_ERR, "Bridge %s %s failed: %s", What, S->Name,
+              Result == 0 ? "end of file" : strerror(errno));
+    return True;
+}
+
+static void
+BridgeLogStats(void)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        BridgeSideType *S = &Sides[i];
+        LogFormat(LOG_INFO, "Bridge %s to %s: %llu bytes, latency avg %llu us, max %llu us.",
+                  S->Name, Sides[1 - i].Name, S->Bytes,
+                  S->Batches ? S->LatencySum / S->Batches : 0, S->LatencyMax);
+    }
+    if (TapDropped)
+        LogFormat(LOG_INFO, "Bridge monitor missed %lu records.", TapDropped);
+}
+
+/* Answer the queued control commands. Returns True when asked to
+   stop right away. */
+static Boolean
+BridgeControl(void)
+{
+    ControlCommandType C;
+    char Reply[512];
+    Boolean Stop = False;
+
+    while (GetControlCommand(&C)) {
+        switch (C.Cmd) {
+        case ControlStop:
+            LogMsg(LOG_NOTICE, "Stop requested.");
+            ReplyControlCommand(&C, "ok\n");
+            Stop = True;
+            break;
+        case ControlDrainStop:
+            LogMsg(LOG_NOTICE, "Drain requested, stopping once the buffers are empty.");
+            Draining = True;
+            ReplyControlCommand(&C, "ok\n");
+            break;
+        case ControlStats:
+            snprintf(Reply, sizeof(Reply),
+                     "bridge_bytes %llu %llu\n"
+                     "bridge_latency_avg_us %llu %llu\n"
+                     "bridge_latency_max_us %llu %llu\n"
+                     "monitor_dropped %lu\n",
+                     Sides[0].Bytes, Sides[1].Bytes,
+                     Sides[0].Batches ? Sides[0].LatencySum / Sides[0].Batches : 0,
+                     Sides[1].Batches ? Sides[1].LatencySum / Sides[1].Batches : 0,
+                     Sides[0].LatencyMax, Sides[1].LatencyMax, TapDropped);
+            ReplyControlCommand(&C, Reply);
+            break;
+        default:
+            /* Each device keeps the settings it was bridged with */
+            ReplyControlCommand(&C, "error bridge mode\n");
+            break;
+        }
+    }
+    return Stop;
+}
+
+int
+RunBridge(PORTHANDLE A, const char *NameA, PORTHANDLE B, const char *NameB,
+          int CaptureFd, SERCD_SOCKET * Monitor)
+{
+    int ControlFd = GetControlFd();
+    int Status = Error;
+    ssize_t Result;
+    int i;
+
+    memset(Sides, 0, sizeof(Sides));
+    Sides[0].Fd = A;
+    Sides[0].Name = NameA;
+    Sides[1].Fd = B;
+    Sides[1].Name = NameB;
+    Capture = CaptureFd;
+    Draining = False;
+
+    LogFormat(LOG_NOTICE, "Bridging %s and %s.", NameA, NameB);
+
+    while (True) {
+        fd_set InFdSet, OutFdSet;
+        int highest_fd = MAX(A, B);
+
+        if (Draining && Sides[0].Start == Sides[0].End && Sides[1].Start == Sides[1].End) {
+            Status = NoError;
+            break;
+        }
+
+        FD_ZERO(&InFdSet);
+        FD_ZERO(&OutFdSet);
+        for (i = 0; i < 2; i++) {
+            /* Read from one side when its data is all with the other */
+            if (Sides[i].Start != Sides[i].End)
+                FD_SET(Sides[1 - i].Fd, &OutFdSet);
+            else if (!Draining)
+                FD_SET(Sides[i].Fd, &InFdSet);
+        }
+        if (ControlFd >= 0) {
+            FD_SET(ControlFd, &InFdSet);
+            highest_fd = MAX(highest_fd, ControlFd);
+        }
+        if (Monitor) {
+            FD_SET(*Monitor, &InFdSet);
+            highest_fd = MAX(highest_fd, *Monitor);
+        }
+        if (MonitorSock >= 0) {
+            /* Only a closed session sends anything */
+            FD_SET(MonitorSock, &InFdSet);
+            if (TapStart != TapEnd)
+                FD_SET(MonitorSock, &OutFdSet);
+            highest_fd = MAX(highest_fd, MonitorSock);
+        }
+
+        if (select(highest_fd + 1, &InFdSet, &OutFdSet, NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            LogMsg(LOG_ERR, "Bridge select error.");
+            break;
+        }
+
+        if (ControlFd >= 0 && FD_ISSET(ControlFd, &InFdSet) && BridgeControl()) {
+            Status = NoError;
+            break;
+        }
+
+        for (i = 0; i < 2; i++) {
+            BridgeSideType *S = &Sides[i];
+            BridgeSideType *To = &Sides[1 - i];
+
+            if (FD_ISSET(S->Fd, &InFdSet)) {
+                Result = ReadFromDev(S->Fd, S->Buffer, sizeof(S->Buffer));
+                if (BridgeFailed(S, Result, "read from"))
+                    goto Done;
+                if (Result > 0) {
+                    S->ReadTime = GetTimeMicros();
+                    S->Start = 0;
+                    S->End = Result;
+                    BridgeTap(i, S->Buffer, Result, S->ReadTime);
+
+                    /* Most of the time the other side takes it right
+                       away, saving a select round */
+                    FD_SET(To->Fd, &OutFdSet);
+                }
+            }
+            if (S->Start != S->End && FD_ISSET(To->Fd, &OutFdSet)) {
+                Result = WriteToDev(To->Fd, S->Buffer + S->Start, S->End - S->Start);
+                if (BridgeFailed(To, Result, "write to"))
+                    goto Done;
+                if (Result > 0) {
+                    S->Start += Result;
+                    S->Bytes += Result;
+                }
+                if (S->Start == S->End) {
+                    unsigned long long Latency = GetTimeMicros() - S->ReadTime;
+                    S->Batches++;
+                    S->LatencySum += Latency;
+                    S->LatencyMax = MAX(S->LatencyMax, Latency);
+                }
+            }
+        }
+
+        /* One monitor session at a time, a new one replaces the old */
+        if (Monitor && FD_ISSET(*Monitor, &InFdSet)) {
+            SERCD_SOCKET Sock = accept(*Monitor, NULL, NULL);
+            if (Sock >= 0) {
+                if (MonitorSock >= 0)
+                    closesocket(MonitorSock);
+                fcntl(Sock, F_SETFL, O_NONBLOCK);
+                MonitorSock = Sock;
+                TapStart = TapEnd = 0;
+                LogMsg(LOG_INFO, "Bridge monitor connected.");
+            }
+        }
+        else if (MonitorSock >= 0 && FD_ISSET(MonitorSock, &InFdSet)) {
+            char Discard[64];
+            if (read(MonitorSock, Discard, sizeof(Discard)) <= 0) {
+                closesocket(MonitorSock);
+                MonitorSock = -1;
+                LogMsg(LOG_INFO, "Bridge monitor disconnected.");
+            }
+        }
+        else if (MonitorSock >= 0 && FD_ISSET(MonitorSock, &OutFdSet)) {
+            Result = write(MonitorSock, Tap + TapStart, TapEnd - TapStart);
+            if (Result > 0)
+                TapStart += Result;
+        }
+    }
+
+  Done:
+    BridgeLogStats();
+    if (MonitorSock >= 0) {
+        closesocket(MonitorSock);
+        MonitorSock = -1;
+    }
+    return Status;
+}
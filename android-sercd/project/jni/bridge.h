@@ -0,0 +1,30 @@
+/*
+ * sercd serial to serial bridge
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_BRIDGE_H
+#define SERCD_BRIDGE_H
+
+#include "sercd.h"
+
+/* Bytes moved per read */
+#define BridgeBufferSize 4096
+
+/* Tap data waiting for a slow monitor session; records which don't
+   fit are dropped */
+#define BridgeTapSize 65536
+
+/* Tap record: time in us (8 bytes), direction (1 byte, 0 for the
+   first device to the second), length (2 bytes), all in network
+   order, then the data */
+#define BridgeTapHeader 11
+
+/* Move data between the open devices A and B until one of them fails
+   or a control command stops the bridge. Both directions are copied to
+   CaptureFd unless it is negative, and to a monitor session accepted
+   on Monitor unless it is NULL. Returns Error when a device failed. */
+int RunBridge(PORTHANDLE A, const char *NameA, PORTHANDLE B, const char *NameB,
+              int CaptureFd, SERCD_SOCKET * Monitor);
+
+#endif /* SERCD_BRIDGE_H */
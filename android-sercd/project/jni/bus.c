@@ -0,0 +1,610 @@
+/*
+ * sercd multi-drop bus poll scheduler
+ * see file COPYING for license details
+ */
+
+#include <stdio.h>              /* fopen */
+#include <stdlib.h>             /* strtol */
+#include <string.h>             /* memcpy */
+#include <ctype.h>              /* isspace */
+#include <unistd.h>             /* read */
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* fcntl */
+#include <sys/select.h>         /* select */
+#include <sys/socket.h>         /* accept */
+#include "sercd.h"
+#include "bus.h"
+#include "control.h"
+
+/* One poll of the table */
+typedef struct
+{
+    unsigned int Address;
+    /* Period in us, and the time the poll is due; it should be done
+       before the next one is due */
+    unsigned long long Period;
+    unsigned long long Release;
+    unsigned char Request[BusMaxRequest];
+    size_t RequestLen;
+    /* Expected response length, 0 if it ends with Terminator */
+    size_t ResponseLen;
+    unsigned char Terminator[BusMaxTerminator];
+    size_t TerminatorLen;
+    /* Cycle in which the poll was last done */
+    unsigned long Cycle;
+}
+BusPollType;
+
+/* Measured response time of a slave, in us, smoothed as TCP does its
+   round trip time */
+typedef struct
+{
+    unsigned long long Srtt;
+    unsigned long long Rttvar;
+    Boolean Measured;
+}
+BusSlaveType;
+
+typedef struct
+{
+    /* -1 for a free slot */
+    SERCD_SOCKET Sock;
+    char Out[BusSubscriberOutSize];
+    size_t OutStart;
+    size_t OutEnd;
+}
+BusSubscriberType;
+
+static BusPollType Polls[BusMaxPolls];
+static int PollCount = 0;
+
+static BusSlaveType Slaves[BusMaxSlaves];
+
+static BusSubscriberType Subscribers[BusMaxSubscribers];
+
+/* Poll on the bus, -1 if none. The bus is quiet from QuietTime on, and
+   the next request may be sent one turnaround gap later. */
+static int Current = -1;
+static unsigned long long QuietTime = 0;
+static unsigned long long Deadline = 0;
+
+/* End of the request on the wire, and arrival of the first byte of its
+   response, 0 while none arrived */
+static unsigned long long RequestEnd = 0;
+static unsigned long long FirstByte = 0;
+static unsigned long CharTime;
+static unsigned long Gap;
+
+static unsigned char Tx[BusMaxRequest];
+static size_t TxStart = 0;
+static size_t TxEnd = 0;
+
+static unsigned char Rx[BusMaxResponse];
+static size_t RxLen = 0;
+
+/* Statistics since the last report. A cycle ends when every poll has
+   been done once since it started. */
+static unsigned long long ReportTime = 0;
+static unsigned long long BusyTime = 0;
+static unsigned long Cycle = 1;
+static int CycleDone = 0;
+static unsigned long long CycleStart = 0;
+static unsigned long long CycleLast = 0;
+static unsigned long long CycleMax = 0;
+static unsigned long Done = 0;
+static unsigned long Timeouts = 0;
+static unsigned long Late = 0;
+static unsigned long Dropped = 0;
+
+/* Asked to stop once the poll on the bus is done */
+static Boolean Draining = False;
+
+/* Parse hex bytes into Buf. Returns the length, -1 on a bad string. */
+static long
+ParseHex(const char *Hex, unsigned char *Buf, size_t Size)
+{
+    size_t Len = 0;
+    char Byte[3];
+    char *End;
+
+    if (strlen(Hex) % 2 != 0 || strlen(Hex) / 2 > Size)
+        return -1;
+    Byte[2] = '\0';
+    while (*Hex) {
+        Byte[0] = Hex[0];
+        Byte[1] = Hex[1];
+        Buf[Len++] = (unsigned char) strtoul(Byte, &End, 16);
+        if (*End)
+            return -1;
+        Hex += 2;
+    }
+    return Len;
+}
+
+int
+LoadPollTable(const char *FileName)
+{
+    char Line[1024];
+    char Request[2 * BusMaxRequest + 2];
+    char Response[2 * BusMaxTerminator + 2];
+    unsigned int Address;
+    unsigned long Period;
+    int LineNo = 0;
+    FILE *F;
+
+    if ((F = fopen(FileName, "r")) == NULL) {
+        LogFormat(LOG_ERR, "Unable to open the poll table %s: %s", FileName, strerror(errno));
+        return Error;
+    }
+
+    PollCount = 0;
+    while (fgets(Line, sizeof(Line), F) != NULL) {
+        BusPollType *P = &Polls[PollCount];
+        char *S = Line;
+        long Len;
+
+        LineNo++;
+        while (isspace((unsigned char) *S))
+            S++;
+        if (*S == '\0' || *S == '#')
+            continue;
+
+        memset(P, 0, sizeof(*P));
+        if (PollCount == BusMaxPolls ||
+            sscanf(S, "%u %lu %513s %17s", &Address, &Period, Request, Response) != 4 ||
+            Address >= BusMaxSlaves || Period == 0 ||
+            (Len = ParseHex(Request, P->Request, sizeof(P->Request))) <= 0)
+            goto Bad;
+        P->Address = Address;
+        P->Period = Period * 1000ULL;
+        P->RequestLen = Len;
+        if (Response[0] == '~') {
+            if ((Len = ParseHex(Response + 1, P->Terminator, sizeof(P->Terminator))) <= 0)
+                goto Bad;
+            P->TerminatorLen = Len;
+        }
+        else {
+            P->ResponseLen = strtoul(Response, &S, 10);
+            if (*S || P->ResponseLen == 0 || P->ResponseLen > BusMaxResponse)
+                goto Bad;
+        }
+        PollCount++;
+    }
+    fclose(F);
+
+    if (PollCount == 0) {
+        LogMsg(LOG_ERR, "The poll table is empty.");
+        return Error;
+    }
+    return NoError;
+
+  Bad:
+    fclose(F);
+    LogFormat(LOG_ERR, "Invalid poll table entry at %s:%d.", FileName, LineNo);
+    return Error;
+}
+
+/* Time to wait for the first byte of a response */
+static unsigned long long
+SlaveTimeout(const BusSlaveType * S, long Timeout)
+{
+    unsigned long long T = (unsigned long long) Timeout * 1000;
+
+    if (S->Measured)
+        T = MIN(T, MAX(S->Srtt + 4 * S->Rttvar, BusMinTimeout * 1000ULL));
+    return T;
+}
+
+static void
+SlaveSample(BusSlaveType * S, unsigned long long Sample)
+{
+    if (!S->Measured) {
+        S->Srtt = Sample;
+        S->Rttvar = Sample / 2;
+        S->Measured = True;
+        return;
+    }
+    S->Rttvar = (3 * S->Rttvar + (S->Srtt > Sample ? S->Srtt - Sample : Sample - S->Srtt)) / 4;
+    S->Srtt = (7 * S->Srtt + Sample) / 8;
+}
+
+/* Send a line to all subscribers */
+static void
+Publish(const char *Line, size_t Len)
+{
+    int i;
+
+    for (i = 0; i < BusMaxSubscribers; i++) {
+        BusSubscriberType *S = &Subscribers[i];
+
+        if (S->Sock < 0)
+            continue;
+        /* Never let a slow subscriber hold the bus back */
+        if (S->OutStart == S->OutEnd)
+            S->OutStart = S->OutEnd = 0;
+        if (BusSubscriberOutSize - S->OutEnd < Len && S->OutStart > 0) {
+            memmove(S->Out, S->Out + S->OutStart, S->OutEnd - S->OutStart);
+            S->OutEnd -= S->OutStart;
+            S->OutStart = 0;
+        }
+        if (BusSubscriberOutSize - S->OutEnd < Len) {
+            Dropped++;
+            continue;
+        }
+        memcpy(S->Out + S->OutEnd, Line, Len);
+        S->OutEnd += Len;
+    }
+}
+
+/* Check if the response in Rx is complete */
+static Boolean
+ResponseComplete(const BusPollType * P)
+{
+    if (P->ResponseLen)
+        return RxLen >= P->ResponseLen;
+    return RxLen >= P->TerminatorLen &&
+        memcmp(Rx + RxLen - P->TerminatorLen, P->Terminator, P->TerminatorLen) == 0;
+}
+
+/* The current poll got its response, or timed out. Publishes
+   "time index address status us data" where status is ok, short or
+   timeout, us is the time from the request to the first byte of the
+   response and data is the response in hex. */
+static void
+FinishPoll(Boolean Complete, unsigned long long Now)
+{
+    BusPollType *P = &Polls[Current];
+    BusSlaveType *S = &Slaves[P->Address];
+    char Line[64 + 2 * BusMaxResponse];
+    unsigned long long Response = FirstByte > RequestEnd ? FirstByte - RequestEnd : 0;
+    size_t Len, i;
+
+    BusyTime += RxLen * CharTime;
+    if (FirstByte)
+        SlaveSample(S, Response);
+    else {
+        /* Start over from the longest timeout */
+        S->Measured = False;
+        Timeouts++;
+    }
+
+    Len = snprintf(Line, 64, "%llu %d %u %s %llu ", Now, Current, P->Address,
+                   Complete ? "ok" : RxLen ? "short" : "timeout", Response);
+    for (i = 0; i < RxLen; i++)
+        Len += snprintf(Line + Len, 3, "%02x", Rx[i]);
+    Line[Len++] = '\n';
+    Publish(Line, Len);
+
+    Done++;
+    if (P->Cycle != Cycle) {
+        P->Cycle = Cycle;
+        if (++CycleDone == PollCount) {
+            CycleLast = Now - CycleStart;
+            CycleMax = MAX(CycleMax, CycleLast);
+            CycleStart = Now;
+            CycleDone = 0;
+            Cycle++;
+        }
+    }
+    Current = -1;
+    RxLen = 0;
+}
+
+/* Start the due poll with the earliest deadline, or return the time the
+   next one is due */
+static unsigned long long
+StartPoll(unsigned long long Now)
+{
+    unsigned long long Next = ~0ULL;
+    int i, Best = -1;
+
+    for (i = 0; i < PollCount; i++) {
+        BusPollType *P = &Polls[i];
+        if (P->Release <= Now && (Best < 0 || P->Release + P->Period <
+                                  Polls[Best].Release + Polls[Best].Period))
+            Best = i;
+        Next = MIN(Next, P->Release);
+    }
+    if (Best < 0)
+        return Next;
+    if (Now < QuietTime + Gap)
+        return QuietTime + Gap;
+
+    {
+        BusPollType *P = &Polls[Best];
+
+        if (Now > P->Release + P->Period)
+            Late++;
+        P->Release += P->Period;
+        if (P->Release < Now)
+            P->Release = Now;
+
+        memcpy(Tx, P->Request, P->RequestLen);
+        TxStart = 0;
+        TxEnd = P->RequestLen;
+        RxLen = 0;
+        FirstByte = 0;
+        Current = Best;
+    }
+    return Now;
+}
+
+static void
+BusReport(unsigned long long Now)
+{
+    char Line[TmpStrLen];
+    unsigned long long Elapsed = Now - ReportTime;
+    size_t Len;
+
+    LogFormat(LOG_INFO, "Bus utilization %llu.%llu%%, cycle %llu ms (max %llu ms), %lu polls, "
+              "%lu timeouts, %lu late, %lu results dropped.",
+              Elapsed ? BusyTime * 100 / Elapsed : 0, Elapsed ? BusyTime * 1000 / Elapsed % 10 : 0,
+              CycleLast / 1000, CycleMax / 1000, Done, Timeouts, Late, Dropped);
+
+    /* Subscribers get it as "time stats utilization% cycle_ms ..." */
+    Len = snprintf(Line, sizeof(Line), "%llu stats %llu %llu %llu %lu %lu %lu\n", Now,
+                   Elapsed ? BusyTime * 100 / Elapsed : 0, CycleLast / 1000, CycleMax / 1000,
+                   Done, Timeouts, Late);
+    Publish(Line, MIN(Len, sizeof(Line) - 1));
+
+    ReportTime = Now;
+    BusyTime = 0;
+    CycleMax = 0;
+    Done = Timeouts = Late = Dropped = 0;
+}
+
+/* Check if a device read or write result means it is gone */
+static Boolean
+PollerFailed(const char *Name, ssize_t Result)
+{
+    if (Result > 0 || (Result < 0 && (errno == EAGAIN || errno == EINTR)))
+        return False;
+    LogFormat(LOG_ERR, "Bus device %s failed: %s", Name,
+              Result == 0 ? "end of file" : strerror(errno));
+    return True;
+}
+
+/* Answer the queued control commands. Returns True when asked to
+   stop right away. */
+static Boolean
+PollerControl(unsigned long long Now)
+{
+    ControlCommandType C;
+    char Reply[512];
+    unsigned long long Elapsed = Now - ReportTime;
+    Boolean Stop = False;
+    int i, Connected = 0;
+
+    while (GetControlCommand(&C)) {
+        switch (C.Cmd) {
+        case ControlStop:
+            LogMsg(LOG_NOTICE, "Stop requested.");
+            ReplyControlCommand(&C, "ok\n");
+            Stop = True;
+            break;
+        case ControlDrainStop:
+            LogMsg(LOG_NOTICE, "Drain requested, stopping once the poll on the bus is done.");
+            Draining = True;
+            ReplyControlCommand(&C, "ok\n");
+            break;
+        case ControlStats:
+            /* Counted since the last report, as the report has them */
+            for (i = 0; i < BusMaxSubscribers; i++)
+                Connected += Subscribers[i].Sock >= 0;
+            snprintf(Reply, sizeof(Reply),
+                     "bus_subscribers %d\n"
+                     "bus_utilization_pct %llu\n"
+                     "bus_cycle_ms %llu\n"
+                     "bus_cycle_max_ms %llu\n"
+                     "bus_polls %lu\n"
+                     "bus_timeouts %lu\n"
+                     "bus_late %lu\n"
+                     "bus_dropped %lu\n",
+                     Connected, Elapsed ? BusyTime * 100 / Elapsed : 0, CycleLast / 1000,
+                     CycleMax / 1000, Done, Timeouts, Late, Dropped);
+            ReplyControlCommand(&C, Reply);
+            break;
+        default:
+            /* The bus runs at the speed the poller started with */
+            ReplyControlCommand(&C, "error bus master mode\n");
+            break;
+        }
+    }
+    return Stop;
+}
+
+/* Check if all results went out to the subscribers */
+static Boolean
+ResultsSent(void)
+{
+    int i;
+
+    for (i = 0; i < BusMaxSubscribers; i++) {
+        if (Subscribers[i].Sock >= 0 && Subscribers[i].OutStart != Subscribers[i].OutEnd)
+            return False;
+    }
+    return True;
+}
+
+int
+RunPoller(PORTHANDLE Dev, const char *Name, unsigned long Speed, SERCD_SOCKET Listen,
+          long Timeout)
+{
+    int ControlFd = GetControlFd();
+    int Status = Error;
+    ssize_t Result;
+    int i;
+
+    /* A character is 11 bits, the turnaround gap 3.5 characters */
+    if (Speed == 0)
+        Speed = 9600;
+    CharTime = 11000000UL / Speed;
+    Gap = CharTime * 35 / 10;
+
+    /* The service may run the poller again in the same process */
+    for (i = 0; i < BusMaxSubscribers; i++)
+        Subscribers[i].Sock = -1;
+    memset(Slaves, 0, sizeof(Slaves));
+    Current = -1;
+    Draining = False;
+    TxStart = TxEnd = RxLen = 0;
+    BusyTime = CycleLast = CycleMax = 0;
+    Cycle = 1;
+    CycleDone = 0;
+    Done = Timeouts = Late = Dropped = 0;
+    QuietTime = ReportTime = CycleStart = GetTimeMicros();
+    for (i = 0; i < PollCount; i++) {
+        Polls[i].Release = QuietTime;
+        Polls[i].Cycle = 0;
+    }
+
+    LogFormat(LOG_NOTICE, "Polling %d entries on %s at %lu bps, turnaround %lu us.",
+              PollCount, Name, Speed, Gap);
+
+    while (True) {
+        unsigned long long Now = GetTimeMicros();
+        unsigned long long Wake, Delay;
+        fd_set InFdSet, OutFdSet;
+        struct timeval TV;
+        int highest_fd = MAX(Dev, Listen);
+
+        if (Current >= 0 && TxStart == TxEnd) {
+            if (ResponseComplete(&Polls[Current]))
+                FinishPoll(True, QuietTime);
+            else if (Now >= Deadline)
+                FinishPoll(False, Now);
+        }
+        if (Now >= ReportTime + BusReportInterval * 1000ULL)
+            BusReport(Now);
+        if (Draining && Current < 0 && ResultsSent()) {
+            Status = NoError;
+            break;
+        }
+
+        Wake = ReportTime + BusReportInterval * 1000ULL;
+        if (Current < 0 && !Draining) {
+            unsigned long long Next = StartPoll(Now);
+            Wake = MIN(Wake, Next);
+        }
+        if (TxStart != TxEnd) {
+            Result = WriteToDev(Dev, Tx + TxStart, TxEnd - TxStart);
+            if (PollerFailed(Name, Result))
+                break;
+            if (Result > 0) {
+                TxStart += Result;
+                if (TxStart == TxEnd) {
+                    /* The request is on the wire until the UART sent it */
+                    BusyTime += TxEnd * CharTime;
+                    QuietTime = RequestEnd = Now + TxEnd * CharTime;
+                    Deadline = QuietTime +
+                        SlaveTimeout(&Slaves[Polls[Current].Address], Timeout);
+                }
+            }
+        }
+        if (Current >= 0 && TxStart == TxEnd)
+            Wake = MIN(Wake, Deadline);
+
+        FD_ZERO(&InFdSet);
+        FD_ZERO(&OutFdSet);
+        FD_SET(Dev, &InFdSet);
+        FD_SET(Listen, &InFdSet);
+        if (TxStart != TxEnd)
+            FD_SET(Dev, &OutFdSet);
+        if (ControlFd >= 0) {
+            FD_SET(ControlFd, &InFdSet);
+            highest_fd = MAX(highest_fd, ControlFd);
+        }
+        for (i = 0; i < BusMaxSubscribers; i++) {
+            BusSubscriberType *S = &Subscribers[i];
+            if (S->Sock < 0)
+                continue;
+            FD_SET(S->Sock, &InFdSet);
+            if (S->OutStart != S->OutEnd)
+                FD_SET(S->Sock, &OutFdSet);
+            highest_fd = MAX(highest_fd, S->Sock);
+        }
+
+        Delay = Wake > Now ? Wake - Now : 0;
+        TV.tv_sec = Delay / 1000000;
+        TV.tv_usec = Delay % 1000000;
+        if (select(highest_fd + 1, &InFdSet, &OutFdSet, NULL, &TV) < 0) {
+            if (errno == EINTR)
+                continue;
+            LogMsg(LOG_ERR, "Bus poller select error.");
+            break;
+        }
+
+        if (ControlFd >= 0 && FD_ISSET(ControlFd, &InFdSet) && PollerControl(GetTimeMicros())) {
+            Status = NoError;
+            break;
+        }
+
+        if (FD_ISSET(Dev, &InFdSet)) {
+            unsigned char Buf[BusMaxResponse];
+            Result = ReadFromDev(Dev, Buf, sizeof(Buf));
+            if (PollerFailed(Name, Result))
+                break;
+            if (Result > 0) {
+                QuietTime = GetTimeMicros();
+                /* Data outside a poll is line noise */
+                if (Current >= 0 && TxStart == TxEnd) {
+                    BusPollType *P = &Polls[Current];
+                    if (RxLen == 0) {
+                        FirstByte = QuietTime;
+                        /* The rest of the response must follow at line
+                           speed, or within the timeout for unknown
+                           lengths */
+                        Deadline = QuietTime + Gap + (P->ResponseLen ?
+                                                      P->ResponseLen * CharTime :
+                                                      Timeout * 1000ULL);
+                    }
+                    Result = MIN((size_t) Result, sizeof(Rx) - RxLen);
+                    memcpy(Rx + RxLen, Buf, Result);
+                    RxLen += Result;
+                }
+            }
+        }
+
+        if (FD_ISSET(Listen, &InFdSet)) {
+            SERCD_SOCKET Sock = accept(Listen, NULL, NULL);
+            if (Sock >= 0) {
+                for (i = 0; i < BusMaxSubscribers && Subscribers[i].Sock >= 0; i++);
+                if (i == BusMaxSubscribers) {
+                    LogMsg(LOG_NOTICE, "Bus subscriber refused, too many subscribers.");
+                    closesocket(Sock);
+                }
+                else {
+                    fcntl(Sock, F_SETFL, O_NONBLOCK);
+                    Subscribers[i].Sock = Sock;
+                    Subscribers[i].OutStart = Subscribers[i].OutEnd = 0;
+                    LogMsg(LOG_INFO, "Bus subscriber connected.");
+                }
+            }
+        }
+
+        for (i = 0; i < BusMaxSubscribers; i++) {
+            BusSubscriberType *S = &Subscribers[i];
+
+            if (S->Sock >= 0 && FD_ISSET(S->Sock, &OutFdSet)) {
+                Result = write(S->Sock, S->Out + S->OutStart, S->OutEnd - S->OutStart);
+                if (Result > 0)
+                    S->OutStart += Result;
+            }
+            /* Only a closed subscriber sends anything */
+            if (S->Sock >= 0 && FD_ISSET(S->Sock, &InFdSet)) {
+                char Discard[64];
+                Result = read(S->Sock, Discard, sizeof(Discard));
+                if (Result == 0 || (Result < 0 && errno != EAGAIN && errno != EINTR)) {
+                    closesocket(S->Sock);
+                    S->Sock = -1;
+                    LogMsg(LOG_INFO, "Bus subscriber disconnected.");
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < BusMaxSubscribers; i++)
+        if (Subscribers[i].Sock >= 0)
+            closesocket(Subscribers[i].Sock);
+    return Status;
+}
@@ -0,0 +1,52 @@
+/*
+ * sercd multi-drop bus poll scheduler
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_BUS_H
+#define SERCD_BUS_H
+
+#include "sercd.h"
+
+/* Poll table limits */
+#define BusMaxPolls 128
+#define BusMaxRequest 256
+#define BusMaxResponse 512
+#define BusMaxTerminator 8
+
+/* Slave addresses are 0 to BusMaxSlaves - 1 */
+#define BusMaxSlaves 256
+
+/* Subscribers to the poll results, and result lines waiting for a slow
+   one; lines which don't fit are dropped */
+#define BusMaxSubscribers 16
+#define BusSubscriberOutSize 16384
+
+/* Shortest response timeout in ms, whatever a slave measured */
+#define BusMinTimeout 2
+
+/* Default and longest response timeout in ms */
+#define DEFAULT_BUS_TIMEOUT 500
+
+/* Bus utilization and poll cycle time report interval, in ms */
+#define BusReportInterval 10000
+
+/* Load the poll table from FileName. Each line holds
+
+     address period request response
+
+   with the slave address, the poll period in ms, the request bytes in
+   hex, and either the expected response length in bytes or a ~ and the
+   hex bytes terminating the response. Empty lines and lines starting
+   with # are skipped. Returns Error, logging why, if the table is
+   unusable. */
+int LoadPollTable(const char *FileName);
+
+/* Poll the table on Dev, running at Speed bps, until the device fails
+   or a control command stops the poller, publishing the results to
+   subscribers accepted on Listen. Slaves get at most Timeout ms to
+   respond. Returns Error when the device failed. */
+int RunPoller(PORTHANDLE Dev, const char *Name, unsigned long Speed, SERCD_SOCKET Listen,
+              long Timeout);
+
+#endif /* SERCD_BUS_H */
@@ -0,0 +1,327 @@
+/*
+ * sercd control channel
+ * see file COPYING for license details
+ */
+
+#include <stdio.h>              /* sscanf */
+#include <stdlib.h>             /* malloc */
+#include <string.h>             /* strcmp */
+#include <unistd.h>             /* write */
+#include <fcntl.h>              /* fcntl */
+#include <pthread.h>            /* pthread_create */
+#include <sched.h>              /* sched_yield */
+#include <sys/un.h>             /* sockaddr_un */
+#include <sys/stat.h>           /* chmod */
+#include <sys/time.h>           /* struct timeval */
+#if defined(__linux__) && !defined(ANDROID)
+#include <sys/eventfd.h>        /* eventfd */
+#define HAVE_EVENTFD
+#endif
+#include "sercd.h"
+#include "control.h"
+
+/* Commands go through an intrusive multiple producer, single consumer
+   queue. Producers swap themselves in at Head and then link the
+   previous node to them; the event loop consumes from Tail. Stub keeps
+   the queue from ever running empty of nodes. */
+static ControlCommandType Stub;
+static ControlCommandType *volatile Head = &Stub;
+static ControlCommandType *Tail = &Stub;
+
+/* Wakeup descriptors: an eventfd, or both ends of a pipe where the
+   platform has no eventfd */
+static int WakeFd[2] = { -1, -1 };
+
+static pthread_once_t ControlOnce = PTHREAD_ONCE_INIT;
+
+/* Commands are taken only while the event loop runs. Posters count
+   themselves in before they look at Accepting, so that the loop can
+   wait for them to finish before it empties the queue. */
+static volatile int Accepting = 0;
+static volatile int Posting = 0;
+
+static void
+ControlSetup(void)
+{
+#ifdef HAVE_EVENTFD
+    WakeFd[0] = WakeFd[1] = eventfd(0, EFD_NONBLOCK);
+#else
+    if (pipe(WakeFd) == 0) {
+        fcntl(WakeFd[0], F_SETFL, O_NONBLOCK);
+        fcntl(WakeFd[1], F_SETFL, O_NONBLOCK);
+    }
+#endif
+}
+
+int
+InitControl(void)
+{
+    pthread_once(&ControlOnce, ControlSetup);
+    return WakeFd[0] < 0 ? Error : NoError;
+}
+
+int
+GetControlFd(void)
+{
+    return WakeFd[0];
+}
+
+int
+ParseControlCommand(const char *Line, ControlCommandType * C)
+{
+    char Parity, Extra;
+    int DataSize, StopSize, N;
+
+    memset(C, 0, sizeof(*C));
+    C->ReplyFd = -1;
+
+    if (strcmp(Line, "stop") == 0)
+        C->Cmd = ControlStop;
+    else if (strcmp(Line, "drain") == 0)
+        C->Cmd = ControlDrainStop;
+    else if (strcmp(Line, "stats") == 0)
+        C->Cmd = ControlStats;
+    else if (strcmp(Line, "kick") == 0)
+        C->Cmd = ControlKick;
+    else if (strncmp(Line, "set ", 4) == 0) {
+        C->Cmd = ControlReconfigure;
+        N = sscanf(Line + 4, "%lu %1d%c%1d%c", &C->Speed, &DataSize, &Parity, &StopSize,
+                   &Extra);
+        if (N != 1 && N != 4)
+            return Error;
+        if (N == 1)
+            return C->Speed > 0 ? NoError : Error;
+
+        if (DataSize < 5 || DataSize > 8)
+            return Error;
+        C->DataSize = (unsigned char) DataSize;
+        switch (Parity) {
+        case 'N':
+            C->Parity = TNCOM_NOPARITY;
+            break;
+        case 'O':
+            C->Parity = TNCOM_ODDPARITY;
+            break;
+        case 'E':
+            C->Parity = TNCOM_EVENPARITY;
+            break;
+        case 'M':
+            C->Parity = TNCOM_MARKPARITY;
+            break;
+        case 'S':
+            C->Parity = TNCOM_SPACEPARITY;
+            break;
+        default:
+            return Error;
+        }
+        if (StopSize == 1)
+            C->StopSize = TNCOM_ONESTOPBIT;
+        else if (StopSize == 2)
+            C->StopSize = TNCOM_TWOSTOPBITS;
+        else
+            return Error;
+    }
+    else
+        return Error;
+    return NoError;
+}
+
+/* Publish the node, then link it behind its predecessor. The consumer
+   waits for the link if it catches up in between. */
+static void
+ControlPush(ControlCommandType * Node)
+{
+    ControlCommandType *Prev;
+
+    Node->Next = NULL;
+    __sync_synchronize();
+    Prev = __sync_lock_test_and_set(&Head, Node);
+    Prev->Next = Node;
+    __sync_synchronize();
+}
+
+int
+PostControlCommand(const ControlCommandType * C)
+{
+    ControlCommandType *Node;
+#ifdef HAVE_EVENTFD
+    uint64_t One = 1;
+#else
+    char One = 1;
+#endif
+
+    if (InitControl() != NoError)
+        return Error;
+
+    __sync_fetch_and_add(&Posting, 1);
+    if (!Accepting || (Node = malloc(sizeof(*Node))) == NULL) {
+        __sync_fetch_and_sub(&Posting, 1);
+        return Error;
+    }
+    *Node = *C;
+    ControlPush(Node);
+    __sync_fetch_and_sub(&Posting, 1);
+
+    /* Fails only if a wakeup is pending anyway */
+    write(WakeFd[1], &One, sizeof(One));
+    return NoError;
+}
+
+/* Unlink the oldest node, NULL if the queue is empty or a producer is
+   still linking its node */
+static ControlCommandType *
+ControlPop(void)
+{
+    ControlCommandType *T = Tail;
+    ControlCommandType *Next = T->Next;
+
+    if (T == &Stub) {
+        if (Next == NULL)
+            return NULL;
+        Tail = T = Next;
+        Next = T->Next;
+    }
+    if (Next) {
+        Tail = Next;
+        return T;
+    }
+    if (T != Head)
+        return NULL;
+
+    /* T is the last node: put the stub behind it to unlink it */
+    ControlPush(&Stub);
+    Next = T->Next;
+    if (Next) {
+        Tail = Next;
+        return T;
+    }
+    return NULL;
+}
+
+Boolean
+GetControlCommand(ControlCommandType * C)
+{
+    ControlCommandType *Node;
+    char Drain[64];
+
+    /* Clear the wakeup before looking at the queue, so that commands
+       posted from now on wake us again */
+    while (read(WakeFd[0], Drain, sizeof(Drain)) > 0);
+
+    __sync_synchronize();
+    Node = ControlPop();
+    if (Node == NULL)
+        return False;
+
+    *C = *Node;
+    free(Node);
+    return True;
+}
+
+void
+OpenControlQueue(void)
+{
+    Accepting = 1;
+    __sync_synchronize();
+}
+
+void
+CloseControlQueue(void)
+{
+    ControlCommandType C;
+
+    Accepting = 0;
+    __sync_synchronize();
+    while (Posting)
+        sched_yield();
+    while (GetControlCommand(&C))
+        ReplyControlCommand(&C, "error not running\n");
+}
+
+void
+ReplyControlCommand(ControlCommandType * C, const char *Reply)
+{
+    if (C->ReplyFd < 0)
+        return;
+    if (write(C->ReplyFd, Reply, strlen(Reply)) < 0)
+        LogMsg(LOG_INFO, "Unable to send a control reply.");
+    close(C->ReplyFd);
+    C->ReplyFd = -1;
+}
+
+/* Read a line command from each connection and queue it, the event
+   loop replies and closes the connection */
+static void *
+ControlSocketThread(void *Arg)
+{
+    int LSock = (int) (long) Arg;
+    ControlCommandType C;
+    char Line[ControlMaxLine];
+    char *End;
+    size_t Len;
+    ssize_t Got;
+    int Sock;
+    struct timeval Timeout = { ControlReadTimeout, 0 };
+
+    while (True) {
+        Sock = accept(LSock, NULL, NULL);
+        if (Sock < 0)
+            continue;
+
+        /* A silent peer must not hold up the commands of others */
+        setsockopt(Sock, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+        Len = 0;
+        End = NULL;
+        while (Len < sizeof(Line) - 1 && End == NULL &&
+               (Got = read(Sock, Line + Len, sizeof(Line) - 1 - Len)) > 0) {
+            End = memchr(Line + Len, '\n', Got);
+            Len += Got;
+        }
+        if (End != NULL)
+            Len = End - Line;
+        if (Len > 0 && Line[Len - 1] == '\r')
+            Len--;
+        Line[Len] = '\0';
+
+        if (ParseControlCommand(Line, &C) != NoError) {
+            C.ReplyFd = Sock;
+            ReplyControlCommand(&C, "error unknown command\n");
+            continue;
+        }
+        C.ReplyFd = Sock;
+        if (PostControlCommand(&C) != NoError) {
+            ReplyControlCommand(&C, "error\n");
+        }
+    }
+    return NULL;
+}
+
+int
+StartControlSocket(const char *Path)
+{
+    struct sockaddr_un sun;
+    pthread_t Thread;
+    int Sock;
+
+    if (InitControl() != NoError)
+        return Error;
+
+    Sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Sock < 0)
+        return Error;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, Path, sizeof(sun.sun_path) - 1);
+    unlink(Path);
+    /* Only our user may send commands; nobody can connect before
+       listen, so the mode is set in time */
+    if (bind(Sock, (struct sockaddr *) &sun, sizeof(sun)) || chmod(Path, 0600) < 0 ||
+        listen(Sock, 4) < 0 ||
+        pthread_create(&Thread, NULL, ControlSocketThread, (void *) (long) Sock) != 0) {
+        close(Sock);
+        return Error;
+    }
+    pthread_detach(Thread);
+    return NoError;
+}
@@ -0,0 +1,84 @@
+/*
+ * sercd control channel
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_CONTROL_H
+#define SERCD_CONTROL_H
+
+#include "sercd.h"
+
+/* Commands to a running sercd */
+typedef enum
+{
+    /* Close everything and exit */
+    ControlStop,
+    /* Stop taking new data, flush the buffers, then exit */
+    ControlDrainStop,
+    /* Reply with the current counters */
+    ControlStats,
+    /* Change the port settings */
+    ControlReconfigure,
+    /* Drop the current client */
+    ControlKick
+}
+ControlCmd;
+
+typedef struct ControlCommand
+{
+    /* Queue link, owned by the queue */
+    struct ControlCommand *volatile Next;
+    ControlCmd Cmd;
+    /* New settings for ControlReconfigure, 0 leaves a setting unchanged */
+    unsigned long Speed;
+    unsigned char DataSize;
+    unsigned char Parity;
+    unsigned char StopSize;
+    /* The reply is written there and the descriptor closed, -1 for
+       no reply */
+    int ReplyFd;
+}
+ControlCommandType;
+
+/* Maximum length of a text command */
+#define ControlMaxLine 128
+
+/* Seconds a control connection may take to send its command */
+#define ControlReadTimeout 5
+
+/* Set up the queue and its wakeup descriptor. May be called from any
+   thread, only the first call has an effect. Returns NoError on
+   success. */
+int InitControl(void);
+
+/* Descriptor becoming readable when commands are queued */
+int GetControlFd(void);
+
+/* Parse a text command such as "stop", "drain", "stats", "kick" or
+   "set 115200 8N1". Returns NoError on success. */
+int ParseControlCommand(const char *Line, ControlCommandType * C);
+
+/* Queue a copy of the command and wake the event loop. Safe to call
+   from any thread. Returns Error if the queue is closed. */
+int PostControlCommand(const ControlCommandType * C);
+
+/* Get the oldest queued command, from the event loop only. Returns
+   False if none is queued. */
+Boolean GetControlCommand(ControlCommandType * C);
+
+/* Start taking commands, once the event loop is about to run */
+void OpenControlQueue(void);
+
+/* Stop taking commands and answer those still queued with an error,
+   when the event loop is gone. Commands posted meanwhile are
+   refused. */
+void CloseControlQueue(void);
+
+/* Send the reply of a command and close its reply descriptor */
+void ReplyControlCommand(ControlCommandType * C, const char *Reply);
+
+/* Accept text commands on the Unix socket at Path, from a background
+   thread. Returns NoError on success. */
+int StartControlSocket(const char *Path);
+
+#endif /* SERCD_CONTROL_H */
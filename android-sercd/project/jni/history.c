@@ -0,0 +1,161 @@
+/*
+ * sercd device output history
+ * see file COPYING for license details
+ */
+
+#include <stdlib.h>             /* malloc */
+#include <string.h>             /* memcpy */
+#include "sercd.h"
+#include "history.h"
+
+/* Allocate the history ring. Size 0 disables the history. */
+int
+InitHistory(HistoryType * H, size_t Size, long MaxAge)
+{
+    memset(H, 0, sizeof(*H));
+    if (Size == 0)
+        return NoError;
+
+    H->Buffer = malloc(Size);
+    if (H->Buffer == NULL)
+        return Error;
+    H->Size = Size;
+    H->MaxAge = MaxAge;
+    return NoError;
+}
+
+/* Record a time mark if the current second has no mark yet */
+static void
+HistoryMark(HistoryType * H)
+{
+    time_t Now = time(NULL);
+    unsigned int Last;
+
+    if (H->MarkCount > 0) {
+        Last = (H->FirstMark + H->MarkCount - 1) % HistoryMaxMarks;
+        if (H->Marks[Last].Time == Now)
+            return;
+    }
+
+    if (H->MarkCount == HistoryMaxMarks) {
+        /* Drop the oldest mark; its data is attributed to the next one */
+        H->FirstMark = (H->FirstMark + 1) % HistoryMaxMarks;
+        H->MarkCount--;
+    }
+
+    Last = (H->FirstMark + H->MarkCount) % HistoryMaxMarks;
+    H->Marks[Last].Time = Now;
+    H->Marks[Last].Start = H->Total;
+    H->MarkCount++;
+}
+
+/* Record device output into the history */
+void
+AddToHistory(HistoryType * H, const unsigned char *Data, size_t Len)
+{
+    size_t Pos, Chunk;
+
+    if (Len == 0)
+        return;
+
+    if (H->MaxAge > 0)
+        HistoryMark(H);
+
+    /* Only the tail of an oversized block fits */
+    if (Len > H->Size) {
+        H->Total += Len - H->Size;
+        Data += Len - H->Size;
+        Len = H->Size;
+    }
+
+    Pos = H->Total % H->Size;
+    Chunk = MIN(Len, H->Size - Pos);
+    memcpy(H->Buffer + Pos, Data, Chunk);
+    memcpy(H->Buffer, Data + Chunk, Len - Chunk);
+    H->Total += Len;
+    H->Kept = MIN(H->Kept + Len, H->Size);
+}
+
+/* Start a replay of the recorded history */
+unsigned long long
+StartHistoryReplay(HistoryType * H)
+{
+    unsigned long long Start = H->Total - H->Kept;
+    unsigned int i;
+
+    if (H->MaxAge > 0) {
+        time_t Limit = time(NULL) - H->MaxAge;
+
+        /* Skip data read before the age limit */
+        for (i = 0; i < H->MarkCount; i++) {
+            HistoryMarkType *M = &H->Marks[(H->FirstMark + i) % HistoryMaxMarks];
+            if (M->Time >= Limit) {
+                if (H->Total - M->Start < H->Total - Start)
+                    Start = M->Start;
+                break;
+            }
+        }
+        if (i == H->MarkCount)
+            Start = H->Total;
+    }
+
+    H->ReplayPos = Start;
+    H->Replaying = True;
+    return H->Total - Start;
+}
+
+/* Start a replay at Offset */
+int
+StartHistoryReplayAt(HistoryType * H, unsigned long long Offset)
+{
+    /* An offset ahead of Total wraps to a distance beyond the ring */
+    if (H->Total - Offset > H->Kept)
+        return Error;
+
+    H->ReplayPos = Offset;
+    H->Replaying = True;
+    return NoError;
+}
+
+/* Forget all recorded data */
+void
+ResetHistory(HistoryType * H)
+{
+    H->Total = 0;
+    H->Kept = 0;
+    H->FirstMark = 0;
+    H->MarkCount = 0;
+    H->Replaying = False;
+}
+
+/* Get the next contiguous block of replay data */
+size_t
+GetHistoryReplayString(HistoryType * H, unsigned char **Data)
+{
+    size_t Pos;
+
+    if (!H->Replaying || H->Total == H->ReplayPos)
+        return 0;
+
+    /* Data overwritten while replaying is lost */
+    if (H->Total - H->ReplayPos > H->Kept)
+        H->ReplayPos = H->Total - H->Kept;
+
+    Pos = H->ReplayPos % H->Size;
+    *Data = H->Buffer + Pos;
+    return MIN(H->Total - H->ReplayPos, H->Size - Pos);
+}
+
+/* Advance the replay cursor */
+void
+HistoryReplayPopBytes(HistoryType * H, size_t Len)
+{
+    H->ReplayPos += Len;
+}
+
+/* Abort a running replay */
+void
+StopHistoryReplay(HistoryType * H)
+{
+    H->Replaying = False;
+}
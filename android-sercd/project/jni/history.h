@@ -0,0 +1,79 @@
+/*
+ * sercd device output history
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_HISTORY_H
+#define SERCD_HISTORY_H
+
+#include "sercd.h"
+#include <sys/types.h>
+#include <time.h>
+
+/* Maximum number of time marks kept in the history. One mark is
+   recorded for every second with device activity, so this bounds the
+   time resolution of old data, not the amount of data. */
+#define HistoryMaxMarks 256
+
+/* Time mark: device output starting at Start was read at Time */
+typedef struct
+{
+    time_t Time;
+    unsigned long long Start;
+}
+HistoryMarkType;
+
+/* History ring of raw (unescaped) device output */
+typedef struct
+{
+    unsigned char *Buffer;
+    size_t Size;
+    /* Maximum age of replayed data in seconds, 0 means no limit */
+    long MaxAge;
+    /* Total number of bytes ever recorded. Offsets in the Total space
+       are 64 bits wide on every ABI, and compared through their
+       distance to Total. */
+    unsigned long long Total;
+    /* Number of bytes still in the ring, the newest ones */
+    size_t Kept;
+    HistoryMarkType Marks[HistoryMaxMarks];
+    unsigned int FirstMark;
+    unsigned int MarkCount;
+    /* Replay cursor, as an offset in the Total space */
+    Boolean Replaying;
+    unsigned long long ReplayPos;
+}
+HistoryType;
+
+/* Allocate the history ring. Size 0 disables the history. Returns
+   NoError on success. */
+int InitHistory(HistoryType * H, size_t Size, long MaxAge);
+
+/* Check if the history is enabled */
+#define IsHistoryEnabled(H) ((H)->Size != 0)
+
+/* Record device output into the history */
+void AddToHistory(HistoryType * H, const unsigned char *Data, size_t Len);
+
+/* Start a replay of the recorded history. Returns the number of bytes
+   to be replayed. */
+unsigned long long StartHistoryReplay(HistoryType * H);
+
+/* Start a replay at Offset, counted from the last reset. Returns
+   Error if the data at Offset is not recorded anymore. */
+int StartHistoryReplayAt(HistoryType * H, unsigned long long Offset);
+
+/* Forget all recorded data */
+void ResetHistory(HistoryType * H);
+
+/* Get the next contiguous block of replay data, without removing
+   it. Returns the length of the block, 0 when the replay is done. */
+size_t GetHistoryReplayString(HistoryType * H, unsigned char **Data);
+
+/* Advance the replay cursor */
+void HistoryReplayPopBytes(HistoryType * H, size_t Len);
+
+/* Abort a running replay */
+void StopHistoryReplay(HistoryType * H);
+
+#endif /* SERCD_HISTORY_H */
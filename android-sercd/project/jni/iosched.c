@@ -0,0 +1,158 @@
+/*
+ * sercd I/O scheduler
+ * see file COPYING for license details
+ */
+
+#include <string.h>             /* memset */
+#include "sercd.h"
+#include "iosched.h"
+
+/* Deficit round-robin: every round each direction with data is
+   credited a quantum and may read up to its deficit, over as many loop
+   iterations as it takes. A round ends once no direction with data has
+   budget left, so a direction whose reads are short is not outrun by
+   one reading full buffers. A direction which had more data than its
+   deficit keeps the rest for the next round; one which ran out of data
+   goes idle, and gets its quantum at once when data comes again instead
+   of waiting for the busy one to finish its round, but no more than one
+   quantum per round. A token bucket on top caps the long term rate. */
+typedef struct
+{
+    size_t Deficit;
+    Boolean Idle;
+    /* Round in which the direction got its last quantum */
+    unsigned long Credited;
+    /* Rate cap in bytes per second, 0 for none */
+    unsigned long Rate;
+    /* Bytes the rate cap allows now, and at most */
+    unsigned long long Tokens;
+    unsigned long long Depth;
+    /* Refill not yet counted in Tokens, in millionths of a byte */
+    unsigned long long Fraction;
+}
+SchedQueueType;
+
+static SchedQueueType Queues[SchedDirections];
+static size_t Quantum = DEFAULT_SCHED_QUANTUM;
+static unsigned long Round = 0;
+static unsigned long long LastRefill = 0;
+
+static void
+SchedSetRate(SchedQueueType * Q, unsigned long Rate)
+{
+    Q->Rate = Rate;
+    /* Allow bursts of 100 ms, and at least one quantum */
+    Q->Depth = MAX((unsigned long long) Rate / 10, Quantum);
+    Q->Tokens = Q->Depth;
+}
+
+void
+InitSched(size_t NewQuantum, unsigned long ToNetRate, unsigned long ToDevRate)
+{
+    int D;
+
+    memset(Queues, 0, sizeof(Queues));
+    Quantum = MAX(NewQuantum, 1);
+    for (D = 0; D < SchedDirections; D++) {
+        Queues[D].Idle = True;
+        Queues[D].Credited = ~0UL;
+    }
+    Round = 0;
+    SchedSetRate(&Queues[SchedToNet], ToNetRate);
+    SchedSetRate(&Queues[SchedToDev], ToDevRate);
+    LastRefill = 0;
+}
+
+void
+SchedRound(unsigned long long Now, unsigned int Ready)
+{
+    unsigned long long Elapsed = LastRefill ? Now - LastRefill : 0;
+    Boolean RoundOver = True;
+    int D;
+
+    LastRefill = Now;
+    for (D = 0; D < SchedDirections; D++) {
+        SchedQueueType *Q = &Queues[D];
+
+        if (Q->Rate) {
+            Q->Fraction += Elapsed * Q->Rate;
+            Q->Tokens = MIN(Q->Tokens + Q->Fraction / 1000000, Q->Depth);
+            Q->Fraction %= 1000000;
+        }
+        if (!(Ready & SchedReady(D)))
+            continue;
+        if (Q->Idle) {
+            Q->Idle = False;
+            if (Q->Credited != Round) {
+                Q->Deficit = Quantum;
+                Q->Credited = Round;
+            }
+        }
+        /* A direction held back by its rate cap holds up nobody */
+        if (Q->Deficit > 0 && (!Q->Rate || Q->Tokens >= Q->Deficit))
+            RoundOver = False;
+    }
+    if (!RoundOver || Ready == 0)
+        return;
+
+    Round++;
+    for (D = 0; D < SchedDirections; D++) {
+        SchedQueueType *Q = &Queues[D];
+
+        /* Two quanta bound the carried deficit */
+        if (Ready & SchedReady(D)) {
+            Q->Deficit = MIN(Q->Deficit + Quantum, 2 * Quantum);
+            Q->Credited = Round;
+        }
+    }
+}
+
+Boolean
+SchedThrottled(SchedDirection D)
+{
+    return Queues[D].Rate && Queues[D].Tokens == 0;
+}
+
+size_t
+SchedBudget(SchedDirection D)
+{
+    SchedQueueType *Q = &Queues[D];
+
+    if (Q->Rate)
+        return (size_t) MIN(Q->Deficit, Q->Tokens);
+    return Q->Deficit;
+}
+
+void
+SchedCharge(SchedDirection D, size_t Bytes, size_t Budget)
+{
+    SchedQueueType *Q = &Queues[D];
+
+    if (Q->Rate)
+        Q->Tokens -= MIN(Bytes, Q->Tokens);
+    if (Bytes < Budget) {
+        Q->Deficit = 0;
+        Q->Idle = True;
+    }
+    else
+        Q->Deficit -= MIN(Bytes, Q->Deficit);
+}
+
+long
+SchedThrottleTimeout(void)
+{
+    long Timeout = -1, Wait;
+    int D;
+
+    for (D = 0; D < SchedDirections; D++) {
+        SchedQueueType *Q = &Queues[D];
+
+        if (!Q->Rate || Q->Tokens > 0)
+            continue;
+        /* Time to earn a quantum, rather than waking for every byte */
+        Wait = (long) ((MIN(Quantum, Q->Depth) * 1000 + Q->Rate - 1) / Q->Rate);
+        if (Timeout < 0 || Wait < Timeout)
+            Timeout = Wait;
+    }
+    return Timeout;
+}
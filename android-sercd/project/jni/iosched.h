@@ -0,0 +1,54 @@
+/*
+ * sercd I/O scheduler
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_IOSCHED_H
+#define SERCD_IOSCHED_H
+
+#include "sercd.h"
+#include <sys/types.h>
+
+/* Traffic directions, each with its own budget */
+typedef enum
+{
+    /* Device input going to the network */
+    SchedToNet,
+    /* Network input going to the device */
+    SchedToDev,
+    SchedDirections
+}
+SchedDirection;
+
+/* Bit of direction D in the Ready mask of SchedRound() */
+#define SchedReady(D) (1U << (D))
+
+/* Default bytes each direction may read per scheduling round */
+#define DEFAULT_SCHED_QUANTUM 512
+
+/* Set the per round quantum and the rate caps in bytes per second, 0
+   for no cap */
+void InitSched(size_t Quantum, unsigned long ToNetRate, unsigned long ToDevRate);
+
+/* Account a wakeup at Now us in which the directions in Ready had
+   data: refill the rate caps, give a direction which just turned busy
+   a quantum, and start a new round, crediting every ready direction a
+   quantum, once none of them has budget left */
+void SchedRound(unsigned long long Now, unsigned int Ready);
+
+/* Check if direction D is out of its rate cap and must not be polled */
+Boolean SchedThrottled(SchedDirection D);
+
+/* Bytes direction D may read in this round, 0 if it has to wait for
+   the next one */
+size_t SchedBudget(SchedDirection D);
+
+/* Account Bytes read in direction D out of Budget. A direction which
+   used less than its budget has no backlog and loses its deficit. */
+void SchedCharge(SchedDirection D, size_t Bytes, size_t Budget);
+
+/* Milliseconds until a direction throttled by its rate cap may read
+   again, -1 if none is throttled */
+long SchedThrottleTimeout(void);
+
+#endif /* SERCD_IOSCHED_H */
@@ -0,0 +1,66 @@
+/*
+ * sercd latency histograms
+ * see file COPYING for license details
+ */
+
+#include "latency.h"
+
+/* Bucket of a time. Above 2 * LatencySub us the top LatencySubBits + 1
+   bits select the bucket, the leading one standing for the power of
+   two. */
+static unsigned int
+LatencyBucket(uint64_t Us)
+{
+    unsigned int Shift;
+
+    if (Us < 2 * LatencySub)
+        return (unsigned int) Us;
+    if (Us > 0xFFFFFFFFUL)
+        Us = 0xFFFFFFFFUL;
+    Shift = 31 - __builtin_clz((uint32_t) Us) - LatencySubBits;
+    return (Shift + 1) * LatencySub + (unsigned int) (Us >> Shift) - LatencySub;
+}
+
+/* Shortest time of a bucket */
+static uint64_t
+LatencyBucketStart(unsigned int Bucket)
+{
+    if (Bucket < 2 * LatencySub)
+        return Bucket;
+    return (uint64_t) (LatencySub + Bucket % LatencySub) << (Bucket / LatencySub - 1);
+}
+
+void
+RecordLatency(LatencyHistType * H, uint64_t Us)
+{
+    H->Buckets[LatencyBucket(Us)]++;
+    H->Count++;
+    H->Sum += Us;
+    if (Us > H->Max)
+        H->Max = Us;
+}
+
+uint64_t
+LatencyPercentile(const LatencyHistType * H, double Fraction)
+{
+    uint64_t Rank, Seen = 0;
+    unsigned int i;
+
+    if (H->Count == 0)
+        return 0;
+    /* Rank of the time looked for, from 1 */
+    Rank = (uint64_t) (Fraction * H->Count);
+    if (Rank < Fraction * H->Count)
+        Rank++;
+    if (Rank < 1)
+        Rank = 1;
+
+    for (i = 0; i < LatencyBuckets - 1; i++) {
+        Seen += H->Buckets[i];
+        if (Seen >= Rank)
+            break;
+    }
+    if (i == LatencyBuckets - 1 || LatencyBucketStart(i + 1) - 1 > H->Max)
+        return H->Max;
+    return LatencyBucketStart(i + 1) - 1;
+}
@@ -0,0 +1,38 @@
+/*
+ * sercd latency histograms
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_LATENCY_H
+#define SERCD_LATENCY_H
+
+/* Only fixed size types here, the histograms are part of the stats
+   page */
+#include <stdint.h>
+
+/* Log-linear buckets: one per us below 2 * LatencySub us, above that
+   LatencySub per power of two, so a bucket is at most 1/LatencySub of
+   its values wide. Times from 2^32 us up share the last bucket. */
+#define LatencySubBits 4
+#define LatencySub (1 << LatencySubBits)
+#define LatencyBuckets ((32 - LatencySubBits + 1) * LatencySub)
+
+typedef struct
+{
+    uint64_t Count;
+    /* Sum and longest of the recorded times, in us */
+    uint64_t Sum;
+    uint64_t Max;
+    uint64_t Buckets[LatencyBuckets];
+}
+LatencyHistType;
+
+/* Add a time of Us us */
+void RecordLatency(LatencyHistType * H, uint64_t Us);
+
+/* The time in us which Fraction of the recorded times don't exceed,
+   e.g. 0.999 for p99.9, rounded up to the end of its bucket. 0 if
+   nothing was recorded. */
+uint64_t LatencyPercentile(const LatencyHistType * H, double Fraction);
+
+#endif /* SERCD_LATENCY_H */
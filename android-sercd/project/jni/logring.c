@@ -0,0 +1,170 @@
+/*
+ * sercd asynchronous logging
+ * see file COPYING for license details
+ */
+
+#include <stdio.h>              /* vsnprintf */
+#include <unistd.h>             /* pipe */
+#include <fcntl.h>              /* fcntl */
+#include <pthread.h>            /* pthread_create */
+#include "sercd.h"
+#include "logring.h"
+
+/* A bounded multiple producer, single consumer ring. Seq of a slot
+   equals the position a producer may claim it at, one more once the
+   record is published, and the position plus LogRingSlots once the
+   log thread is done with it. Producers claim positions with a compare
+   and swap, so that a full ring makes them drop instead of wait. */
+typedef struct
+{
+    volatile unsigned long Seq;
+    int Level;
+    char Text[LogRingTextSize];
+}
+LogRecordType;
+
+static LogRecordType Ring[LogRingSlots];
+static volatile unsigned long WritePos = 0;
+static volatile unsigned long ReadPos = 0;
+static volatile unsigned long Dropped = 0;
+static volatile Boolean Running = False;
+
+/* Set by the log thread before it blocks on the wakeup pipe. A
+   producer clearing it writes the wakeup, so the event loop only pays
+   for a syscall when the thread is idle. */
+static volatile int Sleeping = 0;
+static int WakeFd[2] = { -1, -1 };
+
+static pthread_once_t LogRingOnce = PTHREAD_ONCE_INIT;
+
+static void
+WakeLogThread(void)
+{
+    if (Sleeping && __sync_bool_compare_and_swap(&Sleeping, 1, 0) &&
+        write(WakeFd[1], "", 1) < 0) {
+        /* The pipe is full, the thread is awake anyway */
+    }
+}
+
+Boolean
+LogRingFormat(int LogLevel, const char *Format, va_list Args)
+{
+    LogRecordType *R;
+    unsigned long Pos;
+
+    if (!Running)
+        return False;
+
+    for (;;) {
+        Pos = WritePos;
+        R = &Ring[Pos & (LogRingSlots - 1)];
+        if (R->Seq == Pos) {
+            if (__sync_bool_compare_and_swap(&WritePos, Pos, Pos + 1))
+                break;
+        }
+        else if ((long) (R->Seq - Pos) < 0) {
+            /* Full, the log thread still has the slot */
+            __sync_fetch_and_add(&Dropped, 1);
+            return True;
+        }
+        /* Otherwise another producer claimed Pos first */
+    }
+
+    R->Level = LogLevel;
+    vsnprintf(R->Text, sizeof(R->Text), Format, Args);
+    __sync_synchronize();
+    R->Seq = Pos + 1;
+    __sync_synchronize();
+    WakeLogThread();
+    return True;
+}
+
+/* Emit one published record, if any. Returns False if the ring is
+   empty. */
+static Boolean
+EmitNextRecord(void)
+{
+    LogRecordType *R = &Ring[ReadPos & (LogRingSlots - 1)];
+
+    if (R->Seq != ReadPos + 1)
+        return False;
+    __sync_synchronize();
+    EmitLogMsg(R->Level, R->Text);
+    __sync_synchronize();
+    R->Seq = ReadPos + LogRingSlots;
+    ReadPos = ReadPos + 1;
+    return True;
+}
+
+static void *
+LogRingThread(void *Arg)
+{
+    unsigned long Reported = 0;
+    char Msg[TmpStrLen];
+    char Drain[64];
+
+    (void) Arg;
+    while (True) {
+        while (EmitNextRecord());
+
+        if (Dropped != Reported) {
+            snprintf(Msg, sizeof(Msg), "%lu log messages dropped.", Dropped - Reported);
+            Msg[sizeof(Msg) - 1] = '\0';
+            Reported = Dropped;
+            EmitLogMsg(LOG_WARNING, Msg);
+        }
+
+        /* Announce the sleep before the last look at the ring: a
+           producer publishing after that look sees the flag */
+        Sleeping = 1;
+        __sync_synchronize();
+        if (EmitNextRecord()) {
+            Sleeping = 0;
+            continue;
+        }
+        while (read(WakeFd[0], Drain, sizeof(Drain)) < 0);
+    }
+    return NULL;
+}
+
+static void
+LogRingSetup(void)
+{
+    pthread_t Thread;
+    unsigned long i;
+
+    for (i = 0; i < LogRingSlots; i++)
+        Ring[i].Seq = i;
+    if (pipe(WakeFd) != 0)
+        return;
+    fcntl(WakeFd[1], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&Thread, NULL, LogRingThread, NULL) != 0) {
+        close(WakeFd[0]);
+        close(WakeFd[1]);
+        return;
+    }
+    pthread_detach(Thread);
+    __sync_synchronize();
+    Running = True;
+}
+
+int
+StartLogRing(void)
+{
+    pthread_once(&LogRingOnce, LogRingSetup);
+    return Running ? NoError : Error;
+}
+
+void
+FlushLogRing(void)
+{
+    unsigned long Pos = WritePos;
+    int Waited;
+
+    if (!Running)
+        return;
+    for (Waited = 0; (long) (ReadPos - Pos) < 0 && Waited < LogFlushTimeout; Waited++) {
+        WakeLogThread();
+        usleep(1000);
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * sercd asynchronous logging
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_LOGRING_H
+#define SERCD_LOGRING_H
+
+#include <stdarg.h>
+#include "sercd.h"
+
+/* Messages waiting for the log thread, a power of two; more are
+   dropped and counted */
+#define LogRingSlots 256
+
+/* Longest message, including the terminating NUL */
+#define LogRingTextSize TmpStrLen
+
+/* Longest wait for the log thread to emit the queued messages at exit,
+   in ms */
+#define LogFlushTimeout 1000
+
+/* Start the thread emitting queued messages. May be called from any
+   thread, only the first call has an effect. Returns NoError on
+   success. */
+int StartLogRing(void);
+
+/* Format a message into the ring for the log thread, never blocking.
+   Returns False if the log thread isn't running, leaving Args unused,
+   for the caller to log synchronously. Safe to call from any thread. */
+Boolean LogRingFormat(int LogLevel, const char *Format, va_list Args);
+
+/* Wait for the log thread to emit the messages queued so far, at
+   most LogFlushTimeout ms */
+void FlushLogRing(void);
+
+#endif /* SERCD_LOGRING_H */
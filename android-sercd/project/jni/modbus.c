@@ -0,0 +1,659 @@
+/*
+ * sercd Modbus TCP to RTU gateway
+ * see file COPYING for license details
+ */
+
+#include <stdio.h>              /* snprintf */
+#include <string.h>             /* memcpy */
+#include <unistd.h>             /* read */
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* fcntl */
+#include <sys/select.h>         /* select */
+#include <sys/socket.h>         /* accept */
+#include "sercd.h"
+#include "modbus.h"
+#include "control.h"
+
+/* Function codes */
+#define ModbusReadCoils 1
+#define ModbusReadDiscretes 2
+#define ModbusReadRegisters 3
+#define ModbusReadInputs 4
+#define ModbusWriteCoil 5
+#define ModbusWriteRegister 6
+#define ModbusWriteCoils 15
+#define ModbusWriteRegisters 16
+#define ModbusException 0x80
+
+/* Exception codes sent by the gateway itself */
+#define ModbusBusy 0x06
+#define ModbusNoResponse 0x0B
+
+/* Read requests are cached on unit, function, address and count */
+#define ModbusKeyLen 6
+
+typedef struct
+{
+    /* -1 for a free slot */
+    SERCD_SOCKET Sock;
+    /* Changes with every connection in the slot, so that responses to
+       a gone client are not sent to the next one */
+    unsigned int Generation;
+    unsigned char In[ModbusMaxAdu];
+    size_t InLen;
+    unsigned char Out[ModbusClientOutSize];
+    size_t OutStart;
+    size_t OutEnd;
+}
+ModbusClientType;
+
+typedef struct
+{
+    int Client;
+    unsigned int Generation;
+    unsigned char Tid[2];
+    unsigned char Unit;
+    unsigned char Pdu[ModbusMaxPdu];
+    size_t PduLen;
+}
+ModbusRequestType;
+
+typedef struct
+{
+    unsigned char Key[ModbusKeyLen];
+    /* Time of the response in us, 0 for a free entry */
+    unsigned long long Time;
+    unsigned char Pdu[ModbusMaxPdu];
+    size_t PduLen;
+}
+ModbusCacheType;
+
+static ModbusClientType Clients[ModbusMaxClients];
+
+/* Requests in arrival order, the first one is on the bus while
+   Waiting is set */
+static ModbusRequestType Queue[ModbusQueueSize];
+static unsigned int QueueHead = 0;
+static unsigned int QueueCount = 0;
+
+static ModbusCacheType Cache[ModbusCacheSize];
+
+/* Bus state. The bus is quiet from QuietTime on, and a frame may be
+   sent one inter-frame gap later. */
+static Boolean Waiting = False;
+static unsigned long long QuietTime = 0;
+static unsigned long long Deadline = 0;
+static unsigned long Gap;
+
+/* RTU frame being sent */
+static unsigned char Tx[ModbusMaxPdu + 3];
+static size_t TxStart = 0;
+static size_t TxEnd = 0;
+
+/* Response being received */
+static unsigned char Rx[ModbusMaxPdu + 3];
+static size_t RxLen = 0;
+
+static unsigned short CrcTable[256];
+
+static unsigned long long Requests = 0;
+static unsigned long long CacheHits = 0;
+static unsigned long long Timeouts = 0;
+static unsigned long long CrcErrors = 0;
+static unsigned long long Rejected = 0;
+
+/* Asked to stop once the queued requests are answered */
+static Boolean Draining = False;
+
+static void
+InitCrc(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < 256; i++) {
+        unsigned short Crc = i;
+        for (j = 0; j < 8; j++)
+            Crc = (Crc & 1) ? (Crc >> 1) ^ 0xA001 : Crc >> 1;
+        CrcTable[i] = Crc;
+    }
+}
+
+static unsigned short
+ModbusCrc(const unsigned char *Data, size_t Len)
+{
+    unsigned short Crc = 0xFFFF;
+
+    while (Len--)
+        Crc = (Crc >> 8) ^ CrcTable[(Crc ^ *Data++) & 0xFF];
+    return Crc;
+}
+
+/* Only plain register and bit reads are cached */
+static Boolean
+IsCacheable(const ModbusRequestType * R)
+{
+    return R->PduLen == ModbusKeyLen - 1 &&
+        R->Pdu[0] >= ModbusReadCoils && R->Pdu[0] <= ModbusReadInputs;
+}
+
+static Boolean
+IsWrite(unsigned char Function)
+{
+    return Function == ModbusWriteCoil || Function == ModbusWriteRegister ||
+        Function == ModbusWriteCoils || Function == ModbusWriteRegisters;
+}
+
+static ModbusCacheType *
+CacheLookup(const ModbusRequestType * R, long CacheTime, unsigned long long Now)
+{
+    int i;
+
+    for (i = 0; i < ModbusCacheSize; i++) {
+        ModbusCacheType *E = &Cache[i];
+        if (E->Time && E->Key[0] == R->Unit && memcmp(E->Key + 1, R->Pdu, ModbusKeyLen - 1) == 0)
+            return Now - E->Time <= (unsigned long long) CacheTime * 1000 ? E : NULL;
+    }
+    return NULL;
+}
+
+/* Store a response, replacing the entry of the same request or else the
+   oldest one */
+static void
+CacheStore(const ModbusRequestType * R, const unsigned char *Pdu, size_t Len,
+           unsigned long long Now)
+{
+    ModbusCacheType *E = &Cache[0];
+    int i;
+
+    for (i = 0; i < ModbusCacheSize; i++) {
+        if (Cache[i].Time && Cache[i].Key[0] == R->Unit &&
+            memcmp(Cache[i].Key + 1, R->Pdu, ModbusKeyLen - 1) == 0) {
+            E = &Cache[i];
+            break;
+        }
+        if (Cache[i].Time < E->Time)
+            E = &Cache[i];
+    }
+    E->Key[0] = R->Unit;
+    memcpy(E->Key + 1, R->Pdu, ModbusKeyLen - 1);
+    memcpy(E->Pdu, Pdu, Len);
+    E->PduLen = Len;
+    E->Time = Now;
+}
+
+/* A write may change anything the unit reports, a broadcast anything
+   any unit reports */
+static void
+CacheInvalidate(unsigned char Unit)
+{
+    int i;
+
+    for (i = 0; i < ModbusCacheSize; i++)
+        if (Unit == 0 || Cache[i].Key[0] == Unit)
+            Cache[i].Time = 0;
+}
+
+static void
+DropClient(int i)
+{
+    closesocket(Clients[i].Sock);
+    Clients[i].Sock = -1;
+}
+
+/* Queue a response for the client of R, if it is still there */
+static void
+Reply(const ModbusRequestType * R, const unsigned char *Pdu, size_t Len)
+{
+    ModbusClientType *C = &Clients[R->Client];
+    unsigned char *P;
+
+    if (C->Sock < 0 || C->Generation != R->Generation)
+        return;
+
+    if (C->OutStart == C->OutEnd)
+        C->OutStart = C->OutEnd = 0;
+    if (ModbusClientOutSize - C->OutEnd < ModbusMbapHeader + Len && C->OutStart > 0) {
+        memmove(C->Out, C->Out + C->OutStart, C->OutEnd - C->OutStart);
+        C->OutEnd -= C->OutStart;
+        C->OutStart = 0;
+    }
+    if (ModbusClientOutSize - C->OutEnd < ModbusMbapHeader + Len) {
+        LogMsg(LOG_NOTICE, "Modbus client not reading its responses, dropped.");
+        DropClient(R->Client);
+        return;
+    }
+
+    P = C->Out + C->OutEnd;
+    P[0] = R->Tid[0];
+    P[1] = R->Tid[1];
+    P[2] = 0;
+    P[3] = 0;
+    P[4] = (unsigned char) ((Len + 1) >> 8);
+    P[5] = (unsigned char) (Len + 1);
+    P[6] = R->Unit;
+    memcpy(P + ModbusMbapHeader, Pdu, Len);
+    C->OutEnd += ModbusMbapHeader + Len;
+}
+
+static void
+ReplyException(const ModbusRequestType * R, unsigned char Code)
+{
+    unsigned char Pdu[2];
+
+    Pdu[0] = R->Pdu[0] | ModbusException;
+    Pdu[1] = Code;
+    Reply(R, Pdu, sizeof(Pdu));
+}
+
+/* Take a request of client i, answering it from the cache if possible */
+static void
+HandleRequest(int i, const unsigned char *Adu, size_t Len, long CacheTime)
+{
+    ModbusRequestType *R;
+    ModbusCacheType *E;
+
+    Requests++;
+    if (QueueCount == ModbusQueueSize) {
+        ModbusRequestType Busy;
+        Busy.Client = i;
+        Busy.Generation = Clients[i].Generation;
+        memcpy(Busy.Tid, Adu, 2);
+        Busy.Unit = Adu[6];
+        Busy.Pdu[0] = Adu[ModbusMbapHeader];
+        Rejected++;
+        ReplyException(&Busy, ModbusBusy);
+        return;
+    }
+
+    R = &Queue[(QueueHead + QueueCount) % ModbusQueueSize];
+    R->Client = i;
+    R->Generation = Clients[i].Generation;
+    memcpy(R->Tid, Adu, 2);
+    R->Unit = Adu[6];
+    R->PduLen = Len - ModbusMbapHeader;
+    memcpy(R->Pdu, Adu + ModbusMbapHeader, R->PduLen);
+
+    if (CacheTime > 0 && IsCacheable(R) &&
+        (E = CacheLookup(R, CacheTime, GetTimeMicros())) != NULL) {
+        CacheHits++;
+        Reply(R, E->Pdu, E->PduLen);
+        return;
+    }
+    QueueCount++;
+}
+
+/* Split the input of client i into requests. Returns Error on a
+   malformed one. */
+static int
+ParseRequests(int i, long CacheTime)
+{
+    ModbusClientType *C = &Clients[i];
+    size_t Len;
+
+    while (C->InLen >= ModbusMbapHeader) {
+        Len = 6 + ((C->In[4] << 8) | C->In[5]);
+        if (C->In[2] != 0 || C->In[3] != 0 || Len < ModbusMbapHeader + 1 || Len > ModbusMaxAdu)
+            return Error;
+        if (C->InLen < Len)
+            break;
+        HandleRequest(i, C->In, Len, CacheTime);
+        if (C->Sock < 0)
+            return NoError;
+        memmove(C->In, C->In + Len, C->InLen - Len);
+        C->InLen -= Len;
+    }
+    return NoError;
+}
+
+static void
+PopRequest(void)
+{
+    QueueHead = (QueueHead + 1) % ModbusQueueSize;
+    QueueCount--;
+}
+
+/* Put the first queued request on the bus once the gap has passed,
+   serving it from the cache when an identical request ahead of it has
+   just been answered */
+static void
+StartRequest(long CacheTime, unsigned long long Now)
+{
+    ModbusCacheType *E;
+    unsigned short Crc;
+
+    while (!Waiting && TxStart == TxEnd && QueueCount > 0) {
+        ModbusRequestType *R = &Queue[QueueHead];
+
+        if (CacheTime > 0 && IsCacheable(R) && (E = CacheLookup(R, CacheTime, Now)) != NULL) {
+            CacheHits++;
+            Reply(R, E->Pdu, E->PduLen);
+            PopRequest();
+            continue;
+        }
+        if (Now < QuietTime + Gap)
+            return;
+
+        if (IsWrite(R->Pdu[0]) || R->Unit == 0)
+            CacheInvalidate(R->Unit);
+        Tx[0] = R->Unit;
+        memcpy(Tx + 1, R->Pdu, R->PduLen);
+        Crc = ModbusCrc(Tx, R->PduLen + 1);
+        Tx[R->PduLen + 1] = (unsigned char) Crc;
+        Tx[R->PduLen + 2] = (unsigned char) (Crc >> 8);
+        TxStart = 0;
+        TxEnd = R->PduLen + 3;
+        RxLen = 0;
+        Waiting = True;
+    }
+}
+
+/* Length of the response frame in Rx, 0 while it is not known; others
+   end with the inter-frame gap */
+static size_t
+ResponseLength(void)
+{
+    if (RxLen < 2)
+        return 0;
+    if (Rx[1] & ModbusException)
+        return 5;
+    switch (Rx[1]) {
+    case ModbusReadCoils:
+    case ModbusReadDiscretes:
+    case ModbusReadRegisters:
+    case ModbusReadInputs:
+        return RxLen < 3 ? 0 : 5 + (size_t) Rx[2];
+    case ModbusWriteCoil:
+    case ModbusWriteRegister:
+    case ModbusWriteCoils:
+    case ModbusWriteRegisters:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/* The response to the request on the bus is complete, or it timed out
+   if RxLen is 0 */
+static void
+FinishRequest(long CacheTime, unsigned long long Now)
+{
+    ModbusRequestType *R = &Queue[QueueHead];
+
+    Waiting = False;
+    if (R->Unit == 0) {
+        /* Broadcasts get no response */
+    }
+    else if (RxLen == 0) {
+        Timeouts++;
+        LogFormat(LOG_INFO, "Modbus unit %u did not respond.", R->Unit);
+        ReplyException(R, ModbusNoResponse);
+    }
+    else if (RxLen < 4 || ModbusCrc(Rx, RxLen - 2) != (Rx[RxLen - 2] | (Rx[RxLen - 1] << 8)) ||
+             Rx[0] != R->Unit || (Rx[1] & ~ModbusException) != R->Pdu[0]) {
+        CrcErrors++;
+        LogFormat(LOG_INFO, "Modbus unit %u sent a corrupt response.", R->Unit);
+        ReplyException(R, ModbusNoResponse);
+    }
+    else {
+        if (CacheTime > 0 && IsCacheable(R) && !(Rx[1] & ModbusException))
+            CacheStore(R, Rx + 1, RxLen - 3, Now);
+        Reply(R, Rx + 1, RxLen - 3);
+    }
+    PopRequest();
+    RxLen = 0;
+}
+
+/* Check if a device read or write result means it is gone */
+static Boolean
+GatewayFailed(const char *Name, ssize_t Result)
+{
+    if (Result > 0 || (Result < 0 && (errno == EAGAIN || errno == EINTR)))
+        return False;
+    LogFormat(LOG_ERR, "Modbus device %s failed: %s", Name,
+              Result == 0 ? "end of file" : strerror(errno));
+    return True;
+}
+
+static void
+GatewayLogStats(void)
+{
+    LogFormat(LOG_INFO, "Modbus gateway: %llu requests, %llu from cache, %llu timeouts, "
+              "%llu corrupt responses, %llu refused while busy.",
+              Requests, CacheHits, Timeouts, CrcErrors, Rejected);
+}
+
+/* Answer the queued control commands. Returns True when asked to
+   stop right away. */
+static Boolean
+GatewayControl(void)
+{
+    ControlCommandType C;
+    char Reply[512];
+    Boolean Stop = False;
+    int i, Connected = 0;
+
+    while (GetControlCommand(&C)) {
+        switch (C.Cmd) {
+        case ControlStop:
+            LogMsg(LOG_NOTICE, "Stop requested.");
+            ReplyControlCommand(&C, "ok\n");
+            Stop = True;
+            break;
+        case ControlDrainStop:
+            LogMsg(LOG_NOTICE, "Drain requested, stopping once the requests are answered.");
+            Draining = True;
+            ReplyControlCommand(&C, "ok\n");
+            break;
+        case ControlStats:
+            for (i = 0; i < ModbusMaxClients; i++)
+                Connected += Clients[i].Sock >= 0;
+            snprintf(Reply, sizeof(Reply),
+                     "modbus_clients %d\n"
+                     "modbus_queued %u\n"
+                     "modbus_requests %llu\n"
+                     "modbus_cache_hits %llu\n"
+                     "modbus_timeouts %llu\n"
+                     "modbus_crc_errors %llu\n"
+                     "modbus_rejected %llu\n",
+                     Connected, QueueCount, Requests, CacheHits, Timeouts, CrcErrors, Rejected);
+            ReplyControlCommand(&C, Reply);
+            break;
+        default:
+            /* The bus runs at the speed the gateway started with */
+            ReplyControlCommand(&C, "error gateway mode\n");
+            break;
+        }
+    }
+    return Stop;
+}
+
+/* Check if all answers went out to the clients */
+static Boolean
+RepliesSent(void)
+{
+    int i;
+
+    for (i = 0; i < ModbusMaxClients; i++) {
+        if (Clients[i].Sock >= 0 && Clients[i].OutStart != Clients[i].OutEnd)
+            return False;
+    }
+    return True;
+}
+
+int
+RunGateway(PORTHANDLE Dev, const char *Name, unsigned long Speed, SERCD_SOCKET Listen,
+           long CacheTime, long Timeout)
+{
+    int ControlFd = GetControlFd();
+    int Status = Error;
+    unsigned long CharTime;
+    ssize_t Result;
+    int i;
+
+    /* A character is 11 bits; above 19200 bps the gap is fixed */
+    if (Speed == 0)
+        Speed = 9600;
+    CharTime = 11000000UL / Speed;
+    Gap = Speed > 19200 ? 1750 : CharTime * 35 / 10;
+
+    /* The service may run the gateway again in the same process */
+    InitCrc();
+    for (i = 0; i < ModbusMaxClients; i++)
+        Clients[i].Sock = -1;
+    memset(Cache, 0, sizeof(Cache));
+    QueueHead = QueueCount = 0;
+    Waiting = Draining = False;
+    TxStart = TxEnd = RxLen = 0;
+    Requests = CacheHits = Timeouts = CrcErrors = Rejected = 0;
+    QuietTime = GetTimeMicros();
+
+    LogFormat(LOG_NOTICE, "Modbus gateway on %s at %lu bps, frame gap %lu us.",
+              Name, Speed, Gap);
+
+    while (True) {
+        unsigned long long Now = GetTimeMicros();
+        unsigned long long Wake = 0;
+        fd_set InFdSet, OutFdSet;
+        struct timeval TV;
+        int highest_fd = MAX(Dev, Listen);
+
+        /* A response ends when its length is reached, or else with the
+           inter-frame gap */
+        if (Waiting && TxStart == TxEnd) {
+            size_t Expected = ResponseLength();
+            if ((Expected && RxLen >= Expected) ||
+                (RxLen > 0 && Now >= QuietTime + Gap) || Now >= Deadline) {
+                FinishRequest(CacheTime, Now);
+                QuietTime = MAX(QuietTime, Now);
+            }
+        }
+        if (Draining && QueueCount == 0 && !Waiting && RepliesSent()) {
+            Status = NoError;
+            break;
+        }
+        StartRequest(CacheTime, Now);
+        if (TxStart != TxEnd) {
+            Result = WriteToDev(Dev, Tx + TxStart, TxEnd - TxStart);
+            if (GatewayFailed(Name, Result))
+                break;
+            if (Result > 0) {
+                TxStart += Result;
+                if (TxStart == TxEnd) {
+                    /* The frame is on the wire until the UART sent it */
+                    QuietTime = Now + TxEnd * CharTime;
+                    Deadline = QuietTime +
+                        (Queue[QueueHead].Unit == 0 ? ModbusTurnaround : Timeout) * 1000ULL;
+                }
+            }
+        }
+
+        FD_ZERO(&InFdSet);
+        FD_ZERO(&OutFdSet);
+        FD_SET(Dev, &InFdSet);
+        if (!Draining)
+            FD_SET(Listen, &InFdSet);
+        if (TxStart != TxEnd)
+            FD_SET(Dev, &OutFdSet);
+        if (ControlFd >= 0) {
+            FD_SET(ControlFd, &InFdSet);
+            highest_fd = MAX(highest_fd, ControlFd);
+        }
+        for (i = 0; i < ModbusMaxClients; i++) {
+            ModbusClientType *C = &Clients[i];
+            if (C->Sock < 0)
+                continue;
+            /* A drained gateway takes no new requests */
+            if (!Draining)
+                FD_SET(C->Sock, &InFdSet);
+            if (C->OutStart != C->OutEnd)
+                FD_SET(C->Sock, &OutFdSet);
+            highest_fd = MAX(highest_fd, C->Sock);
+        }
+
+        if (Waiting && TxStart == TxEnd)
+            Wake = RxLen > 0 ? MIN(QuietTime + Gap, Deadline) : Deadline;
+        else if (!Waiting && QueueCount > 0)
+            Wake = QuietTime + Gap;
+        if (Wake) {
+            unsigned long long Delay = Wake > Now ? Wake - Now : 0;
+            TV.tv_sec = Delay / 1000000;
+            TV.tv_usec = Delay % 1000000;
+        }
+        if (select(highest_fd + 1, &InFdSet, &OutFdSet, NULL, Wake ? &TV : NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            LogMsg(LOG_ERR, "Modbus gateway select error.");
+            break;
+        }
+
+        if (ControlFd >= 0 && FD_ISSET(ControlFd, &InFdSet) && GatewayControl()) {
+            Status = NoError;
+            break;
+        }
+
+        if (FD_ISSET(Dev, &InFdSet)) {
+            unsigned char Buf[ModbusMaxPdu + 3];
+            Result = ReadFromDev(Dev, Buf, sizeof(Buf));
+            if (GatewayFailed(Name, Result))
+                break;
+            if (Result > 0) {
+                QuietTime = GetTimeMicros();
+                /* Data outside a request is line noise */
+                if (Waiting && TxStart == TxEnd) {
+                    Result = MIN((size_t) Result, sizeof(Rx) - RxLen);
+                    memcpy(Rx + RxLen, Buf, Result);
+                    RxLen += Result;
+                }
+            }
+        }
+
+        if (FD_ISSET(Listen, &InFdSet)) {
+            SERCD_SOCKET Sock = accept(Listen, NULL, NULL);
+            if (Sock >= 0) {
+                for (i = 0; i < ModbusMaxClients && Clients[i].Sock >= 0; i++);
+                if (i == ModbusMaxClients) {
+                    LogMsg(LOG_NOTICE, "Modbus client refused, too many clients.");
+                    closesocket(Sock);
+                }
+                else {
+                    fcntl(Sock, F_SETFL, O_NONBLOCK);
+                    Clients[i].Sock = Sock;
+                    Clients[i].Generation++;
+                    Clients[i].InLen = 0;
+                    Clients[i].OutStart = Clients[i].OutEnd = 0;
+                    LogMsg(LOG_INFO, "Modbus client connected.");
+                }
+            }
+        }
+
+        for (i = 0; i < ModbusMaxClients; i++) {
+            ModbusClientType *C = &Clients[i];
+
+            if (C->Sock >= 0 && FD_ISSET(C->Sock, &OutFdSet)) {
+                Result = write(C->Sock, C->Out + C->OutStart, C->OutEnd - C->OutStart);
+                if (Result > 0)
+                    C->OutStart += Result;
+            }
+            if (C->Sock >= 0 && FD_ISSET(C->Sock, &InFdSet)) {
+                Result = read(C->Sock, C->In + C->InLen, sizeof(C->In) - C->InLen);
+                if (Result == 0 || (Result < 0 && errno != EAGAIN && errno != EINTR)) {
+                    DropClient(i);
+                    LogMsg(LOG_INFO, "Modbus client disconnected.");
+                }
+                else if (Result > 0) {
+                    C->InLen += Result;
+                    if (ParseRequests(i, CacheTime) != NoError) {
+                        DropClient(i);
+                        LogMsg(LOG_NOTICE, "Modbus client sent a malformed request, dropped.");
+                    }
+                }
+            }
+        }
+    }
+
+    GatewayLogStats();
+    for (i = 0; i < ModbusMaxClients; i++)
+        if (Clients[i].Sock >= 0)
+            DropClient(i);
+    return Status;
+}
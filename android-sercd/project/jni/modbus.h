@@ -0,0 +1,43 @@
+/*
+ * sercd Modbus TCP to RTU gateway
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_MODBUS_H
+#define SERCD_MODBUS_H
+
+#include "sercd.h"
+
+/* Modbus TCP clients served at the same time */
+#define ModbusMaxClients 32
+
+/* Largest PDU, and the MBAP header in front of it on TCP */
+#define ModbusMaxPdu 253
+#define ModbusMbapHeader 7
+#define ModbusMaxAdu (ModbusMbapHeader + ModbusMaxPdu)
+
+/* Requests waiting for the bus; more get a busy exception */
+#define ModbusQueueSize 64
+
+/* Cached read responses */
+#define ModbusCacheSize 64
+
+/* Responses waiting for a slow client; a client falling further
+   behind is dropped */
+#define ModbusClientOutSize 4096
+
+/* Time given to a slave to answer, in ms */
+#define DEFAULT_MODBUS_TIMEOUT 1000
+
+/* Time given to the slaves to act on a broadcast, in ms */
+#define ModbusTurnaround 100
+
+/* Serve Modbus TCP clients accepted on Listen with the RTU slaves on
+   Dev, running at Speed bps, until the device fails or a control
+   command stops the gateway. Slaves get Timeout ms to answer. Read
+   responses are served again to identical requests for CacheTime ms,
+   0 disabling the cache. Returns Error when the device failed. */
+int RunGateway(PORTHANDLE Dev, const char *Name, unsigned long Speed, SERCD_SOCKET Listen,
+               long CacheTime, long Timeout);
+
+#endif /* SERCD_MODBUS_H */
@@ -0,0 +1,183 @@
+/*
+ * sercd device pool and connection queue
+ * see file COPYING for license details
+ */
+
+#include <stdio.h>              /* snprintf */
+#include <string.h>             /* strchr */
+#include <unistd.h>             /* close */
+#include "sercd.h"
+#include "pool.h"
+
+/* Pool of interchangeable devices */
+static PoolDeviceType Pool[PoolMaxDevices];
+static unsigned int PoolSize = 0;
+static unsigned long PoolSessions = 0;
+
+/* Clients waiting for a free device */
+static struct
+{
+    SERCD_SOCKET Sock;
+    time_t Deadline;
+}
+Queue[PoolMaxQueue];
+static unsigned int QueueFirst = 0;
+static unsigned int QueueCount = 0;
+
+/* Split a copy of a comma separated list. Returns the number of
+   elements, or -1 on error. */
+static int
+SplitList(const char *ConstList, char **Elements)
+{
+    int N = 0;
+    char *List = strdup(ConstList);
+
+    if (List == NULL)
+        return -1;
+
+    while (List) {
+        if (N == PoolMaxDevices)
+            return -1;
+        Elements[N++] = List;
+        List = strchr(List, ',');
+        if (List)
+            *List++ = '\0';
+    }
+    return N;
+}
+
+#ifndef ANDROID
+int
+InitPool(const char *DeviceList, const char *LockFileList)
+#else
+int
+InitPool(const char *DeviceList)
+#endif
+{
+    char *Devices[PoolMaxDevices];
+    int N, i;
+#ifndef ANDROID
+    char *LockFiles[PoolMaxDevices];
+#endif
+
+    N = SplitList(DeviceList, Devices);
+    if (N <= 0)
+        return Error;
+#ifndef ANDROID
+    /* One lock file per device */
+    if (SplitList(LockFileList, LockFiles) != N)
+        return Error;
+#endif
+
+    memset(Pool, 0, sizeof(Pool));
+    for (i = 0; i < N; i++) {
+        Pool[i].DeviceName = Devices[i];
+#ifndef ANDROID
+        Pool[i].LockFileName = LockFiles[i];
+#endif
+    }
+    PoolSize = N;
+    return NoError;
+}
+
+PoolDeviceType *
+OpenPoolPort(PORTHANDLE * PortFd)
+{
+    Boolean Tried[PoolMaxDevices];
+    time_t Now = time(NULL);
+    unsigned int i;
+
+    memset(Tried, 0, sizeof(Tried));
+
+    while (True) {
+        PoolDeviceType *D = NULL;
+
+        /* Least recently used device still in rotation. A single
+           device is always retried. */
+        for (i = 0; i < PoolSize; i++) {
+            if (Tried[i] || (PoolSize > 1 && Pool[i].RetryAfter > Now))
+                continue;
+            if (D == NULL || Pool[i].LastUsed < D->LastUsed)
+                D = &Pool[i];
+        }
+        if (D == NULL)
+            return NULL;
+        Tried[D - Pool] = True;
+
+#ifndef ANDROID
+        if (OpenPort(D->DeviceName, D->LockFileName, PortFd) == NoError) {
+#else
+        if (OpenPort(D->DeviceName, PortFd) == NoError) {
+#endif
+            D->Failures = 0;
+            D->RetryAfter = 0;
+            D->LastUsed = ++PoolSessions;
+            return D;
+        }
+
+        /* Take the device out of rotation */
+        D->RetryAfter = Now + MIN(PoolMinBackoff << MIN(D->Failures, 6), PoolMaxBackoff);
+        D->Failures++;
+        LogFormat(LOG_WARNING, "Unable to open pool device %s, retry in %ld s.",
+                  D->DeviceName, (long) (D->RetryAfter - Now));
+    }
+}
+
+time_t
+PoolRetryTime(void)
+{
+    time_t Retry = 0;
+    unsigned int i;
+
+    if (PoolSize < 2)
+        return 0;
+    for (i = 0; i < PoolSize; i++) {
+        if (Pool[i].RetryAfter && (Retry == 0 || Pool[i].RetryAfter < Retry))
+            Retry = Pool[i].RetryAfter;
+    }
+    return Retry;
+}
+
+Boolean
+QueueConnection(SERCD_SOCKET Sock, int Timeout)
+{
+    unsigned int Last;
+
+    if (Timeout <= 0 || QueueCount == PoolMaxQueue)
+        return False;
+
+    Last = (QueueFirst + QueueCount) % PoolMaxQueue;
+    Queue[Last].Sock = Sock;
+    Queue[Last].Deadline = time(NULL) + Timeout;
+    QueueCount++;
+    return True;
+}
+
+Boolean
+DequeueConnection(SERCD_SOCKET * Sock)
+{
+    if (QueueCount == 0)
+        return False;
+
+    *Sock = Queue[QueueFirst].Sock;
+    QueueFirst = (QueueFirst + 1) % PoolMaxQueue;
+    QueueCount--;
+    return True;
+}
+
+void
+ExpireQueuedConnections(void)
+{
+    time_t Now;
+
+    if (QueueCount == 0)
+        return;
+
+    Now = time(NULL);
+    while (QueueCount > 0 && Queue[QueueFirst].Deadline <= Now) {
+        LogMsg(LOG_NOTICE, "No device became free, dropping queued connection");
+        closesocket(Queue[QueueFirst].Sock);
+        QueueFirst = (QueueFirst + 1) % PoolMaxQueue;
+        QueueCount--;
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * sercd device pool and connection queue
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_POOL_H
+#define SERCD_POOL_H
+
+#include "sercd.h"
+#include <time.h>
+
+/* Maximum number of devices in a pool */
+#define PoolMaxDevices 16
+
+/* Maximum number of clients waiting for a free device */
+#define PoolMaxQueue 8
+
+/* Backoff after an OpenPort() failure, doubling up to the maximum */
+#define PoolMinBackoff 1
+#define PoolMaxBackoff 60
+
+/* Default and longest time in seconds a client may wait for a free
+   device */
+#define DEFAULT_QUEUE_TIMEOUT 5
+#define PoolMaxQueueTimeout 3600
+
+/* One interchangeable device of the pool */
+typedef struct
+{
+    char *DeviceName;
+#ifndef ANDROID
+    char *LockFileName;
+#endif
+    /* Consecutive OpenPort() failures */
+    unsigned int Failures;
+    /* Device is out of rotation until then */
+    time_t RetryAfter;
+    /* Session the device was last handed to, counting the sessions of
+       the whole pool: many may start within the same second */
+    unsigned long LastUsed;
+}
+PoolDeviceType;
+
+/* Split the comma separated device (and lock file) lists into the
+   pool. Returns NoError on success. */
+#ifndef ANDROID
+int InitPool(const char *DeviceList, const char *LockFileList);
+#else
+int InitPool(const char *DeviceList);
+#endif
+
+/* Open the least recently used healthy device of the pool, failing
+   over to the next one. Devices failing to open leave the rotation for
+   a while. Returns the opened device or NULL if none could be opened. */
+PoolDeviceType *OpenPoolPort(PORTHANDLE * PortFd);
+
+/* Time the first device out of rotation gets back into it, 0 if there
+   is none or the pool has a single device, which is always retried */
+time_t PoolRetryTime(void);
+
+/* Queue a client connection while all devices are busy. Returns True
+   if the connection has been queued. */
+Boolean QueueConnection(SERCD_SOCKET Sock, int Timeout);
+
+/* Get the oldest queued connection. Returns True if there was one. */
+Boolean DequeueConnection(SERCD_SOCKET * Sock);
+
+/* Close queued connections which have waited too long */
+void ExpireQueuedConnections(void);
+
+#endif /* SERCD_POOL_H */
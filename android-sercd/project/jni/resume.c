@@ -0,0 +1,79 @@
+/*
+ * sercd session resumption
+ * see file COPYING for license details
+ */
+
+#include <stdlib.h>             /* rand */
+#include <string.h>             /* memcmp */
+#include <unistd.h>             /* read */
+#include <fcntl.h>              /* open */
+#include "sercd.h"
+#include "resume.h"
+
+int
+InitResume(ResumeType * R, size_t WindowSize, long Timeout)
+{
+    memset(R, 0, sizeof(*R));
+    R->Timeout = Timeout;
+    return InitHistory(&R->Window, WindowSize, 0);
+}
+
+/* Fill the token with unpredictable bytes */
+static void
+NewToken(unsigned char *Token)
+{
+    int Fd;
+    int i;
+
+    Fd = open("/dev/urandom", O_RDONLY);
+    if (Fd != OpenError) {
+        i = read(Fd, Token, ResumeTokenLen);
+        close(Fd);
+        if (i == ResumeTokenLen)
+            return;
+    }
+
+    LogMsg(LOG_WARNING, "Unable to read /dev/urandom, using a weak session token.");
+    srand((unsigned int) (time(NULL) ^ getpid()));
+    for (i = 0; i < ResumeTokenLen; i++)
+        Token[i] = (unsigned char) rand();
+}
+
+void
+NewResumeSession(ResumeType * R)
+{
+    NewToken(R->Token);
+    ResetHistory(&R->Window);
+    R->FromNet = 0;
+    R->HasToken = True;
+    R->Bound = True;
+}
+
+void
+DetachResumeSession(ResumeType * R)
+{
+    R->Bound = False;
+    R->Deadline = time(NULL) + R->Timeout;
+    StopHistoryReplay(&R->Window);
+}
+
+int
+ResumeSession(ResumeType * R, const unsigned char *Token, unsigned long long Offset)
+{
+    if (!IsSessionDetached(R) || memcmp(R->Token, Token, ResumeTokenLen) != 0)
+        return Error;
+
+    if (StartHistoryReplayAt(&R->Window, Offset) != NoError)
+        return Error;
+
+    R->Bound = True;
+    return NoError;
+}
+
+void
+ForgetResumeSession(ResumeType * R)
+{
+    R->HasToken = False;
+    R->Bound = False;
+    StopHistoryReplay(&R->Window);
+}
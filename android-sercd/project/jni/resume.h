@@ -0,0 +1,64 @@
+/*
+ * sercd session resumption
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_RESUME_H
+#define SERCD_RESUME_H
+
+#include "sercd.h"
+#include "history.h"
+#include <time.h>
+
+/* Session token length in bytes */
+#define ResumeTokenLen 8
+
+/* Seconds a new client has to claim a detached session before it is
+   given up */
+#define ResumeClaimGrace 2
+
+/* Default seconds a detached session is kept */
+#define DEFAULT_RESUME_TIMEOUT 30
+
+/* Resumable session state. Device output queued for the session is
+   recorded in Window, so its Total is the device to network byte
+   count; FromNet counts network to device bytes. */
+typedef struct
+{
+    HistoryType Window;
+    unsigned char Token[ResumeTokenLen];
+    Boolean HasToken;
+    /* A client is bound to the session, otherwise it is detached */
+    Boolean Bound;
+    /* Detached session is given up then */
+    time_t Deadline;
+    long Timeout;
+    unsigned long long FromNet;
+}
+ResumeType;
+
+/* Allocate the retransmit window. WindowSize 0 disables resumption.
+   Returns NoError on success. */
+int InitResume(ResumeType * R, size_t WindowSize, long Timeout);
+
+/* Check if resumption is enabled */
+#define IsResumeEnabled(R) IsHistoryEnabled(&(R)->Window)
+
+/* Check if a session is waiting for its client to come back */
+#define IsSessionDetached(R) ((R)->HasToken && !(R)->Bound)
+
+/* Start a new resumable session, bound to the current client */
+void NewResumeSession(ResumeType * R);
+
+/* Detach the session from its lost client */
+void DetachResumeSession(ResumeType * R);
+
+/* Bind the current client to the detached session if Token matches
+   and Offset is still in the retransmit window. The window replay is
+   started from Offset. Returns NoError on success. */
+int ResumeSession(ResumeType * R, const unsigned char *Token, unsigned long long Offset);
+
+/* Give up the session */
+void ForgetResumeSession(ResumeType * R);
+
+#endif /* SERCD_RESUME_H */
@@ -10,10 +10,12 @@ extern "C" {
 /*
  * Class:     gnu_sercd_SercdService
  * Method:    main
- * Signature: (Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;)I
+ * Signature: (Ljava/lang/String;Ljava/lang/String;IILjava/lang/String;ZLjava/lang/String;Ljava/lang/String;ZLjava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;)I
  */
 JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
-  (JNIEnv *, jobject, jstring, jstring, jstring);
+  (JNIEnv *, jobject, jstring, jstring, jint, jint, jstring, jboolean, jstring, jstring,
+   jboolean, jstring, jstring, jstring, jstring, jstring, jstring, jstring, jstring,
+   jstring, jstring, jstring, jstring, jstring, jstring);
 
 /*
  * Class:     gnu_sercd_SercdService
@@ -23,6 +25,14 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
 JNIEXPORT void JNICALL Java_gnu_sercd_SercdService_exit
   (JNIEnv *, jobject);
 
+/*
+ * Class:     gnu_sercd_SercdService
+ * Method:    control
+ * Signature: (Ljava/lang/String;)Ljava/lang/String;
+ */
+JNIEXPORT jstring JNICALL Java_gnu_sercd_SercdService_control
+  (JNIEnv *, jobject, jstring);
+
 #ifdef __cplusplus
 }
 #endif
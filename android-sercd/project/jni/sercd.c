@@ -51,6 +51,20 @@
 #include <assert.h>             /* assert */
 #include "sercd.h"
 #include "unix.h"
+#include "history.h"
+#include "pool.h"
+#include "spool.h"
+#include "resume.h"
+#include "control.h"
+#include "timer.h"
+#include "slab.h"
+#include "iosched.h"
+#include "bridge.h"
+#include "modbus.h"
+#include "bus.h"
+#include "logring.h"
+#include "statspage.h"
+#include "latency.h"
 #ifndef ANDROID
 #include "win.h"
 #endif
@@ -62,22 +76,81 @@
 /* Buffer size */
 #define BufferSize 2048
 
+/* Default device output history size in KB, 0 means disabled */
+#define DEFAULT_HISTORY_SIZE 0
+
+/* Default dead client timeout and heartbeat interval in seconds, 0
+   keeps the kernel keepalive defaults and sends no heartbeats */
+#ifndef ANDROID
+#define DEFAULT_DEAD_PEER_TIMEOUT 0
+#define DEFAULT_HEARTBEAT_INTERVAL 0
+#else
+#define DEFAULT_DEAD_PEER_TIMEOUT 60
+#define DEFAULT_HEARTBEAT_INTERVAL 20
+#endif
+
+/* Default client data in KB held while the device is gone, 0 drops
+   the client when the device disappears */
+#ifndef ANDROID
+#define DEFAULT_HOTPLUG_BUFFER 0
+#else
+#define DEFAULT_HOTPLUG_BUFFER 4
+#endif
+
+/* Smallest hotplug buffer in KB: while the device is gone, network
+   input waits for room for a whole buffer in it */
+#define HotplugMinBuffer ((BufferSize + 1023) / 1024)
+
+/* Default limits of session profiles requested by clients: fastest
+   modem state poll in ms and largest socket buffer in KB */
+#define DEFAULT_PROFILE_MIN_POLL 10
+#define DEFAULT_PROFILE_MAX_BUFFER 256
+
+/* Longest latency target and largest flush threshold of a profile */
+#define ProfileMaxLatency 1000
+#define ProfileMaxFlush (BufferSize / 2)
+
+/* Keepalive probes sent before a silent client is given up */
+#define KeepaliveProbes 3
+
 /* Cisco IOS bug compatibility */
 Boolean CiscoIOSCompatible = False;
 
 /* Log to stderr instead of syslog */
 Boolean StdErrLogging = False;
 
-/* Buffer structure */
+/* Buffer structure. The storage comes from BufferSlab while a session
+   is active, and is NULL while sercd is idle. */
 typedef struct
 {
-    unsigned char Buffer[BufferSize];
+    unsigned char *Buffer;
     unsigned int RdPos;
     unsigned int WrPos;
 }
 BufferType;
 
+/* Buffer contents as passed on in a handover */
+typedef struct
+{
+    unsigned char Data[BufferSize];
+    unsigned int RdPos;
+    unsigned int WrPos;
+}
+BufferImageType;
+
+/* Session buffers, allocated once at startup so that connecting and
+   disconnecting clients don't allocate memory */
+static SlabType BufferSlab;
+#define SessionBuffers 2
+
+/* Time from the last connection to the port being ready */
+static unsigned long long LastReadyTime = 0;
+
+/* Second device of bridge mode, and its lock file */
+static PORTHANDLE *BridgeFd = NULL;
 #ifndef ANDROID
+static char *BridgeLockFileName = NULL;
+
 /* Complete lock file pathname */
 static char *LockFileName;
 #endif
@@ -92,9 +165,218 @@ static PORTHANDLE *DeviceFd = NULL;
 static SERCD_SOCKET *InSocketFd = NULL;
 static SERCD_SOCKET *OutSocketFd = NULL;
 
+/* Unix socket a new process takes over from us through */
+static SERCD_SOCKET *HandoverFd = NULL;
+
+/* Keep the device open and configured between client sessions */
+Boolean WarmPort = False;
+
+/* Seconds a client may leave data unacknowledged before it is
+   considered dead */
+int DeadPeerTimeout = DEFAULT_DEAD_PEER_TIMEOUT;
+
+/* Seconds without output to the client before a telnet NOP is sent */
+int HeartbeatInterval = DEFAULT_HEARTBEAT_INTERVAL;
+
+/* Seconds without input from the client before a new client may take
+   its session over, -1 never */
+int TakeoverIdle = -1;
+
+/* Let clients from any address take over an idle session, not only
+   the address of the current client */
+Boolean TakeoverAny = False;
+
+/* Last time data was received from and sent to the client */
+static time_t LastNetInput;
+static time_t LastNetOutput;
+
+/* Data to the client is unacknowledged since then, 0 if not */
+static time_t UnackedSince = 0;
+
+/* Latency/throughput profile of the session. All zero, the default,
+   sends device output as soon as possible and polls the modem state at
+   the process poll interval. */
+typedef struct
+{
+    /* Milliseconds device output may wait for more data */
+    unsigned int LatencyTarget;
+    /* Bytes of device output which are sent without waiting */
+    unsigned int FlushThreshold;
+    /* Socket buffer size in KB, 0 for the kernel default */
+    unsigned int SocketBuffer;
+    /* Modem state poll interval in ms, 0 for the process default */
+    unsigned int PollInterval;
+}
+ProfileType;
+
+static ProfileType Profile;
+
+/* Administrator limits of the profiles */
+unsigned int ProfileMinPoll = DEFAULT_PROFILE_MIN_POLL;
+unsigned int ProfileMaxBuffer = DEFAULT_PROFILE_MAX_BUFFER;
+
+/* Microseconds to keep polling without sleeping after I/O activity,
+   0 to always sleep in select() */
+long BusyPollWindow = 0;
+
+/* Percentage of CPU time the busy polling may use */
+int BusyPollShare = 50;
+
+/* Last device or network I/O, and busy polling CPU accounting */
+static unsigned long long LastIoActivity = 0;
+static unsigned long long SpinPeriodStart = 0;
+static unsigned long long SpinPeriodUsed = 0;
+static unsigned long long SpinTotal = 0;
+
+/* Time the oldest data of the network buffer was queued, 0 if none */
+static unsigned long long NetPendingSince = 0;
+
+/* Timers of the main loop and the bits RunTimers() reports for them */
+#define SERCD_TIMER_MODEMPOLL 1
+#define SERCD_TIMER_FLUSH 2
+#define SERCD_TIMER_HOUSEKEEPING 4
+#define SERCD_TIMER_DEVICE 8
+#define SERCD_TIMER_SCHED 16
+
+/* Next modem state poll */
+static TimerType ModemPollTimer;
+
+/* Latency target of data held in the network buffer */
+static TimerType FlushTimer;
+
+/* The checks counting in seconds: queued connections, detached
+   sessions, heartbeats and dead clients */
+static TimerType HousekeepingTimer;
+#define HousekeepingInterval 1000
+
+/* Next look for a vanished device, or for a pool device out of its
+   backoff */
+static TimerType DeviceTimer;
+
+/* End of the wait of a direction throttled by its rate cap */
+static TimerType SchedTimer;
+
+/* Client data held while the device is gone */
+static SpoolType DevSpool;
+
+/* The device vanished under a connected client */
+static Boolean DeviceGone = False;
+
+/* Next reopen attempt of a vanished device */
+static time_t DeviceRetry;
+
+/* Time the device vanished */
+static time_t DeviceGoneTime;
+
+/* A client found every pool device out of rotation: next open attempt
+   and end of its wait */
+static time_t PoolWaitUntil = 0;
+static time_t PoolWaitDeadline = 0;
+
+/* Watch for the device node to come back */
+static int DeviceWatchFd = -1;
+
+/* Port settings to apply again when the device is back */
+static unsigned char PortState[PortStateLen];
+static Boolean PortStateDirty = False;
+
+/* Byte counters for the stats snapshot */
+static unsigned long long DevInBytes = 0;
+static unsigned long long DevOutBytes = 0;
+static unsigned long long NetInBytes = 0;
+static unsigned long long NetOutBytes = 0;
+static unsigned long ClientCount = 0;
+
+/* Counters only the stats page shows */
+static unsigned long long EscapesAdded = 0;
+static unsigned long long IacCommands = 0;
+static unsigned long long Wakeups = 0;
+static unsigned long long ShortWrites = 0;
+
+/* Queue high-water marks since the start and for the current client,
+   only tracked for the stats page */
+static Boolean StatsPageOpen = False;
+static unsigned int ToDevHighWater = 0;
+static unsigned int ToNetHighWater = 0;
+static unsigned int SessionToDevHighWater = 0;
+static unsigned int SessionToNetHighWater = 0;
+
+/* Counters when the current client connected */
+static SercdCountersType SessionBase;
+static unsigned long long SessionStartTime = 0;
+
+/* Latency probe from the client, answered once the client data
+   received before it has been written to the device */
+typedef struct
+{
+    /* Client timestamp, echoed as is */
+    unsigned char Stamp[8];
+    /* Reached once ProbeWritten gets there */
+    unsigned long long Mark;
+    /* Monotonic times of receipt and of the device write, in us */
+    unsigned long long RecvTime;
+    unsigned long long WriteTime;
+    /* Bytes queued to the device ahead of the probe and to the
+       network at receipt */
+    unsigned int ToDevDepth;
+    unsigned int ToNetDepth;
+}
+ProbeType;
+
+#define ProbeMax 8
+static ProbeType Probes[ProbeMax];
+static unsigned int ProbeFirst = 0;
+static unsigned int ProbeCount = 0;
+
+/* Client bytes queued to and written to the device, kept in step for
+   the probes */
+static unsigned long long ProbeQueued = 0;
+static unsigned long long ProbeWritten = 0;
+
+/* Segments of data queued to a buffer and not sent yet: the buffer
+   write position past the last byte of each and the time it was read,
+   to record how long data waits in sercd */
+typedef struct
+{
+    unsigned int Pos;
+    unsigned long long Time;
+}
+SegmentType;
+
+#define SegmentMax 32
+typedef struct
+{
+    SegmentType Segments[SegmentMax];
+    unsigned int First;
+    unsigned int Count;
+    /* Times from the read to the write of the last byte, since sercd
+       started */
+    LatencyHistType Hist;
+}
+DwellType;
+
+static DwellType ToNetDwell;
+static DwellType ToDevDwell;
+
+/* Stamp device data batches with their read time */
+static Boolean DeviceStamps = False;
+
+/* Payload of a device stamp: read time in us and batch length */
+#define DeviceStamp_len 10
+
+/* Room a device read leaves in the network buffer for its stamp */
+#define DeviceStamp_room (DeviceStamps ? SendSercdCommand_bytes(DeviceStamp_len) : 0)
+
 /* Com Port Control enabled flag */
 Boolean PortControlEnable = True;
 
+/* Reverse mode: sercd is the client of a remote port, which it serves
+   on a local pty */
+static Boolean ReverseMode = False;
+
+/* Modem state last notified by the remote port in reverse mode */
+static unsigned char RemoteModemState = 0;
+
 /* Maximum log level to log in the system log */
 int MaxLogLevel = LOG_DEBUG + 1;
 
@@ -115,20 +397,44 @@ static unsigned char IACCommand[TmpStrLen];
 /* Position of insertion into IACCommand[] */
 static size_t IACPos;
 
+/* Last byte written to the network by EscWriteChar() */
+static unsigned char EscWriteLast = 0;
+
+/* Last byte received from the network by EscRedirectChar() */
+static unsigned char EscRedirectLast = 0;
+
 /* Modem state mask set by the client */
 static unsigned char ModemStateMask = ((unsigned char) 255);
 
 /* Line state mask set by the client */
 static unsigned char LineStateMask = ((unsigned char) 0);
 
-#ifdef COMMENT
-/* Current status of the line control lines */
+/* Line state events the client can be notified of */
+#define LineStateSupported (TNCOM_LINEMASK_TIMEOUT | TNCOM_LINEMASK_BREAK_ERR | \
+                            TNCOM_LINEMASK_FRAME_ERR | TNCOM_LINEMASK_PARITY_ERR | \
+                            TNCOM_LINEMASK_OVERRUN_ERR)
+
+/* Line errors seen since the last notification */
 static unsigned char LineState = ((unsigned char) 0);
-#endif
+
+/* Driver line error counters at the last sample, and the errors
+   counted since sercd started */
+static LineCountersType LineCounters;
+static Boolean LineCountersValid = False;
+static LineCountersType LineTotals;
 
 /* Current status of the modem control lines */
 static unsigned char ModemState = ((unsigned char) 0);
 
+/* Device output history */
+static HistoryType History;
+
+/* Device output waiting for a client */
+static SpoolType Spool;
+
+/* Resumable session */
+static ResumeType Resume;
+
 /* Break state flag */
 Boolean BreakSignaled = False;
 
@@ -147,14 +453,62 @@ static struct _tnstate
 }
 tnstate[256];
 
+/* State passed to a new process taking over from us. Both processes
+   run the same binary on the same host, so it is sent as is. */
+#define HandoverMagic 0x73657264UL
+typedef struct
+{
+    unsigned long Magic;
+    size_t Size;
+    Boolean HasClient;
+    Boolean HasDevice;
+    BufferImageType ToDevBuf;
+    BufferImageType ToNetBuf;
+    struct _tnstate tnstate[256];
+    IACState IACEscape;
+    IACState IACSigEscape;
+    unsigned char IACCommand[TmpStrLen];
+    size_t IACPos;
+    unsigned char EscWriteLast;
+    unsigned char EscRedirectLast;
+    unsigned char ModemStateMask;
+    unsigned char LineStateMask;
+    unsigned char ModemState;
+    Boolean BreakSignaled;
+    Boolean InputFlow;
+    Boolean PortControlEnable;
+    ProfileType Profile;
+    char DeviceName[TmpStrLen];
+#ifndef ANDROID
+    char LockFileName[TmpStrLen];
+#endif
+    unsigned char PlatformState[PlatformStateLen];
+}
+HandoverType;
+
 /* Function prototypes */
 
 /* initialize Telnet State Machine */
 void InitTelnetStateMachine(void);
 
+/* Set up the telnet session of a newly connected client */
+void InitSession(BufferType * ToDevB, BufferType * ToNetB);
+
+/* Send initial Telnet negotiations to the client */
+void SendTelnetInitialOptions(BufferType * B);
+
+/* Detach the session from a lost client */
+Boolean DetachSession(void);
+
 /* Initialize a buffer for operation */
 void InitBuffer(BufferType * B);
 
+/* Give the session buffers their storage if they have none */
+void AttachSessionBuffers(BufferType * ToDevB, BufferType * ToNetB);
+
+/* Return the storage of the session buffers to the slab */
+void ReleaseSessionBuffers(BufferType * ToDevB, BufferType * ToNetB);
+
 /* Check if the buffer is empty */
 Boolean IsBufferEmpty(BufferType * B);
 
@@ -183,6 +537,10 @@ unsigned char GetPortFlowControl(PORTHANDLE PortFd, unsigned char Which);
 /* Return the status of the modem control lines (DCD, CTS, DSR, RNG) */
 unsigned char GetModemState(PORTHANDLE PortFd, unsigned char PMState);
 
+/* Sample the line error counters, adding new errors to LineState and
+   to the totals */
+void SampleLineState(PORTHANDLE PortFd);
+
 /* Set the serial port data size */
 void SetPortDataSize(PORTHANDLE PortFd, unsigned char DataSize);
 
@@ -207,20 +565,6 @@ void SetFlush(PORTHANDLE PortFd, int selector);
 /* Init platform subsystems, such as the syslog */
 void PlatformInit();
 
-/* Initialize port */
-#ifndef ANDROID
-int OpenPort(const char *DeviceName, const char *LockFileName, PORTHANDLE * PortFd);
-#else
-int OpenPort(const char *DeviceName, PORTHANDLE * PortFd);
-#endif
-
-/* Close and uninit port */
-#ifndef ANDROID
-void ClosePort(PORTHANDLE PortFd, const char *LockFileName);
-#else
-void ClosePort(PORTHANDLE PortFd);
-#endif
-
 /* Send the signature Sig to the client */
 void SendSignature(BufferType * B, char *Sig);
 
@@ -230,6 +574,9 @@ void EscWriteChar(BufferType * B, unsigned char C);
 /* Redirect char C to PortFd checking for IAC escape sequences */
 void EscRedirectChar(BufferType * SockB, BufferType * DevB, PORTHANDLE PortFd, unsigned char C);
 
+/* Collect a char of a variable length suboption */
+void EscRedirectSubOptionChar(BufferType * SockB, PORTHANDLE PortFd, unsigned char C);
+
 /* Send the specific telnet option to SockFd using Command as command */
 void SendTelnetOption(BufferType * B, unsigned char Command, char Option);
 
@@ -245,6 +592,35 @@ void SendCPCByteCommand(BufferType * B, unsigned char Command, unsigned char Par
 /* Handling of COM Port Control specific commands */
 void HandleCPCCommand(BufferType * B, PORTHANDLE PortFd, unsigned char *Command, size_t CSize);
 
+/* Handling of the COM Port Control notifications of the remote port in
+   reverse mode */
+void HandleCPCNotification(PORTHANDLE PtyFd, unsigned char *Command, size_t CSize);
+
+/* Send the sercd option command Command */
+void SendSercdCommand(BufferType * B, unsigned char Command, const unsigned char *Data,
+                      size_t Len);
+
+/* Handling of sercd option specific commands */
+void HandleSercdCommand(BufferType * B, unsigned char *Command, size_t CSize);
+
+/* Latency probes: queue one, account device writes, send the replies
+   which are due */
+void QueueProbe(const unsigned char *Stamp, unsigned int ToNetDepth);
+void StampProbes(size_t Bytes);
+void SendProbeReplies(BufferType * ToDevB, BufferType * ToNetB);
+
+/* Dwell times: note a segment queued to a buffer, account the bytes
+   popped from it */
+void QueueSegment(DwellType * D, BufferType * B, unsigned int From, unsigned long long Time);
+void PopSegments(DwellType * D, BufferType * B, unsigned int Len, Boolean Sent);
+
+/* Stats page: gather the counters, note the queue lengths, and publish
+   both once per loop round */
+void CollectCounters(SercdCountersType * C);
+void NoteQueueLengths(BufferType * ToDevB, BufferType * ToNetB);
+void PublishStats(BufferType * ToDevB, BufferType * ToNetB, unsigned long long Now,
+                  Boolean Histograms);
+
 /* Common telnet IAC commands handling */
 void HandleIACCommand(BufferType * B, PORTHANDLE PortFd, unsigned char *Command, size_t CSize);
 
@@ -300,7 +676,129 @@ SetSocketOptions(SERCD_SOCKET insocket, SERCD_SOCKET outsocket)
        size. */
     ioctl(outsocket, FIONBIO, &SockParmEnable);
     ioctl(insocket, FIONBIO, &SockParmEnable);
+
+    /* Notice a vanished client within DeadPeerTimeout instead of the
+       kernel default of hours: keepalives while the connection is
+       idle, and a limit on unacknowledged data otherwise */
+    if (DeadPeerTimeout > 0) {
+#ifdef TCP_KEEPIDLE
+        SockParm = MAX(DeadPeerTimeout / 2, 1);
+        setsockopt(insocket, IPPROTO_TCP, TCP_KEEPIDLE, &SockParm, sizeof(SockParm));
+        SockParm = MAX(DeadPeerTimeout / (2 * KeepaliveProbes), 1);
+        setsockopt(insocket, IPPROTO_TCP, TCP_KEEPINTVL, &SockParm, sizeof(SockParm));
+        SockParm = KeepaliveProbes;
+        setsockopt(insocket, IPPROTO_TCP, TCP_KEEPCNT, &SockParm, sizeof(SockParm));
+#endif
+#ifdef TCP_USER_TIMEOUT
+        SockParm = DeadPeerTimeout * 1000;
+        setsockopt(outsocket, IPPROTO_TCP, TCP_USER_TIMEOUT, &SockParm, sizeof(SockParm));
+#endif
+    }
+
+#ifdef SO_BUSY_POLL
+    /* Let the kernel poll the NIC for incoming data as well */
+    if (BusyPollWindow > 0) {
+        SockParm = BusyPollWindow;
+        setsockopt(insocket, SOL_SOCKET, SO_BUSY_POLL, &SockParm, sizeof(SockParm));
+    }
+#endif
 #endif
+
+    LastNetInput = LastNetOutput = time(NULL);
+    UnackedSince = 0;
+}
+
+/* Check if the client stopped acknowledging data. This catches dead
+   clients where TCP_USER_TIMEOUT is not available. */
+Boolean
+IsClientDead(SERCD_SOCKET Sock)
+{
+    time_t Now = time(NULL);
+    long AckWait;
+
+    if (DeadPeerTimeout <= 0)
+        return False;
+
+    AckWait = GetNetAckWait(Sock);
+    if (AckWait <= 0) {
+        UnackedSince = 0;
+        return False;
+    }
+    if (UnackedSince == 0)
+        UnackedSince = Now;
+
+    /* The last acknowledgement may be old if we were silent for a
+       while, so data must also have been waiting long enough */
+    return Now - UnackedSince >= DeadPeerTimeout && AckWait >= DeadPeerTimeout * 1000L;
+}
+
+/* Check if the new client NewSock may take over the session of the
+   client on Sock */
+Boolean
+MayTakeOver(SERCD_SOCKET NewSock, SERCD_SOCKET Sock)
+{
+    struct sockaddr_in NewAddr, Addr;
+    socklen_t NewLen = sizeof(NewAddr), Len = sizeof(Addr);
+
+    if (TakeoverIdle < 0 || time(NULL) - LastNetInput < TakeoverIdle)
+        return False;
+    if (TakeoverAny)
+        return True;
+
+    if (getpeername(NewSock, (struct sockaddr *) &NewAddr, &NewLen) < 0 ||
+        getpeername(Sock, (struct sockaddr *) &Addr, &Len) < 0)
+        return False;
+    return NewAddr.sin_family == AF_INET && Addr.sin_family == AF_INET &&
+        NewAddr.sin_addr.s_addr == Addr.sin_addr.s_addr;
+}
+
+/* Set up the telnet session of a newly connected client */
+void
+InitSession(BufferType * ToDevB, BufferType * ToNetB)
+{
+    AttachSessionBuffers(ToDevB, ToNetB);
+    InitBuffer(ToNetB);
+    InitTelnetStateMachine();
+    InputFlow = True;
+    LineState = 0;
+    LineCountersValid = False;
+    ProbeCount = 0;
+    ToNetDwell.Count = 0;
+    PoolWaitUntil = PoolWaitDeadline = 0;
+    DeviceStamps = False;
+    StopHistoryReplay(&History);
+    CollectCounters(&SessionBase);
+    SessionToDevHighWater = SessionToNetHighWater = 0;
+    SessionStartTime = GetTimeMicros();
+    ClientCount++;
+    memset(&Profile, 0, sizeof(Profile));
+    NetPendingSince = 0;
+
+    /* The new client may be the one of a detached session, whose data
+       still goes to the device. Otherwise what an earlier client left
+       for a warm port is dropped. */
+    if (IsSessionDetached(&Resume))
+        Resume.Deadline = MIN(Resume.Deadline, time(NULL) + ResumeClaimGrace);
+    else {
+        InitBuffer(ToDevB);
+        ToDevDwell.Count = 0;
+        ProbeWritten = ProbeQueued;
+    }
+    SendTelnetInitialOptions(ToNetB);
+}
+
+/* Called when the client connection is lost. A resumable session is
+   detached and waits for its client. Returns True if the port stays
+   open. */
+Boolean
+DetachSession(void)
+{
+    if (Resume.HasToken) {
+        LogMsg(LOG_NOTICE, "Client lost, session detached.");
+        DetachResumeSession(&Resume);
+        return True;
+    }
+    return WarmPort;
 }
 
 /* Initialize a buffer for operation */
@@ -312,6 +810,36 @@ InitBuffer(BufferType * B)
     B->WrPos = 0;
 }
 
+void
+AttachSessionBuffers(BufferType * ToDevB, BufferType * ToNetB)
+{
+    /* The slab holds the buffers of one session, they can't run out */
+    if (ToDevB->Buffer == NULL) {
+        ToDevB->Buffer = SlabAlloc(&BufferSlab);
+        InitBuffer(ToDevB);
+    }
+    if (ToNetB->Buffer == NULL) {
+        ToNetB->Buffer = SlabAlloc(&BufferSlab);
+        InitBuffer(ToNetB);
+    }
+    assert(ToDevB->Buffer != NULL && ToNetB->Buffer != NULL);
+}
+
+void
+ReleaseSessionBuffers(BufferType * ToDevB, BufferType * ToNetB)
+{
+    if (ToDevB->Buffer != NULL) {
+        SlabFree(&BufferSlab, ToDevB->Buffer);
+        ToDevB->Buffer = NULL;
+    }
+    if (ToNetB->Buffer != NULL) {
+        SlabFree(&BufferSlab, ToNetB->Buffer);
+        ToNetB->Buffer = NULL;
+    }
+    InitBuffer(ToDevB);
+    InitBuffer(ToNetB);
+    ToDevDwell.Count = ToNetDwell.Count = 0;
+}
 
 /* Return the length of the data in the buffer */
 unsigned int
@@ -387,13 +915,30 @@ void
 ExitFunction(void)
 {
 #ifndef ANDROID
+    if (ReverseMode && DeviceFd) {
+        ClosePty(*DeviceFd, DeviceName, LockFileName);
+        DeviceFd = NULL;
+    }
     DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
+    if (BridgeFd) {
+        ClosePort(*BridgeFd, BridgeLockFileName);
+        BridgeFd = NULL;
+    }
 #else
+    if (ReverseMode && DeviceFd) {
+        ClosePty(*DeviceFd, DeviceName);
+        DeviceFd = NULL;
+    }
     DropConnection(DeviceFd, InSocketFd, OutSocketFd);
+    if (BridgeFd) {
+        ClosePort(*BridgeFd);
+        BridgeFd = NULL;
+    }
 #endif
 
     /* Program termination notification */
     LogMsg(LOG_NOTICE, "sercd stopped.");
+    FlushLogRing();
 }
 
 #ifndef ANDROID
@@ -453,17 +998,63 @@ SendSignature(BufferType * B, char *Sig)
 void
 EscWriteChar(BufferType * B, unsigned char C)
 {
-    /* Last received byte */
-    static unsigned char Last = 0;
-
-    if (C == TNIAC)
+    if (C == TNIAC) {
         AddToBuffer(B, C);
-    else if (C != 0x0A && !tnstate[TN_TRANSMIT_BINARY].is_will && Last == 0x0D)
+        EscapesAdded++;
+    }
+    else if (C != 0x0A && !tnstate[TN_TRANSMIT_BINARY].is_will && EscWriteLast == 0x0D) {
         AddToBuffer(B, 0x00);
+        EscapesAdded++;
+    }
     AddToBuffer(B, C);
 
     /* Set last received byte */
-    Last = C;
+    EscWriteLast = C;
+}
+
+/* Collect char C of a variable length suboption, which is IAC escaped
+   and terminated by IAC SE */
+void
+EscRedirectSubOptionChar(BufferType * SockB, PORTHANDLE PortFd, unsigned char C)
+{
+    switch (IACSigEscape) {
+    case IACNormal:
+        if (C == TNIAC)
+            IACSigEscape = IACReceived;
+        else if (IACPos < sizeof(IACCommand)) {
+            IACCommand[IACPos] = C;
+            IACPos++;
+        }
+        break;
+
+    case IACComReceiving:
+        IACSigEscape = IACNormal;
+        break;
+
+    case IACReceived:
+        if (C == TNIAC) {
+            if (IACPos < sizeof(IACCommand)) {
+                IACCommand[IACPos] = C;
+                IACPos++;
+            }
+            IACSigEscape = IACNormal;
+        }
+        else {
+            if (IACPos < sizeof(IACCommand)) {
+                IACCommand[IACPos] = TNIAC;
+                IACPos++;
+            }
+
+            if (IACPos < sizeof(IACCommand)) {
+                IACCommand[IACPos] = C;
+                IACPos++;
+            }
+
+            HandleIACCommand(SockB, PortFd, IACCommand, IACPos);
+            IACEscape = IACNormal;
+        }
+        break;
+    }
 }
 
 /* Redirect char C to Device checking for IAC escape sequences */
@@ -472,26 +1063,28 @@ EscWriteChar(BufferType * B, unsigned char C)
 void
 EscRedirectChar(BufferType * SockB, BufferType * DevB, PORTHANDLE PortFd, unsigned char C)
 {
-    /* Last received byte */
-    static unsigned char Last = 0;
-
     /* Check the IAC escape status */
     switch (IACEscape) {
         /* Normal status */
     case IACNormal:
         if (C == TNIAC)
             IACEscape = IACReceived;
-        else if (!tnstate[TN_TRANSMIT_BINARY].is_do && C == 0x00 && Last == 0x0D)
+        else if (!tnstate[TN_TRANSMIT_BINARY].is_do && C == 0x00 && EscRedirectLast == 0x0D)
             /* Swallow the NUL after a CR if not receiving BINARY */
             break;
-        else
+        else {
             AddToBuffer(DevB, C);
+            Resume.FromNet++;
+            ProbeQueued++;
+        }
         break;
 
         /* IAC previously received */
     case IACReceived:
         if (C == TNIAC) {
             AddToBuffer(DevB, C);
+            Resume.FromNet++;
+            ProbeQueued++;
             IACEscape = IACNormal;
         }
         else {
@@ -514,47 +1107,18 @@ EscRedirectChar(BufferType * SockB, BufferType * DevB, PORTHANDLE PortFd, unsign
             }
             else {
                 /* Check which suboption we are dealing with */
-                switch (IACCommand[3]) {
+                if (IACCommand[2] == TNSERCD_OPTION) {
+                    /* sercd options are all variable length */
+                    EscRedirectSubOptionChar(SockB, PortFd, C);
+                    break;
+                }
+
+                /* The server to client commands have the same lengths */
+                switch (ReverseMode && IACCommand[3] >= TNASC_SIGNATURE ?
+                        IACCommand[3] - TNASC_SIGNATURE : IACCommand[3]) {
                     /* Signature, which needs further escaping */
                 case TNCAS_SIGNATURE:
-                    switch (IACSigEscape) {
-                    case IACNormal:
-                        if (C == TNIAC)
-                            IACSigEscape = IACReceived;
-                        else if (IACPos < sizeof(IACCommand)) {
-                            IACCommand[IACPos] = C;
-                            IACPos++;
-                        }
-                        break;
-
-                    case IACComReceiving:
-                        IACSigEscape = IACNormal;
-                        break;
-
-                    case IACReceived:
-                        if (C == TNIAC) {
-                            if (IACPos < sizeof(IACCommand)) {
-                                IACCommand[IACPos] = C;
-                                IACPos++;
-                            }
-                            IACSigEscape = IACNormal;
-                        }
-                        else {
-                            if (IACPos < sizeof(IACCommand)) {
-                                IACCommand[IACPos] = TNIAC;
-                                IACPos++;
-                            }
-
-                            if (IACPos < sizeof(IACCommand)) {
-                                IACCommand[IACPos] = C;
-                                IACPos++;
-                            }
-
-                            HandleIACCommand(SockB, PortFd, IACCommand, IACPos);
-                            IACEscape = IACNormal;
-                        }
-                        break;
-                    }
+                    EscRedirectSubOptionChar(SockB, PortFd, C);
                     break;
 
                     /* Set baudrate */
@@ -607,7 +1171,7 @@ EscRedirectChar(BufferType * SockB, BufferType * DevB, PORTHANDLE PortFd, unsign
     }
 
     /* Set last received byte */
-    Last = C;
+    EscRedirectLast = C;
 }
 
 /* Send the specific telnet option to SockFd using Command as command */
@@ -655,13 +1219,14 @@ SendStr(BufferType * B, char *Str)
         EscWriteChar(B, (unsigned char) Str[I]);
 }
 
-/* Send the baud rate BR to Buffer */
-#define SendBaudRate_bytes (6 + 2*sizeof(unsigned long int))
+/* Send the baud rate BR to Buffer, as a request in reverse mode. It
+   is 4 bytes on the wire whatever the size of a long. */
+#define SendBaudRate_bytes (6 + 2*sizeof(uint32_t))
 void
 SendBaudRate(BufferType * B, unsigned long int BR)
 {
     unsigned char *p;
-    unsigned long int NBR;
+    uint32_t NBR;
     int i;
 
     NBR = htonl(BR);
@@ -669,7 +1234,7 @@ SendBaudRate(BufferType * B, unsigned long int BR)
     AddToBuffer(B, TNIAC);
     AddToBuffer(B, TNSB);
     AddToBuffer(B, TNCOM_PORT_OPTION);
-    AddToBuffer(B, TNASC_SET_BAUDRATE);
+    AddToBuffer(B, ReverseMode ? TNCAS_SET_BAUDRATE : TNASC_SET_BAUDRATE);
     p = (unsigned char *) &NBR;
     for (i = 0; i < (int) sizeof(NBR); i++)
         EscWriteChar(B, p[i]);
@@ -697,7 +1262,6 @@ SendCPCByteCommand(BufferType * B, unsigned char Command, unsigned char Parm)
 void
 HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command, size_t CSize)
 {
-    char LogStr[TmpStrLen];
     char SigStr[255];
     unsigned long int BaudRate;
     unsigned char DataSize;
@@ -705,6 +1269,29 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
     unsigned char StopSize;
     unsigned char FlowControl;
 
+    /* While the device is gone PortFd is not open: the commands reading
+       or changing the port are refused, and the settings saved when it
+       vanished are restored when it comes back */
+    if (!DeviceFd) {
+        switch (Command[3]) {
+        case TNCAS_SET_CONTROL:
+            if (Command[4] == TNCOM_CMD_BREAK_REQ)
+                break;
+            /* Fall through */
+        case TNCAS_SET_BAUDRATE:
+        case TNCAS_SET_DATASIZE:
+        case TNCAS_SET_PARITY:
+        case TNCAS_SET_STOPSIZE:
+        case TNCAS_PURGE_DATA:
+            LogFormat(LOG_NOTICE, "Port command %u refused, the device is gone.",
+                      (unsigned int) Command[3]);
+            return;
+        }
+    }
+
+    /* The port settings may change */
+    PortStateDirty = True;
+
     /* Check wich command has been requested */
     switch (Command[3]) {
         /* Signature */
@@ -712,43 +1299,35 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
         if (CSize == 6) {
             /* Void signature, client is asking for our signature */
             snprintf(SigStr, sizeof(SigStr), "sercd %s %s", VERSION, DeviceName);
-            LogStr[sizeof(SigStr) - 1] = '\0';
+            SigStr[sizeof(SigStr) - 1] = '\0';
             SendSignature(SockB, SigStr);
-            snprintf(LogStr, sizeof(LogStr), "Sent signature: %s", SigStr);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_INFO, LogStr);
+            LogFormat(LOG_INFO, "Sent signature: %s", SigStr);
         }
         else {
             /* Received client signature */
             strncpy(SigStr, (char *) &Command[4], MAX(CSize - 6, sizeof(SigStr) - 1));
-            snprintf(LogStr, sizeof(LogStr) - 1, "Received client signature: %s", SigStr);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_INFO, LogStr);
+            LogFormat(LOG_INFO, "Received client signature: %s", SigStr);
         }
         break;
 
         /* Set serial baud rate */
     case TNCAS_SET_BAUDRATE:
         /* Retrieve the baud rate which is in network order */
-        BaudRate = ntohl(*((unsigned long int *) &Command[4]));
+        BaudRate = ntohl(*((uint32_t *) &Command[4]));
 
         if (BaudRate == 0)
             /* Client is asking for current baud rate */
             LogMsg(LOG_DEBUG, "Baud rate notification received.");
         else {
             /* Change the baud rate */
-            snprintf(LogStr, sizeof(LogStr), "Port baud rate change to %lu requested.", BaudRate);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Port baud rate change to %lu requested.", BaudRate);
             SetPortSpeed(PortFd, BaudRate);
         }
 
         /* Send confirmation */
         BaudRate = GetPortSpeed(PortFd);
         SendBaudRate(SockB, BaudRate);
-        snprintf(LogStr, sizeof(LogStr), "Port baud rate: %lu", BaudRate);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_DEBUG, LogStr);
+        LogFormat(LOG_DEBUG, "Port baud rate: %lu", BaudRate);
         break;
 
         /* Set serial data size */
@@ -758,19 +1337,15 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
             LogMsg(LOG_DEBUG, "Data size notification requested.");
         else {
             /* Set the data size */
-            snprintf(LogStr, sizeof(LogStr),
-                     "Port data size change to %u requested.", (unsigned int) Command[4]);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Port data size change to %u requested.",
+                      (unsigned int) Command[4]);
             SetPortDataSize(PortFd, Command[4]);
         }
 
         /* Send confirmation */
         DataSize = GetPortDataSize(PortFd);
         SendCPCByteCommand(SockB, TNASC_SET_DATASIZE, DataSize);
-        snprintf(LogStr, sizeof(LogStr), "Port data size: %u", (unsigned int) DataSize);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_DEBUG, LogStr);
+        LogFormat(LOG_DEBUG, "Port data size: %u", (unsigned int) DataSize);
         break;
 
         /* Set the serial parity */
@@ -780,19 +1355,14 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
             LogMsg(LOG_DEBUG, "Parity notification requested.");
         else {
             /* Set the parity */
-            snprintf(LogStr, sizeof(LogStr),
-                     "Port parity change to %u requested", (unsigned int) Command[4]);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Port parity change to %u requested", (unsigned int) Command[4]);
             SetPortParity(PortFd, Command[4]);
         }
 
         /* Send confirmation */
         Parity = GetPortParity(PortFd);
         SendCPCByteCommand(SockB, TNASC_SET_PARITY, Parity);
-        snprintf(LogStr, sizeof(LogStr), "Port parity: %u", (unsigned int) Parity);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_DEBUG, LogStr);
+        LogFormat(LOG_DEBUG, "Port parity: %u", (unsigned int) Parity);
         break;
 
         /* Set the serial stop size */
@@ -802,19 +1372,15 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
             LogMsg(LOG_DEBUG, "Stop size notification requested.");
         else {
             /* Set the stop size */
-            snprintf(LogStr, sizeof(LogStr),
-                     "Port stop size change to %u requested.", (unsigned int) Command[4]);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Port stop size change to %u requested.",
+                      (unsigned int) Command[4]);
             SetPortStopSize(PortFd, Command[4]);
         }
 
         /* Send confirmation */
         StopSize = GetPortStopSize(PortFd);
         SendCPCByteCommand(SockB, TNASC_SET_STOPSIZE, StopSize);
-        snprintf(LogStr, sizeof(LogStr), "Port stop size: %u", (unsigned int) StopSize);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_DEBUG, LogStr);
+        LogFormat(LOG_DEBUG, "Port stop size: %u", (unsigned int) StopSize);
         break;
 
         /* Flow control and DTR/RTS handling */
@@ -828,9 +1394,7 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
             LogMsg(LOG_DEBUG, "Flow control notification requested.");
             FlowControl = GetPortFlowControl(PortFd, Command[4]);
             SendCPCByteCommand(SockB, TNASC_SET_CONTROL, FlowControl);
-            snprintf(LogStr, sizeof(LogStr), "Port flow control: %u", (unsigned int) FlowControl);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Port flow control: %u", (unsigned int) FlowControl);
             break;
 
         case TNCOM_CMD_BREAK_REQ:
@@ -859,10 +1423,8 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 
         default:
             /* Set the flow control */
-            snprintf(LogStr, sizeof(LogStr),
-                     "Port flow control change to %u requested.", (unsigned int) Command[4]);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Port flow control change to %u requested.",
+                      (unsigned int) Command[4]);
             SetPortFlowControl(PortFd, Command[4]);
 
             /* Flow control status confirmation */
@@ -877,38 +1439,30 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
                 FlowControl = GetPortFlowControl(PortFd, TNCOM_CMD_FLOW_REQ);
 
             SendCPCByteCommand(SockB, TNASC_SET_CONTROL, FlowControl);
-            snprintf(LogStr, sizeof(LogStr), "Port flow control: %u", (unsigned int) FlowControl);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Port flow control: %u", (unsigned int) FlowControl);
             break;
         }
         break;
 
         /* Set the line state mask */
     case TNCAS_SET_LINESTATE_MASK:
-        snprintf(LogStr, sizeof(LogStr), "Line state set to %u", (unsigned int) Command[4]);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_DEBUG, LogStr);
+        LogFormat(LOG_DEBUG, "Line state set to %u", (unsigned int) Command[4]);
 
-        /* Only break notification supported */
-        LineStateMask = Command[4] & (unsigned char) 16;
+        /* Only error, break and timeout notifications supported */
+        LineStateMask = Command[4] & LineStateSupported;
         SendCPCByteCommand(SockB, TNASC_SET_LINESTATE_MASK, LineStateMask);
         break;
 
         /* Set the modem state mask */
     case TNCAS_SET_MODEMSTATE_MASK:
-        snprintf(LogStr, sizeof(LogStr), "Modem state mask set to %u", (unsigned int) Command[4]);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_DEBUG, LogStr);
+        LogFormat(LOG_DEBUG, "Modem state mask set to %u", (unsigned int) Command[4]);
         ModemStateMask = Command[4];
         SendCPCByteCommand(SockB, TNASC_SET_MODEMSTATE_MASK, ModemStateMask);
         break;
 
         /* Port flush requested */
     case TNCAS_PURGE_DATA:
-        snprintf(LogStr, sizeof(LogStr), "Port flush %u requested.", (unsigned int) Command[4]);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_DEBUG, LogStr);
+        LogFormat(LOG_DEBUG, "Port flush %u requested.", (unsigned int) Command[4]);
         SetFlush(PortFd, Command[4]);
         SendCPCByteCommand(SockB, TNASC_PURGE_DATA, Command[4]);
         break;
@@ -927,85 +1481,492 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 
         /* Unknown request */
     default:
-        snprintf(LogStr, sizeof(LogStr), "Unhandled request %u", (unsigned int) Command[3]);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_DEBUG, LogStr);
+        LogFormat(LOG_DEBUG, "Unhandled request %u", (unsigned int) Command[3]);
         break;
     }
 }
 
-/* Common telnet IAC commands handling */
-#define HandleIACCommand_bytes MAX(HandleCPCCommand_bytes, SendTelnetOption_bytes)
+/* Handling of the COM Port Control notifications and confirmations of
+   the remote port in reverse mode */
 void
-HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command, size_t CSize)
+HandleCPCNotification(PORTHANDLE PtyFd, unsigned char *Command, size_t CSize)
 {
-    char LogStr[TmpStrLen];
+    char SigStr[255];
 
-    /* Check which command */
-    switch (Command[1]) {
-        /* Suboptions */
-    case TNSB:
-        if (!(tnstate[Command[2]].is_will || tnstate[Command[2]].is_do))
-            break;
+    switch (Command[3]) {
+    case TNASC_SIGNATURE:
+        if (CSize > 6) {
+            strncpy(SigStr, (char *) &Command[4], MIN(CSize - 6, sizeof(SigStr) - 1));
+            SigStr[MIN(CSize - 6, sizeof(SigStr) - 1)] = '\0';
+            LogFormat(LOG_INFO, "Remote port signature: %s", SigStr);
+        }
+        break;
 
-        switch (Command[2]) {
-            /* RFC 2217 COM Port Control Protocol option */
-        case TNCOM_PORT_OPTION:
-            HandleCPCCommand(SockB, PortFd, Command, CSize);
-            break;
+    case TNASC_SET_BAUDRATE:
+        LogFormat(LOG_DEBUG, "Remote port baud rate: %lu",
+                  (unsigned long) ntohl(*((uint32_t *) &Command[4])));
+        break;
 
-        default:
-            snprintf(LogStr, sizeof(LogStr), "Unknown suboption received: %u",
-                     (unsigned int) Command[2]);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
-            break;
-        }
+    case TNASC_SET_DATASIZE:
+    case TNASC_SET_PARITY:
+    case TNASC_SET_STOPSIZE:
+    case TNASC_SET_CONTROL:
+    case TNASC_SET_LINESTATE_MASK:
+    case TNASC_SET_MODEMSTATE_MASK:
+    case TNASC_PURGE_DATA:
+        LogFormat(LOG_DEBUG, "Remote port confirmed command %u: %u",
+                  (unsigned int) Command[3] - TNASC_SIGNATURE, (unsigned int) Command[4]);
         break;
 
-        /* Requests for options */
-    case TNWILL:
-        switch (Command[2]) {
-            /* COM Port Control Option */
-        case TNCOM_PORT_OPTION:
-            LogMsg(LOG_INFO, "Telnet COM Port Control Enabled (WILL).");
-            PortControlEnable = True;
-            if (!tnstate[Command[2]].sent_do) {
-                SendTelnetOption(SockB, TNDO, Command[2]);
-            }
-            tnstate[Command[2]].is_do = 1;
-            break;
+    case TNASC_NOTIFY_LINESTATE:
+        if (Command[4] & (TNCOM_LINEMASK_BREAK_ERR | TNCOM_LINEMASK_FRAME_ERR |
+                          TNCOM_LINEMASK_PARITY_ERR | TNCOM_LINEMASK_OVERRUN_ERR)) {
+            LogFormat(LOG_INFO, "Remote port line state: %u", (unsigned int) Command[4]);
+        }
+        break;
 
-            /* Telnet Binary mode */
-        case TN_TRANSMIT_BINARY:
-            LogMsg(LOG_INFO, "Telnet Binary Transfer Enabled (WILL).");
-            if (!tnstate[Command[2]].sent_do)
-                SendTelnetOption(SockB, TNDO, Command[2]);
-            tnstate[Command[2]].is_do = 1;
-            break;
+    case TNASC_NOTIFY_MODEMSTATE:
+        LogFormat(LOG_DEBUG, "Remote port modem state: %u", (unsigned int) Command[4]);
+        /* A pty has no modem lines, only a carrier loss is passed on */
+        if ((RemoteModemState & TNCOM_MODMASK_RLSD) && !(Command[4] & TNCOM_MODMASK_RLSD)) {
+            LogMsg(LOG_INFO, "Remote port lost carrier.");
+            HangupPty(PtyFd);
+        }
+        RemoteModemState = Command[4] & TNCOM_MODMASK_NODELTA;
+        break;
 
-            /* Echo request not handled */
-        case TN_ECHO:
-            LogMsg(LOG_INFO, "Rejecting Telnet Echo Option (WILL).");
-            if (!tnstate[Command[2]].sent_do)
-                SendTelnetOption(SockB, TNDO, Command[2]);
-            tnstate[Command[2]].is_do = 1;
-            break;
+        /* Stop and restart sending pty data to the remote port */
+    case TNASC_FLOWCONTROL_SUSPEND:
+        LogMsg(LOG_DEBUG, "Remote port flow control suspend.");
+        InputFlow = False;
+        break;
 
-            /* No go ahead needed */
-        case TN_SUPPRESS_GO_AHEAD:
-            LogMsg(LOG_INFO, "Suppressing Go Ahead characters (WILL).");
-            if (!tnstate[Command[2]].sent_do)
-                SendTelnetOption(SockB, TNDO, Command[2]);
-            tnstate[Command[2]].is_do = 1;
-            break;
+    case TNASC_FLOWCONTROL_RESUME:
+        LogMsg(LOG_DEBUG, "Remote port flow control resume.");
+        InputFlow = True;
+        break;
+
+    default:
+        LogFormat(LOG_DEBUG, "Unhandled notification %u", (unsigned int) Command[3]);
+        break;
+    }
+}
+
+/* Send the sercd option command Command */
+#define SendSercdCommand_bytes(len) (6 + 2 * (len))
+void
+SendSercdCommand(BufferType * B, unsigned char Command, const unsigned char *Data, size_t Len)
+{
+    size_t i;
+
+    AddToBuffer(B, TNIAC);
+    AddToBuffer(B, TNSB);
+    AddToBuffer(B, TNSERCD_OPTION);
+    AddToBuffer(B, Command);
+    for (i = 0; i < Len; i++) {
+        if (Data[i] == TNIAC)
+            AddToBuffer(B, TNIAC);
+        AddToBuffer(B, Data[i]);
+    }
+    AddToBuffer(B, TNIAC);
+    AddToBuffer(B, TNSE);
+}
+
+/* Store Value in network order */
+void
+PutNetLong(unsigned char *p, unsigned long long Value)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        p[i] = (unsigned char) Value;
+        Value >>= 8;
+    }
+}
+
+/* Retrieve a value stored in network order */
+unsigned long long
+GetNetLong(const unsigned char *p)
+{
+    unsigned long long Value = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        Value = (Value << 8) | p[i];
+    return Value;
+}
+
+/* Store a 16 bit value in network order */
+void
+PutNetShort(unsigned char *p, unsigned int Value)
+{
+    p[0] = (unsigned char) (Value >> 8);
+    p[1] = (unsigned char) Value;
+}
+
+/* Retrieve a 16 bit value stored in network order */
+unsigned int
+GetNetShort(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/* Clamp a requested profile to the administrator limits and apply
+   its socket settings */
+void
+ApplyProfile(ProfileType * P)
+{
+    int SockParm;
+
+    P->LatencyTarget = MIN(P->LatencyTarget, ProfileMaxLatency);
+    P->FlushThreshold = MIN(P->FlushThreshold, ProfileMaxFlush);
+    P->SocketBuffer = MIN(P->SocketBuffer, ProfileMaxBuffer);
+    if (P->PollInterval)
+        P->PollInterval = MAX(P->PollInterval, ProfileMinPoll);
+
+    if (!OutSocketFd)
+        return;
+
+    /* Nagle's algorithm only delays an interactive session */
+    SockParm = P->LatencyTarget == 0 || P->FlushThreshold == 0;
+    setsockopt(*OutSocketFd, IPPROTO_TCP, TCP_NODELAY, (char *) &SockParm, sizeof(SockParm));
+    if (P->SocketBuffer) {
+        SockParm = P->SocketBuffer * 1024;
+        setsockopt(*OutSocketFd, SOL_SOCKET, SO_SNDBUF, (char *) &SockParm, sizeof(SockParm));
+        setsockopt(*InSocketFd, SOL_SOCKET, SO_RCVBUF, (char *) &SockParm, sizeof(SockParm));
+    }
+}
+
+/* Check if the network buffer should be written now. Data is held
+   back until FlushThreshold bytes are queued or the oldest byte waited
+   LatencyTarget ms; FlushTimer is armed for that deadline. */
+Boolean
+IsNetFlushDue(BufferType * B)
+{
+    unsigned long long Now, Age, Target;
+
+    if (IsBufferEmpty(B)) {
+        NetPendingSince = 0;
+        CancelTimer(&FlushTimer);
+        return False;
+    }
+    if (Profile.LatencyTarget == 0 || BufferLength(B) >= Profile.FlushThreshold) {
+        CancelTimer(&FlushTimer);
+        return True;
+    }
+
+    Now = GetTimeMicros();
+    if (NetPendingSince == 0)
+        NetPendingSince = Now;
+    Age = Now - NetPendingSince;
+    Target = Profile.LatencyTarget * 1000ULL;
+    if (Age >= Target) {
+        CancelTimer(&FlushTimer);
+        return True;
+    }
+    AddTimer(&FlushTimer, (NetPendingSince + Target + 999) / 1000);
+    return False;
+}
+
+/* Queue a latency probe received with ToNetDepth bytes waiting for
+   the network */
+void
+QueueProbe(const unsigned char *Stamp, unsigned int ToNetDepth)
+{
+    ProbeType *P;
+
+    if (ProbeCount == ProbeMax) {
+        LogMsg(LOG_NOTICE, "Too many latency probes pending, dropping one.");
+        return;
+    }
+    P = &Probes[(ProbeFirst + ProbeCount++) % ProbeMax];
+    memcpy(P->Stamp, Stamp, sizeof(P->Stamp));
+    P->Mark = ProbeQueued;
+    P->RecvTime = GetTimeMicros();
+    P->WriteTime = P->Mark <= ProbeWritten ? P->RecvTime : 0;
+    P->ToDevDepth = (unsigned int) (ProbeQueued - ProbeWritten);
+    P->ToNetDepth = ToNetDepth;
+}
+
+/* Account Bytes written to the device for the pending probes */
+void
+StampProbes(size_t Bytes)
+{
+    unsigned long long Now = 0;
+    unsigned int i;
+
+    ProbeWritten += Bytes;
+    for (i = 0; i < ProbeCount; i++) {
+        ProbeType *P = &Probes[(ProbeFirst + i) % ProbeMax];
+        if (P->WriteTime)
+            continue;
+        if (P->Mark > ProbeWritten)
+            break;
+        if (Now == 0)
+            Now = GetTimeMicros();
+        P->WriteTime = Now;
+    }
+}
+
+/* Answer the probes which got to the device. Payload of a reply is the
+   client timestamp, the receive and device write times in us, and
+   the queue depths at receipt, 16 bits each. */
+#define ProbeReply_len 28
+void
+SendProbeReplies(BufferType * ToDevB, BufferType * ToNetB)
+{
+    unsigned char Reply[ProbeReply_len];
+
+    /* Client data dropped on the way, as by a purge, never reaches
+       the device: once nothing is queued, every probe got through */
+    if (ProbeCount && IsBufferEmpty(ToDevB) && IsSpoolEmpty(&DevSpool)) {
+        ProbeWritten = ProbeQueued;
+        StampProbes(0);
+    }
+
+    while (ProbeCount && Probes[ProbeFirst].WriteTime &&
+           BufferHasRoomFor(ToNetB, SendSercdCommand_bytes(ProbeReply_len))) {
+        ProbeType *P = &Probes[ProbeFirst];
+        memcpy(&Reply[0], P->Stamp, sizeof(P->Stamp));
+        PutNetLong(&Reply[8], P->RecvTime);
+        PutNetLong(&Reply[16], P->WriteTime);
+        PutNetShort(&Reply[24], MIN(P->ToDevDepth, 0xFFFF));
+        PutNetShort(&Reply[26], MIN(P->ToNetDepth, 0xFFFF));
+        SendSercdCommand(ToNetB, TNSSC_PROBE, Reply, sizeof(Reply));
+        ProbeFirst = (ProbeFirst + 1) % ProbeMax;
+        ProbeCount--;
+    }
+}
+
+/* Note the data queued to B from the write position From on as a
+   segment read at Time */
+void
+QueueSegment(DwellType * D, BufferType * B, unsigned int From, unsigned long long Time)
+{
+    SegmentType *S;
+
+    if (B->WrPos == From)
+        return;
+    if (D->Count == SegmentMax) {
+        /* Join the last segment: its earlier time can only make the
+           wait look longer, never shorter */
+        D->Segments[(D->First + D->Count - 1) % SegmentMax].Pos = B->WrPos;
+        return;
+    }
+    S = &D->Segments[(D->First + D->Count++) % SegmentMax];
+    S->Pos = B->WrPos;
+    S->Time = Time;
+}
+
+/* Account Len bytes about to be popped from B. The segments ending
+   within them get their wait recorded if the bytes were Sent, and are
+   dropped otherwise. */
+void
+PopSegments(DwellType * D, BufferType * B, unsigned int Len, Boolean Sent)
+{
+    unsigned long long Now = 0;
+    unsigned int Offset;
+
+    while (D->Count) {
+        SegmentType *S = &D->Segments[D->First];
+        /* Bytes of B up to the end of the segment */
+        Offset = (S->Pos - B->RdPos + BufferSize) % BufferSize;
+        if (Offset > Len)
+            break;
+        if (Sent) {
+            if (Now == 0)
+                Now = GetTimeMicros();
+            RecordLatency(&D->Hist, Now - S->Time);
+        }
+        D->First = (D->First + 1) % SegmentMax;
+        D->Count--;
+    }
+}
+
+/* Handling of sercd option specific commands. Command[4] to
+   Command[CSize - 3] is the payload. */
+#define HandleSercdCommand_bytes SendSercdCommand_bytes(ResumeTokenLen)
+void
+HandleSercdCommand(BufferType * SockB, unsigned char *Command, size_t CSize)
+{
+    unsigned char Counter[8];
+    size_t Len = CSize - 6;
+
+    switch (Command[3]) {
+        /* Replay of the device output history */
+    case TNSCS_REPLAY_HISTORY:
+        if (History.Replaying) {
+            LogMsg(LOG_DEBUG, "History replay already running.");
+            break;
+        }
+        LogFormat(LOG_DEBUG, "History replay of %llu bytes requested.",
+                  StartHistoryReplay(&History));
+        SendSercdCommand(SockB, TNSSC_HISTORY_BEGIN, NULL, 0);
+        break;
+
+        /* Start a resumable session */
+    case TNSCS_SESSION_BEGIN:
+        if (!IsResumeEnabled(&Resume)) {
+            LogMsg(LOG_DEBUG, "Session resumption disabled.");
+            SendSercdCommand(SockB, TNSSC_SESSION_LOST, NULL, 0);
+            break;
+        }
+        NewResumeSession(&Resume);
+        LogMsg(LOG_INFO, "Resumable session started.");
+        SendSercdCommand(SockB, TNSSC_SESSION_TOKEN, Resume.Token, ResumeTokenLen);
+        break;
+
+        /* Resume a detached session. Payload is the token followed by
+           the number of device bytes the client received. */
+    case TNSCS_SESSION_RESUME:
+        if (Len != ResumeTokenLen + 8 ||
+            ResumeSession(&Resume, &Command[4], GetNetLong(&Command[4 + ResumeTokenLen]))
+            != NoError) {
+            LogMsg(LOG_NOTICE, "Unable to resume session.");
+            SendSercdCommand(SockB, TNSSC_SESSION_LOST, NULL, 0);
+            break;
+        }
+        LogFormat(LOG_INFO, "Session resumed, retransmitting %llu bytes.",
+                  Resume.Window.Total - Resume.Window.ReplayPos);
+        /* Tell the client where to resume sending */
+        PutNetLong(Counter, Resume.FromNet);
+        SendSercdCommand(SockB, TNSSC_SESSION_RESUMED, Counter, sizeof(Counter));
+        break;
+
+        /* Latency/throughput profile. Payload is the latency target
+           in ms, the flush threshold in bytes, the socket buffer size in
+           KB and the modem state poll interval in ms, 16 bits each. The
+           reply holds the profile in effect. */
+    case TNSCS_PROFILE:
+        if (Len != 8) {
+            LogMsg(LOG_NOTICE, "Invalid profile request.");
+            break;
+        }
+        Profile.LatencyTarget = GetNetShort(&Command[4]);
+        Profile.FlushThreshold = GetNetShort(&Command[6]);
+        Profile.SocketBuffer = GetNetShort(&Command[8]);
+        Profile.PollInterval = GetNetShort(&Command[10]);
+        ApplyProfile(&Profile);
+        LogFormat(LOG_INFO, "Profile: latency %u ms, flush %u bytes, buffer %u KB, poll %u ms.",
+                  Profile.LatencyTarget, Profile.FlushThreshold, Profile.SocketBuffer,
+                  Profile.PollInterval);
+        PutNetShort(&Counter[0], Profile.LatencyTarget);
+        PutNetShort(&Counter[2], Profile.FlushThreshold);
+        PutNetShort(&Counter[4], Profile.SocketBuffer);
+        PutNetShort(&Counter[6], Profile.PollInterval);
+        SendSercdCommand(SockB, TNSSC_PROFILE, Counter, 8);
+        break;
+
+        /* Latency probe, payload is a client timestamp. The reply is
+           sent by SendProbeReplies(). */
+    case TNSCS_PROBE:
+        if (Len != 8) {
+            LogMsg(LOG_NOTICE, "Invalid latency probe.");
+            break;
+        }
+        QueueProbe(&Command[4], BufferLength(SockB));
+        break;
+
+        /* Stamp device data batches, payload is 1 to start, 0 to stop */
+    case TNSCS_DEVICE_STAMPS:
+        if (Len != 1) {
+            LogMsg(LOG_NOTICE, "Invalid device stamp request.");
+            break;
+        }
+        DeviceStamps = Command[4] != 0;
+        LogMsg(LOG_INFO, DeviceStamps ? "Device stamps on." : "Device stamps off.");
+        break;
+
+        /* Unknown request */
+    default:
+        LogFormat(LOG_DEBUG, "Unhandled sercd request %u", (unsigned int) Command[3]);
+        break;
+    }
+}
+
+/* Common telnet IAC commands handling */
+#define HandleIACCommand_bytes \
+ MAX(HandleCPCCommand_bytes, MAX(HandleSercdCommand_bytes, SendTelnetOption_bytes))
+void
+HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command, size_t CSize)
+{
+    IacCommands++;
+
+    /* Check which command */
+    switch (Command[1]) {
+        /* Suboptions */
+    case TNSB:
+        if (!(tnstate[Command[2]].is_will || tnstate[Command[2]].is_do))
+            break;
+
+        switch (Command[2]) {
+            /* RFC 2217 COM Port Control Protocol option */
+        case TNCOM_PORT_OPTION:
+            if (ReverseMode)
+                HandleCPCNotification(PortFd, Command, CSize);
+            else
+                HandleCPCCommand(SockB, PortFd, Command, CSize);
+            break;
+
+            /* sercd extensions */
+        case TNSERCD_OPTION:
+            HandleSercdCommand(SockB, Command, CSize);
+            break;
+
+        default:
+            LogFormat(LOG_DEBUG, "Unknown suboption received: %u", (unsigned int) Command[2]);
+            break;
+        }
+        break;
+
+        /* Requests for options */
+    case TNWILL:
+        switch (Command[2]) {
+            /* COM Port Control Option */
+        case TNCOM_PORT_OPTION:
+            LogMsg(LOG_INFO, "Telnet COM Port Control Enabled (WILL).");
+            PortControlEnable = True;
+            if (!tnstate[Command[2]].sent_do) {
+                SendTelnetOption(SockB, TNDO, Command[2]);
+            }
+            tnstate[Command[2]].is_do = 1;
+            break;
+
+            /* sercd extensions */
+        case TNSERCD_OPTION:
+            LogMsg(LOG_INFO, "sercd extensions enabled (WILL).");
+            if (!tnstate[Command[2]].sent_do)
+                SendTelnetOption(SockB, TNDO, Command[2]);
+            tnstate[Command[2]].is_do = 1;
+            break;
+
+            /* Telnet Binary mode */
+        case TN_TRANSMIT_BINARY:
+            LogMsg(LOG_INFO, "Telnet Binary Transfer Enabled (WILL).");
+            if (!tnstate[Command[2]].sent_do)
+                SendTelnetOption(SockB, TNDO, Command[2]);
+            tnstate[Command[2]].is_do = 1;
+            break;
+
+            /* Echo request not handled */
+        case TN_ECHO:
+            LogMsg(LOG_INFO, "Rejecting Telnet Echo Option (WILL).");
+            if (!tnstate[Command[2]].sent_do)
+                SendTelnetOption(SockB, TNDO, Command[2]);
+            tnstate[Command[2]].is_do = 1;
+            break;
+
+            /* No go ahead needed */
+        case TN_SUPPRESS_GO_AHEAD:
+            LogMsg(LOG_INFO, "Suppressing Go Ahead characters (WILL).");
+            if (!tnstate[Command[2]].sent_do)
+                SendTelnetOption(SockB, TNDO, Command[2]);
+            tnstate[Command[2]].is_do = 1;
+            break;
 
             /* Reject everything else */
         default:
-            snprintf(LogStr, sizeof(LogStr), "Rejecting option WILL: %u",
-                     (unsigned int) Command[2]);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Rejecting option WILL: %u", (unsigned int) Command[2]);
             SendTelnetOption(SockB, TNDONT, Command[2]);
             tnstate[Command[2]].is_do = 0;
             break;
@@ -1026,6 +1987,14 @@ HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
             tnstate[Command[2]].is_will = 1;
             break;
 
+            /* sercd extensions */
+        case TNSERCD_OPTION:
+            LogMsg(LOG_INFO, "sercd extensions enabled (DO).");
+            if (!tnstate[Command[2]].sent_will)
+                SendTelnetOption(SockB, TNWILL, Command[2]);
+            tnstate[Command[2]].is_will = 1;
+            break;
+
             /* Telnet Binary mode */
         case TN_TRANSMIT_BINARY:
             LogMsg(LOG_INFO, "Telnet Binary Transfer Enabled (DO).");
@@ -1052,9 +2021,7 @@ HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 
             /* Reject everything else */
         default:
-            snprintf(LogStr, sizeof(LogStr), "Rejecting option DO: %u", (unsigned int) Command[2]);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Rejecting option DO: %u", (unsigned int) Command[2]);
             SendTelnetOption(SockB, TNWONT, Command[2]);
             tnstate[Command[2]].is_will = 0;
             break;
@@ -1065,10 +2032,7 @@ HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 
         /* Notifications of rejections for options */
     case TNDONT:
-        snprintf(LogStr, sizeof(LogStr), "Received rejection for option: %u",
-                 (unsigned int) Command[2]);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_DEBUG, LogStr);
+        LogFormat(LOG_DEBUG, "Received rejection for option: %u", (unsigned int) Command[2]);
         if (tnstate[Command[2]].is_will) {
             SendTelnetOption(SockB, TNWONT, Command[2]);
             tnstate[Command[2]].is_will = 0;
@@ -1083,10 +2047,7 @@ HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
                    "Protocol Option (RFC 2217), trying to serve anyway.");
         }
         else {
-            snprintf(LogStr, sizeof(LogStr),
-                     "Received rejection for option: %u", (unsigned int) Command[2]);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_DEBUG, LogStr);
+            LogFormat(LOG_DEBUG, "Received rejection for option: %u", (unsigned int) Command[2]);
         }
         if (tnstate[Command[2]].is_do) {
             SendTelnetOption(SockB, TNDONT, Command[2]);
@@ -1117,11 +2078,793 @@ IOResultError(int iobytes, const char *err, const char *eof_err)
     return False;
 }
 
+/* Move replay data of H to the network buffer, and terminate the
+   replay once all of it has been queued, optionally with a
+   HISTORY_END notification. Returns True while the replay is
+   running. */
+Boolean
+FeedHistoryReplay(HistoryType * H, BufferType * B, Boolean Framed)
+{
+    unsigned char *p;
+    size_t len, i;
+
+    while ((len = GetHistoryReplayString(H, &p)) > 0) {
+        len = MIN(len, BufferRoomLeft(B) / EscWriteChar_bytes);
+        if (len == 0)
+            return True;
+        for (i = 0; i < len; i++)
+            EscWriteChar(B, p[i]);
+        HistoryReplayPopBytes(H, len);
+    }
+
+    if (Framed) {
+        if (!BufferHasRoomFor(B, SendSercdCommand_bytes(0)))
+            return True;
+        SendSercdCommand(B, TNSSC_HISTORY_END, NULL, 0);
+    }
+    StopHistoryReplay(H);
+    LogMsg(LOG_DEBUG, "Replay done.");
+    return False;
+}
+
+/* Move spooled device output to the network buffer */
+void
+FeedSpool(BufferType * B)
+{
+    /* Spool.Dropped when the loss was last logged */
+    static unsigned long long Reported = 0;
+    unsigned char *p;
+    size_t len, i;
+
+    while ((len = GetSpoolString(&Spool, &p)) > 0) {
+        len = MIN(len, BufferRoomLeft(B) / EscWriteChar_bytes);
+        if (len == 0)
+            return;
+        for (i = 0; i < len; i++)
+            EscWriteChar(B, p[i]);
+        if (Resume.HasToken)
+            AddToHistory(&Resume.Window, p, len);
+        SpoolPopBytes(&Spool, len);
+    }
+
+    if (Spool.Dropped != Reported) {
+        LogFormat(LOG_WARNING, "Spool full, %llu bytes of device output lost.",
+                  Spool.Dropped - Reported);
+        Reported = Spool.Dropped;
+    }
+}
+
+/* Collect the session state for a new process taking over */
+void
+SaveHandoverState(HandoverType * H, BufferType * ToDevB, BufferType * ToNetB)
+{
+    memset(H, 0, sizeof(*H));
+    H->Magic = HandoverMagic;
+    H->Size = sizeof(*H);
+    H->HasClient = InSocketFd != NULL;
+    H->HasDevice = DeviceFd != NULL;
+    if (ToDevB->Buffer != NULL)
+        memcpy(H->ToDevBuf.Data, ToDevB->Buffer, BufferSize);
+    H->ToDevBuf.RdPos = ToDevB->RdPos;
+    H->ToDevBuf.WrPos = ToDevB->WrPos;
+    if (ToNetB->Buffer != NULL)
+        memcpy(H->ToNetBuf.Data, ToNetB->Buffer, BufferSize);
+    H->ToNetBuf.RdPos = ToNetB->RdPos;
+    H->ToNetBuf.WrPos = ToNetB->WrPos;
+    memcpy(H->tnstate, tnstate, sizeof(tnstate));
+    H->IACEscape = IACEscape;
+    H->IACSigEscape = IACSigEscape;
+    memcpy(H->IACCommand, IACCommand, sizeof(IACCommand));
+    H->IACPos = IACPos;
+    H->EscWriteLast = EscWriteLast;
+    H->EscRedirectLast = EscRedirectLast;
+    H->ModemStateMask = ModemStateMask;
+    H->LineStateMask = LineStateMask;
+    H->ModemState = ModemState;
+    H->BreakSignaled = BreakSignaled;
+    H->InputFlow = InputFlow;
+    H->PortControlEnable = PortControlEnable;
+    H->Profile = Profile;
+    strncpy(H->DeviceName, DeviceName, sizeof(H->DeviceName) - 1);
+#ifndef ANDROID
+    strncpy(H->LockFileName, LockFileName, sizeof(H->LockFileName) - 1);
+#endif
+    SavePlatformState(H->PlatformState);
+}
+
+/* Continue the session of the process we took over from. Returns
+   Error if the state was written by an incompatible build. */
+int
+RestoreHandoverState(HandoverType * H, BufferType * ToDevB, BufferType * ToNetB)
+{
+    if (H->Magic != HandoverMagic || H->Size != sizeof(*H))
+        return Error;
+
+    AttachSessionBuffers(ToDevB, ToNetB);
+    memcpy(ToDevB->Buffer, H->ToDevBuf.Data, BufferSize);
+    ToDevB->RdPos = H->ToDevBuf.RdPos % BufferSize;
+    ToDevB->WrPos = H->ToDevBuf.WrPos % BufferSize;
+    memcpy(ToNetB->Buffer, H->ToNetBuf.Data, BufferSize);
+    ToNetB->RdPos = H->ToNetBuf.RdPos % BufferSize;
+    ToNetB->WrPos = H->ToNetBuf.WrPos % BufferSize;
+    memcpy(tnstate, H->tnstate, sizeof(tnstate));
+    IACEscape = H->IACEscape;
+    IACSigEscape = H->IACSigEscape;
+    memcpy(IACCommand, H->IACCommand, sizeof(IACCommand));
+    IACPos = H->IACPos;
+    EscWriteLast = H->EscWriteLast;
+    EscRedirectLast = H->EscRedirectLast;
+    ModemStateMask = H->ModemStateMask;
+    LineStateMask = H->LineStateMask;
+    ModemState = H->ModemState;
+    BreakSignaled = H->BreakSignaled;
+    InputFlow = H->InputFlow;
+    PortControlEnable = H->PortControlEnable;
+    Profile = H->Profile;
+    if (H->HasDevice) {
+        DeviceName = strdup(H->DeviceName);
+#ifndef ANDROID
+        LockFileName = strdup(H->LockFileName);
+#endif
+    }
+    RestorePlatformState(H->PlatformState);
+    return NoError;
+}
+
+void
+SampleLineState(PORTHANDLE PortFd)
+{
+    LineCountersType C;
+    unsigned long Overrun, Frame, Parity, Break, BufOverrun;
+
+    if (GetLineCounters(PortFd, &C) != NoError)
+        return;
+
+    /* The first sample, or counters which went back with a new
+       device, only set the baseline */
+    if (!LineCountersValid || C.Overrun < LineCounters.Overrun ||
+        C.Frame < LineCounters.Frame || C.Parity < LineCounters.Parity ||
+        C.Break < LineCounters.Break || C.BufOverrun < LineCounters.BufOverrun) {
+        LineCounters = C;
+        LineCountersValid = True;
+        return;
+    }
+
+    Overrun = C.Overrun - LineCounters.Overrun;
+    Frame = C.Frame - LineCounters.Frame;
+    Parity = C.Parity - LineCounters.Parity;
+    Break = C.Break - LineCounters.Break;
+    BufOverrun = C.BufOverrun - LineCounters.BufOverrun;
+    LineCounters = C;
+
+    LineTotals.Overrun += Overrun;
+    LineTotals.Frame += Frame;
+    LineTotals.Parity += Parity;
+    LineTotals.Break += Break;
+    LineTotals.BufOverrun += BufOverrun;
+
+    if (Overrun || BufOverrun)
+        LineState |= TNCOM_LINEMASK_OVERRUN_ERR;
+    if (Frame)
+        LineState |= TNCOM_LINEMASK_FRAME_ERR;
+    if (Parity)
+        LineState |= TNCOM_LINEMASK_PARITY_ERR;
+    if (Break)
+        LineState |= TNCOM_LINEMASK_BREAK_ERR;
+}
+
+/* Close a device which vanished under a connected client and tell
+   the client its lines dropped. Returns False if the session can't be
+   kept without the device. */
+Boolean
+DetachDevice(BufferType * ToNetB)
+{
+    unsigned char Delta = 0;
+
+    if (!IsSpoolEnabled(&DevSpool) || !InSocketFd)
+        return False;
+
+#ifndef ANDROID
+    DropConnection(DeviceFd, NULL, NULL, LockFileName);
+#else
+    DropConnection(DeviceFd, NULL, NULL);
+#endif
+    DeviceFd = NULL;
+    DeviceGone = True;
+    DeviceGoneTime = time(NULL);
+    DeviceRetry = DeviceGoneTime + 1;
+    DeviceWatchFd = WatchDeviceNode(DeviceName);
+
+    LogFormat(LOG_NOTICE, "Device %s gone, holding the session.", DeviceName);
+
+    /* Carrier and handshake lines went away with the device */
+    if (ModemState & TNCOM_MODMASK_RLSD)
+        Delta |= TNCOM_MODMASK_RLSD_DELTA;
+    if (ModemState & TNCOM_MODMASK_DSR)
+        Delta |= TNCOM_MODMASK_DSR_DELTA;
+    if (ModemState & TNCOM_MODMASK_CTS)
+        Delta |= TNCOM_MODMASK_CTS_DELTA;
+    ModemState = 0;
+    if (PortControlEnable && (Delta & ModemStateMask) &&
+        BufferHasRoomFor(ToNetB, SendCPCByteCommand_bytes))
+        SendCPCByteCommand(ToNetB, TNASC_NOTIFY_MODEMSTATE, Delta & ModemStateMask);
+    if (PortControlEnable && (LineStateMask & TNCOM_LINEMASK_TIMEOUT) &&
+        BufferHasRoomFor(ToNetB, SendCPCByteCommand_bytes))
+        SendCPCByteCommand(ToNetB, TNASC_NOTIFY_LINESTATE, TNCOM_LINEMASK_TIMEOUT);
+    return True;
+}
+
+/* Try to reopen a vanished device and apply the settings it had */
+void
+ReattachDevice(PORTHANDLE * PortFd)
+{
+    if (!DeviceNodeChanged(DeviceWatchFd, DeviceName) && time(NULL) < DeviceRetry)
+        return;
+    DeviceRetry = time(NULL) + 1;
+
+#ifndef ANDROID
+    if (OpenPort(DeviceName, LockFileName, PortFd) != NoError)
+#else
+    if (OpenPort(DeviceName, PortFd) != NoError)
+#endif
+        return;
+
+    RestorePortState(*PortFd, PortState);
+    DeviceFd = PortFd;
+    DeviceGone = False;
+    if (DeviceWatchFd >= 0) {
+        close(DeviceWatchFd);
+        DeviceWatchFd = -1;
+    }
+
+    LogFormat(LOG_NOTICE, "Device %s back after %ld s.", DeviceName,
+              (long) (time(NULL) - DeviceGoneTime));
+}
+
+/* Stop waiting for a vanished device once its client is gone */
+void
+ForgetDevice(void)
+{
+    unsigned char *p;
+    size_t len;
+
+    DeviceGone = False;
+    if (DeviceWatchFd >= 0) {
+        close(DeviceWatchFd);
+        DeviceWatchFd = -1;
+    }
+    while ((len = GetSpoolString(&DevSpool, &p)) > 0)
+        SpoolPopBytes(&DevSpool, len);
+}
+
+/* Move client data held for the device to the device buffer */
+void
+FeedDevSpool(BufferType * B)
+{
+    unsigned char *p;
+    size_t len, i;
+
+    while ((len = GetSpoolString(&DevSpool, &p)) > 0) {
+        len = MIN(len, BufferRoomLeft(B));
+        if (len == 0)
+            return;
+        for (i = 0; i < len; i++)
+            AddToBuffer(B, p[i]);
+        SpoolPopBytes(&DevSpool, len);
+    }
+}
+
+/* Select timeout in busy poll mode: 0 while the line was active in the
+   last BusyPollWindow us and the CPU share of the current second is
+   not used up */
+long
+BusyPollTimeout(long Timeout, unsigned long long Now)
+{
+    if (BusyPollWindow <= 0 || Now - LastIoActivity >= (unsigned long long) BusyPollWindow)
+        return Timeout;
+
+    if (Now - SpinPeriodStart >= 1000000) {
+        SpinPeriodStart = Now;
+        SpinPeriodUsed = 0;
+    }
+    if (SpinPeriodUsed >= BusyPollShare * 10000ULL)
+        return Timeout;
+    return 0;
+}
+
+/* Text reply to a stats control command */
+void
+FormatStats(char *Buf, size_t Len, BufferType * ToDevB, BufferType * ToNetB)
+{
+    static const char ParityChar[] = "?NOEMS";
+    unsigned char Parity = 0, StopSize = 0;
+    size_t Pos;
+
+    Pos = snprintf(Buf, Len, "client %s\n",
+                   InSocketFd ? "connected" : IsSessionDetached(&Resume) ? "detached" : "none");
+    if (DeviceFd && Pos < Len) {
+        Parity = GetPortParity(*DeviceFd);
+        StopSize = GetPortStopSize(*DeviceFd);
+        Pos += snprintf(Buf + Pos, Len - Pos, "device %s %lu %u%c%s\n", DeviceName,
+                        GetPortSpeed(*DeviceFd), (unsigned int) GetPortDataSize(*DeviceFd),
+                        Parity < sizeof(ParityChar) - 1 ? ParityChar[Parity] : '?',
+                        StopSize == TNCOM_TWOSTOPBITS ? "2" :
+                        StopSize == TNCOM_ONE5STOPBITS ? "1.5" : "1");
+    }
+    else if (Pos < Len) {
+        Pos += snprintf(Buf + Pos, Len - Pos, DeviceGone ? "device gone\n" : "device closed\n");
+    }
+    if (Pos < Len) {
+        Pos += snprintf(Buf + Pos, Len - Pos,
+                        "clients %lu\n"
+                        "device_in %llu\n"
+                        "device_out %llu\n"
+                        "network_in %llu\n"
+                        "network_out %llu\n"
+                        "to_device_buffered %u\n"
+                        "to_network_buffered %u\n"
+                        "history %lu\n"
+                        "spooled %lu\n"
+                        "busy_poll_us %llu\n"
+                        "buffers %u/%u\n"
+                        "buffer_allocs %lu\n"
+                        "port_ready_us %llu\n"
+                        "overruns %lu\n"
+                        "framing_errors %lu\n"
+                        "parity_errors %lu\n"
+                        "breaks %lu\n"
+                        "buffer_overruns %lu\n",
+                        ClientCount, DevInBytes, DevOutBytes, NetInBytes, NetOutBytes,
+                        BufferLength(ToDevB), BufferLength(ToNetB),
+                        (unsigned long) History.Kept,
+                        (unsigned long) (Spool.Length + Spool.FileLength), SpinTotal,
+                        BufferSlab.InUse, BufferSlab.Count, BufferSlab.Allocs, LastReadyTime,
+                        LineTotals.Overrun, LineTotals.Frame, LineTotals.Parity, LineTotals.Break,
+                        LineTotals.BufOverrun);
+    }
+    /* p50, p99, p99.9 and longest wait of data in sercd */
+    if (Pos < Len) {
+        Pos += snprintf(Buf + Pos, Len - Pos, "to_network_dwell_us %llu %llu %llu %llu\n",
+                        (unsigned long long) LatencyPercentile(&ToNetDwell.Hist, 0.5),
+                        (unsigned long long) LatencyPercentile(&ToNetDwell.Hist, 0.99),
+                        (unsigned long long) LatencyPercentile(&ToNetDwell.Hist, 0.999),
+                        (unsigned long long) ToNetDwell.Hist.Max);
+    }
+    if (Pos < Len) {
+        snprintf(Buf + Pos, Len - Pos, "to_device_dwell_us %llu %llu %llu %llu\n",
+                 (unsigned long long) LatencyPercentile(&ToDevDwell.Hist, 0.5),
+                 (unsigned long long) LatencyPercentile(&ToDevDwell.Hist, 0.99),
+                 (unsigned long long) LatencyPercentile(&ToDevDwell.Hist, 0.999),
+                 (unsigned long long) ToDevDwell.Hist.Max);
+    }
+    Buf[Len - 1] = '\0';
+}
+
+void
+CollectCounters(SercdCountersType * C)
+{
+    C->DevIn = DevInBytes;
+    C->DevOut = DevOutBytes;
+    C->NetIn = NetInBytes;
+    C->NetOut = NetOutBytes;
+    C->EscapesAdded = EscapesAdded;
+    C->IacCommands = IacCommands;
+    C->Wakeups = Wakeups;
+    C->ShortWrites = ShortWrites;
+    C->Overruns = LineTotals.Overrun + LineTotals.BufOverrun;
+    C->Drops = Spool.Dropped + DevSpool.Dropped;
+    C->Connects = ClientCount;
+    C->ToDevHighWater = ToDevHighWater;
+    C->ToNetHighWater = ToNetHighWater;
+}
+
+void
+NoteQueueLengths(BufferType * ToDevB, BufferType * ToNetB)
+{
+    unsigned int ToDev = BufferLength(ToDevB);
+    unsigned int ToNet = BufferLength(ToNetB);
+
+    if (ToDev > SessionToDevHighWater) {
+        SessionToDevHighWater = ToDev;
+        ToDevHighWater = MAX(ToDevHighWater, ToDev);
+    }
+    if (ToNet > SessionToNetHighWater) {
+        SessionToNetHighWater = ToNet;
+        ToNetHighWater = MAX(ToNetHighWater, ToNet);
+    }
+}
+
+void
+PublishStats(BufferType * ToDevB, BufferType * ToNetB, unsigned long long Now,
+             Boolean Histograms)
+{
+    SercdCountersType Port, Session;
+    const SercdCountersType *B = &SessionBase;
+
+    NoteQueueLengths(ToDevB, ToNetB);
+    CollectCounters(&Port);
+    if (InSocketFd) {
+        Session.DevIn = Port.DevIn - B->DevIn;
+        Session.DevOut = Port.DevOut - B->DevOut;
+        Session.NetIn = Port.NetIn - B->NetIn;
+        Session.NetOut = Port.NetOut - B->NetOut;
+        Session.EscapesAdded = Port.EscapesAdded - B->EscapesAdded;
+        Session.IacCommands = Port.IacCommands - B->IacCommands;
+        Session.Wakeups = Port.Wakeups - B->Wakeups;
+        Session.ShortWrites = Port.ShortWrites - B->ShortWrites;
+        Session.Overruns = Port.Overruns - B->Overruns;
+        Session.Drops = Port.Drops - B->Drops;
+        Session.Connects = Port.Connects - B->Connects;
+        Session.ToDevHighWater = SessionToDevHighWater;
+        Session.ToNetHighWater = SessionToNetHighWater;
+    }
+    else
+        memset(&Session, 0, sizeof(Session));
+    /* The histograms are large, they are copied on housekeeping only */
+    UpdateStatsPage(&Port, &Session, InSocketFd ? SessionStartTime : 0, Now,
+                    Histograms ? &ToNetDwell.Hist : NULL, Histograms ? &ToDevDwell.Hist : NULL);
+}
+
+/* Apply the port settings of a reconfigure control command to PortFd */
+void
+ApplyLineSettings(PORTHANDLE PortFd, ControlCommandType * C)
+{
+    if (C->Speed)
+        SetPortSpeed(PortFd, C->Speed);
+    if (C->DataSize)
+        SetPortDataSize(PortFd, C->DataSize);
+    if (C->Parity)
+        SetPortParity(PortFd, C->Parity);
+    if (C->StopSize)
+        SetPortStopSize(PortFd, C->StopSize);
+}
+
+/* Apply "speed [8N1]" settings to device A and, if not NULL, the
+   bridged device B; a second set after a slash is for B. Returns
+   NoError on success. */
+int
+ApplyDeviceSettings(PORTHANDLE A, PORTHANDLE * B, const char *Settings)
+{
+    ControlCommandType C;
+    char Line[ControlMaxLine];
+    const char *Second = strchr(Settings, '/');
+
+    snprintf(Line, sizeof(Line), "set %.*s",
+             (int) (Second ? (size_t) (Second - Settings) : strlen(Settings)), Settings);
+    if (ParseControlCommand(Line, &C) != NoError)
+        return Error;
+    ApplyLineSettings(A, &C);
+    if (!B)
+        return Second ? Error : NoError;
+
+    if (Second) {
+        snprintf(Line, sizeof(Line), "set %s", Second + 1);
+        if (ParseControlCommand(Line, &C) != NoError)
+            return Error;
+    }
+    ApplyLineSettings(*B, &C);
+    return NoError;
+}
+
+/* Send the line settings of PtyFd which changed since the last call
+   to the remote port, all of them if Force */
+#define MirrorPtySettings_bytes (SendBaudRate_bytes + 5 * SendCPCByteCommand_bytes)
+void
+MirrorPtySettings(BufferType * B, PORTHANDLE PtyFd, Boolean Force)
+{
+    static unsigned long int Speed = 0;
+    static unsigned char DataSize = 0;
+    static unsigned char Parity = 0;
+    static unsigned char StopSize = 0;
+    static unsigned char Flow = 0;
+    static Boolean DtrOff = False;
+    unsigned long int NewSpeed = GetPortSpeed(PtyFd);
+    unsigned char NewDataSize = GetPortDataSize(PtyFd);
+    unsigned char NewParity = GetPortParity(PtyFd);
+    unsigned char NewStopSize = GetPortStopSize(PtyFd);
+    unsigned char NewFlow = GetPortFlowControl(PtyFd, TNCOM_CMD_FLOW_REQ);
+
+    /* B0 hangs up a real port, the remote one drops DTR instead */
+    if (NewSpeed == 0) {
+        if (Force || !DtrOff)
+            SendCPCByteCommand(B, TNCAS_SET_CONTROL, TNCOM_CMD_DTR_OFF);
+        DtrOff = True;
+    }
+    else {
+        if (DtrOff)
+            SendCPCByteCommand(B, TNCAS_SET_CONTROL, TNCOM_CMD_DTR_ON);
+        DtrOff = False;
+        if (Force || NewSpeed != Speed)
+            SendBaudRate(B, NewSpeed);
+        Speed = NewSpeed;
+    }
+    if (Force || NewDataSize != DataSize)
+        SendCPCByteCommand(B, TNCAS_SET_DATASIZE, NewDataSize);
+    if (Force || NewParity != Parity)
+        SendCPCByteCommand(B, TNCAS_SET_PARITY, NewParity);
+    if (Force || NewStopSize != StopSize)
+        SendCPCByteCommand(B, TNCAS_SET_STOPSIZE, NewStopSize);
+    if (Force || NewFlow != Flow)
+        SendCPCByteCommand(B, TNCAS_SET_CONTROL, NewFlow);
+    DataSize = NewDataSize;
+    Parity = NewParity;
+    StopSize = NewStopSize;
+    Flow = NewFlow;
+}
+
+/* Reverse mode counters, and the drain request */
+static unsigned long ReverseConnects = 0;
+static unsigned long long ReverseToRemote = 0;
+static unsigned long long ReverseToPty = 0;
+static Boolean ReverseDraining = False;
+
+/* Answer the queued control commands in reverse mode. Returns True
+   when asked to stop right away. */
+static Boolean
+ReverseControl(const char *Host, const char *Port, Boolean Connected, BufferType * ToDevB,
+               BufferType * ToNetB)
+{
+    ControlCommandType C;
+    char Reply[512];
+    Boolean Stop = False;
+
+    while (GetControlCommand(&C)) {
+        switch (C.Cmd) {
+        case ControlStop:
+            LogMsg(LOG_NOTICE, "Stop requested.");
+            ReplyControlCommand(&C, "ok\n");
+            Stop = True;
+            break;
+        case ControlDrainStop:
+            LogMsg(LOG_NOTICE, "Drain requested, stopping once the buffers are empty.");
+            ReverseDraining = True;
+            ReplyControlCommand(&C, "ok\n");
+            break;
+        case ControlStats:
+            snprintf(Reply, sizeof(Reply),
+                     "remote %s:%s\n"
+                     "remote_connected %d\n"
+                     "remote_connects %lu\n"
+                     "to_remote_bytes %llu\n"
+                     "to_pty_bytes %llu\n"
+                     "to_remote_buffered %u\n"
+                     "to_pty_buffered %u\n",
+                     Host, Port, Connected ? 1 : 0, ReverseConnects, ReverseToRemote,
+                     ReverseToPty, BufferLength(ToNetB), BufferLength(ToDevB));
+            ReplyControlCommand(&C, Reply);
+            break;
+        default:
+            /* The remote port follows the settings the application
+               makes on the pty */
+            ReplyControlCommand(&C, "error reverse mode\n");
+            break;
+        }
+    }
+    return Stop;
+}
+
+/* Wait Seconds before connecting again, answering the control
+   commands meanwhile. Returns True when asked to stop. */
+static Boolean
+ReverseBackoff(const char *Host, const char *Port, int Seconds, BufferType * ToDevB,
+               BufferType * ToNetB)
+{
+    int ControlFd = GetControlFd();
+    unsigned long long End = GetTimeMicros() + Seconds * 1000000ULL;
+    unsigned long long Now;
+    fd_set InFdSet;
+    struct timeval Tv;
+
+    while ((Now = GetTimeMicros()) < End) {
+        if (ControlFd < 0) {
+            sleep(Seconds);
+            return False;
+        }
+        FD_ZERO(&InFdSet);
+        FD_SET(ControlFd, &InFdSet);
+        Tv.tv_sec = (End - Now) / 1000000;
+        Tv.tv_usec = (End - Now) % 1000000;
+        if (select(ControlFd + 1, &InFdSet, NULL, NULL, &Tv) > 0 &&
+            (ReverseControl(Host, Port, False, ToDevB, ToNetB) || ReverseDraining))
+            return True;
+    }
+    return False;
+}
+
+/* Serve the remote RFC 2217 port Host:Port on PtyFd, connecting again
+   whenever the connection is lost, until a control command stops it.
+   The line settings of the pty are checked whenever it is active, and
+   every PollInterval ms. Returns Error when the pty failed. */
+int
+RunReverse(const char *Host, const char *Port, PORTHANDLE PtyFd, long PollInterval)
+{
+    /* Reachable through InSocketFd by the exit function */
+    static SERCD_SOCKET Sock;
+    BufferType ToDevBuf = { NULL, 0, 0 };
+    BufferType ToNetBuf = { NULL, 0, 0 };
+    unsigned char readbuf[512];
+    int ControlFd = GetControlFd();
+    int Backoff = PoolMinBackoff;
+    Boolean Mirrored;
+    fd_set InFdSet, OutFdSet;
+    struct timeval Tv;
+    ssize_t iobytes;
+    unsigned int i, trybytes;
+    unsigned char *p;
+
+    /* The service may run reverse mode again in the same process */
+    ReverseConnects = 0;
+    ReverseToRemote = ReverseToPty = 0;
+    ReverseDraining = False;
+
+    for (;;) {
+        if ((Sock = ConnectServer(Host, Port)) < 0) {
+            LogFormat(LOG_WARNING, "Unable to connect to %s:%s, retrying in %d s.", Host, Port,
+                      Backoff);
+            if (ReverseBackoff(Host, Port, Backoff, &ToDevBuf, &ToNetBuf))
+                return NoError;
+            Backoff = MIN(Backoff * 2, PoolMaxBackoff);
+            continue;
+        }
+        Backoff = PoolMinBackoff;
+        ReverseConnects++;
+        LogFormat(LOG_NOTICE, "Connected to the remote port %s:%s.", Host, Port);
+
+        InSocketFd = OutSocketFd = &Sock;
+        SetSocketOptions(Sock, Sock);
+        AttachSessionBuffers(&ToDevBuf, &ToNetBuf);
+        InitBuffer(&ToDevBuf);
+        InitBuffer(&ToNetBuf);
+        InitTelnetStateMachine();
+        IACEscape = IACNormal;
+        IACSigEscape = IACNormal;
+        EscWriteLast = EscRedirectLast = 0;
+        InputFlow = True;
+        RemoteModemState = 0;
+        Mirrored = False;
+
+        /* We are the client side of the option negotiation */
+        SendTelnetOption(&ToNetBuf, TNWILL, TN_TRANSMIT_BINARY);
+        tnstate[TN_TRANSMIT_BINARY].sent_will = 1;
+        SendTelnetOption(&ToNetBuf, TNDO, TN_TRANSMIT_BINARY);
+        tnstate[TN_TRANSMIT_BINARY].sent_do = 1;
+        SendTelnetOption(&ToNetBuf, TNDO, TN_SUPPRESS_GO_AHEAD);
+        tnstate[TN_SUPPRESS_GO_AHEAD].sent_do = 1;
+        SendTelnetOption(&ToNetBuf, TNWILL, TNCOM_PORT_OPTION);
+        tnstate[TNCOM_PORT_OPTION].sent_will = 1;
+
+        while (InSocketFd) {
+            int highest_fd = MAX(PtyFd, Sock);
+
+            /* Done draining once what we hold went both ways */
+            if (ReverseDraining && IsBufferEmpty(&ToDevBuf) && IsBufferEmpty(&ToNetBuf)) {
+                closesocket(Sock);
+                InSocketFd = OutSocketFd = NULL;
+                ReleaseSessionBuffers(&ToDevBuf, &ToNetBuf);
+                return NoError;
+            }
+
+            /* A pty has no change notification. Checking before
+               reading keeps settings ahead of the data written after
+               them. */
+            if (tnstate[TNCOM_PORT_OPTION].is_will &&
+                BufferHasRoomFor(&ToNetBuf, MirrorPtySettings_bytes + SendCPCByteCommand_bytes) &&
+                (PtySettingsChanged(PtyFd) || !Mirrored)) {
+                MirrorPtySettings(&ToNetBuf, PtyFd, !Mirrored);
+                if (!Mirrored)
+                    SendCPCByteCommand(&ToNetBuf, TNCAS_SET_MODEMSTATE_MASK, 255);
+                Mirrored = True;
+            }
+
+            FD_ZERO(&InFdSet);
+            FD_ZERO(&OutFdSet);
+            if (InputFlow && !ReverseDraining &&
+                BufferHasRoomFor(&ToNetBuf, EscWriteChar_bytes))
+                FD_SET(PtyFd, &InFdSet);
+            if (!IsBufferEmpty(&ToDevBuf))
+                FD_SET(PtyFd, &OutFdSet);
+            if (!IsBufferEmpty(&ToNetBuf))
+                FD_SET(Sock, &OutFdSet);
+            if (!ReverseDraining && BufferHasRoomFor(&ToDevBuf, EscRedirectChar_bytes_DevB) &&
+                BufferHasRoomFor(&ToNetBuf, EscRedirectChar_bytes_SockB))
+                FD_SET(Sock, &InFdSet);
+            if (ControlFd >= 0) {
+                FD_SET(ControlFd, &InFdSet);
+                highest_fd = MAX(highest_fd, ControlFd);
+            }
+            Tv.tv_sec = PollInterval / 1000;
+            Tv.tv_usec = (PollInterval % 1000) * 1000;
+            if (select(highest_fd + 1, &InFdSet, &OutFdSet, NULL, &Tv) < 0) {
+                if (errno == EINTR)
+                    continue;
+                LogMsg(LOG_ERR, "Reverse mode select error.");
+                return Error;
+            }
+
+            /* Same order as the main loop: pty input, pty output,
+               network output, network input */
+            if (FD_ISSET(PtyFd, &InFdSet)) {
+                trybytes = MIN(sizeof(readbuf), BufferRoomLeft(&ToNetBuf) / EscWriteChar_bytes);
+                iobytes = ReadFromDev(PtyFd, readbuf, trybytes);
+                if (IOResultError(iobytes, "Error reading from the pty", "EOF from the pty"))
+                    return Error;
+                for (i = 0; i < iobytes; i++)
+                    EscWriteChar(&ToNetBuf, readbuf[i]);
+                ReverseToRemote += MAX(iobytes, 0);
+            }
+
+            if (FD_ISSET(PtyFd, &OutFdSet)) {
+                p = GetBufferString(&ToDevBuf, &trybytes);
+                iobytes = WriteToDev(PtyFd, p, trybytes);
+                if (IOResultError(iobytes, "Error writing to the pty.", "EOF to the pty"))
+                    return Error;
+                BufferPopBytes(&ToDevBuf, MAX(iobytes, 0));
+                ReverseToPty += MAX(iobytes, 0);
+            }
+
+            if (FD_ISSET(Sock, &OutFdSet)) {
+                p = GetBufferString(&ToNetBuf, &trybytes);
+                iobytes = WriteToNet(Sock, p, trybytes);
+                if (IOResultError(iobytes, "Error writing to network", "EOF to network"))
+                    InSocketFd = OutSocketFd = NULL;
+                else
+                    BufferPopBytes(&ToNetBuf, MAX(iobytes, 0));
+            }
+
+            /* The pty input may have used up the room select saw, and
+               an empty read would look like the end of the connection */
+            if (InSocketFd && FD_ISSET(Sock, &InFdSet) &&
+                BufferHasRoomFor(&ToDevBuf, EscRedirectChar_bytes_DevB) &&
+                BufferHasRoomFor(&ToNetBuf, EscRedirectChar_bytes_SockB)) {
+                trybytes = sizeof(readbuf);
+                trybytes = MIN(trybytes, BufferRoomLeft(&ToNetBuf) / EscRedirectChar_bytes_SockB);
+                trybytes = MIN(trybytes, BufferRoomLeft(&ToDevBuf) / EscRedirectChar_bytes_DevB);
+                iobytes = ReadFromNet(Sock, readbuf, trybytes);
+                if (IOResultError(iobytes, "Error reading from network.", "EOF from network"))
+                    InSocketFd = OutSocketFd = NULL;
+                for (i = 0; InSocketFd && i < iobytes; i++)
+                    EscRedirectChar(&ToNetBuf, &ToDevBuf, PtyFd, readbuf[i]);
+            }
+
+            if (ControlFd >= 0 && FD_ISSET(ControlFd, &InFdSet) &&
+                ReverseControl(Host, Port, InSocketFd != NULL, &ToDevBuf, &ToNetBuf)) {
+                if (InSocketFd)
+                    closesocket(Sock);
+                InSocketFd = OutSocketFd = NULL;
+                ReleaseSessionBuffers(&ToDevBuf, &ToNetBuf);
+                return NoError;
+            }
+        }
+
+        /* The port is gone for the application as if the carrier was
+           lost, until we are back */
+        closesocket(Sock);
+        ReleaseSessionBuffers(&ToDevBuf, &ToNetBuf);
+        LogMsg(LOG_NOTICE, "Remote port connection lost.");
+        HangupPty(PtyFd);
+        if (ReverseDraining)
+            return NoError;
+    }
+}
+
+/* Apply the port settings of a reconfigure control command */
+int
+ReconfigurePort(ControlCommandType * C)
+{
+    if (!DeviceFd)
+        return Error;
+
+    ApplyLineSettings(*DeviceFd, C);
+    PortStateDirty = True;
+    LogFormat(LOG_NOTICE, "Port reconfigured by control command: %lu baud.",
+              GetPortSpeed(*DeviceFd));
+    return NoError;
+}
+
 void
 LogPortSettings(unsigned long speed, unsigned char datasize, unsigned char parity,
                 unsigned char stopsize, unsigned char outflow, unsigned char inflow)
 {
-    char LogStr[TmpStrLen];
     char parchar;
     char *stopbits = "";
     char *outflowtype = "";
@@ -1199,11 +2942,8 @@ LogPortSettings(unsigned long speed, unsigned char datasize, unsigned char parit
         break;
     }
 
-    snprintf(LogStr, sizeof(LogStr),
-             "Port settings:%lu-%u-%c-%s outflow:%s inflow:%s",
-             speed, datasize, parchar, stopbits, outflowtype, inflowtype);
-    LogStr[sizeof(LogStr) - 1] = '\0';
-    LogMsg(LOG_NOTICE, LogStr);
+    LogFormat(LOG_NOTICE, "Port settings:%lu-%u-%c-%s outflow:%s inflow:%s",
+              speed, datasize, parchar, stopbits, outflowtype, inflowtype);
 }
 
 void
@@ -1216,20 +2956,144 @@ Usage(void)
             "\n"
             "Usage:\n"
 #ifndef ANDROID
-            "sercd [-ie] [-p port] [-l addr] <loglevel> <device> <lockfile> [pollingterval]\n"
+            "sercd [-iewN] [-p port] [-l addr] [-H kb[:sec]] [-Q sec] [-S kb]\n"
+            "      [-F file:kb] [-R kb[:sec]] [-U path] [-K sec] [-B sec] [-T sec[:any]]\n"
+            "      [-C path] [-O path] [-D kb] [-L ms:kb] [-r prio[:cpu]]\n"
+            "      [-b us[:pct]] [-q bytes[:kb[:kb]]] [-X device[:lockfile]]\n"
+            "      [-V settings[/settings]] [-Z file] [-M ms[:ms]] [-P file[:ms]]\n"
+            "      [-Y host:port]\n"
+            "      <loglevel> <device> <lockfile> [pollingterval]\n"
 #else
-        "sercd [-ie] [-p port] [-l addr] <loglevel> <device> [pollingterval]\n"
+        "sercd [-iewN] [-p port] [-l addr] [-H kb[:sec]] [-Q sec] [-S kb]\n"
+        "      [-F file:kb] [-R kb[:sec]] <loglevel> <device> [pollingterval]\n"
 #endif
             "-i       indicates Cisco IOS Bug compatibility\n"
             "-e       send output to standard error instead of syslog\n"
+            "-w       warm port: open the device at startup and keep it open\n"
+            "         and configured between client sessions\n"
             "-p port  listen on specified port, instead of port 7000\n"
             "-l addr  standalone mode, bind to specified adress, empty string for all\n"
+            "-H kb[:sec] keep the last kb KB (and at most sec seconds) of device\n"
+            "         output for replay to new clients, default is %d KB\n"
+            "-S kb    store up to kb KB of device output in memory while no\n"
+            "         client can take it, and forward it to the next client\n"
+            "-F file:kb spill up to kb KB more to file when the memory is full\n"
+            "-N       drop the newest instead of the oldest spooled data\n"
+            "-R kb[:sec] let clients resume a lost session within sec seconds\n"
+            "         (default %d), retransmitting up to kb KB of device output\n"
+            "-Q sec   let new clients wait up to sec seconds for a busy port,\n"
+            "         or for a pool device to come back into rotation,\n"
+            "         default is %d, 0 refuses them right away\n"
+            "-K sec   drop a client leaving data unacknowledged for sec seconds,\n"
+            "         and tune keepalives to notice it within sec seconds\n"
+            "-B sec   send a telnet NOP to a client idle for sec seconds\n"
+            "-T sec[:any] let a new client from the same address, or from any\n"
+            "         address with :any, take over a session idle for sec seconds\n"
+            "-C path  accept control commands (stop, drain, stats, kick,\n"
+            "         set <speed> [8N1]) on Unix socket path\n"
+            "-O path  publish the counters and latency histograms in a shared\n"
+            "         memory page at path, for sercdstat and other readers\n"
+            "-D kb    keep the client when the device disappears, holding up\n"
+            "         to kb KB of its data until the device is back, at least %d\n"
+            "-L ms:kb limit session profiles requested by clients to a modem\n"
+            "         poll interval of at least ms and socket buffers of at\n"
+            "         most kb KB, default is %d:%d\n"
+            "-b us[:pct] busy poll mode: keep polling for us microseconds after\n"
+            "         I/O instead of sleeping, using at most pct percent of a\n"
+            "         CPU, default 50\n"
+            "-q bytes[:kb[:kb]] let each direction read at most bytes per\n"
+            "         scheduling round (default %d), and cap device to network\n"
+            "         and network to device traffic at kb KB per second\n"
+            "-r prio[:cpu] real-time mode: run under SCHED_FIFO at priority\n"
+            "         prio with all memory locked, pinned to cpu if given\n"
+#ifndef ANDROID
+            "-X device[:lockfile] bridge mode: join <device> and device\n"
+#else
+            "-X device bridge mode: join <device> and device\n"
+#endif
+            "         directly, standalone mode serves monitor sessions\n"
+            "         receiving both directions as timestamped records\n"
+            "-M ms[:ms] standalone Modbus gateway mode: serve Modbus TCP clients\n"
+            "         with the RTU slaves on <device>, answering identical reads\n"
+            "         from a cache for ms (0 for no cache) and giving slaves ms\n"
+            "         to respond, default 1000\n"
+            "-P file[:ms] standalone bus master mode: poll the slaves on <device>\n"
+            "         as listed in file, giving them at most ms to respond\n"
+            "         (default 500), and send the results to all clients\n"
+            "-V settings[/settings] line settings of the bridged devices, or\n"
+            "         of <device> in Modbus gateway and bus master modes,\n"
+            "         as \"115200 8N1\", default is to leave them as they are\n"
+            "-Z file  append both bridged directions as timestamped records\n"
+            "         to file\n"
+            "-Y host:port reverse mode: serve the remote RFC 2217 port\n"
+            "         host:port on a pty linked at <device>, locked with\n"
+            "         <lockfile>\n"
+            "-U path  standalone mode: take over the port and client of the\n"
+            "         sercd listening at Unix socket path, then listen there\n"
+            "         for the next process to take over\n"
+            "<device> and <lockfile> may be comma separated lists of\n"
+            "         interchangeable devices forming a pool: a session gets\n"
+            "         the least recently used device which opens, failing over\n"
+            "         to the others; one session is served at a time\n"
             "Poll interval is in milliseconds, default is %d,\n"
-            "0 means no polling\n", VERSION, DEFAULT_POLL_INTERVAL);
+            "0 means no polling\n", VERSION, DEFAULT_HISTORY_SIZE, DEFAULT_RESUME_TIMEOUT,
+            DEFAULT_QUEUE_TIMEOUT, HotplugMinBuffer, DEFAULT_PROFILE_MIN_POLL,
+            DEFAULT_PROFILE_MAX_BUFFER, DEFAULT_SCHED_QUANTUM, DEFAULT_POLL_INTERVAL);
 }
 
+#ifndef ANDROID
+#define OptionError(Msg) fprintf(stderr, "%s\n", Msg)
+#else
+/* The service has no standard error */
+#define OptionError(Msg) LogMsg(LOG_ERR, Msg)
+#endif
+
 #ifdef ANDROID
 SERCD_SOCKET *LSocketFd = NULL;
+
+/* Words of the command line made of the settings of the service */
+#define SettingsMaxArgs 64
+
+/* Add the setting Value of the service as option Opt, unless it is
+   empty */
+void
+AddSetting(JNIEnv * env, char **Argv, int *Argc, const char *Opt, jstring Value)
+{
+    const char *Str;
+
+    if (Value == NULL || *Argc + 2 > SettingsMaxArgs)
+        return;
+    Str = (*env)->GetStringUTFChars(env, Value, NULL);
+    if (Str == NULL)
+        return;
+    if (*Str) {
+        Argv[(*Argc)++] = (char *) Opt;
+        Argv[(*Argc)++] = strdup(Str);
+    }
+    (*env)->ReleaseStringUTFChars(env, Value, Str);
+}
+
+/* Returning to Java runs no exit function, close everything here */
+void
+StopFunction(void)
+{
+    if (ReverseMode && DeviceFd) {
+        ClosePty(*DeviceFd, DeviceName);
+        DeviceFd = NULL;
+    }
+    ReverseMode = False;
+    DropConnection(DeviceFd, InSocketFd, OutSocketFd);
+    DeviceFd = NULL;
+    InSocketFd = OutSocketFd = NULL;
+    if (BridgeFd) {
+        ClosePort(*BridgeFd);
+        BridgeFd = NULL;
+    }
+    if (LSocketFd) {
+        close(*LSocketFd);
+        LSocketFd = NULL;
+    }
+}
 #endif
 
 #ifndef ANDROID
@@ -1238,15 +3102,23 @@ int
 main(int argc, char **argv)
 #else
 JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
-  (JNIEnv *env, jobject thiz, jstring serialport, jstring netinterface, jint port)
+  (JNIEnv *env, jobject thiz, jstring serialport, jstring netinterface, jint port,
+   jint loglevel, jstring history, jboolean warmport, jstring spool, jstring spoolfile,
+   jboolean spooldropnewest, jstring resume, jstring handoverpath, jstring controlpath,
+   jstring profilelimits, jstring realtime, jstring busypoll, jstring schedquantum,
+   jstring statspath, jstring bridgedevice, jstring bridgesettings, jstring capturefile,
+   jstring modbusgateway, jstring polltable, jstring remoteport)
 #endif
 {
+#ifdef ANDROID
+    /* Command line made of the settings */
+    char *argv[SettingsMaxArgs];
+    int argc = 0;
+#endif
+
     /* Chars read */
     char readbuf[512];
 
-    /* Temporary string for logging */
-    char LogStr[TmpStrLen];
-
     /* Poll interval and timer */
     long PollInterval;
 
@@ -1256,17 +3128,92 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
     /* Buffer to Network from Device */
     BufferType ToNetBuf;
 
+    /* Time the current client connected, 0 once the port is ready */
+    unsigned long long ConnectTime = 0;
+
     int opt = 0;
-    char *optstring = "iep:l:";
+    char *optstring = "iewNp:l:H:Q:S:F:R:U:K:B:T:C:O:D:L:r:b:q:X:V:Z:M:P:Y:";
     unsigned int opt_port = 7000;
     Boolean inetd_mode = True;
     struct in_addr opt_bind_addr;
     SERCD_SOCKET insocket, outsocket, lsocket;
     PORTHANDLE devicefd;
+    PoolDeviceType *PoolDevice;
+    long opt_history_size = DEFAULT_HISTORY_SIZE;
+    long opt_history_age = 0;
+    int opt_queue_timeout = DEFAULT_QUEUE_TIMEOUT;
+    long opt_spool_size = 0;
+    char *opt_spool_file = NULL;
+    long opt_spool_file_size = 0;
+    SpoolPolicy opt_spool_policy = SpoolDropOldest;
+    long opt_resume_window = 0;
+    long opt_resume_timeout = DEFAULT_RESUME_TIMEOUT;
+    char *opt_handover_path = NULL;
+    HandoverType handover;
+    int handoverfds[HandoverMaxFds];
+    int nhandoverfds = 0;
+    SERCD_SOCKET handoverfd;
+    Boolean TookOver = False;
+    unsigned long long HandoverStart;
+    char *opt_control_path = NULL;
+    char *opt_stats_path = NULL;
+    int controlfd;
+    ControlCommandType Control;
+    Boolean Draining = False;
+    long opt_hotplug_buffer = DEFAULT_HOTPLUG_BUFFER;
+    int opt_rt_priority = 0;
+    int opt_rt_cpu = -1;
+    char *opt_bridge_device = NULL;
+    char *opt_bridge_settings = NULL;
+    char *opt_capture_file = NULL;
+    PORTHANDLE bridgefd;
+    long opt_modbus_cache = -1;
+    long opt_modbus_timeout = DEFAULT_MODBUS_TIMEOUT;
+    char *opt_poll_table = NULL;
+    long opt_poll_timeout = DEFAULT_BUS_TIMEOUT;
+    char *opt_reverse_host = NULL;
+    char *opt_reverse_port = NULL;
+    long opt_sched_quantum = DEFAULT_SCHED_QUANTUM;
+    long opt_sched_to_net = 0;
+    long opt_sched_to_dev = 0;
 
     opt_bind_addr.s_addr = INADDR_ANY;
+    ToDevBuf.Buffer = ToNetBuf.Buffer = NULL;
+    InitBuffer(&ToDevBuf);
+    InitBuffer(&ToNetBuf);
+
+    /* Commands posted from now on wait for the event loop */
+    OpenControlQueue();
+
+#ifdef ANDROID
+    /* The settings of the service are given as command line options */
+    argv[argc++] = "sercd";
+    AddSetting(env, argv, &argc, "-H", history);
+    if (warmport)
+        argv[argc++] = "-w";
+    AddSetting(env, argv, &argc, "-S", spool);
+    AddSetting(env, argv, &argc, "-F", spoolfile);
+    if (spooldropnewest)
+        argv[argc++] = "-N";
+    AddSetting(env, argv, &argc, "-R", resume);
+    AddSetting(env, argv, &argc, "-U", handoverpath);
+    AddSetting(env, argv, &argc, "-C", controlpath);
+    AddSetting(env, argv, &argc, "-L", profilelimits);
+    AddSetting(env, argv, &argc, "-r", realtime);
+    AddSetting(env, argv, &argc, "-b", busypoll);
+    AddSetting(env, argv, &argc, "-q", schedquantum);
+    AddSetting(env, argv, &argc, "-O", statspath);
+    AddSetting(env, argv, &argc, "-X", bridgedevice);
+    AddSetting(env, argv, &argc, "-V", bridgesettings);
+    AddSetting(env, argv, &argc, "-Z", capturefile);
+    AddSetting(env, argv, &argc, "-M", modbusgateway);
+    AddSetting(env, argv, &argc, "-P", polltable);
+    AddSetting(env, argv, &argc, "-Y", remoteport);
+
+    /* The service may start sercd again in the same process */
+    optind = 0;
+#endif
 
-#ifndef ANDROID
     while (opt != -1) {
         opt = getopt(argc, argv, optstring);
         switch (opt) {
@@ -1277,10 +3224,13 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
         case 'e':
             StdErrLogging = True;
             break;
+        case 'w':
+            WarmPort = True;
+            break;
         case 'p':
             opt_port = strtol(optarg, NULL, 10);
             if (opt_port == 0) {
-                fprintf(stderr, "Invalid port\n");
+                OptionError("Invalid port");
                 exit(Error);
             }
             break;
@@ -1288,21 +3238,180 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
             if (*optarg) {
                 opt_bind_addr.s_addr = inet_addr(optarg);
                 if (opt_bind_addr.s_addr == (unsigned) -1) {
-                    fprintf(stderr, "Invalid bind address\n");
+                    OptionError("Invalid bind address");
                     exit(Error);
                 }
             }
             inetd_mode = False;
             break;
+        case 'H':
+            {
+                char *endptr;
+                opt_history_size = strtol(optarg, &endptr, 10);
+                if (*endptr == ':')
+                    opt_history_age = strtol(endptr + 1, &endptr, 10);
+                if (*endptr || opt_history_size < 0 || opt_history_age < 0) {
+                    OptionError("Invalid history size");
+                    exit(Error);
+                }
+            }
+            break;
+        case 'Q':
+            {
+                char *endptr;
+                opt_queue_timeout = strtol(optarg, &endptr, 10);
+                if (*endptr || opt_queue_timeout < 0 || opt_queue_timeout > PoolMaxQueueTimeout) {
+                    OptionError("Invalid queue timeout");
+                    exit(Error);
+                }
+            }
+            break;
+        case 'S':
+            opt_spool_size = strtol(optarg, NULL, 10);
+            if (opt_spool_size <= 0) {
+                OptionError("Invalid spool size");
+                exit(Error);
+            }
+            break;
+        case 'F':
+            {
+                char *sep = strrchr(optarg, ':');
+                if (!sep || (opt_spool_file_size = strtol(sep + 1, NULL, 10)) <= 0) {
+                    OptionError("Invalid spool file");
+                    exit(Error);
+                }
+                *sep = '\0';
+                opt_spool_file = optarg;
+            }
+            break;
+        case 'N':
+            opt_spool_policy = SpoolDropNewest;
+            break;
+        case 'R':
+            {
+                char *endptr;
+                opt_resume_window = strtol(optarg, &endptr, 10);
+                if (*endptr == ':')
+                    opt_resume_timeout = strtol(endptr + 1, &endptr, 10);
+                if (*endptr || opt_resume_window <= 0 || opt_resume_timeout <= 0) {
+                    OptionError("Invalid resume window");
+                    exit(Error);
+                }
+            }
+            break;
+        case 'U':
+            opt_handover_path = optarg;
+            break;
+        case 'X':
+            opt_bridge_device = optarg;
+#ifndef ANDROID
+            if ((BridgeLockFileName = strchr(optarg, ':')) != NULL)
+                *BridgeLockFileName++ = '\0';
+#endif
+            break;
+        case 'V':
+            opt_bridge_settings = optarg;
+            break;
+        case 'Z':
+            opt_capture_file = optarg;
+            break;
+        case 'M':
+            if (sscanf(optarg, "%ld:%ld", &opt_modbus_cache, &opt_modbus_timeout) < 1 ||
+                opt_modbus_cache < 0 || opt_modbus_timeout <= 0) {
+                OptionError("Invalid Modbus gateway settings");
+                exit(Error);
+            }
+            break;
+        case 'P':
+            opt_poll_table = optarg;
+            if ((optarg = strrchr(optarg, ':')) != NULL) {
+                char *endptr;
+                *optarg++ = '\0';
+                opt_poll_timeout = strtol(optarg, &endptr, 10);
+                if (*endptr || opt_poll_timeout <= 0) {
+                    OptionError("Invalid poll timeout");
+                    exit(Error);
+                }
+            }
+            break;
+        case 'Y':
+            /* The last colon, the host may be an IPv6 address */
+            opt_reverse_host = optarg;
+            if ((opt_reverse_port = strrchr(optarg, ':')) == NULL || opt_reverse_port == optarg) {
+                OptionError("Invalid remote port");
+                exit(Error);
+            }
+            *opt_reverse_port++ = '\0';
+            break;
+        case 'C':
+            opt_control_path = optarg;
+            break;
+        case 'O':
+            opt_stats_path = optarg;
+            break;
+        case 'D':
+            {
+                char *endptr;
+                opt_hotplug_buffer = strtol(optarg, &endptr, 10);
+                if (*endptr || opt_hotplug_buffer < 0 ||
+                    (opt_hotplug_buffer > 0 && opt_hotplug_buffer < HotplugMinBuffer)) {
+                    OptionError("Invalid hotplug buffer size");
+                    exit(Error);
+                }
+            }
+            break;
+        case 'b':
+            if (sscanf(optarg, "%ld:%d", &BusyPollWindow, &BusyPollShare) < 1 ||
+                BusyPollWindow < 0 || BusyPollShare <= 0 || BusyPollShare > 100) {
+                OptionError("Invalid busy poll window");
+                exit(Error);
+            }
+            break;
+        case 'q':
+            if (sscanf(optarg, "%ld:%ld:%ld", &opt_sched_quantum, &opt_sched_to_net,
+                       &opt_sched_to_dev) < 1 || opt_sched_quantum <= 0 ||
+                opt_sched_to_net < 0 || opt_sched_to_dev < 0) {
+                OptionError("Invalid scheduling quantum");
+                exit(Error);
+            }
+            break;
+        case 'r':
+            if (sscanf(optarg, "%d:%d", &opt_rt_priority, &opt_rt_cpu) < 1 ||
+                opt_rt_priority <= 0) {
+                OptionError("Invalid real-time priority");
+                exit(Error);
+            }
+            break;
+        case 'L':
+            if (sscanf(optarg, "%u:%u", &ProfileMinPoll, &ProfileMaxBuffer) != 2) {
+                OptionError("Invalid profile limits");
+                exit(Error);
+            }
+            break;
+        case 'K':
+            DeadPeerTimeout = strtol(optarg, NULL, 10);
+            break;
+        case 'B':
+            HeartbeatInterval = strtol(optarg, NULL, 10);
+            break;
+        case 'T':
+            {
+                char *endptr;
+                TakeoverIdle = strtol(optarg, &endptr, 10);
+                if (strcmp(endptr, ":any") == 0)
+                    TakeoverAny = True;
+                else if (*endptr || TakeoverIdle < 0) {
+                    OptionError("Invalid takeover policy");
+                    exit(Error);
+                }
+            }
+            break;
         }
     }
 
-    /* Check the command line argument count */
 #ifndef ANDROID
+    /* Check the command line argument count */
     if (argc - optind < 3 || argc - optind > 4) {
-#else
-    if (argc - optind < 2 || argc - optind > 3) {
-#endif
         Usage();
         exit(Error);
     }
@@ -1317,7 +3426,9 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
 #ifndef ANDROID
 	MaxLogLevel = atoi(argv[optind++]);
 #else
-	MaxLogLevel = 7;
+    /* The service passes a syslog level, debugging costs time on the
+       data path */
+    MaxLogLevel = (loglevel >= LOG_EMERG && loglevel <= LOG_DEBUG) ? loglevel : LOG_INFO;
 #endif
 
     /* Gets device and lock file names */
@@ -1327,8 +3438,19 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
 	DeviceName = (char*)(*env)->GetStringUTFChars(env, serialport, &isCopy);
 #endif
 #ifndef ANDROID
-    LockFileName = argv[optind++];
+    LockFileName = argv[optind++];
+#endif
+
+    /* Several comma separated devices form a pool */
+#ifndef ANDROID
+    if (InitPool(DeviceName, LockFileName) != NoError) {
+        fprintf(stderr, "Invalid device pool, need one lock file per device\n");
+#else
+    if (InitPool(DeviceName) != NoError) {
+        LogMsg(LOG_ERR, "Invalid device pool.");
 #endif
+        exit(Error);
+    }
 
     /* Retrieve the polling interval */
 #ifndef ANDROID
@@ -1349,18 +3471,96 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
 
     PlatformInit();
 
+    if (InitSlab(&BufferSlab, BufferSize, SessionBuffers) != NoError) {
+        LogMsg(LOG_ERR, "Unable to allocate the session buffers.");
+        exit(Error);
+    }
+
+    InitSched(opt_sched_quantum, opt_sched_to_net * 1024, opt_sched_to_dev * 1024);
+
+    if (InitHistory(&History, opt_history_size * 1024, opt_history_age) != NoError) {
+        LogMsg(LOG_ERR, "Unable to allocate the history buffer.");
+        exit(Error);
+    }
+
+    if (InitSpool(&Spool, opt_spool_size * 1024, opt_spool_file,
+                  (off_t) opt_spool_file_size * 1024, opt_spool_policy) != NoError) {
+        LogMsg(LOG_ERR, "Unable to set up the spool.");
+        exit(Error);
+    }
+
+    if (InitResume(&Resume, opt_resume_window * 1024, opt_resume_timeout) != NoError) {
+        LogMsg(LOG_ERR, "Unable to allocate the retransmit window.");
+        exit(Error);
+    }
+
+    if (InitSpool(&DevSpool, MAX(opt_hotplug_buffer, 0) * 1024, NULL, 0,
+                  SpoolDropNewest) != NoError) {
+        LogMsg(LOG_ERR, "Unable to allocate the hotplug buffer.");
+        exit(Error);
+    }
+
+    if (InitControl() != NoError) {
+        LogMsg(LOG_ERR, "Unable to set up the control channel.");
+        exit(Error);
+    }
+    controlfd = GetControlFd();
+    if (opt_control_path && StartControlSocket(opt_control_path) != NoError) {
+        LogMsg(LOG_ERR, "Unable to create the control socket.");
+        exit(Error);
+    }
+    if (opt_stats_path) {
+        if (OpenStatsPage(opt_stats_path, DeviceName) != NoError) {
+            LogMsg(LOG_ERR, "Unable to create the stats page.");
+            exit(Error);
+        }
+        StatsPageOpen = True;
+    }
+
     /* Logs sercd start */
     LogMsg(LOG_NOTICE, "sercd started.");
 
     /* Logs sercd log level */
-    snprintf(LogStr, sizeof(LogStr), "Log level: %i", MaxLogLevel);
-    LogStr[sizeof(LogStr) - 1] = '\0';
-    LogMsg(LOG_INFO, LogStr);
+    LogFormat(LOG_INFO, "Log level: %i", MaxLogLevel);
 
     /* Logs the polling interval */
-    snprintf(LogStr, sizeof(LogStr), "Polling interval (ms): %ld", PollInterval);
-    LogStr[sizeof(LogStr) - 1] = '\0';
-    LogMsg(LOG_INFO, LogStr);
+    LogFormat(LOG_INFO, "Polling interval (ms): %ld", PollInterval);
+
+    /* Reverse mode is the client of a remote port, with the
+       application on a local pty instead of a client of ours */
+    if (opt_reverse_host) {
+#ifndef ANDROID
+        if (OpenPty(DeviceName, LockFileName, &devicefd) != NoError)
+            exit(Error);
+        ReverseMode = True;
+        DeviceFd = &devicefd;
+        exit(RunReverse(opt_reverse_host, opt_reverse_port, devicefd, PollInterval));
+#else
+        int ReverseStatus;
+
+        if (OpenPty(DeviceName, &devicefd) != NoError)
+            exit(Error);
+        ReverseMode = True;
+        DeviceFd = &devicefd;
+        ChangeState(env, thiz, STATE_PORT_OPENED);
+        ReverseStatus = RunReverse(opt_reverse_host, opt_reverse_port, devicefd, PollInterval);
+        StopFunction();
+        exit(ReverseStatus);
+#endif
+    }
+
+    /* Take over the port and client of a running process, if any */
+    HandoverStart = GetTimeMicros();
+    if (!inetd_mode && opt_handover_path &&
+        ReceiveHandover(opt_handover_path, &handover, sizeof(handover), handoverfds,
+                        &nhandoverfds) == NoError) {
+        if (nhandoverfds != (int) (1 + handover.HasClient + handover.HasDevice) ||
+            RestoreHandoverState(&handover, &ToDevBuf, &ToNetBuf) != NoError) {
+            LogMsg(LOG_ERR, "Invalid handover state.");
+            exit(Error);
+        }
+        TookOver = True;
+    }
 
     if (inetd_mode) {
         /* inetd mode */
@@ -1369,9 +3569,39 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
         InSocketFd = &insocket;
         OutSocketFd = &outsocket;
         SetSocketOptions(*InSocketFd, *OutSocketFd);
-        InitBuffer(&ToNetBuf);
-        InitTelnetStateMachine();
-        SendTelnetInitialOptions(&ToNetBuf);
+        InitSession(&ToDevBuf, &ToNetBuf);
+        ConnectTime = GetTimeMicros();
+    }
+    else if (TookOver) {
+        /* Sockets and device come in the order they were sent */
+        int fdi = 0;
+        lsocket = handoverfds[fdi++];
+        LSocketFd = &lsocket;
+        if (handover.HasClient) {
+            insocket = handoverfds[fdi++];
+            OutSocketFd = InSocketFd = &insocket;
+        }
+        if (handover.HasDevice) {
+            devicefd = handoverfds[fdi++];
+            DeviceFd = &devicefd;
+#ifndef ANDROID
+            if (TakeOverPortLock(LockFileName) != NoError)
+                LogMsg(LOG_WARNING, "Unable to take over the device lock file.");
+#endif
+        }
+        LastNetInput = LastNetOutput = time(NULL);
+        LogFormat(LOG_NOTICE, "Took over from the previous process in %llu us.",
+                  GetTimeMicros() - HandoverStart);
+
+        /* Only a warm port stays open without a client */
+        if (DeviceFd && !InSocketFd && !WarmPort) {
+#ifndef ANDROID
+            DropConnection(DeviceFd, NULL, NULL, LockFileName);
+#else
+            DropConnection(DeviceFd, NULL, NULL);
+#endif
+            DeviceFd = NULL;
+        }
     }
     else {
         /* Standalone mode */
@@ -1404,7 +3634,9 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
             fprintf(stderr, "Couldn't bind to tcp port %d\n", opt_port);
             exit(Error);
         }
-        if (listen(lsocket, 1) < 0) {
+        /* Let as many clients wait for accept() as for a free device,
+           a full backlog delays a connect by whole SYN retries */
+        if (listen(lsocket, PoolMaxQueue) < 0) {
             perror("listen");
             exit(Error);
         }
@@ -1412,6 +3644,137 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
         NewListener(*LSocketFd);
     }
 
+    /* Bridge mode joins the device with a second one, without telnet
+       layer; the listening socket serves monitor sessions */
+    if (opt_bridge_device) {
+        int CaptureFd = -1;
+#ifdef ANDROID
+        int BridgeStatus;
+#endif
+
+        DeviceFd = &devicefd;
+        if ((PoolDevice = OpenPoolPort(DeviceFd)) == NULL) {
+            DeviceFd = NULL;
+            LogMsg(LOG_ERR, "Unable to open the device.");
+            exit(Error);
+        }
+        DeviceName = PoolDevice->DeviceName;
+#ifndef ANDROID
+        LockFileName = PoolDevice->LockFileName;
+        if (OpenPort(opt_bridge_device, BridgeLockFileName, &bridgefd) != NoError) {
+#else
+        if (OpenPort(opt_bridge_device, &bridgefd) != NoError) {
+#endif
+            LogMsg(LOG_ERR, "Unable to open the bridged device.");
+            exit(Error);
+        }
+        BridgeFd = &bridgefd;
+        if (opt_bridge_settings &&
+            ApplyDeviceSettings(*DeviceFd, BridgeFd, opt_bridge_settings) != NoError) {
+            LogMsg(LOG_ERR, "Invalid bridge line settings.");
+            exit(Error);
+        }
+        if (opt_capture_file &&
+            (CaptureFd = open(opt_capture_file, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+            LogMsg(LOG_ERR, "Unable to open the capture file.");
+            exit(Error);
+        }
+#ifndef ANDROID
+        exit(RunBridge(*DeviceFd, DeviceName, *BridgeFd, opt_bridge_device, CaptureFd,
+                       inetd_mode ? NULL : LSocketFd));
+#else
+        ChangeState(env, thiz, STATE_PORT_OPENED);
+        BridgeStatus = RunBridge(*DeviceFd, DeviceName, *BridgeFd, opt_bridge_device, CaptureFd,
+                                 LSocketFd);
+        if (CaptureFd >= 0)
+            close(CaptureFd);
+        StopFunction();
+        exit(BridgeStatus);
+#endif
+    }
+
+    /* Gateway and bus master modes serve any number of clients with
+       their own protocols instead of RFC 2217 to one */
+    if (opt_modbus_cache >= 0 || opt_poll_table) {
+#ifdef ANDROID
+        int ModeStatus;
+#endif
+
+        if (inetd_mode) {
+            LogMsg(LOG_ERR, "Modbus gateway and bus master modes need standalone mode.");
+            exit(Error);
+        }
+        if (opt_poll_table && LoadPollTable(opt_poll_table) != NoError)
+            exit(Error);
+        DeviceFd = &devicefd;
+        if ((PoolDevice = OpenPoolPort(DeviceFd)) == NULL) {
+            DeviceFd = NULL;
+            LogMsg(LOG_ERR, "Unable to open the device.");
+            exit(Error);
+        }
+        DeviceName = PoolDevice->DeviceName;
+#ifndef ANDROID
+        LockFileName = PoolDevice->LockFileName;
+#endif
+        if (opt_bridge_settings &&
+            ApplyDeviceSettings(*DeviceFd, NULL, opt_bridge_settings) != NoError) {
+            LogMsg(LOG_ERR, "Invalid line settings.");
+            exit(Error);
+        }
+#ifndef ANDROID
+        if (opt_poll_table)
+            exit(RunPoller(*DeviceFd, DeviceName, GetPortSpeed(*DeviceFd), *LSocketFd,
+                           opt_poll_timeout));
+        exit(RunGateway(*DeviceFd, DeviceName, GetPortSpeed(*DeviceFd), *LSocketFd,
+                        opt_modbus_cache, opt_modbus_timeout));
+#else
+        ChangeState(env, thiz, STATE_PORT_OPENED);
+        if (opt_poll_table)
+            ModeStatus = RunPoller(*DeviceFd, DeviceName, GetPortSpeed(*DeviceFd), *LSocketFd,
+                                   opt_poll_timeout);
+        else
+            ModeStatus = RunGateway(*DeviceFd, DeviceName, GetPortSpeed(*DeviceFd), *LSocketFd,
+                                    opt_modbus_cache, opt_modbus_timeout);
+        StopFunction();
+        exit(ModeStatus);
+#endif
+    }
+
+    /* Let the next process take over from us */
+    if (opt_handover_path && !inetd_mode) {
+        handoverfd = NewHandoverListener(opt_handover_path);
+        if (handoverfd < 0) {
+            LogMsg(LOG_ERR, "Unable to create the handover socket.");
+            exit(Error);
+        }
+        HandoverFd = &handoverfd;
+    }
+
+    /* A warm port is opened right away and stays open */
+    if (WarmPort && !inetd_mode && !DeviceFd) {
+        DeviceFd = &devicefd;
+        if ((PoolDevice = OpenPoolPort(DeviceFd)) == NULL) {
+            LogMsg(LOG_WARNING, "Unable to open any pool device, retrying on connect.");
+            DeviceFd = NULL;
+        }
+        else {
+            DeviceName = PoolDevice->DeviceName;
+#ifndef ANDROID
+            LockFileName = PoolDevice->LockFileName;
+#endif
+            LogFormat(LOG_INFO, "Opened warm device %s.", DeviceName);
+            PortStateDirty = True;
+        }
+    }
+
+    /* Real-time mode, once all buffers are allocated */
+    if (opt_rt_priority > 0) {
+        if (EnterRealTime(opt_rt_priority, opt_rt_cpu) == NoError) {
+            LogFormat(LOG_INFO, "Real-time mode: priority %d, CPU %d.",
+                      opt_rt_priority, opt_rt_cpu);
+        }
+    }
+
     /* Main loop with fd's control. General note: We basically have
        three states:
 
@@ -1420,9 +3783,19 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
        3) Client connected, port open
 
        This means that if DeviceFd is set, InSocketFd and OutSocketFd
-       should be set as well. */
+       should be set as well, except for a warm port, which also has a
+       fourth state:
+
+       4) No client connection, port open */
     ChangeState(env, thiz, STATE_READY);
 
+    InitTimers(GetTimeMicros() / 1000);
+    InitTimer(&ModemPollTimer, SERCD_TIMER_MODEMPOLL);
+    InitTimer(&FlushTimer, SERCD_TIMER_FLUSH);
+    InitTimer(&HousekeepingTimer, SERCD_TIMER_HOUSEKEEPING);
+    InitTimer(&DeviceTimer, SERCD_TIMER_DEVICE);
+    InitTimer(&SchedTimer, SERCD_TIMER_SCHED);
+
     while (True) {
         int selret;
 
@@ -1431,36 +3804,286 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
         PORTHANDLE *Modemstate = NULL;
         SERCD_SOCKET *SocketOut = NULL;
         SERCD_SOCKET *SocketIn = NULL;
+        Boolean Replaying = False;
+        Boolean Spooling;
+        Boolean Detached;
+        long SessionPollInterval = Profile.PollInterval ? (long) Profile.PollInterval : PollInterval;
+        long Timeout;
+        unsigned long long SpinStart = 0;
+        unsigned long long NowMicros = GetTimeMicros();
+        unsigned long long Now = NowMicros / 1000;
+        unsigned int Expired = RunTimers(Now);
+        long ThrottleTimeout;
+        Boolean Housekeeping = (Expired & SERCD_TIMER_HOUSEKEEPING) || !IsTimerPending(&HousekeepingTimer);
+
+        if (Housekeeping) {
+            AddTimer(&HousekeepingTimer, Now + HousekeepingInterval);
+        }
+
+        if (StatsPageOpen) {
+            PublishStats(&ToDevBuf, &ToNetBuf, NowMicros, Housekeeping);
+        }
+
+        /* Keep the line error totals current while no client polls the
+           modem state; errors seen meanwhile wait for its next poll */
+        if (Housekeeping && DeviceFd) {
+            SampleLineState(*DeviceFd);
+        }
+
+        /* Hand the port over to the next queued client */
+        if (LSocketFd) {
+            if (Housekeeping)
+                ExpireQueuedConnections();
+            if (!InSocketFd && DequeueConnection(&insocket)) {
+                LogMsg(LOG_NOTICE, "Serving queued connection");
+                ChangeState(env, thiz, STATE_CONNECTED);
+                OutSocketFd = InSocketFd = &insocket;
+                SetSocketOptions(*InSocketFd, *OutSocketFd);
+                InitSession(&ToDevBuf, &ToNetBuf);
+                ConnectTime = GetTimeMicros();
+            }
+        }
+
+        /* Give up a detached session nobody came back for */
+        if (Housekeeping && IsSessionDetached(&Resume) && time(NULL) >= Resume.Deadline) {
+            LogMsg(LOG_NOTICE, "Detached session expired.");
+            ForgetResumeSession(&Resume);
+            if (DeviceFd && !InSocketFd && !WarmPort) {
+#ifndef ANDROID
+                DropConnection(DeviceFd, NULL, NULL, LockFileName);
+#else
+                DropConnection(DeviceFd, NULL, NULL);
+#endif
+                DeviceFd = NULL;
+            }
+        }
+        Detached = IsSessionDetached(&Resume);
+
+        /* An idle process holds no buffer storage */
+        if (InSocketFd || DeviceFd || DeviceGone || Detached) {
+            AttachSessionBuffers(&ToDevBuf, &ToNetBuf);
+        }
+        else {
+            ReleaseSessionBuffers(&ToDevBuf, &ToNetBuf);
+        }
+
+        /* Wait for a vanished device as long as its client stays */
+        if (DeviceGone && !InSocketFd) {
+            ForgetDevice();
+        }
+        else if (DeviceGone) {
+            ReattachDevice(&devicefd);
+            if (DeviceGone && !IsTimerPending(&DeviceTimer))
+                AddTimer(&DeviceTimer, Now + SessionPollInterval);
+        }
+
+        /* Open the serial port of a new client */
+        if (InSocketFd && OutSocketFd && !DeviceFd && !DeviceGone && time(NULL) >= PoolWaitUntil) {
+            time_t Retry = 0;
 
-        if (DeviceFd && BufferHasRoomFor(&ToNetBuf, EscWriteChar_bytes) && InputFlow) {
+            DeviceFd = &devicefd;
+            if ((PoolDevice = OpenPoolPort(DeviceFd)) == NULL) {
+                DeviceFd = NULL;
+                if (PoolWaitDeadline == 0)
+                    PoolWaitDeadline = time(NULL) + opt_queue_timeout;
+                Retry = PoolRetryTime();
+            }
+            if (!DeviceFd && Retry != 0 && Retry <= PoolWaitDeadline) {
+                /* Wait for a device to get back into rotation, as
+                   a queued client would for a busy port */
+                if (PoolWaitUntil == 0)
+                    LogMsg(LOG_NOTICE, "All pool devices out of rotation, client waits.");
+                PoolWaitUntil = Retry;
+                AddTimer(&DeviceTimer, Now + (Retry - time(NULL)) * 1000);
+            }
+            else if (!DeviceFd) {
+                /* Open failed */
+                LogMsg(LOG_ERR, "Unable to open any pool device.");
+                /* Emulate the inetd behaviour: Close the connection. */
+#ifndef ANDROID
+                DropConnection(NULL, InSocketFd, OutSocketFd, LockFileName);
+#else
+                ChangeState(env, thiz, STATE_READY);
+                DropConnection(NULL, InSocketFd, OutSocketFd);
+#endif
+                InSocketFd = OutSocketFd = NULL;
+                DeviceFd = NULL;
+                continue;
+            }
+            else {
+                /* Successfully opened port */
+                PoolWaitUntil = PoolWaitDeadline = 0;
+                DeviceName = PoolDevice->DeviceName;
+#ifndef ANDROID
+                LockFileName = PoolDevice->LockFileName;
+#endif
+                LogFormat(LOG_INFO, "Opened device %s.", DeviceName);
+                InitBuffer(&ToDevBuf);
+                ToDevDwell.Count = 0;
+                PortStateDirty = True;
+            }
+        }
+
+        /* Client can stream now, log how long it had to wait */
+        if (InSocketFd && DeviceFd && ConnectTime) {
+            LastReadyTime = GetTimeMicros() - ConnectTime;
+            LogFormat(LOG_INFO, "Port ready %llu us after connect (%s).",
+                      LastReadyTime, WarmPort ? "warm" : "cold");
+            ConnectTime = 0;
+            ChangeState(env, thiz, STATE_PORT_OPENED);
+        }
+
+        if (DeviceFd && PortStateDirty && IsSpoolEnabled(&DevSpool)) {
+            SavePortState(*DeviceFd, PortState);
+            PortStateDirty = False;
+        }
+
+        /* Client data held for the device goes out before newer data */
+        if (DeviceFd && !IsSpoolEmpty(&DevSpool)) {
+            FeedDevSpool(&ToDevBuf);
+        }
+
+        /* Keep the connection of a quiet client busy, so that it is
+           noticed soon if the client vanishes */
+        if (Housekeeping && OutSocketFd && HeartbeatInterval > 0 && IsBufferEmpty(&ToNetBuf) &&
+            time(NULL) - LastNetOutput >= HeartbeatInterval) {
+            AddToBuffer(&ToNetBuf, TNIAC);
+            AddToBuffer(&ToNetBuf, TNNOP);
+        }
+
+        /* Free the port from a client which stopped acknowledging data */
+        if (Housekeeping && OutSocketFd && IsClientDead(*OutSocketFd)) {
+            Boolean KeepPort = DetachSession();
+            LogMsg(LOG_NOTICE, "Client stopped acknowledging data, dropping it.");
+#ifndef ANDROID
+            DropConnection(KeepPort ? NULL : DeviceFd, InSocketFd, OutSocketFd, LockFileName);
+#else
+            ChangeState(env, thiz, STATE_READY);
+            DropConnection(KeepPort ? NULL : DeviceFd, InSocketFd, OutSocketFd);
+#endif
+            InSocketFd = OutSocketFd = NULL;
+            if (!KeepPort)
+                DeviceFd = NULL;
+            continue;
+        }
+
+        /* A history or retransmit replay goes out before any live data */
+        if (History.Replaying && OutSocketFd) {
+            Replaying = FeedHistoryReplay(&History, &ToNetBuf, True);
+        }
+        else if (Resume.Window.Replaying && OutSocketFd) {
+            Replaying = FeedHistoryReplay(&Resume.Window, &ToNetBuf, False);
+        }
+
+        /* Spooled data goes out before live data, and live data is
+           spooled as long as older data is waiting or the client
+           can't take it */
+        if (!Replaying && OutSocketFd && InputFlow && !Detached && !IsSpoolEmpty(&Spool)) {
+            FeedSpool(&ToNetBuf);
+        }
+
+        /* Latency probe replies go out once their data reached the
+           device */
+        if (OutSocketFd && ProbeCount) {
+            SendProbeReplies(&ToDevBuf, &ToNetBuf);
+        }
+
+        Spooling = IsSpoolEnabled(&Spool) &&
+            (!OutSocketFd || Detached || Replaying || !InputFlow || !IsSpoolEmpty(&Spool) ||
+             !BufferHasRoomFor(&ToNetBuf, EscWriteChar_bytes + DeviceStamp_room));
+
+        if (Draining) {
+            /* Take no new data, only flush the buffers */
+        }
+        else if (SchedThrottled(SchedToNet)) {
+            /* Device input is over its rate cap */
+        }
+        else if (DeviceFd && Spooling) {
+            DeviceIn = DeviceFd;
+        }
+        /* Without a client, device output only feeds the history and
+           the retransmit window of a detached session */
+        else if (DeviceFd && BufferHasRoomFor(&ToNetBuf, EscWriteChar_bytes + DeviceStamp_room) &&
+            InputFlow && !Replaying && (OutSocketFd || IsHistoryEnabled(&History) || Detached)) {
             DeviceIn = DeviceFd;
         }
         if (DeviceFd && !IsBufferEmpty(&ToDevBuf)) {
             DeviceOut = DeviceFd;
         }
-        if (DeviceFd && PortControlEnable && InputFlow &&
+        /* The modem state is polled when its timer expired, and the
+           timer runs as long as the state is wanted */
+        if (DeviceFd && OutSocketFd && PortControlEnable && InputFlow &&
             BufferHasRoomFor(&ToNetBuf, SendCPCByteCommand_bytes)) {
-            Modemstate = DeviceFd;
+            if (Expired & SERCD_TIMER_MODEMPOLL)
+                Modemstate = DeviceFd;
+            if (!IsTimerPending(&ModemPollTimer))
+                AddTimer(&ModemPollTimer, Now + SessionPollInterval);
+        }
+        else {
+            CancelTimer(&ModemPollTimer);
         }
-        if (OutSocketFd && !IsBufferEmpty(&ToNetBuf)) {
+        if (OutSocketFd && IsNetFlushDue(&ToNetBuf)) {
             SocketOut = OutSocketFd;
         }
-        if (DeviceFd && BufferHasRoomFor(&ToDevBuf, EscRedirectChar_bytes_DevB) &&
-            InSocketFd && BufferHasRoomFor(&ToNetBuf, EscRedirectChar_bytes_SockB)) {
+        if (BufferHasRoomFor(&ToDevBuf, EscRedirectChar_bytes_DevB) && !Draining &&
+            !SchedThrottled(SchedToDev) &&
+            InSocketFd && BufferHasRoomFor(&ToNetBuf, EscRedirectChar_bytes_SockB) &&
+            (DeviceFd ? IsSpoolEmpty(&DevSpool) :
+             DeviceGone && DevSpool.Size - DevSpool.Length >= BufferSize)) {
             SocketIn = InSocketFd;
         }
 
-        if (!DeviceIn && !DeviceOut && !SocketOut && !SocketIn && !LSocketFd) {
+        /* A direction out of its rate cap waits for the cap to refill */
+        ThrottleTimeout = SchedThrottleTimeout();
+        if (ThrottleTimeout >= 0 && !IsTimerPending(&SchedTimer)) {
+            AddTimer(&SchedTimer, Now + MAX(ThrottleTimeout, 1));
+        }
+
+        if (!DeviceIn && !DeviceOut && !SocketOut && !SocketIn && !LSocketFd && !DeviceGone &&
+            !PoolWaitUntil && ThrottleTimeout < 0) {
             /* Nothing more to do */
+#ifdef ANDROID
+            StopFunction();
+#endif
             exit(NoError);
         }
 
+        /* Sleep until the nearest timer, not at all if the modem state
+           is to be polled now */
+        Timeout = Modemstate ? 0 : NextTimerTimeout(Now, -1);
+        if (BusyPollWindow > 0) {
+            SpinStart = GetTimeMicros();
+            Timeout = BusyPollTimeout(Timeout, SpinStart);
+        }
+
         selret = SercdSelect(DeviceIn, DeviceOut, Modemstate, SocketOut, SocketIn,
-                             LSocketFd, PollInterval);
+                             LSocketFd, HandoverFd, &controlfd, Timeout);
+        Wakeups++;
+
+        /* Account busy polling: active lines extend the window, idle
+           spins use up the CPU share */
+        if (BusyPollWindow > 0 && selret >= 0) {
+            unsigned long long WakeTime = GetTimeMicros();
+            if (selret & (SERCD_EV_DEVICEIN | SERCD_EV_DEVICEOUT |
+                          SERCD_EV_SOCKETIN | SERCD_EV_SOCKETOUT)) {
+                LastIoActivity = WakeTime;
+            }
+            else if (Timeout == 0) {
+                SpinPeriodUsed += WakeTime - SpinStart;
+                SpinTotal += WakeTime - SpinStart;
+            }
+        }
+
+        /* A direction out of budget keeps its data until the scheduler
+           starts the next round */
+        if (selret >= 0) {
+            SchedRound(GetTimeMicros(),
+                       ((selret & SERCD_EV_DEVICEIN) ? SchedReady(SchedToNet) : 0) |
+                       ((selret & SERCD_EV_SOCKETIN) ? SchedReady(SchedToDev) : 0));
+        }
+
         if (selret < 0) {
-            snprintf(LogStr, sizeof(LogStr), "select error: %d", errno);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_ERR, LogStr);
+            LogFormat(LOG_ERR, "select error: %d", errno);
             exit(Error);
         }
         else if (selret > 0) {
@@ -1479,13 +4102,23 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
             ssize_t iobytes;
             unsigned int i, trybytes;
             unsigned char *p;
+            unsigned int QueuedFrom;
+            unsigned long long ReadTime;
 
-            if (selret & SERCD_EV_DEVICEIN) {
+            if ((selret & SERCD_EV_DEVICEIN) && SchedBudget(SchedToNet) > 0) {
                 /* Read from serial port. Each serial port byte might
                    produce EscWriteChar_bytes of network data. */
-                trybytes = MIN(sizeof(readbuf), BufferRoomLeft(&ToNetBuf) / EscWriteChar_bytes);
+                if (Spooling)
+                    trybytes = sizeof(readbuf);
+                else
+                    trybytes = MIN(sizeof(readbuf),
+                                   (BufferRoomLeft(&ToNetBuf) - DeviceStamp_room) / EscWriteChar_bytes);
+                trybytes = MIN(trybytes, SchedBudget(SchedToNet));
                 iobytes = ReadFromDev(*DeviceFd, &readbuf, trybytes);
+                ReadTime = GetTimeMicros();
                 if (IOResultError(iobytes, "Error reading from device", "EOF from device")) {
+                    if (DetachDevice(&ToNetBuf))
+                        continue;
 #ifndef ANDROID
                     DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
 #else
@@ -1497,10 +4130,36 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
                     continue;
                 }
                 else {
-                    for (i = 0; i < iobytes; i++) {
-                        EscWriteChar(&ToNetBuf, readbuf[i]);
+                    SchedCharge(SchedToNet, MAX(iobytes, 0), trybytes);
+                    if (iobytes > 0)
+                        DevInBytes += iobytes;
+                    if (IsHistoryEnabled(&History) && iobytes > 0) {
+                        AddToHistory(&History, (unsigned char *) readbuf, iobytes);
+                    }
+                    if (Spooling && iobytes > 0) {
+                        AddToSpool(&Spool, (unsigned char *) readbuf, iobytes);
+                    }
+                    else if (iobytes > 0) {
+                        if (Resume.HasToken) {
+                            AddToHistory(&Resume.Window, (unsigned char *) readbuf, iobytes);
+                        }
+                        if (DeviceStamps && OutSocketFd && !Detached) {
+                            unsigned char Stamp[DeviceStamp_len];
+                            PutNetLong(&Stamp[0], ReadTime);
+                            PutNetShort(&Stamp[8], (unsigned int) iobytes);
+                            SendSercdCommand(&ToNetBuf, TNSSC_DEVICE_STAMP, Stamp, sizeof(Stamp));
+                        }
+                        QueuedFrom = ToNetBuf.WrPos;
+                        for (i = 0; OutSocketFd && !Detached && i < iobytes; i++) {
+                            EscWriteChar(&ToNetBuf, readbuf[i]);
+                        }
+                        QueueSegment(&ToNetDwell, &ToNetBuf, QueuedFrom, ReadTime);
                     }
                 }
+                /* The network queue is at its longest now */
+                if (StatsPageOpen) {
+                    NoteQueueLengths(&ToDevBuf, &ToNetBuf);
+                }
             }
 
             if (selret & SERCD_EV_DEVICEOUT) {
@@ -1508,18 +4167,27 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
                 p = GetBufferString(&ToDevBuf, &trybytes);
                 iobytes = WriteToDev(*DeviceFd, p, trybytes);
                 if (IOResultError(iobytes, "Error writing to device.", "EOF to device")) {
+                    if (DetachDevice(&ToNetBuf))
+                        continue;
 #ifndef ANDROID
-                        DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
+                    DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
 #else
-                        ChangeState(env, thiz, STATE_READY);
-                        DropConnection(DeviceFd, InSocketFd, OutSocketFd);
+                    ChangeState(env, thiz, STATE_READY);
+                    DropConnection(DeviceFd, InSocketFd, OutSocketFd);
 #endif
                     InSocketFd = OutSocketFd = NULL;
                     DeviceFd = NULL;
                     continue;
                 }
                 else {
+                    PopSegments(&ToDevDwell, &ToDevBuf, MAX(iobytes, 0), True);
                     BufferPopBytes(&ToDevBuf, iobytes);
+                    if (iobytes < (ssize_t) trybytes)
+                        ShortWrites++;
+                    if (iobytes > 0) {
+                        DevOutBytes += iobytes;
+                        StampProbes(iobytes);
+                    }
                 }
             }
 
@@ -1528,47 +4196,104 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
                 p = GetBufferString(&ToNetBuf, &trybytes);
                 iobytes = WriteToNet(*OutSocketFd, p, trybytes);
                 if (IOResultError(iobytes, "Error writing to network", "EOF to network")) {
+                    Boolean KeepPort = DetachSession();
 #ifndef ANDROID
-                        DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
+                    DropConnection(KeepPort ? NULL : DeviceFd, InSocketFd, OutSocketFd, LockFileName);
 #else
-                        ChangeState(env, thiz, STATE_READY);
-                        DropConnection(DeviceFd, InSocketFd, OutSocketFd);
+                    ChangeState(env, thiz, STATE_READY);
+                    DropConnection(KeepPort ? NULL : DeviceFd, InSocketFd, OutSocketFd);
 #endif
-                        InSocketFd = OutSocketFd = NULL;
-                    DeviceFd = NULL;
+                    InSocketFd = OutSocketFd = NULL;
+                    if (!KeepPort)
+                        DeviceFd = NULL;
                     continue;
                 }
                 else {
+                    PopSegments(&ToNetDwell, &ToNetBuf, MAX(iobytes, 0), True);
                     BufferPopBytes(&ToNetBuf, iobytes);
+                    if (iobytes < (ssize_t) trybytes)
+                        ShortWrites++;
+                    if (iobytes > 0) {
+                        NetOutBytes += iobytes;
+                        LastNetOutput = time(NULL);
+                    }
                 }
             }
 
-            if (selret & SERCD_EV_SOCKETIN) {
+            /* The device input may have used up the room select saw,
+               and an empty read would look like the end of the
+               connection */
+            if ((selret & SERCD_EV_SOCKETIN) && SchedBudget(SchedToDev) > 0 &&
+                BufferHasRoomFor(&ToNetBuf, EscRedirectChar_bytes_SockB) &&
+                BufferHasRoomFor(&ToDevBuf, EscRedirectChar_bytes_DevB)) {
                 /* Read from network. Each network byte might produce
                    EscRedirectChar_bytes_DevB or or up to
                    EscRedirectChar_bytes_SockB network data. */
                 trybytes = sizeof(readbuf);
                 trybytes = MIN(trybytes, BufferRoomLeft(&ToNetBuf) / EscRedirectChar_bytes_SockB);
                 trybytes = MIN(trybytes, BufferRoomLeft(&ToDevBuf) / EscRedirectChar_bytes_DevB);
+                trybytes = MIN(trybytes, SchedBudget(SchedToDev));
                 iobytes = ReadFromNet(*InSocketFd, readbuf, trybytes);
+                ReadTime = GetTimeMicros();
                 if (IOResultError(iobytes, "Error readbuf from network.", "EOF from network")) {
+                    Boolean KeepPort = DetachSession();
 #ifndef ANDROID
-                        DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
+                    DropConnection(KeepPort ? NULL : DeviceFd, InSocketFd, OutSocketFd, LockFileName);
 #else
-                        ChangeState(env, thiz, STATE_READY);
-                        DropConnection(DeviceFd, InSocketFd, OutSocketFd);
+                    ChangeState(env, thiz, STATE_READY);
+                    DropConnection(KeepPort ? NULL : DeviceFd, InSocketFd, OutSocketFd);
 #endif
-                        InSocketFd = OutSocketFd = NULL;
-                    DeviceFd = NULL;
+                    InSocketFd = OutSocketFd = NULL;
+                    if (!KeepPort)
+                        DeviceFd = NULL;
                     continue;
                 }
                 else {
+                    SchedCharge(SchedToDev, MAX(iobytes, 0), trybytes);
+                    if (iobytes > 0) {
+                        NetInBytes += iobytes;
+                        LastNetInput = time(NULL);
+                    }
+                    QueuedFrom = ToDevBuf.WrPos;
                     for (i = 0; i < iobytes; i++) {
-                        EscRedirectChar(&ToNetBuf, &ToDevBuf, *DeviceFd, readbuf[i]);
+                        EscRedirectChar(&ToNetBuf, &ToDevBuf, DeviceFd ? *DeviceFd : -1, readbuf[i]);
+                    }
+                    QueueSegment(&ToDevDwell, &ToDevBuf, QueuedFrom, ReadTime);
+
+                    /* Hold client data until the device is back */
+                    while (DeviceGone && !IsBufferEmpty(&ToDevBuf)) {
+                        p = GetBufferString(&ToDevBuf, &trybytes);
+                        AddToSpool(&DevSpool, p, trybytes);
+                        PopSegments(&ToDevDwell, &ToDevBuf, trybytes, False);
+                        BufferPopBytes(&ToDevBuf, trybytes);
                     }
                 }
             }
 
+            /* Hand everything over to a new process and quit. Data
+               still buffered goes along, the device and the client
+               connection stay open. */
+            if (selret & SERCD_EV_HANDOVER) {
+                nhandoverfds = 0;
+                handoverfds[nhandoverfds++] = *LSocketFd;
+                if (InSocketFd)
+                    handoverfds[nhandoverfds++] = *InSocketFd;
+                if (DeviceFd)
+                    handoverfds[nhandoverfds++] = *DeviceFd;
+                SaveHandoverState(&handover, &ToDevBuf, &ToNetBuf);
+                if (SendHandover(*HandoverFd, &handover, sizeof(handover), handoverfds,
+                                 nhandoverfds) != NoError) {
+                    LogMsg(LOG_ERR, "Handover to the new process failed.");
+                }
+                else {
+                    LogMsg(LOG_NOTICE, "Handed over to the new process.");
+                    /* Nothing must be closed or reset on exit */
+                    DeviceFd = NULL;
+                    InSocketFd = OutSocketFd = NULL;
+                    exit(NoError);
+                }
+            }
+
             /* accept new connections */
             if (selret & SERCD_EV_SOCKETCONNECT) {
                 struct sockaddr addr;
@@ -1578,14 +4303,37 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
                 /* FIXME: Might be a good idea to log the client addr */
                 LogMsg(LOG_NOTICE, "New connection");
                 csock = accept(*LSocketFd, &addr, &addrlen);
+                if (csock >= 0 && InSocketFd && MayTakeOver(csock, *InSocketFd)) {
+                    /* The new client replaces an idle one, which is
+                       probably gone */
+                    Boolean KeepPort = DetachSession();
+                    LogMsg(LOG_NOTICE, "Idle session taken over by new connection");
+#ifndef ANDROID
+                    DropConnection(KeepPort ? NULL : DeviceFd, InSocketFd, OutSocketFd, LockFileName);
+#else
+                    ChangeState(env, thiz, STATE_READY);
+                    DropConnection(KeepPort ? NULL : DeviceFd, InSocketFd, OutSocketFd);
+#endif
+                    InSocketFd = OutSocketFd = NULL;
+                    if (!KeepPort)
+                        DeviceFd = NULL;
+                }
+
                 if (csock < 0) {
                     /* FIXME: Log what kind of error. */
                     LogMsg(LOG_ERR, "Error accepting socket");
                 }
                 else if (InSocketFd && OutSocketFd) {
-                    /* We can only handle one connection at a time. */
-                    LogMsg(LOG_ERR, "Another client connected, dropping new connection");
-                    closesocket(csock);
+                    /* We can only handle one connection at a time. Let
+                       the client wait a little for the port to become
+                       free instead of refusing it right away. */
+                    if (QueueConnection(csock, opt_queue_timeout)) {
+                        LogMsg(LOG_NOTICE, "Port busy, queueing new connection");
+                    }
+                    else {
+                        LogMsg(LOG_ERR, "Another client connected, dropping new connection");
+                        closesocket(csock);
+                    }
                 }
                 else {
                     ChangeState(env, thiz, STATE_CONNECTED);
@@ -1594,40 +4342,8 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
                     insocket = csock;
                     OutSocketFd = InSocketFd = &insocket;
                     SetSocketOptions(*InSocketFd, *OutSocketFd);
-                    InitBuffer(&ToNetBuf);
-                    InitTelnetStateMachine();
-                    SendTelnetInitialOptions(&ToNetBuf);
-                }
-            }
-
-            /* Open serial port if not yet open */
-            if (InSocketFd && OutSocketFd && !DeviceFd) {
-                DeviceFd = &devicefd;
-#ifndef ANDROID
-                if (OpenPort(DeviceName, LockFileName, DeviceFd) == Error) {
-#else
-                if (OpenPort(DeviceName, DeviceFd) == Error) {
-#endif
-                    /* Open failed */
-                    snprintf(LogStr, sizeof(LogStr), "Unable to open device %s. Exiting.",
-                             DeviceName);
-                    LogStr[sizeof(LogStr) - 1] = '\0';
-                    LogMsg(LOG_ERR, LogStr);
-                    /* Emulate the inetd behaviour: Close the connection. */
-#ifndef ANDROID
-                    DropConnection(NULL, InSocketFd, OutSocketFd, LockFileName);
-#else
-                    ChangeState(env, thiz, STATE_READY);
-                    DropConnection(NULL, InSocketFd, OutSocketFd);
-#endif
-                    InSocketFd = OutSocketFd = NULL;
-                    DeviceFd = NULL;
-                    continue;
-                }
-                else {
-                    /* Successfully opened port */
-                	ChangeState(env, thiz, STATE_PORT_OPENED);
-                    InitBuffer(&ToDevBuf);
+                    InitSession(&ToDevBuf, &ToNetBuf);
+                    ConnectTime = GetTimeMicros();
                 }
             }
 
@@ -1642,10 +4358,72 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
                     ModemState = newstate;
                     SendCPCByteCommand(&ToNetBuf, TNASC_NOTIFY_MODEMSTATE,
                                        (ModemState & ModemStateMask));
-                    snprintf(LogStr, sizeof(LogStr), "Sent modem state: %u",
-                             (unsigned int) (ModemState & ModemStateMask));
-                    LogStr[sizeof(LogStr) - 1] = '\0';
-                    LogMsg(LOG_DEBUG, LogStr);
+                    LogFormat(LOG_DEBUG, "Sent modem state: %u",
+                              (unsigned int) (ModemState & ModemStateMask));
+                }
+
+                /* Line errors are sampled along with the modem state */
+                SampleLineState(*DeviceFd);
+                if ((LineState & LineStateMask) &&
+                    BufferHasRoomFor(&ToNetBuf, SendCPCByteCommand_bytes)) {
+                    SendCPCByteCommand(&ToNetBuf, TNASC_NOTIFY_LINESTATE,
+                                       (LineState & LineStateMask));
+                    LogFormat(LOG_DEBUG, "Sent line state: %u",
+                              (unsigned int) (LineState & LineStateMask));
+                    LineState = 0;
+                }
+            }
+
+            /* Control commands, with all buffers consistent */
+            while ((selret & SERCD_EV_CONTROL) && GetControlCommand(&Control)) {
+                switch (Control.Cmd) {
+                case ControlStop:
+                    LogMsg(LOG_NOTICE, "Stop requested.");
+                    ReplyControlCommand(&Control, "ok\n");
+#ifdef ANDROID
+                    StopFunction();
+#endif
+                    exit(NoError);
+                    break;
+                case ControlDrainStop:
+                    LogMsg(LOG_NOTICE, "Drain requested, stopping once the buffers are empty.");
+                    Draining = True;
+                    if (LSocketFd) {
+                        closesocket(*LSocketFd);
+                        LSocketFd = NULL;
+                    }
+                    ReplyControlCommand(&Control, "ok\n");
+                    break;
+                case ControlStats:
+                    {
+                        char StatsStr[1024];
+                        FormatStats(StatsStr, sizeof(StatsStr), &ToDevBuf, &ToNetBuf);
+                        ReplyControlCommand(&Control, StatsStr);
+                    }
+                    break;
+                case ControlReconfigure:
+                    ReplyControlCommand(&Control, ReconfigurePort(&Control) == NoError ?
+                                        "ok\n" : "error device closed\n");
+                    break;
+                case ControlKick:
+                    if (!InSocketFd) {
+                        ReplyControlCommand(&Control, "error no client\n");
+                        break;
+                    }
+                    LogMsg(LOG_NOTICE, "Client kicked by control command.");
+                    ForgetResumeSession(&Resume);
+#ifndef ANDROID
+                    DropConnection(WarmPort ? NULL : DeviceFd, InSocketFd, OutSocketFd,
+                                   LockFileName);
+#else
+                    ChangeState(env, thiz, STATE_READY);
+                    DropConnection(WarmPort ? NULL : DeviceFd, InSocketFd, OutSocketFd);
+#endif
+                    InSocketFd = OutSocketFd = NULL;
+                    if (!WarmPort)
+                        DeviceFd = NULL;
+                    ReplyControlCommand(&Control, "ok\n");
+                    break;
                 }
             }
         }
@@ -1655,8 +4433,46 @@ JNIEXPORT jint JNICALL Java_gnu_sercd_SercdService_main
 #ifdef ANDROID
 JNIEXPORT void JNICALL Java_gnu_sercd_SercdService_exit(JNIEnv *env, jobject thiz)
 {
-	/* Close the files descriptors to force the next call to "select" to fail. */
-	DropConnection(DeviceFd, InSocketFd, OutSocketFd);
-	close(*LSocketFd);
+	ControlCommandType C;
+
+	(void) env;
+	(void) thiz;
+	/* The event loop closes everything itself */
+	ParseControlCommand("stop", &C);
+	PostControlCommand(&C);
+}
+
+JNIEXPORT jstring JNICALL Java_gnu_sercd_SercdService_control(JNIEnv *env, jobject thiz,
+	jstring command)
+{
+	ControlCommandType C;
+	const char *Line;
+	char Reply[1024];
+	size_t Len = 0;
+	ssize_t N;
+	int sv[2];
+	struct timeval Timeout = { 2, 0 };
+
+	(void) thiz;
+	Line = (*env)->GetStringUTFChars(env, command, NULL);
+	N = ParseControlCommand(Line, &C);
+	(*env)->ReleaseStringUTFChars(env, command, Line);
+	if (N != NoError)
+		return (*env)->NewStringUTF(env, "error unknown command\n");
+
+	/* Wait for the reply of the event loop, if it runs */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return (*env)->NewStringUTF(env, "error\n");
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+	C.ReplyFd = sv[1];
+	if (PostControlCommand(&C) != NoError) {
+		close(sv[1]);
+		Len = snprintf(Reply, sizeof(Reply), "error not running\n");
+	}
+	while (Len < sizeof(Reply) - 1 && (N = read(sv[0], Reply + Len, sizeof(Reply) - 1 - Len)) > 0)
+		Len += N;
+	Reply[Len] = '\0';
+	close(sv[0]);
+	return (*env)->NewStringUTF(env, Reply);
 }
 #endif
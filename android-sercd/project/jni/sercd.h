@@ -136,26 +136,62 @@ Boolean;
 #define TNCOM_PURGE_TX ((unsigned char) 2)
 #define TNCOM_PURGE_BOTH ((unsigned char) 3)
 
+/* sercd vendor Telnet option, carrying extensions not covered by
+   RFC 2217. Suboptions are variable length and IAC escaped. */
+#define TNSERCD_OPTION ((unsigned char) 160)
+
+/* sercd option Client to Access Server constants */
+#define TNSCS_REPLAY_HISTORY ((unsigned char) 1)
+#define TNSCS_SESSION_BEGIN ((unsigned char) 2)
+#define TNSCS_SESSION_RESUME ((unsigned char) 3)
+#define TNSCS_PROFILE ((unsigned char) 4)
+#define TNSCS_PROBE ((unsigned char) 5)
+#define TNSCS_DEVICE_STAMPS ((unsigned char) 6)
+
+/* sercd option Access Server to Client constants */
+#define TNSSC_HISTORY_BEGIN ((unsigned char) 101)
+#define TNSSC_HISTORY_END ((unsigned char) 102)
+#define TNSSC_SESSION_TOKEN ((unsigned char) 103)
+#define TNSSC_SESSION_RESUMED ((unsigned char) 104)
+#define TNSSC_SESSION_LOST ((unsigned char) 105)
+#define TNSSC_PROFILE ((unsigned char) 106)
+#define TNSSC_PROBE ((unsigned char) 107)
+#define TNSSC_DEVICE_STAMP ((unsigned char) 108)
+
 /* Generic log function with log level control. Uses the same log levels
 of the syslog(3) system call */
 void LogMsg(int LogLevel, const char *const Msg);
 
+/* Log a printf style message. The arguments are neither evaluated nor
+   formatted unless LogLevel is logged. */
+extern int MaxLogLevel;
+#define LogFormat(LogLevel, ...) \
+    do { if ((LogLevel) <= MaxLogLevel) LogFormatted((LogLevel), __VA_ARGS__); } while (0)
+void LogFormatted(int LogLevel, const char *Format, ...);
+
+/* Write a message to the platform log right away, whatever its level */
+void EmitLogMsg(int LogLevel, const char *Msg);
+
 /* Function executed when the program exits */
 void ExitFunction(void);
 
 /* Function called on break signal */
 void BreakFunction(int unused);
 
-/* Abstract platform-independent select function */
+/* Abstract platform-independent select function. Waits at most Timeout
+   ms, -1 for no limit. */
 int SercdSelect(PORTHANDLE *DeviceIn, PORTHANDLE *DeviceOut, PORTHANDLE *Modemstate,
                 SERCD_SOCKET *SocketOut, SERCD_SOCKET *SocketIn,
-                SERCD_SOCKET *SocketConnect, long PollInterval);
+                SERCD_SOCKET *SocketConnect, SERCD_SOCKET *SocketHandover,
+                int *Control, long Timeout);
 #define SERCD_EV_DEVICEIN 1
 #define SERCD_EV_DEVICEOUT 2
 #define SERCD_EV_SOCKETOUT 4
 #define SERCD_EV_SOCKETIN 8
 #define SERCD_EV_SOCKETCONNECT 16
 #define SERCD_EV_MODEMSTATE 32
+#define SERCD_EV_HANDOVER 64
+#define SERCD_EV_CONTROL 128
 
 /* macros */
 #ifndef MAX
@@ -165,6 +201,20 @@ int SercdSelect(PORTHANDLE *DeviceIn, PORTHANDLE *DeviceOut, PORTHANDLE *Modemst
 #define MIN(x,y)                (((x) > (y)) ? (y) : (x))
 #endif
 
+/* Initialize port */
+#ifndef ANDROID
+int OpenPort(const char *DeviceName, const char *LockFileName, PORTHANDLE * PortFd);
+#else
+int OpenPort(const char *DeviceName, PORTHANDLE * PortFd);
+#endif
+
+/* Close and uninit port */
+#ifndef ANDROID
+void ClosePort(PORTHANDLE PortFd, const char *LockFileName);
+#else
+void ClosePort(PORTHANDLE PortFd);
+#endif
+
 void NewListener(SERCD_SOCKET LSocketFd);
 #ifndef ANDROID
 void DropConnection(PORTHANDLE * DeviceFd, SERCD_SOCKET * InSocketFd, SERCD_SOCKET * OutSocketFd, 
@@ -177,6 +227,69 @@ ssize_t ReadFromDev(PORTHANDLE port, void *buf, size_t count);
 ssize_t WriteToNet(SERCD_SOCKET sock, const void *buf, size_t count);
 ssize_t ReadFromNet(SERCD_SOCKET sock,  void *buf, size_t count);
 void ModemStateNotified();
+/* Handover of a running sercd to a new process */
+SERCD_SOCKET NewHandoverListener(const char *Path);
+int SendHandover(SERCD_SOCKET LSocketFd, const void *State, size_t Len, const int *Fds,
+                 int NFds);
+int ReceiveHandover(const char *Path, void *State, size_t Len, int *Fds, int *NFds);
+#define HandoverMaxFds 3
+#define PlatformStateLen 256
+size_t SavePlatformState(unsigned char *Buf);
+void RestorePlatformState(const unsigned char *Buf);
+#ifndef ANDROID
+int TakeOverPortLock(const char *LockFileName);
+#endif
+/* Line settings and modem control lines of an open port, to apply
+   them again once a vanished device is back */
+#define PortStateLen 128
+void SavePortState(PORTHANDLE PortFd, unsigned char *Buf);
+void RestorePortState(PORTHANDLE PortFd, const unsigned char *Buf);
+/* Watch for the device node to be created again. Returns the watch
+   descriptor, -1 if unsupported. */
+int WatchDeviceNode(const char *DeviceName);
+/* Check if the device node was created or changed since the last call */
+Boolean DeviceNodeChanged(int WatchFd, const char *DeviceName);
+/* Run the calling thread under SCHED_FIFO at Priority, lock all
+   memory and pin the thread to Cpu unless it is negative. Returns
+   NoError if every step succeeded. */
+int EnterRealTime(int Priority, int Cpu);
+/* Milliseconds since the peer last acknowledged data, 0 if nothing is
+   waiting for an acknowledgement, -1 if unknown */
+long GetNetAckWait(SERCD_SOCKET Sock);
+/* Line error counters of a port, as counted by the driver */
+typedef struct
+{
+    unsigned long Overrun;
+    unsigned long Frame;
+    unsigned long Parity;
+    unsigned long Break;
+    /* Data lost because the driver buffer was full */
+    unsigned long BufOverrun;
+}
+LineCountersType;
+/* Read the line error counters. Returns Error if the driver doesn't
+   count them. */
+int GetLineCounters(PORTHANDLE PortFd, LineCountersType * C);
+/* Monotonic time in microseconds */
+unsigned long long GetTimeMicros(void);
+/* Reverse mode pty, reachable at the symlink LinkName and locked with
+   LockFileName; the termios calls on PtyFd see the settings the
+   application made */
+#ifndef ANDROID
+int OpenPty(const char *LinkName, const char *LockFileName, PORTHANDLE * PtyFd);
+void ClosePty(PORTHANDLE PtyFd, const char *LinkName, const char *LockFileName);
+#else
+int OpenPty(const char *LinkName, PORTHANDLE * PtyFd);
+void ClosePty(PORTHANDLE PtyFd, const char *LinkName);
+#endif
+/* Check if the application changed the line settings of the pty since
+   the last call */
+Boolean PtySettingsChanged(PORTHANDLE PtyFd);
+/* Hang up the pty as a carrier loss would hang up a real port, unless
+   the application set CLOCAL */
+void HangupPty(PORTHANDLE PtyFd);
+/* Connect to Host:Port. Returns the nonblocking socket, -1 on failure. */
+SERCD_SOCKET ConnectServer(const char *Host, const char *Port);
 void LogPortSettings(unsigned long speed, unsigned char datasize, unsigned char parity,
                      unsigned char stopsize, unsigned char outflow, unsigned char inflow);
 #endif /* SERCD_H */
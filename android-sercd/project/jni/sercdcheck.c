@@ -0,0 +1,1842 @@
+/*
+ * sercd self checks
+ * see file COPYING for license details
+ *
+ * Runs checks of sercd modules on the target, where the behaviour of
+ * the kernel and C library matters. Each check prints its results and
+ * the exit status is 1 if any of them failed.
+ */
+
+#include <stdio.h>              /* printf */
+#include <stdlib.h>             /* strtol */
+#include <string.h>             /* strcmp */
+#include <unistd.h>             /* close */
+#include <fcntl.h>              /* open */
+#include <pthread.h>            /* pthread_create */
+#include <time.h>               /* clock_gettime */
+#include <sched.h>              /* sched_yield */
+#include <poll.h>               /* poll */
+#include <netdb.h>              /* getaddrinfo */
+#include <termios.h>            /* cfmakeraw */
+#include <sys/mman.h>           /* mmap */
+#include <sys/socket.h>         /* connect */
+#include <sys/un.h>             /* sockaddr_un */
+#include <netinet/in.h>         /* IPPROTO_TCP */
+#include <netinet/tcp.h>        /* TCP_NODELAY */
+
+#include "sercd.h"
+#include "baudrate.h"
+#include "logring.h"
+#include "statspage.h"
+#include "latency.h"
+#include "timer.h"
+#include "iosched.h"
+
+static unsigned long long
+Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Rates set and read back on the port: standard ones, some without a
+   speed code of their own, and 0 last to hang up */
+static const unsigned long CheckRates[] = {
+    9600, 115200, 921600, 4000000, 250000, 3250000, 31250, 0
+};
+
+/* Set each rate on Device and read it back */
+static int
+CheckBaudRate(const char *Device)
+{
+    unsigned long Actual;
+    unsigned int i;
+    int Fd, Failed = 0;
+
+    if ((Fd = open(Device, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) {
+        perror(Device);
+        return 1;
+    }
+    for (i = 0; i < sizeof(CheckRates) / sizeof(CheckRates[0]); i++) {
+        if (SetBaudRate(Fd, CheckRates[i], &Actual) != 0) {
+            printf("baudrate %lu: not settable\n", CheckRates[i]);
+            Failed = 1;
+        }
+        else if (Actual != CheckRates[i] || GetBaudRate(Fd) != Actual) {
+            printf("baudrate %lu: set %lu, read back %lu\n", CheckRates[i], Actual,
+                   GetBaudRate(Fd));
+            Failed = 1;
+        }
+        else
+            printf("baudrate %lu: ok\n", CheckRates[i]);
+    }
+    close(Fd);
+    return Failed;
+}
+
+/* Producers of the log ring check */
+#define LogMaxThreads 16
+
+/* What the log thread emitted, only touched by it */
+static unsigned long LogNext[LogMaxThreads];
+static volatile unsigned long LogEmitted = 0;
+static volatile unsigned long LogDropped = 0;
+static unsigned long LogDisorder = 0;
+
+/* Stands in for the syslog and Android log output of unix.c */
+void
+EmitLogMsg(int LogLevel, const char *Msg)
+{
+    unsigned int Thread;
+    unsigned long Seq, Count;
+
+    (void) LogLevel;
+    if (sscanf(Msg, "producer %u message %lu", &Thread, &Seq) == 2 &&
+        Thread < LogMaxThreads) {
+        /* Drops leave gaps, but a producer's messages stay in order */
+        if (Seq < LogNext[Thread])
+            LogDisorder++;
+        LogNext[Thread] = Seq + 1;
+        LogEmitted++;
+    }
+    else if (sscanf(Msg, "%lu log messages dropped.", &Count) == 1)
+        LogDropped += Count;
+}
+
+static unsigned long LogMessages;
+
+static void
+LogProducerFormat(const char *Format, ...)
+{
+    va_list Args;
+
+    va_start(Args, Format);
+    LogRingFormat(LOG_INFO, Format, Args);
+    va_end(Args);
+}
+
+static void *
+LogProducer(void *Arg)
+{
+    unsigned int Thread = (unsigned int) (long) Arg;
+    unsigned long i;
+
+    for (i = 0; i < LogMessages; i++)
+        LogProducerFormat("producer %u message %lu", Thread, i);
+    return NULL;
+}
+
+/* Log Messages messages from each of Threads threads at once, then
+   check that every message was emitted in order or counted as dropped */
+static int
+CheckLogRing(unsigned int Threads, unsigned long Messages)
+{
+    pthread_t Producers[LogMaxThreads];
+    unsigned long long Start, Elapsed;
+    unsigned long Total = Threads * Messages;
+    unsigned int i;
+    int Waited;
+
+    if (Threads < 1 || Threads > LogMaxThreads || Messages < 1) {
+        fprintf(stderr, "1 to %d threads and at least one message\n", LogMaxThreads);
+        return 1;
+    }
+    if (StartLogRing() != NoError) {
+        printf("logring: the log thread didn't start\n");
+        return 1;
+    }
+
+    LogMessages = Messages;
+    Start = Now();
+    for (i = 0; i < Threads; i++)
+        pthread_create(&Producers[i], NULL, LogProducer, (void *) (long) i);
+    for (i = 0; i < Threads; i++)
+        pthread_join(Producers[i], NULL);
+    Elapsed = Now() - Start;
+
+    /* The drop report follows the last emitted message */
+    FlushLogRing();
+    for (Waited = 0; LogEmitted + LogDropped < Total && Waited < LogFlushTimeout; Waited++)
+        usleep(1000);
+
+    printf("logring: %lu messages from %u threads, %lu emitted, %lu dropped, "
+           "%lu out of order\n", Total, Threads, LogEmitted, LogDropped, LogDisorder);
+    printf("logring: %llu ns per message on the producer side\n", Elapsed / Total);
+    return LogDisorder != 0 || LogEmitted == 0 || LogEmitted + LogDropped != Total;
+}
+
+/* Copy attempts before giving up on a page which is always changing,
+   as in sercdstat */
+#define StatsReadTries 1000
+
+static volatile int StatsWriting;
+
+/* Update the page as fast as possible, every counter of an update
+   holding the same value, which only grows */
+static void *
+StatsWriter(void *Arg)
+{
+    SercdCountersType C;
+    LatencyHistType *Hist = Arg;
+    uint64_t k = 0;
+
+    while (StatsWriting) {
+        k++;
+        C.DevIn = C.DevOut = C.NetIn = C.NetOut = C.EscapesAdded = C.IacCommands = k;
+        C.Wakeups = C.ShortWrites = C.Overruns = C.Drops = C.Connects = k;
+        C.ToDevHighWater = C.ToNetHighWater = k;
+        /* The histograms go along on every 64th update, as on
+           housekeeping in sercd */
+        Hist->Count = k;
+        UpdateStatsPage(&C, &C, k, k, (k & 63) ? NULL : Hist, (k & 63) ? NULL : Hist);
+    }
+    return NULL;
+}
+
+/* The page is consistent if every counter has the value of one update */
+static int
+StatsConsistent(const SercdStatsPageType * P)
+{
+    const uint64_t *Port = (const uint64_t *) &P->Port;
+    const uint64_t *Session = (const uint64_t *) &P->Session;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(P->Port) / sizeof(uint64_t); i++) {
+        if (Port[i] != P->UpdateTime || Session[i] != P->UpdateTime)
+            return 0;
+    }
+    return P->SessionStart == P->UpdateTime && P->ToNetDwell.Count <= P->UpdateTime &&
+        P->ToNetDwell.Count == P->ToDevDwell.Count;
+}
+
+/* Read the page at Path while a thread updates it for Seconds, and
+   check that every copy is consistent and the counters never go back */
+static int
+CheckStatsPage(const char *Path, long Seconds)
+{
+    static LatencyHistType Hist;
+    static SercdStatsPageType Copy;
+    const SercdStatsPageType *Page;
+    pthread_t Writer;
+    unsigned long long End;
+    unsigned long Reads = 0, Retries = 0, Torn = 0, Backwards = 0, Stuck = 0;
+    uint64_t Last = 0;
+    uint32_t Seq;
+    int Fd, i;
+
+    if (OpenStatsPage(Path, "sercdcheck") != NoError) {
+        perror(Path);
+        return 1;
+    }
+    /* Mapped again read only, as a reader process does */
+    if ((Fd = open(Path, O_RDONLY)) < 0) {
+        perror(Path);
+        return 1;
+    }
+    Page = mmap(NULL, sizeof(*Page), PROT_READ, MAP_SHARED, Fd, 0);
+    close(Fd);
+    if (Page == MAP_FAILED) {
+        perror(Path);
+        return 1;
+    }
+
+    StatsWriting = 1;
+    pthread_create(&Writer, NULL, StatsWriter, &Hist);
+    End = Now() + Seconds * 1000000000ULL;
+    while (Now() < End) {
+        for (i = 0; i < StatsReadTries; i++) {
+            Seq = Page->Seq;
+            __sync_synchronize();
+            if (Seq & 1) {
+                Retries++;
+                sched_yield();
+                continue;
+            }
+            memcpy(&Copy, (const void *) Page, sizeof(Copy));
+            __sync_synchronize();
+            if (Page->Seq == Seq)
+                break;
+            Retries++;
+        }
+        if (i == StatsReadTries) {
+            Stuck++;
+            continue;
+        }
+        Reads++;
+        if (!StatsConsistent(&Copy))
+            Torn++;
+        if (Copy.Port.Drops < Last)
+            Backwards++;
+        Last = Copy.Port.Drops;
+    }
+    StatsWriting = 0;
+    pthread_join(Writer, NULL);
+    unlink(Path);
+
+    printf("statspage: %lu copies of %lu updates, %lu retries, %lu given up\n", Reads,
+           (unsigned long) Last, Retries, Stuck);
+    printf("statspage: %lu inconsistent copies, %lu counters going back\n", Torn, Backwards);
+    return Reads == 0 || Torn != 0 || Backwards != 0;
+}
+
+/* Percentile checked against a uniform distribution */
+typedef struct
+{
+    const char *Name;
+    double Fraction;
+}
+PercentileType;
+
+static const PercentileType CheckPercentiles[] = {
+    {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p99.9", 0.999}, {"max", 1.0}
+};
+
+/* Record known times and check the bucket bounds and percentiles */
+static int
+CheckLatency(void)
+{
+    static LatencyHistType H;
+    unsigned long long Start, Elapsed;
+    uint64_t Us, Got, Want;
+    unsigned int i;
+    int Failed = 0;
+
+    /* A single time comes back exactly below 2 * LatencySub us, and
+       rounded up by at most 1/LatencySub above */
+    for (Us = 0; Us < 100000000ULL; Us = Us < 64 ? Us + 1 : Us * 17 / 16 + 1) {
+        memset(&H, 0, sizeof(H));
+        RecordLatency(&H, Us);
+        Got = LatencyPercentile(&H, 0.5);
+        if (Got != Us) {
+            printf("latency: %llu us alone reads back as %llu\n", (unsigned long long) Us,
+                   (unsigned long long) Got);
+            Failed = 1;
+        }
+        RecordLatency(&H, Us + Us / 2 + 1);
+        Got = LatencyPercentile(&H, 0.5);
+        if (Got < Us || (Us >= 2 * LatencySub ? Got - Us > Us / LatencySub : Got != Us)) {
+            printf("latency: p50 of %llu us and a longer time is %llu\n",
+                   (unsigned long long) Us, (unsigned long long) Got);
+            Failed = 1;
+        }
+    }
+
+    /* 1 to 1000000 us once each */
+    memset(&H, 0, sizeof(H));
+    Start = Now();
+    for (Us = 1; Us <= 1000000; Us++)
+        RecordLatency(&H, Us);
+    Elapsed = Now() - Start;
+    for (i = 0; i < sizeof(CheckPercentiles) / sizeof(CheckPercentiles[0]); i++) {
+        Want = (uint64_t) (CheckPercentiles[i].Fraction * 1000000);
+        Got = LatencyPercentile(&H, CheckPercentiles[i].Fraction);
+        printf("latency: %s of 1..1000000 us is %llu\n", CheckPercentiles[i].Name,
+               (unsigned long long) Got);
+        if (Got < Want || Got - Want > Want / LatencySub)
+            Failed = 1;
+    }
+    if (H.Count != 1000000 || H.Sum != 500000500000ULL || H.Max != 1000000)
+        Failed = 1;
+    printf("latency: %llu ns per recorded time\n", Elapsed / 1000000);
+    printf("latency: %s\n", Failed ? "FAILED" : "ok");
+    return Failed;
+}
+
+/* Span of the timer expiries, in ms */
+#define TimerCheckSpan 600000
+
+/* Scans of all deadlines timed for the comparison */
+#define TimerCheckScans 1000
+
+static unsigned int TimerSeed = 1;
+
+static unsigned int
+TimerRandom(void)
+{
+    TimerSeed = TimerSeed * 1103515245 + 12345;
+    return TimerSeed >> 8;
+}
+
+static int
+CompareExpires(const void *A, const void *B)
+{
+    unsigned long long EA = (*(TimerType * const *) A)->Expires;
+    unsigned long long EB = (*(TimerType * const *) B)->Expires;
+
+    return EA < EB ? -1 : EA > EB;
+}
+
+/* Arm Count timers over ten minutes, rearm all and cancel half of
+   them, then run the wheel as the main loop does, waking up when
+   NextTimerTimeout() says, and check that each timer fires exactly on
+   time. The time of a scan of all deadlines, as a loop without the
+   wheel would do on each wakeup, is printed for comparison. */
+static int
+CheckTimers(long Count)
+{
+    TimerType *Timers;
+    TimerType **Order;
+    unsigned long long Base = 123456789, T, Start, Add, Rearm, Cancel, Run = 0, Scan;
+    volatile unsigned long long Nearest = 0;
+    unsigned long Wakeups = 0, Late = 0, Early = 0;
+    long i, j, Armed = 0, Fired = 0;
+    long Wait;
+    int Failed = 0;
+
+    if (Count < 1) {
+        fprintf(stderr, "At least one timer\n");
+        return 1;
+    }
+    Timers = malloc(Count * sizeof(*Timers));
+    Order = malloc(Count * sizeof(*Order));
+    if (Timers == NULL || Order == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    InitTimers(Base);
+    for (i = 0; i < Count; i++)
+        InitTimer(&Timers[i], 1);
+    Start = Now();
+    for (i = 0; i < Count; i++)
+        AddTimer(&Timers[i], Base + 1 + TimerRandom() % TimerCheckSpan);
+    Add = Now() - Start;
+    Start = Now();
+    for (i = 0; i < Count; i++)
+        AddTimer(&Timers[i], Base + 1 + TimerRandom() % TimerCheckSpan);
+    Rearm = Now() - Start;
+    Start = Now();
+    for (i = 1; i < Count; i += 2)
+        CancelTimer(&Timers[i]);
+    Cancel = Now() - Start;
+
+    for (i = 0; i < Count; i++)
+        if (IsTimerPending(&Timers[i]))
+            Order[Armed++] = &Timers[i];
+    qsort(Order, Armed, sizeof(*Order), CompareExpires);
+
+    T = Base;
+    while (Fired < Armed) {
+        Wait = NextTimerTimeout(T, -1);
+        if (Wait < 0) {
+            printf("timers: no timeout with %ld timers armed\n", Armed - Fired);
+            Failed = 1;
+            break;
+        }
+        T += Wait;
+        Start = Now();
+        RunTimers(T);
+        Run += Now() - Start;
+        Wakeups++;
+        for (; Fired < Armed && Order[Fired]->Expires <= T; Fired++) {
+            if (IsTimerPending(Order[Fired]))
+                Late++;
+            else if (Order[Fired]->Expires < T)
+                Late++;
+        }
+        if (Fired < Armed && !IsTimerPending(Order[Fired]))
+            Early++;
+        if (Early)
+            break;
+    }
+    if (Early || Late) {
+        printf("timers: %lu fired early, %lu late\n", Early, Late);
+        Failed = 1;
+    }
+
+    Start = Now();
+    for (j = 0; j < TimerCheckScans; j++) {
+        unsigned long long Min = ~0ULL;
+        for (i = 0; i < Count; i++)
+            Min = MIN(Min, Timers[i].Expires);
+        Nearest += Min;
+    }
+    Scan = Now() - Start;
+
+    printf("timers: %ld armed in %llu ns each, rearmed in %llu ns, cancelled in %llu ns\n",
+           Count, Add / Count, Rearm / Count, Cancel / MAX(Count / 2, 1));
+    printf("timers: %ld fired over %d s in %lu wakeups, %llu ns per run\n", Fired,
+           TimerCheckSpan / 1000, Wakeups, Run / MAX(Wakeups, 1));
+    printf("timers: a scan of %ld deadlines takes %llu ns\n", Count, Scan / TimerCheckScans);
+    printf("timers: %s\n", Failed ? "FAILED" : "ok");
+    free(Timers);
+    free(Order);
+    return Failed;
+}
+
+/* Simulated loop iterations of the scheduler check, 100 us apart */
+#define SchedCheckRounds 100000
+#define SchedCheckTick 100
+
+/* A direction in the scheduler check: Avail bytes wait to be read,
+   Arrive more come every Every iterations, and a read takes at most
+   ReadSize of them. Unlimited data for a flood. */
+typedef struct
+{
+    unsigned long Avail;
+    unsigned long Arrive;
+    unsigned long Every;
+    unsigned long ReadSize;
+    Boolean Flood;
+    unsigned long long Read;
+    /* Iterations the oldest unread byte waited, and the most */
+    unsigned long Waiting;
+    unsigned long MaxWait;
+}
+SchedFlowType;
+
+/* Run the main loop's use of the scheduler over Flows for
+   SchedCheckRounds iterations */
+static void
+SchedSimulate(SchedFlowType * Flows)
+{
+    unsigned long long Now = 1000000;
+    unsigned int Ready;
+    size_t Budget, Try, Got;
+    long i;
+    int D;
+
+    for (i = 0; i < SchedCheckRounds; i++, Now += SchedCheckTick) {
+        Ready = 0;
+        for (D = 0; D < SchedDirections; D++) {
+            SchedFlowType *F = &Flows[D];
+            if (F->Every && i % F->Every == 0)
+                F->Avail += F->Arrive;
+            if ((F->Flood || F->Avail > 0) && !SchedThrottled(D))
+                Ready |= SchedReady(D);
+        }
+        SchedRound(Now, Ready);
+        for (D = 0; D < SchedDirections; D++) {
+            SchedFlowType *F = &Flows[D];
+            if (!(Ready & SchedReady(D)) || (Budget = SchedBudget(D)) == 0) {
+                if (F->Avail > 0 && ++F->Waiting > F->MaxWait)
+                    F->MaxWait = F->Waiting;
+                continue;
+            }
+            Try = MIN(Budget, F->ReadSize);
+            Got = F->Flood ? Try : MIN(Try, F->Avail);
+            SchedCharge(D, Got, Try);
+            if (!F->Flood)
+                F->Avail -= Got;
+            F->Read += Got;
+            F->Waiting = 0;
+        }
+    }
+}
+
+/* Check that the scheduler shares the two directions fairly: a flood
+   takes no more bytes than another busy direction with short reads,
+   and does not delay a direction with occasional data */
+static int
+CheckSched(void)
+{
+    SchedFlowType Flows[SchedDirections];
+    unsigned long long Expected;
+    int Failed = 0;
+
+    /* Both busy, one reading full buffers and one 16 bytes at a time */
+    InitSched(DEFAULT_SCHED_QUANTUM, 0, 0);
+    memset(Flows, 0, sizeof(Flows));
+    Flows[SchedToNet].Flood = Flows[SchedToDev].Flood = True;
+    Flows[SchedToNet].ReadSize = 512;
+    Flows[SchedToDev].ReadSize = 16;
+    SchedSimulate(Flows);
+    printf("sched: both busy, %llu bytes to the network, %llu to the device\n",
+           Flows[SchedToNet].Read, Flows[SchedToDev].Read);
+    if (Flows[SchedToNet].Read > Flows[SchedToDev].Read + 2 * DEFAULT_SCHED_QUANTUM)
+        Failed = 1;
+
+    /* A flood to the network, a few bytes to the device now and then */
+    InitSched(DEFAULT_SCHED_QUANTUM, 0, 0);
+    memset(Flows, 0, sizeof(Flows));
+    Flows[SchedToNet].Flood = True;
+    Flows[SchedToNet].ReadSize = 512;
+    Flows[SchedToDev].Arrive = 3;
+    Flows[SchedToDev].Every = 37;
+    Flows[SchedToDev].ReadSize = 512;
+    SchedSimulate(Flows);
+    printf("sched: flood to the network, bytes to the device waited at most %lu rounds\n",
+           Flows[SchedToDev].MaxWait);
+    if (Flows[SchedToDev].MaxWait > 0 ||
+        Flows[SchedToDev].Read != 3ULL * ((SchedCheckRounds + 36) / 37))
+        Failed = 1;
+
+    /* The same while the device gets a little data on every iteration:
+       the flood still gets its share */
+    InitSched(DEFAULT_SCHED_QUANTUM, 0, 0);
+    memset(Flows, 0, sizeof(Flows));
+    Flows[SchedToNet].Flood = True;
+    Flows[SchedToNet].ReadSize = 512;
+    Flows[SchedToDev].Arrive = 8;
+    Flows[SchedToDev].Every = 1;
+    Flows[SchedToDev].ReadSize = 512;
+    SchedSimulate(Flows);
+    printf("sched: flood to the network, steady trickle to the device: %llu and %llu bytes, "
+           "waits of at most %lu and %lu rounds\n", Flows[SchedToNet].Read,
+           Flows[SchedToDev].Read, Flows[SchedToNet].MaxWait, Flows[SchedToDev].MaxWait);
+    if (Flows[SchedToNet].Read < Flows[SchedToDev].Read || Flows[SchedToNet].MaxWait > 1 ||
+        Flows[SchedToDev].MaxWait > 1)
+        Failed = 1;
+
+    /* A rate cap of 100 KB/s to the network, which bursts 100 ms */
+    InitSched(DEFAULT_SCHED_QUANTUM, 100 * 1024, 0);
+    memset(Flows, 0, sizeof(Flows));
+    Flows[SchedToNet].Flood = Flows[SchedToDev].Flood = True;
+    Flows[SchedToNet].ReadSize = Flows[SchedToDev].ReadSize = 512;
+    SchedSimulate(Flows);
+    Expected = 100 * 1024ULL * SchedCheckRounds * SchedCheckTick / 1000000 + 10 * 1024;
+    printf("sched: capped to the network at 100 KB/s, %llu bytes of %llu, "
+           "%llu to the device\n", Flows[SchedToNet].Read, Expected, Flows[SchedToDev].Read);
+    if (Flows[SchedToNet].Read > Expected || Flows[SchedToNet].Read < Expected * 95 / 100 ||
+        Flows[SchedToDev].Read < 512ULL * SchedCheckRounds * 9 / 10)
+        Failed = 1;
+
+    printf("sched: %s\n", Failed ? "FAILED" : "ok");
+    return Failed;
+}
+
+/* The benchmarks below run against a sercd serving a device whose
+   other end is Far: the second port of a null modem cable or of a
+   linked pty pair. */
+
+/* Connect to sercd at Host:Port, -1 on failure */
+static int
+ConnectSercd(const char *Host, const char *Port)
+{
+    struct addrinfo Hints, *Addr;
+    int Sock, On = 1;
+
+    memset(&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(Host, Port, &Hints, &Addr) != 0) {
+        fprintf(stderr, "Unknown host %s\n", Host);
+        return -1;
+    }
+    Sock = socket(Addr->ai_family, Addr->ai_socktype, Addr->ai_protocol);
+    if (Sock >= 0 && connect(Sock, Addr->ai_addr, Addr->ai_addrlen) < 0) {
+        close(Sock);
+        Sock = -1;
+    }
+    freeaddrinfo(Addr);
+    if (Sock < 0)
+        perror("connect");
+    else
+        setsockopt(Sock, IPPROTO_TCP, TCP_NODELAY, &On, sizeof(On));
+    return Sock;
+}
+
+/* Open the far end of the device in raw mode, -1 on failure */
+static int
+OpenFarEnd(const char *Path)
+{
+    struct termios Settings;
+    int Fd;
+
+    if ((Fd = open(Path, O_RDWR | O_NOCTTY)) < 0) {
+        perror(Path);
+        return -1;
+    }
+    if (tcgetattr(Fd, &Settings) == 0) {
+        cfmakeraw(&Settings);
+        tcsetattr(Fd, TCSANOW, &Settings);
+    }
+    tcflush(Fd, TCIOFLUSH);
+    return Fd;
+}
+
+/* Telnet input parser of a sercd connection */
+typedef enum
+{
+    TelnetData,
+    TelnetIAC,
+    TelnetOption,
+    TelnetSub,
+    TelnetSubIAC
+}
+TelnetState;
+
+/* Strip the telnet commands from the Len bytes at Buf, returns the
+   number of data bytes left at Buf */
+static size_t
+TelnetFilter(TelnetState * State, unsigned char *Buf, size_t Len)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < Len; i++) {
+        unsigned char C = Buf[i];
+
+        switch (*State) {
+        case TelnetData:
+            if (C == TNIAC)
+                *State = TelnetIAC;
+            else
+                Buf[n++] = C;
+            break;
+        case TelnetIAC:
+            if (C == TNIAC) {
+                Buf[n++] = C;
+                *State = TelnetData;
+            }
+            else if (C == TNSB)
+                *State = TelnetSub;
+            else if (C == TNWILL || C == TNWONT || C == TNDO || C == TNDONT)
+                *State = TelnetOption;
+            else
+                *State = TelnetData;
+            break;
+        case TelnetOption:
+            *State = TelnetData;
+            break;
+        case TelnetSub:
+            if (C == TNIAC)
+                *State = TelnetSubIAC;
+            break;
+        case TelnetSubIAC:
+            *State = C == TNSE ? TelnetData : TelnetSub;
+            break;
+        }
+    }
+    return n;
+}
+
+/* Wait up to Ms ms for the data byte C on Fd, going through the telnet
+   parser if State is not NULL. Other bytes are dropped. Returns 0 once
+   C arrived, -1 on timeout or error. */
+static int
+WaitForByte(int Fd, TelnetState * State, unsigned char C, int Ms)
+{
+    unsigned char Buf[4096];
+    unsigned long long End = Now() + Ms * 1000000ULL;
+    struct pollfd P;
+    ssize_t Got;
+    size_t i, n;
+
+    P.fd = Fd;
+    P.events = POLLIN;
+    while (Now() < End) {
+        if (poll(&P, 1, (int) ((End - Now()) / 1000000) + 1) <= 0)
+            continue;
+        if ((Got = read(Fd, Buf, sizeof(Buf))) <= 0)
+            return -1;
+        n = State ? TelnetFilter(State, Buf, Got) : (size_t) Got;
+        for (i = 0; i < n; i++) {
+            if (Buf[i] == C)
+                return 0;
+        }
+    }
+    return -1;
+}
+
+/* Print the percentiles of the times in H, in us */
+static void
+PrintLatency(const char *Name, const LatencyHistType * H)
+{
+    printf("%s: p50 %llu us, p99 %llu us, p99.9 %llu us, max %llu us\n", Name,
+           (unsigned long long) LatencyPercentile(H, 0.5),
+           (unsigned long long) LatencyPercentile(H, 0.99),
+           (unsigned long long) LatencyPercentile(H, 0.999), (unsigned long long) H->Max);
+}
+
+/* Run at the lowest real-time priority if allowed, so that the load we
+   create delays sercd and not our measurements */
+static int
+MeasureInRealTime(void)
+{
+    struct sched_param Param;
+
+    Param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    return sched_setscheduler(0, SCHED_FIFO, &Param) == 0;
+}
+
+/* Threads spinning at the priority of normal processes */
+#define JitterMaxHogs 64
+
+static volatile int Hogging;
+
+static void *
+Hog(void *Arg)
+{
+    (void) Arg;
+    while (Hogging);
+    return NULL;
+}
+
+/* Gap between two bytes of the jitter benchmark, in us */
+#define JitterInterval 1000
+
+/* Send single bytes from the far end for Seconds while Hogs threads
+   keep every CPU busy, and record when each one reaches the client.
+   Run it against sercd with and without real-time mode to compare. */
+static int
+BenchJitter(const char *Host, const char *Port, const char *Far, long Seconds, long Hogs)
+{
+    static LatencyHistType H;
+    pthread_t Spinners[JitterMaxHogs];
+    TelnetState State = TelnetData;
+    unsigned long long End, Sent;
+    unsigned long Lost = 0;
+    unsigned char C = 'a';
+    int Sock, Fd, RealTime;
+    long i;
+
+    if (Hogs < 0 || Hogs > JitterMaxHogs || Seconds < 1) {
+        fprintf(stderr, "0 to %d hogs and at least one second\n", JitterMaxHogs);
+        return 1;
+    }
+    if ((Fd = OpenFarEnd(Far)) < 0 || (Sock = ConnectSercd(Host, Port)) < 0)
+        return 1;
+    /* The device is ready once a first byte went through */
+    if (write(Fd, &C, 1) != 1 || WaitForByte(Sock, &State, C, 5000) < 0) {
+        printf("jitter: no data from the device\n");
+        return 1;
+    }
+
+    /* The hogs are started first, so they don't inherit our priority */
+    Hogging = 1;
+    for (i = 0; i < Hogs; i++)
+        pthread_create(&Spinners[i], NULL, Hog, NULL);
+    RealTime = MeasureInRealTime();
+    End = Now() + Seconds * 1000000000ULL;
+    while (Now() < End) {
+        C = C == 'z' ? 'a' : C + 1;
+        Sent = Now();
+        if (write(Fd, &C, 1) != 1 || WaitForByte(Sock, &State, C, 1000) < 0)
+            Lost++;
+        else
+            RecordLatency(&H, (Now() - Sent) / 1000);
+        usleep(JitterInterval);
+    }
+    Hogging = 0;
+    for (i = 0; i < Hogs; i++)
+        pthread_join(Spinners[i], NULL);
+    close(Sock);
+    close(Fd);
+
+    printf("jitter: %llu bytes device to client under %ld hogs, %lu lost%s\n",
+           (unsigned long long) H.Count, Hogs, Lost,
+           RealTime ? "" : ", measured without real-time priority");
+    PrintLatency("jitter", &H);
+    return H.Count == 0 || Lost != 0;
+}
+
+/* Gap between two probes of the flood benchmark, in us */
+#define FloodInterval 10000
+
+/* A flood: FloodFd is written as fast as it takes data, SinkFd reads
+   and drops everything that comes out */
+typedef struct
+{
+    int FloodFd;
+    int SinkFd;
+    unsigned long long Sunk;
+}
+FloodType;
+
+static volatile int Flooding, Sinking;
+
+static void *
+Flooder(void *Arg)
+{
+    FloodType *F = Arg;
+    unsigned char Buf[4096];
+    struct pollfd P;
+
+    memset(Buf, 'f', sizeof(Buf));
+    P.fd = F->FloodFd;
+    P.events = POLLOUT;
+    while (Flooding) {
+        if (poll(&P, 1, 100) <= 0)
+            continue;
+        if (write(F->FloodFd, Buf, sizeof(Buf)) < 0)
+            break;
+    }
+    return NULL;
+}
+
+static void *
+FloodSink(void *Arg)
+{
+    FloodType *F = Arg;
+    unsigned char Buf[4096];
+    struct pollfd P;
+    ssize_t Got;
+
+    P.fd = F->SinkFd;
+    P.events = POLLIN;
+    while (Sinking) {
+        if (poll(&P, 1, 100) <= 0)
+            continue;
+        if ((Got = read(F->SinkFd, Buf, sizeof(Buf))) <= 0)
+            break;
+        F->Sunk += Got;
+    }
+    return NULL;
+}
+
+/* For Seconds, send a probe byte from ProbeFd every FloodInterval and
+   record when it comes out at ReplyFd, while F floods the other
+   direction unless F is NULL. Returns the number of lost probes. */
+static unsigned long
+FloodPhase(const char *Name, FloodType * F, int ProbeFd, int ReplyFd, TelnetState * State,
+           long Seconds)
+{
+    static LatencyHistType H;
+    pthread_t Threads[2];
+    unsigned long long Start, End, Sent;
+    unsigned long Lost = 0;
+    unsigned char C = 'p';
+
+    memset(&H, 0, sizeof(H));
+    if (F) {
+        Flooding = Sinking = 1;
+        F->Sunk = 0;
+        pthread_create(&Threads[0], NULL, Flooder, F);
+        pthread_create(&Threads[1], NULL, FloodSink, F);
+    }
+    Start = Now();
+    End = Start + Seconds * 1000000000ULL;
+    while (Now() < End) {
+        Sent = Now();
+        if (write(ProbeFd, &C, 1) != 1 || WaitForByte(ReplyFd, State, C, 1000) < 0)
+            Lost++;
+        else
+            RecordLatency(&H, (Now() - Sent) / 1000);
+        usleep(FloodInterval);
+    }
+    if (F) {
+        /* The flooder may be blocked in a write until the sink drained
+           enough, so the sink stops last */
+        Flooding = 0;
+        pthread_join(Threads[0], NULL);
+        Sinking = 0;
+        pthread_join(Threads[1], NULL);
+        printf("%s: flood of %llu KB/s, %llu probes, %lu lost\n", Name,
+               F->Sunk * 1000000 / MAX((Now() - Start) / 1000, 1) / 1024,
+               (unsigned long long) H.Count, Lost);
+    }
+    else
+        printf("%s: %llu probes, %lu lost\n", Name, (unsigned long long) H.Count, Lost);
+    PrintLatency(Name, &H);
+    return Lost;
+}
+
+/* Probe the latency of each direction alone, then while the other
+   direction floods. Compare sercd with different scheduling quanta. */
+static int
+BenchFlood(const char *Host, const char *Port, const char *Far, long Seconds)
+{
+    TelnetState State = TelnetData;
+    FloodType F;
+    unsigned long Lost = 0;
+    unsigned char C = 'a';
+    int Sock, Fd;
+
+    if (Seconds < 1) {
+        fprintf(stderr, "At least one second\n");
+        return 1;
+    }
+    if ((Fd = OpenFarEnd(Far)) < 0 || (Sock = ConnectSercd(Host, Port)) < 0)
+        return 1;
+    if (write(Fd, &C, 1) != 1 || WaitForByte(Sock, &State, C, 5000) < 0) {
+        printf("flood: no data from the device\n");
+        return 1;
+    }
+
+    Lost += FloodPhase("to device", NULL, Sock, Fd, NULL, Seconds);
+    F.FloodFd = Fd;
+    F.SinkFd = Sock;
+    Lost += FloodPhase("to device, device floods", &F, Sock, Fd, NULL, Seconds);
+    /* Let the flood drain before probing the other way */
+    WaitForByte(Sock, NULL, 0, 500);
+
+    Lost += FloodPhase("to client", NULL, Fd, Sock, &State, Seconds);
+    F.FloodFd = Sock;
+    F.SinkFd = Fd;
+    Lost += FloodPhase("to client, client floods", &F, Fd, Sock, &State, Seconds);
+    close(Sock);
+    close(Fd);
+    return Lost != 0;
+}
+
+/* Send Count single bytes from the client, echo each one back at the
+   far end and record the round trip. Compare sercd with and without
+   busy polling. */
+static int
+BenchRoundTrip(const char *Host, const char *Port, const char *Far, long Count)
+{
+    static LatencyHistType H;
+    TelnetState State = TelnetData;
+    unsigned long long Start, Sent;
+    unsigned long Lost = 0;
+    unsigned char C = 'a';
+    int Sock, Fd;
+    long i;
+
+    if (Count < 1) {
+        fprintf(stderr, "At least one round trip\n");
+        return 1;
+    }
+    if ((Fd = OpenFarEnd(Far)) < 0 || (Sock = ConnectSercd(Host, Port)) < 0)
+        return 1;
+    if (write(Sock, &C, 1) != 1 || WaitForByte(Fd, NULL, C, 5000) < 0) {
+        printf("roundtrip: no data to the device\n");
+        return 1;
+    }
+    MeasureInRealTime();
+
+    Start = Now();
+    for (i = 0; i < Count; i++) {
+        C = C == 'z' ? 'a' : C + 1;
+        Sent = Now();
+        if (write(Sock, &C, 1) != 1 || WaitForByte(Fd, NULL, C, 1000) < 0 ||
+            write(Fd, &C, 1) != 1 || WaitForByte(Sock, &State, C, 1000) < 0)
+            Lost++;
+        else
+            RecordLatency(&H, (Now() - Sent) / 1000);
+    }
+    close(Sock);
+    close(Fd);
+
+    printf("roundtrip: %llu round trips in %llu ms, %lu lost\n", (unsigned long long) H.Count,
+           (Now() - Start) / 1000000, Lost);
+    PrintLatency("roundtrip", &H);
+    return H.Count == 0 || Lost != 0;
+}
+
+/* Modbus clients of the gateway benchmark */
+#define ModbusBenchMaxClients 32
+
+/* Registers read by each poll, and the most a slave answers */
+#define ModbusBenchRegisters 10
+#define ModbusBenchMaxRegisters 125
+
+static unsigned short
+ModbusBenchCrc(const unsigned char *Data, size_t Len)
+{
+    unsigned short Crc = 0xFFFF;
+    int i;
+
+    while (Len--) {
+        Crc ^= *Data++;
+        for (i = 0; i < 8; i++)
+            Crc = (Crc & 1) ? (Crc >> 1) ^ 0xA001 : Crc >> 1;
+    }
+    return Crc;
+}
+
+typedef struct
+{
+    int Fd;
+    /* Time a character takes on the wire, in us */
+    unsigned long CharTime;
+    unsigned long Answered;
+}
+ModbusSlaveType;
+
+static volatile int ModbusRunning;
+
+/* Answer the register reads of any unit at the far end, taking as
+   long as the request and the response take on a line at the speed of
+   the device */
+static void *
+ModbusSlave(void *Arg)
+{
+    ModbusSlaveType *S = Arg;
+    unsigned char Rx[256], Tx[5 + 2 * ModbusBenchMaxRegisters];
+    struct pollfd P;
+    size_t Len = 0, TxLen;
+    ssize_t Got;
+    unsigned int i, Count;
+
+    P.fd = S->Fd;
+    P.events = POLLIN;
+    while (ModbusRunning) {
+        if (poll(&P, 1, 100) <= 0 || (Got = read(S->Fd, Rx + Len, sizeof(Rx) - Len)) <= 0)
+            continue;
+        Len += Got;
+        /* unit, function, address and count, CRC */
+        while (Len >= 8) {
+            Count = (Rx[4] << 8) | Rx[5];
+            if (Rx[0] >= 1 && Rx[0] <= 247 && Rx[1] == 3 && Count >= 1 &&
+                Count <= ModbusBenchMaxRegisters &&
+                ModbusBenchCrc(Rx, 6) == (Rx[6] | (Rx[7] << 8))) {
+                Tx[0] = Rx[0];
+                Tx[1] = 3;
+                Tx[2] = 2 * Count;
+                for (i = 0; i < 2 * Count; i++)
+                    Tx[3 + i] = (unsigned char) (S->Answered + i);
+                i = ModbusBenchCrc(Tx, 3 + 2 * Count);
+                TxLen = 5 + 2 * Count;
+                Tx[TxLen - 2] = (unsigned char) i;
+                Tx[TxLen - 1] = (unsigned char) (i >> 8);
+                usleep((8 + TxLen) * S->CharTime);
+                if (write(S->Fd, Tx, TxLen) != (ssize_t) TxLen)
+                    break;
+                S->Answered++;
+            }
+            /* Anything else is noise to skip */
+            memmove(Rx, Rx + 8, Len - 8);
+            Len -= 8;
+        }
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    const char *Host, *Port;
+    unsigned long long End;
+    unsigned long Polls, Exceptions, Lost;
+    LatencyHistType H;
+}
+ModbusPollerType;
+
+/* Poll the registers of unit 1 one request at a time */
+static void *
+ModbusPoller(void *Arg)
+{
+    ModbusPollerType *C = Arg;
+    unsigned char Req[12], Rsp[256];
+    unsigned short Tid = 0;
+    unsigned long long Sent;
+    struct pollfd P;
+    size_t Len;
+    ssize_t Got;
+    int Sock;
+
+    if ((Sock = ConnectSercd(C->Host, C->Port)) < 0)
+        return NULL;
+    P.fd = Sock;
+    P.events = POLLIN;
+    while (Now() < C->End) {
+        Tid++;
+        Req[0] = Tid >> 8;
+        Req[1] = (unsigned char) Tid;
+        Req[2] = Req[3] = Req[4] = 0;
+        Req[5] = 6;
+        Req[6] = 1;
+        Req[7] = 3;
+        Req[8] = Req[9] = 0;
+        Req[10] = 0;
+        Req[11] = ModbusBenchRegisters;
+        Sent = Now();
+        if (write(Sock, Req, sizeof(Req)) != (ssize_t) sizeof(Req))
+            break;
+        /* MBAP header, then the length it gives */
+        for (Len = 0; Len < 6 || Len < 6U + ((Rsp[4] << 8) | Rsp[5]); Len += Got) {
+            if (poll(&P, 1, 5000) <= 0 || (Got = read(Sock, Rsp + Len, sizeof(Rsp) - Len)) <= 0)
+                break;
+        }
+        if (Len < 9 || Rsp[0] != Req[0] || Rsp[1] != Req[1]) {
+            C->Lost++;
+            break;
+        }
+        if (Rsp[7] & 0x80)
+            C->Exceptions++;
+        else {
+            C->Polls++;
+            RecordLatency(&C->H, (Now() - Sent) / 1000);
+        }
+    }
+    close(Sock);
+    return NULL;
+}
+
+/* Let Clients Modbus TCP clients poll the gateway at Host:Port for
+   Seconds, all reading the same registers, while a simulated RTU slave
+   answers at the far end of the device. Prints the polls served per
+   second, their times and how many reached the slave. */
+static int
+BenchModbus(const char *Host, const char *Port, const char *Far, long Clients, long Seconds)
+{
+    static ModbusPollerType C[ModbusBenchMaxClients];
+    static LatencyHistType H;
+    pthread_t Slave, Threads[ModbusBenchMaxClients];
+    ModbusSlaveType S;
+    unsigned long Polls = 0, Exceptions = 0, Lost = 0;
+    unsigned long long Start;
+    unsigned long Speed;
+    long i;
+    unsigned int b;
+
+    if (Clients < 1 || Clients > ModbusBenchMaxClients || Seconds < 1) {
+        fprintf(stderr, "1 to %d clients for at least one second\n", ModbusBenchMaxClients);
+        return 1;
+    }
+    if ((S.Fd = OpenFarEnd(Far)) < 0)
+        return 1;
+    /* 11 bits a character at the speed of the line */
+    Speed = GetBaudRate(S.Fd);
+    S.CharTime = 11000000UL / (Speed ? Speed : 9600);
+    S.Answered = 0;
+
+    ModbusRunning = 1;
+    pthread_create(&Slave, NULL, ModbusSlave, &S);
+    Start = Now();
+    for (i = 0; i < Clients; i++) {
+        memset(&C[i], 0, sizeof(C[i]));
+        C[i].Host = Host;
+        C[i].Port = Port;
+        C[i].End = Start + Seconds * 1000000000ULL;
+        pthread_create(&Threads[i], NULL, ModbusPoller, &C[i]);
+    }
+    memset(&H, 0, sizeof(H));
+    for (i = 0; i < Clients; i++) {
+        pthread_join(Threads[i], NULL);
+        Polls += C[i].Polls;
+        Exceptions += C[i].Exceptions;
+        Lost += C[i].Lost;
+        for (b = 0; b < LatencyBuckets; b++)
+            H.Buckets[b] += C[i].H.Buckets[b];
+        H.Count += C[i].H.Count;
+        H.Sum += C[i].H.Sum;
+        H.Max = MAX(H.Max, C[i].H.Max);
+    }
+    ModbusRunning = 0;
+    pthread_join(Slave, NULL);
+    close(S.Fd);
+
+    printf("modbus: %lu polls of %ld clients in %llu ms, %.1f per second\n", Polls, Clients,
+           (Now() - Start) / 1000000, Polls * 1e9 / (double) MAX(Now() - Start, 1));
+    printf("modbus: %lu answered by the slave at %lu us a character, %lu exceptions, "
+           "%lu lost\n", S.Answered, S.CharTime, Exceptions, Lost);
+    PrintLatency("modbus", &H);
+    return Polls == 0 || Lost != 0;
+}
+
+/* Subscribe to the results of sercd in bus master mode at Host:Port
+   for Seconds, while simulated RTU slaves answer the register reads of
+   its poll table at the far end of the device. Prints the results per
+   second, the response times the poller measured and the statistics
+   it published last. */
+static int
+BenchBus(const char *Host, const char *Port, const char *Far, long Seconds)
+{
+    static LatencyHistType H;
+    pthread_t Slave;
+    ModbusSlaveType S;
+    char Buf[4096], Status[16];
+    unsigned long Ok = 0, Short = 0, TimedOut = 0, Reports = 0;
+    unsigned long long Start, End, Us, Utilization = 0, Cycle = 0, CycleMax = 0;
+    struct pollfd P;
+    size_t Len = 0;
+    ssize_t Got;
+    char *Line, *Next;
+    int Sock;
+
+    if (Seconds < 1) {
+        fprintf(stderr, "At least one second\n");
+        return 1;
+    }
+    if ((S.Fd = OpenFarEnd(Far)) < 0)
+        return 1;
+    if ((Sock = ConnectSercd(Host, Port)) < 0) {
+        close(S.Fd);
+        return 1;
+    }
+    Us = GetBaudRate(S.Fd);
+    S.CharTime = 11000000UL / (Us ? Us : 9600);
+    S.Answered = 0;
+
+    ModbusRunning = 1;
+    pthread_create(&Slave, NULL, ModbusSlave, &S);
+    memset(&H, 0, sizeof(H));
+    P.fd = Sock;
+    P.events = POLLIN;
+    Start = Now();
+    End = Start + Seconds * 1000000000ULL;
+    while (Now() < End) {
+        if (poll(&P, 1, 100) <= 0)
+            continue;
+        if ((Got = read(Sock, Buf + Len, sizeof(Buf) - 1 - Len)) <= 0)
+            break;
+        Len += Got;
+        Buf[Len] = '\0';
+        /* "time index address status us data" for each poll, and
+           "time stats utilization% cycle_ms max_ms ..." for each report */
+        for (Line = Buf; (Next = strchr(Line, '\n')) != NULL; Line = Next + 1) {
+            *Next = '\0';
+            if (sscanf(Line, "%*u stats %llu %llu %llu", &Utilization, &Cycle, &CycleMax) == 3)
+                Reports++;
+            else if (sscanf(Line, "%*u %*d %*u %15s %llu", Status, &Us) == 2) {
+                if (strcmp(Status, "ok") == 0) {
+                    Ok++;
+                    RecordLatency(&H, Us);
+                }
+                else if (strcmp(Status, "short") == 0)
+                    Short++;
+                else
+                    TimedOut++;
+            }
+        }
+        Len -= Line - Buf;
+        memmove(Buf, Line, Len);
+        if (Len == sizeof(Buf) - 1)
+            Len = 0;
+    }
+    ModbusRunning = 0;
+    pthread_join(Slave, NULL);
+    close(Sock);
+    close(S.Fd);
+
+    printf("bus: %lu results in %llu ms, %.1f per second\n", Ok + Short + TimedOut,
+           (Now() - Start) / 1000000,
+           (Ok + Short + TimedOut) * 1e9 / (double) MAX(Now() - Start, 1));
+    printf("bus: %lu ok, %lu short, %lu timeouts, %lu answered by the slaves at %lu us a "
+           "character\n", Ok, Short, TimedOut, S.Answered, S.CharTime);
+    PrintLatency("bus response", &H);
+    if (Reports)
+        printf("bus: utilization %llu%%, cycle %llu ms, max %llu ms at the last report\n",
+               Utilization, Cycle, CycleMax);
+    else
+        printf("bus: no report yet, run for longer than the report interval\n");
+    return Ok == 0;
+}
+
+/* Send Count single bytes from each end of a bridge, one at a time,
+   and record when they come out at the other end. The same run over
+   the links alone, with nothing in between, gives the time the bridge
+   adds. */
+static int
+BenchBridge(const char *FarA, const char *FarB, long Count)
+{
+    static LatencyHistType H[2];
+    const char *Names[2];
+    unsigned long long Sent;
+    unsigned long Lost = 0;
+    unsigned char C = 'a';
+    int Fd[2], d;
+    long i;
+
+    if (Count < 1) {
+        fprintf(stderr, "At least one byte\n");
+        return 1;
+    }
+    Names[0] = FarA;
+    Names[1] = FarB;
+    if ((Fd[0] = OpenFarEnd(FarA)) < 0 || (Fd[1] = OpenFarEnd(FarB)) < 0)
+        return 1;
+    MeasureInRealTime();
+
+    for (d = 0; d < 2; d++) {
+        memset(&H[d], 0, sizeof(H[d]));
+        for (i = 0; i < Count; i++) {
+            C = C == 'z' ? 'a' : C + 1;
+            Sent = Now();
+            if (write(Fd[d], &C, 1) != 1 || WaitForByte(Fd[1 - d], NULL, C, 1000) < 0)
+                Lost++;
+            else
+                RecordLatency(&H[d], (Now() - Sent) / 1000);
+        }
+        printf("bridge: %s to %s, %llu bytes\n", Names[d], Names[1 - d],
+               (unsigned long long) H[d].Count);
+        PrintLatency("bridge", &H[d]);
+    }
+    close(Fd[0]);
+    close(Fd[1]);
+    printf("bridge: %lu lost\n", Lost);
+    return Lost != 0;
+}
+
+/* Largest reverse benchmark transfer, in KiB */
+#define ReverseBenchMaxKBytes 1048576
+
+/* Move Bytes from Src[d] to Dst[d], named DstName[d], in each of the
+   Count directions at once, counting bytes with all values so that
+   telnet escaping is exercised, and check they arrive in order.
+   Returns the time it took in ns, 0 if data was lost or corrupted. */
+static unsigned long long
+ReverseTransfer(const int *Src, const int *Dst, const char *const *DstName, int Count,
+                unsigned long Bytes)
+{
+    unsigned char Buf[4096];
+    unsigned long Sent[2] = { 0, 0 }, Got[2] = { 0, 0 };
+    unsigned long long Start = Now(), Progress = Start;
+    struct pollfd P[4];
+    ssize_t Len, i;
+    int d;
+
+    while (Got[0] < Bytes || (Count > 1 && Got[1] < Bytes)) {
+        for (d = 0; d < Count; d++) {
+            P[2 * d].fd = Src[d];
+            P[2 * d].events = Sent[d] < Bytes ? POLLOUT : 0;
+            P[2 * d + 1].fd = Dst[d];
+            P[2 * d + 1].events = POLLIN;
+        }
+        if (poll(P, 2 * Count, 100) < 0)
+            return 0;
+        if (Now() - Progress > 5000000000ULL) {
+            fprintf(stderr, "Stalled after %lu and %lu bytes\n", Got[0], Got[1]);
+            return 0;
+        }
+        for (d = 0; d < Count; d++) {
+            if (P[2 * d].revents & POLLOUT) {
+                Len = MIN(sizeof(Buf), Bytes - Sent[d]);
+                for (i = 0; i < Len; i++)
+                    Buf[i] = (unsigned char) (Sent[d] + i);
+                if ((Len = write(Src[d], Buf, Len)) > 0)
+                    Sent[d] += Len;
+            }
+            if ((P[2 * d + 1].revents & POLLIN) && (Len = read(Dst[d], Buf, sizeof(Buf))) > 0) {
+                for (i = 0; i < Len; i++) {
+                    if (Buf[i] != (unsigned char) (Got[d] + i)) {
+                        fprintf(stderr, "Wrong byte at %s after %lu bytes\n", DstName[d],
+                                Got[d] + i);
+                        return 0;
+                    }
+                }
+                Got[d] += Len;
+                Progress = Now();
+            }
+        }
+    }
+    return MAX(Now() - Start, 1);
+}
+
+/* Send KBytes KiB from the pty of a sercd in reverse mode to the far
+   end of the device of the sercd it is the client of, then the other
+   way, then both ways at once, and print the throughput. The same run
+   over the links alone gives what the two sercds and the network
+   between them cost. */
+static int
+BenchReverse(const char *Pty, const char *Far, long KBytes)
+{
+    const char *Names[2], *DstName[2];
+    int Fd[2], Src[2], Dst[2];
+    unsigned long long Time;
+    unsigned long Bytes = KBytes * 1024UL;
+    int d;
+
+    if (KBytes < 1 || KBytes > ReverseBenchMaxKBytes) {
+        fprintf(stderr, "1 to %d KiB\n", ReverseBenchMaxKBytes);
+        return 1;
+    }
+    if ((Fd[0] = OpenFarEnd(Pty)) < 0 || (Fd[1] = OpenFarEnd(Far)) < 0)
+        return 1;
+    fcntl(Fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(Fd[1], F_SETFL, O_NONBLOCK);
+    Names[0] = Pty;
+    Names[1] = Far;
+
+    for (d = 0; d < 3; d++) {
+        /* One way, the other way, then both */
+        Src[0] = Dst[1] = Fd[d == 1];
+        Dst[0] = Src[1] = Fd[d != 1];
+        DstName[0] = Names[d != 1];
+        DstName[1] = Names[d == 1];
+        if ((Time = ReverseTransfer(Src, Dst, DstName, d == 2 ? 2 : 1, Bytes)) == 0)
+            break;
+        printf("reverse: %s %s, %ld KiB in %llu ms, %.1f KiB/s%s\n", Names[d == 1],
+               d == 2 ? "both ways" : d == 1 ? "to the pty" : "to the far end", KBytes,
+               Time / 1000000, KBytes * 1e9 / (double) Time, d == 2 ? " each" : "");
+    }
+    close(Fd[0]);
+    close(Fd[1]);
+    return d != 3;
+}
+
+/* Send Cmd to the control socket at Path and read the reply into
+   Reply. Returns 0 on success. */
+static int
+ControlRequest(const char *Path, const char *Cmd, char *Reply, size_t Len)
+{
+    struct sockaddr_un Addr;
+    size_t Got = 0;
+    ssize_t n;
+    int Sock;
+
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    strncpy(Addr.sun_path, Path, sizeof(Addr.sun_path) - 1);
+    if ((Sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(Sock, (struct sockaddr *) &Addr, sizeof(Addr)) < 0 ||
+        write(Sock, Cmd, strlen(Cmd)) != (ssize_t) strlen(Cmd)) {
+        perror(Path);
+        if (Sock >= 0)
+            close(Sock);
+        return -1;
+    }
+    while (Got < Len - 1 && (n = read(Sock, Reply + Got, Len - 1 - Got)) > 0)
+        Got += n;
+    Reply[Got] = '\0';
+    close(Sock);
+    return Got > 0 ? 0 : -1;
+}
+
+/* Read the session buffer statistics of sercd. Returns 0 on success. */
+static int
+ReadBufferStats(const char *Path, unsigned int *InUse, unsigned long *Allocs)
+{
+    char Reply[2048];
+    const char *p, *q;
+
+    if (ControlRequest(Path, "stats\n", Reply, sizeof(Reply)) != 0 ||
+        (p = strstr(Reply, "\nbuffers ")) == NULL ||
+        (q = strstr(Reply, "\nbuffer_allocs ")) == NULL ||
+        sscanf(p, "\nbuffers %u/", InUse) != 1 || sscanf(q, "\nbuffer_allocs %lu", Allocs) != 1) {
+        fprintf(stderr, "No buffer statistics from %s\n", Path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Connect and disconnect Count clients one after the other and record
+   the time from connect() to the first telnet negotiation, which sercd
+   sends once the device is open. The session buffers come from the
+   slab sercd sized at startup: a cold port takes its two blocks on
+   each connection and gives them back when the client goes, a warm
+   port keeps them. */
+static int
+BenchChurn(const char *Host, const char *Port, const char *Control, long Count)
+{
+    static LatencyHistType H;
+    unsigned long long Start, Connect;
+    unsigned long AllocsBefore, AllocsAfter, Lost = 0;
+    unsigned int InUse;
+    long i;
+    int Sock;
+
+    if (Count < 1) {
+        fprintf(stderr, "At least one connection\n");
+        return 1;
+    }
+    if (ReadBufferStats(Control, &InUse, &AllocsBefore) != 0)
+        return 1;
+
+    Start = Now();
+    for (i = 0; i < Count; i++) {
+        Connect = Now();
+        if ((Sock = ConnectSercd(Host, Port)) < 0)
+            return 1;
+        if (WaitForByte(Sock, NULL, TNIAC, 5000) < 0)
+            Lost++;
+        else
+            RecordLatency(&H, (Now() - Connect) / 1000);
+        close(Sock);
+    }
+    Connect = Now() - Start;
+
+    /* Let sercd see the last client go */
+    usleep(200000);
+    if (ReadBufferStats(Control, &InUse, &AllocsAfter) != 0)
+        return 1;
+
+    printf("churn: %llu connections in %llu ms, %lu without a reply\n",
+           (unsigned long long) H.Count, Connect / 1000000, Lost);
+    PrintLatency("churn", &H);
+    printf("churn: %.2f buffer allocations per connection, %u buffers in use afterwards\n",
+           (double) (AllocsAfter - AllocsBefore) / Count, InUse);
+    return H.Count == 0 || Lost != 0;
+}
+
+/* Clients and devices of the pool benchmark */
+#define PoolBenchMaxClients 32
+#define PoolBenchMaxDevices 16
+
+/* How long a client waits for its byte to reach a device */
+#define PoolBenchTimeout 10000
+
+typedef struct
+{
+    int Fd[PoolBenchMaxDevices];
+    unsigned long Served[PoolBenchMaxDevices];
+    unsigned int Devices;
+    /* Client i sends 'A' + i and waits while Waiting[i] */
+    int Waiting[PoolBenchMaxClients];
+    unsigned long long Started[PoolBenchMaxClients];
+    LatencyHistType H;
+    pthread_mutex_t Lock;
+    const char *Host, *Port;
+    unsigned long long End;
+}
+PoolBenchType;
+
+typedef struct
+{
+    PoolBenchType *B;
+    unsigned int Id;
+    unsigned long Sessions, Dropped, TimedOut, Refused;
+}
+PoolClientType;
+
+static volatile int PoolReading;
+
+/* Watch the far ends of the devices for the bytes of the clients */
+static void *
+PoolReader(void *Arg)
+{
+    PoolBenchType *B = Arg;
+    struct pollfd P[PoolBenchMaxDevices];
+    unsigned char Buf[256];
+    unsigned int d, i;
+    ssize_t Got, j;
+
+    for (d = 0; d < B->Devices; d++) {
+        P[d].fd = B->Fd[d];
+        P[d].events = POLLIN;
+    }
+    while (PoolReading) {
+        if (poll(P, B->Devices, 100) <= 0)
+            continue;
+        for (d = 0; d < B->Devices; d++) {
+            if (!(P[d].revents & POLLIN) || (Got = read(P[d].fd, Buf, sizeof(Buf))) <= 0)
+                continue;
+            pthread_mutex_lock(&B->Lock);
+            for (j = 0; j < Got; j++) {
+                i = Buf[j] - 'A';
+                if (i < PoolBenchMaxClients && B->Waiting[i]) {
+                    RecordLatency(&B->H, (Now() - B->Started[i]) / 1000);
+                    B->Waiting[i] = 0;
+                    B->Served[d]++;
+                }
+            }
+            pthread_mutex_unlock(&B->Lock);
+        }
+    }
+    return NULL;
+}
+
+/* Connect, send a byte and hang up once it reached a device, over and
+   over until the end of the benchmark */
+static void *
+PoolClient(void *Arg)
+{
+    PoolClientType *C = Arg;
+    PoolBenchType *B = C->B;
+    unsigned char Buf[256], Id = 'A' + C->Id;
+    struct pollfd P;
+    int Sock, Waiting;
+
+    while (Now() < B->End) {
+        pthread_mutex_lock(&B->Lock);
+        B->Started[C->Id] = Now();
+        B->Waiting[C->Id] = 1;
+        pthread_mutex_unlock(&B->Lock);
+
+        if ((Sock = ConnectSercd(B->Host, B->Port)) < 0) {
+            C->Refused++;
+            usleep(10000);
+            continue;
+        }
+        /* A queued client's byte waits in the socket until sercd
+           serves it */
+        Waiting = write(Sock, &Id, 1) == 1;
+        P.fd = Sock;
+        P.events = POLLIN;
+        while (Waiting) {
+            /* Drain the telnet negotiation, a hangup means sercd
+               dropped the connection */
+            if (poll(&P, 1, 1) > 0 && read(Sock, Buf, sizeof(Buf)) <= 0) {
+                C->Dropped++;
+                break;
+            }
+            pthread_mutex_lock(&B->Lock);
+            Waiting = B->Waiting[C->Id];
+            if (Waiting && Now() - B->Started[C->Id] > PoolBenchTimeout * 1000000ULL) {
+                C->TimedOut++;
+                Waiting = 0;
+            }
+            else if (!Waiting)
+                C->Sessions++;
+            pthread_mutex_unlock(&B->Lock);
+        }
+        pthread_mutex_lock(&B->Lock);
+        B->Waiting[C->Id] = 0;
+        pthread_mutex_unlock(&B->Lock);
+        close(Sock);
+    }
+    return NULL;
+}
+
+/* Let Clients clients connect to a pool sercd over and over for
+   Seconds, each hanging up once its byte reached one of the devices
+   whose far ends are in the comma separated list Far. Prints the rate
+   of sessions served, the time from connect() to the device, which
+   includes the wait in the connection queue, and how the sessions
+   spread over the devices. */
+static int
+BenchPool(const char *Host, const char *Port, const char *Far, long Clients, long Seconds)
+{
+    static PoolBenchType B;
+    static PoolClientType C[PoolBenchMaxClients];
+    pthread_t Reader, Threads[PoolBenchMaxClients];
+    unsigned long Sessions = 0, Dropped = 0, TimedOut = 0, Refused = 0;
+    unsigned long long Start;
+    char *List, *Path;
+    unsigned int d;
+    long i;
+
+    if (Clients < 1 || Clients > PoolBenchMaxClients || Seconds < 1) {
+        fprintf(stderr, "1 to %d clients for at least one second\n", PoolBenchMaxClients);
+        return 1;
+    }
+    memset(&B, 0, sizeof(B));
+    List = strdup(Far);
+    for (Path = strtok(List, ","); Path; Path = strtok(NULL, ",")) {
+        if (B.Devices == PoolBenchMaxDevices) {
+            fprintf(stderr, "At most %d devices\n", PoolBenchMaxDevices);
+            return 1;
+        }
+        if ((B.Fd[B.Devices++] = OpenFarEnd(Path)) < 0)
+            return 1;
+    }
+    free(List);
+    pthread_mutex_init(&B.Lock, NULL);
+    B.Host = Host;
+    B.Port = Port;
+
+    PoolReading = 1;
+    pthread_create(&Reader, NULL, PoolReader, &B);
+    Start = Now();
+    B.End = Start + Seconds * 1000000000ULL;
+    for (i = 0; i < Clients; i++) {
+        memset(&C[i], 0, sizeof(C[i]));
+        C[i].B = &B;
+        C[i].Id = i;
+        pthread_create(&Threads[i], NULL, PoolClient, &C[i]);
+    }
+    for (i = 0; i < Clients; i++) {
+        pthread_join(Threads[i], NULL);
+        Sessions += C[i].Sessions;
+        Dropped += C[i].Dropped;
+        TimedOut += C[i].TimedOut;
+        Refused += C[i].Refused;
+    }
+    PoolReading = 0;
+    pthread_join(Reader, NULL);
+
+    printf("pool: %lu sessions of %ld clients in %llu ms, %.1f per second\n", Sessions,
+           Clients, (Now() - Start) / 1000000,
+           Sessions * 1e9 / (double) MAX(Now() - Start, 1));
+    printf("pool: %lu dropped, %lu timed out, %lu refused\n", Dropped, TimedOut, Refused);
+    PrintLatency("pool time to device", &B.H);
+    for (d = 0; d < B.Devices; d++) {
+        printf("pool: device %u served %lu sessions\n", d, B.Served[d]);
+        close(B.Fd[d]);
+    }
+    return Sessions == 0 || TimedOut != 0;
+}
+
+static void
+Usage(void)
+{
+    fprintf(stderr,
+            "Usage: sercdcheck baudrate <device>\n"
+            "       sercdcheck logring [threads [messages]]\n"
+            "       sercdcheck statspage <file> [seconds]\n"
+            "       sercdcheck latency\n"
+            "       sercdcheck timers [count]\n"
+            "       sercdcheck sched\n"
+            "       sercdcheck jitter <host> <port> <far> [seconds [hogs]]\n"
+            "       sercdcheck roundtrip <host> <port> <far> [count]\n"
+            "       sercdcheck flood <host> <port> <far> [seconds]\n"
+            "       sercdcheck churn <host> <port> <control> [count]\n"
+            "       sercdcheck pool <host> <port> <far>[,<far>...] [clients [seconds]]\n"
+            "       sercdcheck bridge <far> <far> [count]\n"
+            "       sercdcheck modbus <host> <port> <far> [clients [seconds]]\n"
+            "       sercdcheck bus <host> <port> <far> [seconds]\n"
+            "       sercdcheck reverse <pty> <far> [kbytes]\n"
+            "baudrate set rates with and without a speed code on device, a\n"
+            "         pty will do, and read them back\n"
+            "logring  log messages from threads threads at once (default 4),\n"
+            "         messages each (default 100000), and check that each one\n"
+            "         is emitted in order or counted as dropped\n"
+            "statspage update a stats page at file from a thread for seconds\n"
+            "         (default 2) while reading it as sercdstat does, and check\n"
+            "         that no copy mixes two updates\n"
+            "latency  record known times in a dwell time histogram and check\n"
+            "         its resolution and percentiles\n"
+            "timers   arm count timers (default 10000) on the timer wheel, run\n"
+            "         it as the main loop does, check that each one fires on\n"
+            "         time and print the cost of each operation\n"
+            "sched    run the I/O scheduler over simulated flows and check\n"
+            "         that a flooding direction can't starve the other one\n"
+            "The benchmarks run against the sercd at host:port, whose device\n"
+            "has its other end at far, as with a null modem cable or linked\n"
+            "ptys:\n"
+            "jitter   send a byte from far every ms for seconds (default 10)\n"
+            "         while hogs threads spin (default one per CPU), and print\n"
+            "         the p99.9 and max time to the client; compare sercd with\n"
+            "         and without real-time mode\n"
+            "roundtrip send count bytes (default 10000) one at a time from the\n"
+            "         client, echo them at far and print the round trip times;\n"
+            "         compare sercd with and without busy polling\n"
+            "flood    send a byte each way every 10 ms for seconds (default 5)\n"
+            "         alone, then while the other direction floods, and print\n"
+            "         the times; compare sercd with different quanta\n"
+            "churn    connect and disconnect count clients (default 1000) and\n"
+            "         print the time to the first telnet negotiation and the\n"
+            "         buffer allocations read from the control socket\n"
+            "pool     let clients clients (default 4) connect over and over for\n"
+            "         seconds (default 10) to sercd serving a pool of devices\n"
+            "         with their other ends at the far list, and print the\n"
+            "         sessions served per second, the time from connect to\n"
+            "         the device and the sessions of each device\n"
+            "bridge   send count bytes (default 10000) one at a time from\n"
+            "         the far end of each device sercd bridges in bridge mode\n"
+            "         and print the times to the other one; compare with the\n"
+            "         same run over the links alone\n"
+            "modbus   let clients Modbus TCP clients (default 8) poll the\n"
+            "         same registers for seconds (default 10) through sercd in\n"
+            "         Modbus gateway mode, with a simulated RTU slave at far,\n"
+            "         and print the polls per second and their times; compare\n"
+            "         sercd with and without the response cache\n"
+            "bus      subscribe to sercd in bus master mode for seconds\n"
+            "         (default 12), with simulated RTU slaves answering the\n"
+            "         register reads of its poll table at far, and print the\n"
+            "         results per second, the response times and the bus\n"
+            "         utilization and cycle time sercd reported\n"
+            "reverse  send kbytes KiB (default 4096) from the pty of a sercd\n"
+            "         in reverse mode, which is the client of the sercd whose\n"
+            "         device has its other end at far, to far, then back, then\n"
+            "         both ways at once, and print the throughput; compare\n"
+            "         with the same run over the links alone\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "baudrate") == 0)
+        return CheckBaudRate(argv[2]);
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "logring") == 0)
+        return CheckLogRing(argc > 2 ? strtol(argv[2], NULL, 10) : 4,
+                            argc > 3 ? strtol(argv[3], NULL, 10) : 100000);
+    if (argc == 2 && strcmp(argv[1], "latency") == 0)
+        return CheckLatency();
+    if (argc == 2 && strcmp(argv[1], "sched") == 0)
+        return CheckSched();
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "timers") == 0)
+        return CheckTimers(argc > 2 ? strtol(argv[2], NULL, 10) : 10000);
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "statspage") == 0)
+        return CheckStatsPage(argv[2], argc > 3 ? strtol(argv[3], NULL, 10) : 2);
+    if (argc >= 5 && argc <= 7 && strcmp(argv[1], "jitter") == 0)
+        return BenchJitter(argv[2], argv[3], argv[4], argc > 5 ? strtol(argv[5], NULL, 10) : 10,
+                           argc > 6 ? strtol(argv[6], NULL, 10) :
+                           sysconf(_SC_NPROCESSORS_ONLN));
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "roundtrip") == 0)
+        return BenchRoundTrip(argv[2], argv[3], argv[4],
+                              argc > 5 ? strtol(argv[5], NULL, 10) : 10000);
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "bridge") == 0)
+        return BenchBridge(argv[2], argv[3], argc > 4 ? strtol(argv[4], NULL, 10) : 10000);
+    if (argc >= 5 && argc <= 7 && strcmp(argv[1], "modbus") == 0)
+        return BenchModbus(argv[2], argv[3], argv[4], argc > 5 ? strtol(argv[5], NULL, 10) : 8,
+                           argc > 6 ? strtol(argv[6], NULL, 10) : 10);
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "bus") == 0)
+        return BenchBus(argv[2], argv[3], argv[4], argc > 5 ? strtol(argv[5], NULL, 10) : 12);
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "reverse") == 0)
+        return BenchReverse(argv[2], argv[3], argc > 4 ? strtol(argv[4], NULL, 10) : 4096);
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "flood") == 0)
+        return BenchFlood(argv[2], argv[3], argv[4], argc > 5 ? strtol(argv[5], NULL, 10) : 5);
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "churn") == 0)
+        return BenchChurn(argv[2], argv[3], argv[4],
+                          argc > 5 ? strtol(argv[5], NULL, 10) : 1000);
+    if (argc >= 5 && argc <= 7 && strcmp(argv[1], "pool") == 0)
+        return BenchPool(argv[2], argv[3], argv[4], argc > 5 ? strtol(argv[5], NULL, 10) : 4,
+                         argc > 6 ? strtol(argv[6], NULL, 10) : 10);
+
+    Usage();
+    return 1;
+}
@@ -0,0 +1,300 @@
+/*
+ * sercd latency probe client
+ * see file COPYING for license details
+ *
+ * Connects to a sercd, sends latency probes and prints how the round
+ * trip splits between the network and sercd's device queue. With -s,
+ * device data batches are stamped too, and their age from the device
+ * read to their receipt here is printed.
+ */
+
+#include <stdio.h>              /* printf */
+#include <stdlib.h>             /* strtol */
+#include <string.h>             /* memcpy */
+#include <unistd.h>             /* getopt */
+#include <time.h>               /* clock_gettime */
+#include <netdb.h>              /* getaddrinfo */
+#include <sys/select.h>         /* select */
+#include <sys/socket.h>         /* connect */
+
+#define TNIAC ((unsigned char) 255)
+#define TNSB ((unsigned char) 250)
+#define TNSE ((unsigned char) 240)
+#define TNWILL ((unsigned char) 251)
+#define TNWONT ((unsigned char) 252)
+#define TNDO ((unsigned char) 253)
+#define TNDONT ((unsigned char) 254)
+
+/* Must match sercd.h */
+#define TNSERCD_OPTION ((unsigned char) 160)
+#define TNSCS_PROBE ((unsigned char) 5)
+#define TNSCS_DEVICE_STAMPS ((unsigned char) 6)
+#define TNSSC_PROBE ((unsigned char) 107)
+#define TNSSC_DEVICE_STAMP ((unsigned char) 108)
+
+/* Telnet input parser states */
+typedef enum
+{
+    TelnetData,
+    TelnetIAC,
+    TelnetOption,
+    TelnetSub,
+    TelnetSubIAC
+}
+TelnetState;
+
+static int Sock;
+static TelnetState State = TelnetData;
+static unsigned char Sub[256];
+static size_t SubLen;
+
+/* sercd clock minus our clock in us, from the last probe */
+static long long ClockOffset;
+static int HaveOffset = 0;
+
+static unsigned int Replies = 0;
+
+static unsigned long long
+Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static unsigned long long
+GetNetLong(const unsigned char *p)
+{
+    unsigned long long Value = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        Value = (Value << 8) | p[i];
+    return Value;
+}
+
+/* Send a sercd suboption, IAC escaped */
+static int
+SendSercdCommand(unsigned char Command, const unsigned char *Data, size_t Len)
+{
+    unsigned char Buf[4 + 2 * 16 + 2];
+    size_t i, n = 0;
+
+    Buf[n++] = TNIAC;
+    Buf[n++] = TNSB;
+    Buf[n++] = TNSERCD_OPTION;
+    Buf[n++] = Command;
+    for (i = 0; i < Len && i < 16; i++) {
+        if (Data[i] == TNIAC)
+            Buf[n++] = TNIAC;
+        Buf[n++] = Data[i];
+    }
+    Buf[n++] = TNIAC;
+    Buf[n++] = TNSE;
+    return write(Sock, Buf, n) == (ssize_t) n ? 0 : -1;
+}
+
+static int
+SendProbe(void)
+{
+    unsigned char Stamp[8];
+    unsigned long long T = Now();
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        Stamp[i] = (unsigned char) T;
+        T >>= 8;
+    }
+    return SendSercdCommand(TNSCS_PROBE, Stamp, sizeof(Stamp));
+}
+
+/* Handle a complete suboption received at time T */
+static void
+HandleSub(unsigned long long T)
+{
+    if (SubLen < 2 || Sub[0] != TNSERCD_OPTION)
+        return;
+
+    if (Sub[1] == TNSSC_PROBE && SubLen == 2 + 28) {
+        unsigned long long Sent = GetNetLong(&Sub[2]);
+        unsigned long long Recv = GetNetLong(&Sub[10]);
+        unsigned long long Written = GetNetLong(&Sub[18]);
+        unsigned int ToDev = (Sub[26] << 8) | Sub[27];
+        unsigned int ToNet = (Sub[28] << 8) | Sub[29];
+        long long Rtt = (long long) (T - Sent);
+        long long Queue = (long long) (Written - Recv);
+        long long Net = Rtt - Queue;
+
+        /* The request and the reply each took about half the network
+           time */
+        ClockOffset = (long long) Recv - (long long) Sent - Net / 2;
+        HaveOffset = 1;
+        printf("rtt %.3f ms  network %.3f ms  device queue %.3f ms  "
+               "queued to device %u  to network %u\n",
+               Rtt / 1000.0, Net / 1000.0, Queue / 1000.0, ToDev, ToNet);
+        Replies++;
+    }
+    else if (Sub[1] == TNSSC_DEVICE_STAMP && SubLen == 2 + 10 && HaveOffset) {
+        unsigned long long Read = GetNetLong(&Sub[2]);
+        unsigned int Len = (Sub[10] << 8) | Sub[11];
+        long long Age = (long long) T - ((long long) Read - ClockOffset);
+
+        printf("device batch %u bytes  read to receipt %.3f ms\n", Len, Age / 1000.0);
+    }
+    fflush(stdout);
+}
+
+/* Run the telnet input through the parser, device data is dropped */
+static void
+Parse(const unsigned char *Buf, size_t Len, unsigned long long T)
+{
+    size_t i;
+
+    for (i = 0; i < Len; i++) {
+        unsigned char C = Buf[i];
+
+        switch (State) {
+        case TelnetData:
+            if (C == TNIAC)
+                State = TelnetIAC;
+            break;
+        case TelnetIAC:
+            if (C == TNSB) {
+                State = TelnetSub;
+                SubLen = 0;
+            }
+            else if (C == TNWILL || C == TNWONT || C == TNDO || C == TNDONT)
+                State = TelnetOption;
+            else
+                State = TelnetData;
+            break;
+        case TelnetOption:
+            State = TelnetData;
+            break;
+        case TelnetSub:
+            if (C == TNIAC)
+                State = TelnetSubIAC;
+            else if (SubLen < sizeof(Sub))
+                Sub[SubLen++] = C;
+            break;
+        case TelnetSubIAC:
+            if (C == TNSE) {
+                HandleSub(T);
+                State = TelnetData;
+            }
+            else {
+                if (SubLen < sizeof(Sub))
+                    Sub[SubLen++] = C;
+                State = TelnetSub;
+            }
+            break;
+        }
+    }
+}
+
+static void
+Usage(void)
+{
+    fprintf(stderr,
+            "Usage: sercdprobe [-s] [-i ms] [-n count] <host> <port>\n"
+            "-s       stamp device data batches and print their age\n"
+            "-i ms    probe interval, default 1000\n"
+            "-n count stop after count probes, default 10, 0 for no limit\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    static const unsigned char Will[] = { TNIAC, TNWILL, TNSERCD_OPTION };
+    struct addrinfo Hints, *Addr;
+    unsigned char Buf[4096];
+    unsigned char On = 1;
+    long Interval = 1000;
+    long Count = 10;
+    int Stamps = 0;
+    long Sent = 0;
+    unsigned long long NextProbe;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "si:n:")) != -1) {
+        switch (opt) {
+        case 's':
+            Stamps = 1;
+            break;
+        case 'i':
+            Interval = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            Count = strtol(optarg, NULL, 10);
+            break;
+        default:
+            Usage();
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || Interval <= 0 || Count < 0) {
+        Usage();
+        return 1;
+    }
+
+    memset(&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind], argv[optind + 1], &Hints, &Addr) != 0) {
+        fprintf(stderr, "Unknown host %s\n", argv[optind]);
+        return 1;
+    }
+    Sock = socket(Addr->ai_family, Addr->ai_socktype, Addr->ai_protocol);
+    if (Sock < 0 || connect(Sock, Addr->ai_addr, Addr->ai_addrlen) < 0) {
+        perror("connect");
+        return 1;
+    }
+    freeaddrinfo(Addr);
+
+    if (write(Sock, Will, sizeof(Will)) != sizeof(Will) ||
+        (Stamps && SendSercdCommand(TNSCS_DEVICE_STAMPS, &On, 1) < 0)) {
+        perror("write");
+        return 1;
+    }
+
+    NextProbe = Now();
+    while (Count == 0 || Replies < (unsigned long) Count) {
+        unsigned long long T = Now();
+        struct timeval Timeout;
+        fd_set In;
+        ssize_t n;
+
+        if (T >= NextProbe) {
+            if (Count == 0 || Sent < Count) {
+                if (SendProbe() < 0) {
+                    perror("write");
+                    return 1;
+                }
+                Sent++;
+            }
+            NextProbe = T + Interval * 1000ULL;
+        }
+
+        T = NextProbe > T ? NextProbe - T : 0;
+        Timeout.tv_sec = T / 1000000;
+        Timeout.tv_usec = T % 1000000;
+        FD_ZERO(&In);
+        FD_SET(Sock, &In);
+        if (select(Sock + 1, &In, NULL, NULL, &Timeout) < 0) {
+            perror("select");
+            return 1;
+        }
+        if (!FD_ISSET(Sock, &In))
+            continue;
+
+        n = read(Sock, Buf, sizeof(Buf));
+        if (n <= 0) {
+            fprintf(stderr, "Connection closed\n");
+            return 1;
+        }
+        Parse(Buf, n, Now());
+    }
+    close(Sock);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * sercd stats page reader
+ * see file COPYING for license details
+ *
+ * Maps the stats page of a sercd started with -O and prints its
+ * counters and latency percentiles, once or at an interval. Reading
+ * the page takes no syscall into sercd and doesn't slow it down.
+ */
+
+#include <stdio.h>              /* printf */
+#include <stdlib.h>             /* strtol */
+#include <string.h>             /* memcpy */
+#include <unistd.h>             /* getopt */
+#include <fcntl.h>              /* open */
+#include <signal.h>             /* kill */
+#include <sched.h>              /* sched_yield */
+#include <time.h>               /* clock_gettime */
+#include <sys/mman.h>           /* mmap */
+#include <sys/stat.h>           /* fstat */
+
+#define SERCD_STATS_READER
+#include "statspage.h"
+
+/* Copy attempts before giving up on a page which is always changing */
+#define ReadTries 1000
+
+static unsigned long long
+Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Copy the page while sercd isn't updating it. Returns 0 on success. */
+static int
+ReadPage(const SercdStatsPageType * Page, SercdStatsPageType * Copy)
+{
+    uint32_t Seq;
+    int i;
+
+    for (i = 0; i < ReadTries; i++) {
+        Seq = Page->Seq;
+        __sync_synchronize();
+        if (Seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(Copy, (const void *) Page, sizeof(*Copy));
+        __sync_synchronize();
+        if (Page->Seq == Seq)
+            return 0;
+    }
+    return -1;
+}
+
+static void
+PrintCounter(const char *Name, uint64_t Port, uint64_t Session)
+{
+    printf("%-18s %20llu %20llu\n", Name, (unsigned long long) Port,
+           (unsigned long long) Session);
+}
+
+/* Time data waited in sercd, in us */
+static void
+PrintDwell(const char *Name, const LatencyHistType * H)
+{
+    printf("%-18s %12llu %9llu %9llu %9llu %9llu %9llu\n", Name, (unsigned long long) H->Count,
+           (unsigned long long) (H->Count ? H->Sum / H->Count : 0),
+           (unsigned long long) LatencyPercentile(H, 0.5),
+           (unsigned long long) LatencyPercentile(H, 0.99),
+           (unsigned long long) LatencyPercentile(H, 0.999), (unsigned long long) H->Max);
+}
+
+static void
+PrintPage(const SercdStatsPageType * P)
+{
+    unsigned long long T = Now();
+
+    printf("device %.*s  pid %u%s  updated %.3f s ago", (int) sizeof(P->Device), P->Device,
+           (unsigned int) P->Pid, kill(P->Pid, 0) == 0 ? "" : " (not running)",
+           T > P->UpdateTime ? (T - P->UpdateTime) / 1e6 : 0.0);
+    if (P->SessionStart)
+        printf("  client for %.3f s", T > P->SessionStart ? (T - P->SessionStart) / 1e6 : 0.0);
+    printf("\n%-18s %20s %20s\n", "", "port", "session");
+    PrintCounter("device_in", P->Port.DevIn, P->Session.DevIn);
+    PrintCounter("device_out", P->Port.DevOut, P->Session.DevOut);
+    PrintCounter("network_in", P->Port.NetIn, P->Session.NetIn);
+    PrintCounter("network_out", P->Port.NetOut, P->Session.NetOut);
+    PrintCounter("escapes_added", P->Port.EscapesAdded, P->Session.EscapesAdded);
+    PrintCounter("iac_commands", P->Port.IacCommands, P->Session.IacCommands);
+    PrintCounter("wakeups", P->Port.Wakeups, P->Session.Wakeups);
+    PrintCounter("short_writes", P->Port.ShortWrites, P->Session.ShortWrites);
+    PrintCounter("overruns", P->Port.Overruns, P->Session.Overruns);
+    PrintCounter("drops", P->Port.Drops, P->Session.Drops);
+    PrintCounter("connects", P->Port.Connects, P->Session.Connects);
+    PrintCounter("to_device_max", P->Port.ToDevHighWater, P->Session.ToDevHighWater);
+    PrintCounter("to_network_max", P->Port.ToNetHighWater, P->Session.ToNetHighWater);
+    printf("\n%-18s %12s %9s %9s %9s %9s %9s\n", "dwell_us", "segments", "mean", "p50", "p99",
+           "p99.9", "max");
+    PrintDwell("to_network", &P->ToNetDwell);
+    PrintDwell("to_device", &P->ToDevDwell);
+    fflush(stdout);
+}
+
+static void
+Usage(void)
+{
+    fprintf(stderr,
+            "Usage: sercdstat [-i ms] [-n count] <file>\n"
+            "-i ms    print the counters every ms, default is to print them once\n"
+            "-n count stop after count prints, 0 for no limit\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const SercdStatsPageType *Page;
+    SercdStatsPageType Copy;
+    struct stat St;
+    long Interval = 0;
+    long Count = 0;
+    long Printed = 0;
+    int Fd, opt;
+
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+        case 'i':
+            Interval = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            Count = strtol(optarg, NULL, 10);
+            break;
+        default:
+            Usage();
+            return 1;
+        }
+    }
+    if (argc - optind != 1 || Interval < 0 || Count < 0) {
+        Usage();
+        return 1;
+    }
+    if (Interval == 0)
+        Count = 1;
+
+    if ((Fd = open(argv[optind], O_RDONLY)) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    /* A shorter file would fault when read */
+    if (fstat(Fd, &St) != 0 || St.st_size < (off_t) sizeof(*Page)) {
+        fprintf(stderr, "%s is not a sercd stats page\n", argv[optind]);
+        return 1;
+    }
+    Page = mmap(NULL, sizeof(*Page), PROT_READ, MAP_SHARED, Fd, 0);
+    close(Fd);
+    if (Page == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (Page->Magic != SercdStatsMagic || Page->Version != SercdStatsVersion) {
+        fprintf(stderr, "%s is not a sercd stats page of this version\n", argv[optind]);
+        return 1;
+    }
+
+    while (Count == 0 || Printed < Count) {
+        if (Printed > 0)
+            usleep(Interval * 1000);
+        if (ReadPage(Page, &Copy) != 0) {
+            fprintf(stderr, "The page keeps changing\n");
+            return 1;
+        }
+        if (Printed > 0)
+            printf("\n");
+        PrintPage(&Copy);
+        Printed++;
+    }
+    return 0;
+}
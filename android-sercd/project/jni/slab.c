@@ -0,0 +1,61 @@
+/*
+ * sercd slab allocator
+ * see file COPYING for license details
+ */
+
+#include <stdlib.h>             /* malloc */
+#include <string.h>             /* memset */
+#include <assert.h>             /* assert */
+#include "sercd.h"
+#include "slab.h"
+
+int
+InitSlab(SlabType * S, size_t Size, unsigned int Count)
+{
+    unsigned int i;
+
+    memset(S, 0, sizeof(*S));
+    S->BlockSize = (MAX(Size, sizeof(void *)) + SlabAlign - 1) & ~((size_t) SlabAlign - 1);
+
+    /* Old C libraries have no aligned allocation, so align by hand */
+    S->Memory = malloc(S->BlockSize * Count + SlabAlign - 1);
+    if (S->Memory == NULL)
+        return Error;
+    S->Blocks = (unsigned char *)
+        (((unsigned long) S->Memory + SlabAlign - 1) & ~((unsigned long) SlabAlign - 1));
+    S->Count = Count;
+
+    /* Link the blocks in address order */
+    for (i = Count; i > 0; i--) {
+        void *Block = S->Blocks + (i - 1) * S->BlockSize;
+        *(void **) Block = S->FreeList;
+        S->FreeList = Block;
+    }
+    return NoError;
+}
+
+void *
+SlabAlloc(SlabType * S)
+{
+    void *Block = S->FreeList;
+
+    if (Block == NULL) {
+        S->Misses++;
+        return NULL;
+    }
+    S->FreeList = *(void **) Block;
+    S->InUse++;
+    S->Allocs++;
+    return Block;
+}
+
+void
+SlabFree(SlabType * S, void *Block)
+{
+    assert((unsigned char *) Block >= S->Blocks &&
+           (unsigned char *) Block < S->Blocks + S->Count * S->BlockSize);
+
+    *(void **) Block = S->FreeList;
+    S->FreeList = Block;
+    S->InUse--;
+}
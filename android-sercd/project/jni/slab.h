@@ -0,0 +1,43 @@
+/*
+ * sercd slab allocator
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_SLAB_H
+#define SERCD_SLAB_H
+
+#include "sercd.h"
+#include <sys/types.h>
+
+/* Blocks are aligned and padded to this, so that no two blocks share
+   a cache line */
+#define SlabAlign 64
+
+/* Fixed-size blocks carved out of one allocation made at startup.
+   Free blocks are linked through their first bytes. Not thread safe:
+   used from the event loop only. */
+typedef struct
+{
+    unsigned char *Memory;
+    unsigned char *Blocks;
+    size_t BlockSize;
+    unsigned int Count;
+    void *FreeList;
+    unsigned int InUse;
+    /* Successful and failed allocations, for the statistics */
+    unsigned long Allocs;
+    unsigned long Misses;
+}
+SlabType;
+
+/* Allocate Count blocks of at least Size bytes. Returns NoError on
+   success. */
+int InitSlab(SlabType * S, size_t Size, unsigned int Count);
+
+/* Take a block from the slab. Returns NULL if all blocks are in use. */
+void *SlabAlloc(SlabType * S);
+
+/* Give a block back to the slab */
+void SlabFree(SlabType * S, void *Block);
+
+#endif /* SERCD_SLAB_H */
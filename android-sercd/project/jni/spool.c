@@ -0,0 +1,159 @@
+/*
+ * sercd store-and-forward spool
+ * see file COPYING for license details
+ */
+
+#include <stdlib.h>             /* malloc */
+#include <string.h>             /* memcpy */
+#include <unistd.h>             /* pread */
+#include <fcntl.h>              /* open */
+#include "sercd.h"
+#include "spool.h"
+
+int
+InitSpool(SpoolType * S, size_t Size, const char *FileName, off_t FileSize, SpoolPolicy Policy)
+{
+    memset(S, 0, sizeof(*S));
+    S->FileFd = -1;
+    S->Policy = Policy;
+    if (Size == 0)
+        return NoError;
+
+    S->Buffer = malloc(Size);
+    if (S->Buffer == NULL)
+        return Error;
+    S->Size = Size;
+
+    if (FileName && FileSize > 0) {
+        S->FileFd = open(FileName, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (S->FileFd == OpenError)
+            return Error;
+        S->FileSize = FileSize;
+    }
+    return NoError;
+}
+
+/* Room for new data. Once data spilled to the file, new data must go
+   there too, to keep it behind the older data. */
+static size_t
+SpoolRoomLeft(SpoolType * S)
+{
+    size_t FileRoom = S->FileFd != -1 ? S->FileSize - S->FileLength : 0;
+
+    if (S->FileLength > 0)
+        return FileRoom;
+    return S->Size - S->Length + FileRoom;
+}
+
+/* Drop all file data after an I/O error */
+static void
+SpoolFileError(SpoolType * S, const char *Msg)
+{
+    LogMsg(LOG_ERR, Msg);
+    S->Dropped += S->FileLength;
+    S->FileRdPos = 0;
+    S->FileLength = 0;
+}
+
+/* Append data to the file ring */
+static void
+SpoolFileWrite(SpoolType * S, const unsigned char *Data, size_t Len)
+{
+    off_t Pos = (S->FileRdPos + S->FileLength) % S->FileSize;
+    size_t Chunk = MIN(Len, (size_t) (S->FileSize - Pos));
+
+    if (pwrite(S->FileFd, Data, Chunk, Pos) != (ssize_t) Chunk ||
+        pwrite(S->FileFd, Data + Chunk, Len - Chunk, 0) != (ssize_t) (Len - Chunk)) {
+        SpoolFileError(S, "Error writing to spool file");
+        S->Dropped += Len;
+        return;
+    }
+    S->FileLength += Len;
+}
+
+/* Move the oldest file data to the memory queue */
+static void
+SpoolRefill(SpoolType * S)
+{
+    while (S->FileLength > 0 && S->Length < S->Size) {
+        size_t WrPos = (S->RdPos + S->Length) % S->Size;
+        size_t Len = MIN(S->Size - S->Length, S->Size - WrPos);
+        size_t FileChunk = S->FileSize - S->FileRdPos;
+
+        Len = MIN(Len, (size_t) S->FileLength);
+        Len = MIN(Len, FileChunk);
+        if (pread(S->FileFd, S->Buffer + WrPos, Len, S->FileRdPos) != (ssize_t) Len) {
+            SpoolFileError(S, "Error reading from spool file");
+            return;
+        }
+        S->Length += Len;
+        S->FileRdPos = (S->FileRdPos + Len) % S->FileSize;
+        S->FileLength -= Len;
+    }
+}
+
+/* Store device output */
+void
+AddToSpool(SpoolType * S, const unsigned char *Data, size_t Len)
+{
+    size_t Room, Need, Drop;
+
+    while (Len > (Room = SpoolRoomLeft(S))) {
+        Need = Len - Room;
+        if (S->Policy == SpoolDropNewest) {
+            Drop = Need;
+            Len -= Drop;
+        }
+        else if (S->Length > 0) {
+            /* Memory holds the oldest data */
+            Drop = MIN(Need, S->Length);
+            S->RdPos = (S->RdPos + Drop) % S->Size;
+            S->Length -= Drop;
+            SpoolRefill(S);
+        }
+        else if (S->FileLength > 0) {
+            Drop = MIN(Need, (size_t) S->FileLength);
+            S->FileRdPos = (S->FileRdPos + Drop) % S->FileSize;
+            S->FileLength -= Drop;
+        }
+        else {
+            /* Larger than the whole spool, keep the tail */
+            Drop = Need;
+            Data += Drop;
+            Len -= Drop;
+        }
+        S->Dropped += Drop;
+    }
+
+    if (S->FileLength == 0) {
+        size_t WrPos = (S->RdPos + S->Length) % S->Size;
+        size_t MemLen = MIN(Len, S->Size - S->Length);
+        size_t Chunk = MIN(MemLen, S->Size - WrPos);
+
+        memcpy(S->Buffer + WrPos, Data, Chunk);
+        memcpy(S->Buffer, Data + Chunk, MemLen - Chunk);
+        S->Length += MemLen;
+        Data += MemLen;
+        Len -= MemLen;
+    }
+
+    if (Len > 0)
+        SpoolFileWrite(S, Data, Len);
+}
+
+size_t
+GetSpoolString(SpoolType * S, unsigned char **Data)
+{
+    if (S->Length == 0)
+        SpoolRefill(S);
+
+    *Data = S->Buffer + S->RdPos;
+    return MIN(S->Length, S->Size - S->RdPos);
+}
+
+void
+SpoolPopBytes(SpoolType * S, size_t Len)
+{
+    S->RdPos = (S->RdPos + Len) % S->Size;
+    S->Length -= Len;
+}
@@ -0,0 +1,64 @@
+/*
+ * sercd store-and-forward spool
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_SPOOL_H
+#define SERCD_SPOOL_H
+
+#include "sercd.h"
+#include <sys/types.h>
+
+/* What to drop when the spool is full */
+typedef enum
+{ SpoolDropOldest, SpoolDropNewest }
+SpoolPolicy;
+
+/* Device output waiting for a client. The oldest data is kept in
+   memory; once the memory queue is full, newer data spills to a file
+   used as a fixed-size ring, so memory data is always older than file
+   data. */
+typedef struct
+{
+    /* Memory queue */
+    unsigned char *Buffer;
+    size_t Size;
+    size_t RdPos;
+    size_t Length;
+
+    /* Spill file, FileFd is -1 without one */
+    int FileFd;
+    off_t FileSize;
+    off_t FileRdPos;
+    off_t FileLength;
+
+    SpoolPolicy Policy;
+
+    /* Bytes lost because the spool was full, a running total */
+    unsigned long long Dropped;
+}
+SpoolType;
+
+/* Allocate the memory queue and create the spill file. Size 0
+   disables the spool, FileName NULL disables spilling. Returns NoError
+   on success. */
+int InitSpool(SpoolType * S, size_t Size, const char *FileName, off_t FileSize,
+              SpoolPolicy Policy);
+
+/* Check if the spool is enabled */
+#define IsSpoolEnabled(S) ((S)->Size != 0)
+
+/* Check if the spool holds data */
+#define IsSpoolEmpty(S) ((S)->Length == 0 && (S)->FileLength == 0)
+
+/* Store device output */
+void AddToSpool(SpoolType * S, const unsigned char *Data, size_t Len);
+
+/* Get the oldest contiguous block of spooled data, without removing
+   it. Returns the length of the block. */
+size_t GetSpoolString(SpoolType * S, unsigned char **Data);
+
+/* Remove the number of forwarded bytes specified */
+void SpoolPopBytes(SpoolType * S, size_t Len);
+
+#endif /* SERCD_SPOOL_H */
@@ -0,0 +1,63 @@
+/*
+ * sercd shared memory stats page
+ * see file COPYING for license details
+ */
+
+#include <string.h>             /* memset */
+#include <unistd.h>             /* ftruncate */
+#include <fcntl.h>              /* open */
+#include <sys/mman.h>           /* mmap */
+#include "sercd.h"
+#include "statspage.h"
+
+static SercdStatsPageType *Page = NULL;
+
+int
+OpenStatsPage(const char *Path, const char *DeviceName)
+{
+    int Fd;
+    void *Map;
+
+    if ((Fd = open(Path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+        return Error;
+    if (ftruncate(Fd, sizeof(SercdStatsPageType)) != 0) {
+        close(Fd);
+        return Error;
+    }
+    Map = mmap(NULL, sizeof(SercdStatsPageType), PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+    close(Fd);
+    if (Map == MAP_FAILED)
+        return Error;
+
+    Page = Map;
+    memset(Page, 0, sizeof(*Page));
+    Page->Version = SercdStatsVersion;
+    Page->Pid = getpid();
+    strncpy(Page->Device, DeviceName, sizeof(Page->Device) - 1);
+    /* Readers ignore the page until the magic appears */
+    __sync_synchronize();
+    Page->Magic = SercdStatsMagic;
+    return NoError;
+}
+
+void
+UpdateStatsPage(const SercdCountersType * Port, const SercdCountersType * Session,
+                unsigned long long SessionStart, unsigned long long Now,
+                const LatencyHistType * ToNetDwell, const LatencyHistType * ToDevDwell)
+{
+    if (!Page)
+        return;
+
+    Page->Seq++;
+    __sync_synchronize();
+    Page->UpdateTime = Now;
+    Page->SessionStart = SessionStart;
+    Page->Port = *Port;
+    Page->Session = *Session;
+    if (ToNetDwell)
+        Page->ToNetDwell = *ToNetDwell;
+    if (ToDevDwell)
+        Page->ToDevDwell = *ToDevDwell;
+    __sync_synchronize();
+    Page->Seq++;
+}
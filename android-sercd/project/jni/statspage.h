@@ -0,0 +1,81 @@
+/*
+ * sercd shared memory stats page
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_STATSPAGE_H
+#define SERCD_STATSPAGE_H
+
+/* Only fixed size types here, the layout is read by other processes,
+   sercdstat among them */
+#include <stdint.h>
+#include "latency.h"
+
+#define SercdStatsMagic 0x73726364UL
+/* Changed whenever the layout changes */
+#define SercdStatsVersion 2
+
+typedef struct
+{
+    /* Bytes read from and written to the device and the network */
+    uint64_t DevIn;
+    uint64_t DevOut;
+    uint64_t NetIn;
+    uint64_t NetOut;
+    /* Bytes the telnet escaping added to device output */
+    uint64_t EscapesAdded;
+    /* Telnet commands received from clients */
+    uint64_t IacCommands;
+    /* Returns from select */
+    uint64_t Wakeups;
+    /* Device and network writes which took less than offered */
+    uint64_t ShortWrites;
+    /* Device FIFO and driver buffer overruns */
+    uint64_t Overruns;
+    /* Spooled bytes lost because a spool was full */
+    uint64_t Drops;
+    /* Clients served */
+    uint64_t Connects;
+    /* Most bytes queued to the device and to the network */
+    uint64_t ToDevHighWater;
+    uint64_t ToNetHighWater;
+}
+SercdCountersType;
+
+/* The page is written by sercd alone. Seq is odd while it updates the
+   page: readers copy the page and retry if Seq was odd or changed. */
+typedef struct
+{
+    uint32_t Magic;
+    uint32_t Version;
+    volatile uint32_t Seq;
+    uint32_t Pid;
+    char Device[64];
+    /* Monotonic time in us of the last update, and of the connection
+       of the current client, 0 without a client */
+    uint64_t UpdateTime;
+    uint64_t SessionStart;
+    /* Since sercd started, and for the current client */
+    SercdCountersType Port;
+    SercdCountersType Session;
+    /* Time data waited in sercd since it started, from the device read
+       to the network write and from the network read to the device
+       write. Updated about once a second. */
+    LatencyHistType ToNetDwell;
+    LatencyHistType ToDevDwell;
+}
+SercdStatsPageType;
+
+#ifndef SERCD_STATS_READER
+/* Create the page at Path, shared with readers mapping the same file,
+   for device DeviceName. Returns NoError on success. */
+int OpenStatsPage(const char *Path, const char *DeviceName);
+
+/* Copy the counters into the page, if one is open, and the dwell time
+   histograms unless they are NULL */
+void UpdateStatsPage(const SercdCountersType * Port, const SercdCountersType * Session,
+                     unsigned long long SessionStart, unsigned long long Now,
+                     const LatencyHistType * ToNetDwell, const LatencyHistType * ToDevDwell);
+#endif
+
+#endif /* SERCD_STATSPAGE_H */
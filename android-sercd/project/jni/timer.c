@@ -0,0 +1,223 @@
+/*
+ * sercd timer wheel
+ * see file COPYING for license details
+ */
+
+#include <string.h>             /* memset */
+#include "sercd.h"
+#include "timer.h"
+
+/* Slot list heads; lists are circular through the head */
+static TimerType Wheel[TimerLevels][TimerSlots];
+static TimerType Overflow;
+
+/* Bit n of Occupied[l] is set if Wheel[l][n] holds timers */
+static unsigned long long Occupied[TimerLevels];
+
+/* The wheel has run up to this tick */
+static unsigned long long Current;
+
+/* Number of armed timers */
+static unsigned int Pending;
+
+/* Shift of the slot index of a level */
+#define LevelShift(Level) (TimerSlotBits * (Level))
+
+static void
+ListInit(TimerType * Head)
+{
+    Head->Next = Head->Prev = Head;
+}
+
+static void
+ListAdd(TimerType * Head, TimerType * T)
+{
+    T->Prev = Head->Prev;
+    T->Next = Head;
+    Head->Prev->Next = T;
+    Head->Prev = T;
+}
+
+/* Unlink T and clear the occupied bit of its slot if it is empty now */
+static void
+ListDel(TimerType * T)
+{
+    T->Prev->Next = T->Next;
+    T->Next->Prev = T->Prev;
+    if (T->Slot >= 0 && T->Next == T->Prev &&
+        T->Next == &Wheel[T->Slot / TimerSlots][T->Slot % TimerSlots])
+        Occupied[T->Slot / TimerSlots] &= ~(1ULL << (T->Slot % TimerSlots));
+    T->Next = T->Prev = NULL;
+}
+
+/* Put T in the lowest level whose current slot range contains it,
+   expiring no earlier than tick Min */
+static void
+TimerPlace(TimerType * T, unsigned long long Min)
+{
+    unsigned long long Expires = MAX(T->Expires, Min);
+    unsigned int Slot;
+    int Level;
+
+    for (Level = 0; Level < TimerLevels; Level++) {
+        if ((Expires >> LevelShift(Level + 1)) == (Current >> LevelShift(Level + 1))) {
+            Slot = (Expires >> LevelShift(Level)) & (TimerSlots - 1);
+            ListAdd(&Wheel[Level][Slot], T);
+            Occupied[Level] |= 1ULL << Slot;
+            T->Slot = Level * TimerSlots + Slot;
+            return;
+        }
+    }
+    ListAdd(&Overflow, T);
+    T->Slot = -1;
+}
+
+/* Place again all timers of a list */
+static void
+TimerReplace(TimerType * Head)
+{
+    TimerType List;
+
+    if (Head->Next == Head)
+        return;
+
+    /* Move them to a private list first, they may go back to Head */
+    List.Next = Head->Next;
+    List.Prev = Head->Prev;
+    List.Next->Prev = &List;
+    List.Prev->Next = &List;
+    ListInit(Head);
+
+    while (List.Next != &List) {
+        TimerType *T = List.Next;
+        List.Next = T->Next;
+        T->Next->Prev = &List;
+        /* The caller fires the level 0 slot of Current next */
+        TimerPlace(T, Current);
+    }
+}
+
+/* The current time entered a new slot of Level: move its timers down */
+static void
+TimerCascade(int Level)
+{
+    unsigned int Slot;
+
+    if (Level == TimerLevels) {
+        TimerReplace(&Overflow);
+        return;
+    }
+
+    Slot = (Current >> LevelShift(Level)) & (TimerSlots - 1);
+    if (Slot == 0)
+        TimerCascade(Level + 1);
+    Occupied[Level] &= ~(1ULL << Slot);
+    TimerReplace(&Wheel[Level][Slot]);
+}
+
+void
+InitTimer(TimerType * T, unsigned int Event)
+{
+    memset(T, 0, sizeof(*T));
+    T->Event = Event;
+}
+
+void
+InitTimers(unsigned long long Now)
+{
+    int Level, Slot;
+
+    for (Level = 0; Level < TimerLevels; Level++) {
+        for (Slot = 0; Slot < TimerSlots; Slot++)
+            ListInit(&Wheel[Level][Slot]);
+        Occupied[Level] = 0;
+    }
+    ListInit(&Overflow);
+    Current = Now;
+    Pending = 0;
+}
+
+void
+AddTimer(TimerType * T, unsigned long long Expires)
+{
+    CancelTimer(T);
+    T->Expires = Expires;
+    TimerPlace(T, Current + 1);
+    Pending++;
+}
+
+void
+CancelTimer(TimerType * T)
+{
+    if (!IsTimerPending(T))
+        return;
+    ListDel(T);
+    Pending--;
+}
+
+unsigned int
+RunTimers(unsigned long long Now)
+{
+    unsigned int Events = 0;
+    unsigned int Index;
+    TimerType *Head;
+
+    while (Current < Now) {
+        if (Pending == 0) {
+            Current = Now;
+            break;
+        }
+
+        /* Skip to the end of the level 0 range if nothing is due there */
+        Index = Current & (TimerSlots - 1);
+        if (Index < TimerSlots - 1 && (Occupied[0] >> (Index + 1)) == 0) {
+            Current = MIN(Current | (TimerSlots - 1), Now);
+            continue;
+        }
+
+        Current++;
+        Index = Current & (TimerSlots - 1);
+        if (Index == 0)
+            TimerCascade(1);
+
+        Head = &Wheel[0][Index];
+        while (Head->Next != Head) {
+            TimerType *T = Head->Next;
+            Events |= T->Event;
+            ListDel(T);
+            Pending--;
+        }
+    }
+    return Events;
+}
+
+long
+NextTimerTimeout(unsigned long long Now, long Max)
+{
+    unsigned long long Deadline, Bits;
+    unsigned int Index;
+    int Level;
+
+    if (Pending == 0)
+        return Max;
+
+    /* The first occupied slot ahead, in the lowest level having one,
+       holds the nearest timers; for upper levels its start is a lower
+       bound, reached in time to move them down */
+    Deadline = ((Current >> LevelShift(TimerLevels)) + 1) << LevelShift(TimerLevels);
+    for (Level = 0; Level < TimerLevels; Level++) {
+        Index = (Current >> LevelShift(Level)) & (TimerSlots - 1);
+        Bits = Index == TimerSlots - 1 ? 0 : Occupied[Level] & (~0ULL << (Index + 1));
+        if (Bits) {
+            Deadline = ((Current >> LevelShift(Level + 1)) << LevelShift(Level + 1)) +
+                ((unsigned long long) __builtin_ctzll(Bits) << LevelShift(Level));
+            break;
+        }
+    }
+
+    if (Deadline <= Now)
+        return 0;
+    if (Max >= 0 && Deadline - Now > (unsigned long long) Max)
+        return Max;
+    return (long) (Deadline - Now);
+}
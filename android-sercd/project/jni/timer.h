@@ -0,0 +1,57 @@
+/*
+ * sercd timer wheel
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_TIMER_H
+#define SERCD_TIMER_H
+
+#include "sercd.h"
+
+/* Hierarchical timing wheel with a 1 ms tick. Each level has 64 slots
+   covering 64 times the range of the level below; timers further away
+   than the top level wait in an overflow list. A timer sits in the
+   lowest level whose slot range still contains both the current time
+   and its expiry, and moves down a level when the current time enters
+   its slot. */
+#define TimerLevels 4
+#define TimerSlotBits 6
+#define TimerSlots (1 << TimerSlotBits)
+
+/* A timer, embedded in its owner. Fired timers report their Event
+   bits from RunTimers(). */
+typedef struct TimerNode
+{
+    struct TimerNode *Next;
+    struct TimerNode *Prev;
+    unsigned long long Expires;
+    unsigned int Event;
+    /* Wheel slot holding the timer, -1 for the overflow list */
+    int Slot;
+}
+TimerType;
+
+/* Set up an unarmed timer reporting Event */
+void InitTimer(TimerType * T, unsigned int Event);
+
+/* Start the wheel at Now, in ms */
+void InitTimers(unsigned long long Now);
+
+/* Arm T to expire at Expires ms, rearming it if it is pending. O(1). */
+void AddTimer(TimerType * T, unsigned long long Expires);
+
+/* Disarm T if it is pending. O(1). */
+void CancelTimer(TimerType * T);
+
+/* Check if T is armed */
+#define IsTimerPending(T) ((T)->Next != NULL)
+
+/* Advance the wheel to Now and disarm the expired timers. Returns the
+   Event bits of the expired timers. */
+unsigned int RunTimers(unsigned long long Now);
+
+/* Milliseconds from Now until the wheel needs to run again, at most
+   Max; -1 if Max is -1 and no timer is armed */
+long NextTimerTimeout(unsigned long long Now, long Max);
+
+#endif /* SERCD_TIMER_H */
@@ -5,8 +5,12 @@
  */
 
 #ifndef WIN32
+/* sched_setaffinity, struct ucred */
+#define _GNU_SOURCE
 #include "sercd.h"
 #include "unix.h"
+#include "baudrate.h"
+#include "logring.h"
 
 #include <termios.h>
 #ifndef ANDROID
@@ -18,11 +22,22 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>           /* gettimeofday */
+#include <time.h>               /* clock_gettime */
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <string.h>
+#include <sys/un.h>             /* sockaddr_un */
+#include <netdb.h>              /* getaddrinfo */
+#include <sys/inotify.h>        /* inotify_init */
+#include <sys/mman.h>           /* mlockall */
+#include <sched.h>              /* sched_setaffinity */
+#include <pthread.h>            /* pthread_setschedparam */
+#ifdef __linux__
+#include <linux/serial.h>       /* serial_icounter_struct */
+#endif
 #ifdef ANDROID
 #include <android/log.h>
 #endif
@@ -48,7 +63,6 @@ extern Boolean StdErrLogging;
 
 extern int MaxLogLevel;
 
-static struct timeval LastPoll = { 0, 0 };
 
 /* Initial serial port settings */
 static struct termios *InitialPortSettings;
@@ -63,63 +77,6 @@ static struct termios initialportsettings;
 #define LockFileMode 0644
 #define HDBHeaderLen 11
 
-/* Convert termios speed to tncom speed */
-static unsigned long int
-Termios2TncomSpeed(struct termios *ti)
-{
-    speed_t ispeed, ospeed;
-
-    ispeed = cfgetispeed(ti);
-    ospeed = cfgetospeed(ti);
-
-    if (ispeed != ospeed) {
-        LogMsg(LOG_WARNING, "warning: different input and output speed, using output speed");
-    }
-
-    switch (ospeed) {
-    case B50:
-        return (50UL);
-    case B75:
-        return (75UL);
-    case B110:
-        return (110UL);
-    case B134:
-        return (134UL);
-    case B150:
-        return (150UL);
-    case B200:
-        return (200UL);
-    case B300:
-        return (300UL);
-    case B600:
-        return (600UL);
-    case B1200:
-        return (1200UL);
-    case B1800:
-        return (1800UL);
-    case B2400:
-        return (2400UL);
-    case B4800:
-        return (4800UL);
-    case B9600:
-        return (9600UL);
-    case B19200:
-        return (19200UL);
-    case B38400:
-        return (38400UL);
-    case B57600:
-        return (57600UL);
-    case B115200:
-        return (115200UL);
-    case B230400:
-        return (230400UL);
-    case B460800:
-        return (460800UL);
-    default:
-        return (0UL);
-    }
-}
-
 /* Convert termios data size to tncom size */
 static unsigned char
 Termios2TncomDataSize(struct termios *ti)
@@ -187,7 +144,7 @@ Termios2TncomInFlow(struct termios *ti)
 }
 
 static void
-UnixLogPortSettings(struct termios *ti)
+UnixLogPortSettings(PORTHANDLE PortFd, struct termios *ti)
 {
     unsigned long speed;
     unsigned char datasize;
@@ -195,7 +152,7 @@ UnixLogPortSettings(struct termios *ti)
     unsigned char stopsize;
     unsigned char outflow, inflow;
 
-    speed = Termios2TncomSpeed(ti);
+    speed = GetBaudRate(PortFd);
     datasize = Termios2TncomDataSize(ti);
     parity = Termios2TncomParity(ti);
     stopsize = Termios2TncomStopSize(ti);
@@ -209,10 +166,7 @@ UnixLogPortSettings(struct termios *ti)
 unsigned long int
 GetPortSpeed(PORTHANDLE PortFd)
 {
-    struct termios PortSettings;
-
-    tcgetattr(PortFd, &PortSettings);
-    return Termios2TncomSpeed(&PortSettings);
+    return GetBaudRate(PortFd);
 }
 
 /* Retrieves the data size from PortFd */
@@ -352,7 +306,7 @@ SetPortDataSize(PORTHANDLE PortFd, unsigned char DataSize)
     PortSettings.c_cflag &= ~CSIZE;
     PortSettings.c_cflag |= PDataSize & CSIZE;
     tcsetattr(PortFd, TCSADRAIN, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+    UnixLogPortSettings(PortFd, &PortSettings);
 }
 
 /* Set the serial port parity */
@@ -381,7 +335,7 @@ SetPortParity(PORTHANDLE PortFd, unsigned char Parity)
     }
 
     tcsetattr(PortFd, TCSADRAIN, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+    UnixLogPortSettings(PortFd, &PortSettings);
 }
 
 /* Set the serial port stop bits size */
@@ -409,7 +363,7 @@ SetPortStopSize(PORTHANDLE PortFd, unsigned char StopSize)
     }
 
     tcsetattr(PortFd, TCSADRAIN, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+    UnixLogPortSettings(PortFd, &PortSettings);
 }
 
 /* Set the port flow control and DTR and RTS status */
@@ -486,7 +440,7 @@ SetPortFlowControl(PORTHANDLE PortFd, unsigned char How)
 
     tcsetattr(PortFd, TCSADRAIN, &PortSettings);
     ioctl(PortFd, TIOCMSET, &MLines);
-    UnixLogPortSettings(&PortSettings);
+    UnixLogPortSettings(PortFd, &PortSettings);
 }
 
 /* Set the serial port speed */
@@ -494,77 +448,20 @@ void
 SetPortSpeed(PORTHANDLE PortFd, unsigned long BaudRate)
 {
     struct termios PortSettings;
-    speed_t Speed;
+    unsigned long Actual;
 
-    switch (BaudRate) {
-    case 50UL:
-        Speed = B50;
-        break;
-    case 75UL:
-        Speed = B75;
-        break;
-    case 110UL:
-        Speed = B110;
-        break;
-    case 134UL:
-        Speed = B134;
-        break;
-    case 150UL:
-        Speed = B150;
-        break;
-    case 200UL:
-        Speed = B200;
-        break;
-    case 300UL:
-        Speed = B300;
-        break;
-    case 600UL:
-        Speed = B600;
-        break;
-    case 1200UL:
-        Speed = B1200;
-        break;
-    case 1800UL:
-        Speed = B1800;
-        break;
-    case 2400UL:
-        Speed = B2400;
-        break;
-    case 4800UL:
-        Speed = B4800;
-        break;
-    case 9600UL:
-        Speed = B9600;
-        break;
-    case 19200UL:
-        Speed = B19200;
-        break;
-    case 38400UL:
-        Speed = B38400;
-        break;
-    case 57600UL:
-        Speed = B57600;
-        break;
-    case 115200UL:
-        Speed = B115200;
-        break;
-    case 230400UL:
-        Speed = B230400;
-        break;
-    case 460800UL:
-        Speed = B460800;
-        break;
-    default:
-        LogMsg(LOG_WARNING, "Unknwon baud rate requested, setting to 9600.");
-        Speed = B9600;
-        break;
+    /* Keep the current rate rather than guess one */
+    if (SetBaudRate(PortFd, BaudRate, &Actual) != 0) {
+        LogFormat(LOG_WARNING, "Unable to set baud rate %lu, keeping the current one.",
+                  BaudRate);
+    }
+    else if (Actual != BaudRate) {
+        LogFormat(LOG_INFO, "Baud rate %lu requested, the port runs at %lu.",
+                  BaudRate, Actual);
     }
 
     tcgetattr(PortFd, &PortSettings);
-    cfsetospeed(&PortSettings, Speed);
-    cfsetispeed(&PortSettings, Speed);
-    tcsetattr(PortFd, TCSADRAIN, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+    UnixLogPortSettings(PortFd, &PortSettings);
 }
 
 void
@@ -603,7 +500,6 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
     int FileDes;
     int N;
     char HDBBuffer[HDBHeaderLen + 1];
-    char LogStr[TmpStrLen];
 
     /* Try to create the lock file */
     while ((FileDes = open(LockFile, O_CREAT | O_WRONLY | O_EXCL, LockFileMode)) == OpenError) {
@@ -618,9 +514,7 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
             if (N <= 0) {
                 /* Emtpy lock file or error: may be another application
                    was writing its pid in it */
-                snprintf(LogStr, sizeof(LogStr), "Can't read pid from lock file %s.", LockFile);
-                LogStr[sizeof(LogStr) - 1] = '\0';
-                LogMsg(LOG_NOTICE, LogStr);
+                LogFormat(LOG_NOTICE, "Can't read pid from lock file %s.", LockFile);
 
                 /* Lock process failed */
                 return (LockKo);
@@ -633,9 +527,7 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
             /* Check if it is our pid */
             if (Pid == LockPid) {
                 /* File already locked by us */
-                snprintf(LogStr, sizeof(LogStr), "Read our pid from lock %s.", LockFile);
-                LogStr[sizeof(LogStr) - 1] = '\0';
-                LogMsg(LOG_DEBUG, LogStr);
+                LogFormat(LOG_DEBUG, "Read our pid from lock %s.", LockFile);
 
                 /* Lock process succeded */
                 return (LockOk);
@@ -646,23 +538,15 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
             if ((Pid == 0) || ((kill(Pid, 0) != 0) && (errno == ESRCH)))
                 /* Invalid lock, remove it */
                 if (unlink(LockFile) == NoError) {
-                    snprintf(LogStr, sizeof(LogStr),
-                             "Removed stale lock %s (pid %d).", LockFile, Pid);
-                    LogStr[sizeof(LogStr) - 1] = '\0';
-                    LogMsg(LOG_NOTICE, LogStr);
+                    LogFormat(LOG_NOTICE, "Removed stale lock %s (pid %d).", LockFile, Pid);
                 }
                 else {
-                    snprintf(LogStr, sizeof(LogStr),
-                             "Couldn't remove stale lock %s (pid %d).", LockFile, Pid);
-                    LogStr[sizeof(LogStr) - 1] = '\0';
-                    LogMsg(LOG_ERR, LogStr);
+                    LogFormat(LOG_ERR, "Couldn't remove stale lock %s (pid %d).", LockFile, Pid);
                     return (LockKo);
                 }
             else {
                 /* The lock file is owned by another valid process */
-                snprintf(LogStr, sizeof(LogStr), "Lock %s is owned by pid %d.", LockFile, Pid);
-                LogStr[sizeof(LogStr) - 1] = '\0';
-                LogMsg(LOG_INFO, LogStr);
+                LogFormat(LOG_INFO, "Lock %s is owned by pid %d.", LockFile, Pid);
 
                 /* Lock process failed */
                 return (Locked);
@@ -670,9 +554,7 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
         }
         else {
             /* Lock file creation problem */
-            snprintf(LogStr, sizeof(LogStr), "Can't create lock file %s.", LockFile);
-            LogStr[sizeof(LogStr) - 1] = '\0';
-            LogMsg(LOG_ERR, LogStr);
+            LogFormat(LOG_ERR, "Can't create lock file %s.", LockFile);
 
             /* Lock process failed */
             return (LockKo);
@@ -681,15 +563,13 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
 
     /* Prepare the HDB buffer with our pid */
     snprintf(HDBBuffer, sizeof(HDBBuffer), "%10d\n", (int) LockPid);
-    LogStr[sizeof(HDBBuffer) - 1] = '\0';
+    HDBBuffer[sizeof(HDBBuffer) - 1] = '\0';
 
     /* Fill the lock file with the HDB buffer */
     if (write(FileDes, HDBBuffer, HDBHeaderLen) != HDBHeaderLen) {
         /* Lock file creation problem, remove it */
         close(FileDes);
-        snprintf(LogStr, sizeof(LogStr), "Can't write HDB header to lock file %s.", LockFile);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_ERR, LogStr);
+        LogFormat(LOG_ERR, "Can't write HDB header to lock file %s.", LockFile);
         unlink(LockFile);
 
         /* Lock process failed */
@@ -707,15 +587,11 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
 static void
 HDBUnlockFile(const char *LockFile, pid_t LockPid)
 {
-    char LogStr[TmpStrLen];
-
     /* Check if the lock file is still owned by us */
     if (HDBLockFile(LockFile, LockPid) == LockOk) {
         /* Remove the lock file */
         unlink(LockFile);
-        snprintf(LogStr, sizeof(LogStr), "Unlocked lock file %s.", LockFile);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_NOTICE, LogStr);
+        LogFormat(LOG_NOTICE, "Unlocked lock file %s.", LockFile);
     }
 }
 
@@ -726,7 +602,6 @@ OpenPort(const char *DeviceName, const char *LockFileName, PORTHANDLE * PortFd)
 OpenPort(const char *DeviceName, PORTHANDLE * PortFd)
 #endif
 {
-    char LogStr[TmpStrLen];
     /* Actual port settings */
     struct termios PortSettings;
 
@@ -734,16 +609,12 @@ OpenPort(const char *DeviceName, PORTHANDLE * PortFd)
     /* Try to lock the device */
     if (HDBLockFile(LockFileName, getpid()) != LockOk) {
         /* Lock failed */
-        snprintf(LogStr, sizeof(LogStr), "Unable to lock %s. Exiting.", LockFileName);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_NOTICE, LogStr);
+        LogFormat(LOG_NOTICE, "Unable to lock %s. Exiting.", LockFileName);
         return (Error);
     }
     else {
         /* Lock succeeded */
-        snprintf(LogStr, sizeof(LogStr), "Device %s locked.", DeviceName);
-        LogStr[sizeof(LogStr) - 1] = '\0';
-        LogMsg(LOG_INFO, LogStr);
+        LogFormat(LOG_INFO, "Device %s locked.", DeviceName);
     }
 #endif
 
@@ -756,7 +627,7 @@ OpenPort(const char *DeviceName, PORTHANDLE * PortFd)
     InitialPortSettings = &initialportsettings;
     tcgetattr(*PortFd, InitialPortSettings);
     tcgetattr(*PortFd, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+    UnixLogPortSettings(*PortFd, &PortSettings);
 
     /* Set the serial port to raw mode */
     cfmakeraw(&PortSettings);
@@ -799,6 +670,143 @@ ClosePort(PORTHANDLE PortFd)
     }
 }
 
+/* Slave side of the reverse mode pty, kept open so that the master
+   sees no hangup while the application has it closed */
+static int PtySlaveFd = -1;
+
+/* Last pty settings seen by PtySettingsChanged() */
+static struct termios PtySettings;
+static unsigned long PtyRate;
+static Boolean PtySettingsKnown = False;
+
+int
+#ifndef ANDROID
+OpenPty(const char *LinkName, const char *LockFileName, PORTHANDLE * PtyFd)
+#else
+OpenPty(const char *LinkName, PORTHANDLE * PtyFd)
+#endif
+{
+    struct termios PortSettings;
+    struct stat LinkStat;
+    char *SlaveName;
+
+#ifndef ANDROID
+    if (HDBLockFile(LockFileName, getpid()) != LockOk) {
+        LogFormat(LOG_NOTICE, "Unable to lock %s. Exiting.", LockFileName);
+        return (Error);
+    }
+#endif
+
+    /* Old Bionic has no posix_openpt(), and devpts needs no grantpt() */
+    if ((*PtyFd = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_NONBLOCK)) == OpenError)
+        goto Fail;
+    if (unlockpt(*PtyFd) != 0 || (SlaveName = ptsname(*PtyFd)) == NULL ||
+        (PtySlaveFd = open(SlaveName, O_RDWR | O_NOCTTY)) == OpenError) {
+        close(*PtyFd);
+        goto Fail;
+    }
+
+    /* Start raw, as OpenPort() leaves a real port */
+    tcgetattr(PtySlaveFd, &PortSettings);
+    cfmakeraw(&PortSettings);
+    cfsetispeed(&PortSettings, B9600);
+    cfsetospeed(&PortSettings, B9600);
+    PortSettings.c_cflag |= HUPCL | CLOCAL;
+    tcsetattr(PtySlaveFd, TCSANOW, &PortSettings);
+    PtySettingsKnown = False;
+
+    /* Only a stale link of ours may be replaced */
+    if (lstat(LinkName, &LinkStat) == 0 && S_ISLNK(LinkStat.st_mode))
+        unlink(LinkName);
+    if (symlink(SlaveName, LinkName) != 0) {
+        LogFormat(LOG_ERR, "Unable to create %s: %s", LinkName, strerror(errno));
+        close(PtySlaveFd);
+        close(*PtyFd);
+        PtySlaveFd = -1;
+        goto Fail;
+    }
+
+    LogFormat(LOG_INFO, "Serving the remote port on %s (%s).", LinkName, SlaveName);
+    return NoError;
+
+  Fail:
+#ifndef ANDROID
+    HDBUnlockFile(LockFileName, getpid());
+#endif
+    return (Error);
+}
+
+void
+#ifndef ANDROID
+ClosePty(PORTHANDLE PtyFd, const char *LinkName, const char *LockFileName)
+#else
+ClosePty(PORTHANDLE PtyFd, const char *LinkName)
+#endif
+{
+    unlink(LinkName);
+    if (PtySlaveFd >= 0) {
+        close(PtySlaveFd);
+        PtySlaveFd = -1;
+    }
+    close(PtyFd);
+#ifndef ANDROID
+    HDBUnlockFile(LockFileName, getpid());
+#endif
+}
+
+Boolean
+PtySettingsChanged(PORTHANDLE PtyFd)
+{
+    struct termios T;
+
+    /* The termios calls on the master act on the slave */
+    if (tcgetattr(PtyFd, &T) != 0)
+        return False;
+    if (PtySettingsKnown && T.c_iflag == PtySettings.c_iflag &&
+        T.c_cflag == PtySettings.c_cflag && GetBaudRate(PtyFd) == PtyRate)
+        return False;
+    PtySettings = T;
+    PtyRate = GetBaudRate(PtyFd);
+    PtySettingsKnown = True;
+    return True;
+}
+
+void
+HangupPty(PORTHANDLE PtyFd)
+{
+#ifdef TIOCSIG
+    struct termios T;
+
+    if (tcgetattr(PtyFd, &T) == 0 && !(T.c_cflag & CLOCAL))
+        ioctl(PtyFd, TIOCSIG, SIGHUP);
+#endif
+}
+
+SERCD_SOCKET
+ConnectServer(const char *Host, const char *Port)
+{
+    struct addrinfo Hints, *Addrs, *A;
+    SERCD_SOCKET Sock = -1;
+
+    memset(&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(Host, Port, &Hints, &Addrs) != 0)
+        return -1;
+    for (A = Addrs; A != NULL; A = A->ai_next) {
+        if ((Sock = socket(A->ai_family, A->ai_socktype, A->ai_protocol)) < 0)
+            continue;
+        if (connect(Sock, A->ai_addr, A->ai_addrlen) == 0)
+            break;
+        close(Sock);
+        Sock = -1;
+    }
+    freeaddrinfo(Addrs);
+    if (Sock >= 0)
+        fcntl(Sock, F_SETFL, O_NONBLOCK);
+    return Sock;
+}
+
 /* Function called on many signals */
 static void
 SignalFunction(int unused)
@@ -830,6 +838,10 @@ PlatformInit()
     /* Register the function to be called on break condition */
     signal(SIGINT, BreakFunction);
 #endif
+
+    /* Keep syslog and logcat out of the event loop */
+    if (StartLogRing() != NoError)
+        LogMsg(LOG_WARNING, "Unable to start the log thread, logging synchronously.");
 }
 
 /* Generic log function with log level control. Uses the same log levels
@@ -837,51 +849,73 @@ of the syslog(3) system call */
 void
 LogMsg(int LogLevel, const char *const Msg)
 {
-    if (LogLevel <= MaxLogLevel) {
+    LogFormat(LogLevel, "%s", Msg);
+}
+
+/* Queue the message for the log thread, and only write it here if
+   there is none */
+void
+LogFormatted(int LogLevel, const char *Format, ...)
+{
+    va_list Args;
+    char Msg[TmpStrLen];
+
+    va_start(Args, Format);
+    if (!LogRingFormat(LogLevel, Format, Args)) {
+        vsnprintf(Msg, sizeof(Msg), Format, Args);
+        EmitLogMsg(LogLevel, Msg);
+    }
+    va_end(Args);
+}
+
+void
+EmitLogMsg(int LogLevel, const char *Msg)
+{
 #ifndef ANDROID
-        if (StdErrLogging) {
-            fprintf(stderr, "%s\n", Msg);
-        }
-        else {
-            syslog(LogLevel, "%s", Msg);
-        }
+    if (StdErrLogging) {
+        fprintf(stderr, "%s\n", Msg);
+    }
+    else {
+        syslog(LogLevel, "%s", Msg);
+    }
 #else
-        int prio;
-        switch(LogLevel) {
-        case LOG_EMERG:
-        	prio = ANDROID_LOG_FATAL;
-        	break;
-        case LOG_ALERT:
-        case LOG_CRIT:
-        case LOG_ERR:
-        	prio = ANDROID_LOG_ERROR;
-        	break;
-        case LOG_WARNING:
-        	prio = ANDROID_LOG_WARN;
-        	break;
-        case LOG_NOTICE:
-        case LOG_INFO:
-        	prio = ANDROID_LOG_INFO;
-        	break;
-        case LOG_DEBUG:
-        	prio = ANDROID_LOG_DEBUG;
-        }
-        __android_log_write(prio, "sercd", Msg);
-#endif
+    int prio;
+    switch(LogLevel) {
+    case LOG_EMERG:
+    	prio = ANDROID_LOG_FATAL;
+    	break;
+    case LOG_ALERT:
+    case LOG_CRIT:
+    case LOG_ERR:
+    	prio = ANDROID_LOG_ERROR;
+    	break;
+    case LOG_WARNING:
+    	prio = ANDROID_LOG_WARN;
+    	break;
+    case LOG_NOTICE:
+    case LOG_INFO:
+    	prio = ANDROID_LOG_INFO;
+    	break;
+    case LOG_DEBUG:
+    default:
+    	prio = ANDROID_LOG_DEBUG;
+    	break;
     }
+    __android_log_write(prio, "sercd", Msg);
+#endif
 }
 
 
 int
 SercdSelect(PORTHANDLE * DeviceIn, PORTHANDLE * DeviceOut, PORTHANDLE * Modemstate,
             SERCD_SOCKET * SocketOut, SERCD_SOCKET * SocketIn,
-            SERCD_SOCKET * SocketConnect, long PollInterval)
+            SERCD_SOCKET * SocketConnect, SERCD_SOCKET * SocketHandover, int *Control,
+            long Timeout)
 {
     fd_set InFdSet;
     fd_set OutFdSet;
     int highest_fd = -1, selret;
     struct timeval BTimeout;
-    struct timeval newpoll;
     int ret = 0;
 
     FD_ZERO(&InFdSet);
@@ -907,11 +941,19 @@ SercdSelect(PORTHANDLE * DeviceIn, PORTHANDLE * DeviceOut, PORTHANDLE * Modemsta
         FD_SET(*SocketConnect, &InFdSet);
         highest_fd = MAX(highest_fd, *SocketConnect);
     }
+    if (SocketHandover) {
+        FD_SET(*SocketHandover, &InFdSet);
+        highest_fd = MAX(highest_fd, *SocketHandover);
+    }
+    if (Control) {
+        FD_SET(*Control, &InFdSet);
+        highest_fd = MAX(highest_fd, *Control);
+    }
 
-    BTimeout.tv_sec = PollInterval / 1000;
-    BTimeout.tv_usec = (PollInterval % 1000) * 1000;
+    BTimeout.tv_sec = Timeout / 1000;
+    BTimeout.tv_usec = (Timeout % 1000) * 1000;
 
-    selret = select(highest_fd + 1, &InFdSet, &OutFdSet, NULL, &BTimeout);
+    selret = select(highest_fd + 1, &InFdSet, &OutFdSet, NULL, Timeout < 0 ? NULL : &BTimeout);
 
     if (selret < 0)
         return selret;
@@ -931,19 +973,16 @@ SercdSelect(PORTHANDLE * DeviceIn, PORTHANDLE * DeviceOut, PORTHANDLE * Modemsta
     if (SocketConnect && FD_ISSET(*SocketConnect, &InFdSet)) {
         ret |= SERCD_EV_SOCKETCONNECT;
     }
+    if (SocketHandover && FD_ISSET(*SocketHandover, &InFdSet)) {
+        ret |= SERCD_EV_HANDOVER;
+    }
+    if (Control && FD_ISSET(*Control, &InFdSet)) {
+        ret |= SERCD_EV_CONTROL;
+    }
 
+    /* The caller passes the modem state only when its poll is due */
     if (Modemstate) {
-        gettimeofday(&newpoll, NULL);
-        if (timercmp(&newpoll, &LastPoll, <)) {
-            /* Time moved backwards */
-            timerclear(&LastPoll);
-        }
-        newpoll.tv_sec -= PollInterval / 1000;
-        newpoll.tv_usec -= PollInterval % 1000;
-        if (timercmp(&LastPoll, &newpoll, <)) {
-            gettimeofday(&LastPoll, NULL);
-            ret |= SERCD_EV_MODEMSTATE;
-        }
+        ret |= SERCD_EV_MODEMSTATE;
     }
 
     return ret;
@@ -1011,4 +1050,343 @@ ModemStateNotified()
 {
 }
 
+int
+GetLineCounters(PORTHANDLE PortFd, LineCountersType * C)
+{
+#ifdef TIOCGICOUNT
+    struct serial_icounter_struct Count;
+
+    if (ioctl(PortFd, TIOCGICOUNT, &Count) < 0)
+        return Error;
+    C->Overrun = Count.overrun;
+    C->Frame = Count.frame;
+    C->Parity = Count.parity;
+    C->Break = Count.brk;
+    C->BufOverrun = Count.buf_overrun;
+    return NoError;
+#else
+    return Error;
+#endif
+}
+
+/* Create the Unix socket a new sercd process connects to for taking
+   over from us */
+SERCD_SOCKET
+NewHandoverListener(const char *Path)
+{
+    struct sockaddr_un sun;
+    SERCD_SOCKET Sock;
+
+    Sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Sock < 0)
+        return -1;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, Path, sizeof(sun.sun_path) - 1);
+    unlink(Path);
+    /* Our descriptors go to whoever connects, so only our user may;
+       nobody can connect before listen, so the mode is set in time */
+    if (bind(Sock, (struct sockaddr *) &sun, sizeof(sun)) || chmod(Path, 0600) < 0 ||
+        listen(Sock, 1) < 0) {
+        close(Sock);
+        return -1;
+    }
+    return Sock;
+}
+
+/* Accept the new process and send it the session state and our file
+   descriptors. The connection is left open, the new process waits for
+   it to close when we exit. */
+int
+SendHandover(SERCD_SOCKET LSocketFd, const void *State, size_t Len, const int *Fds, int NFds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * HandoverMaxFds)];
+    struct ucred Peer;
+    socklen_t PeerLen = sizeof(Peer);
+    SERCD_SOCKET Sock;
+
+    Sock = accept(LSocketFd, NULL, NULL);
+    if (Sock < 0)
+        return Error;
+
+    /* Check the peer too, the socket mode may have been changed */
+    if (getsockopt(Sock, SOL_SOCKET, SO_PEERCRED, &Peer, &PeerLen) < 0 ||
+        Peer.uid != getuid()) {
+        LogMsg(LOG_WARNING, "Handover refused to a process of another user.");
+        close(Sock);
+        return Error;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *) State;
+    iov.iov_len = Len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * NFds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * NFds);
+    memcpy(CMSG_DATA(cmsg), Fds, sizeof(int) * NFds);
+
+    if (sendmsg(Sock, &msg, 0) != (ssize_t) Len) {
+        close(Sock);
+        return Error;
+    }
+    return NoError;
+}
+
+/* Take over from a running sercd listening at Path. Returns Error if
+   there is none. On success, the old process has exited. */
+int
+ReceiveHandover(const char *Path, void *State, size_t Len, int *Fds, int *NFds)
+{
+    struct sockaddr_un sun;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * HandoverMaxFds)];
+    SERCD_SOCKET Sock;
+    ssize_t Got, N;
+    char c;
+
+    Sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Sock < 0)
+        return Error;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, Path, sizeof(sun.sun_path) - 1);
+    if (connect(Sock, (struct sockaddr *) &sun, sizeof(sun))) {
+        close(Sock);
+        return Error;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = State;
+    iov.iov_len = Len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    Got = recvmsg(Sock, &msg, MSG_WAITALL);
+    if (Got <= 0) {
+        close(Sock);
+        return Error;
+    }
+
+    *NFds = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *NFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(Fds, CMSG_DATA(cmsg), sizeof(int) * *NFds);
+        }
+    }
+
+    /* Rest of the state, if the message was split */
+    while (Got < (ssize_t) Len) {
+        N = read(Sock, (char *) State + Got, Len - Got);
+        if (N <= 0) {
+            close(Sock);
+            return Error;
+        }
+        Got += N;
+    }
+
+    /* Wait for the old process to exit */
+    while (read(Sock, &c, 1) > 0);
+    close(Sock);
+    return NoError;
+}
+
+/* Platform part of the handover state: the settings to restore when
+   the port is closed */
+size_t
+SavePlatformState(unsigned char *Buf)
+{
+    Buf[0] = InitialPortSettings != NULL;
+    memcpy(Buf + 1, &initialportsettings, sizeof(initialportsettings));
+    return 1 + sizeof(initialportsettings);
+}
+
+void
+RestorePlatformState(const unsigned char *Buf)
+{
+    memcpy(&initialportsettings, Buf + 1, sizeof(initialportsettings));
+    InitialPortSettings = Buf[0] ? &initialportsettings : NULL;
+}
+
+#ifndef ANDROID
+/* Rewrite the lock file of a port taken over from another process */
+int
+TakeOverPortLock(const char *LockFileName)
+{
+    int Tries;
+
+    /* The old process may take a moment to be reaped */
+    for (Tries = 0; Tries < 100; Tries++) {
+        if (HDBLockFile(LockFileName, getpid()) == LockOk)
+            return NoError;
+        usleep(10000);
+    }
+    return Error;
+}
+#endif
+
+void
+SavePortState(PORTHANDLE PortFd, unsigned char *Buf)
+{
+    struct termios PortSettings;
+    int ModemLines = 0;
+
+    tcgetattr(PortFd, &PortSettings);
+    ioctl(PortFd, TIOCMGET, &ModemLines);
+    memcpy(Buf, &PortSettings, sizeof(PortSettings));
+    memcpy(Buf + sizeof(PortSettings), &ModemLines, sizeof(ModemLines));
+}
+
+void
+RestorePortState(PORTHANDLE PortFd, const unsigned char *Buf)
+{
+    struct termios PortSettings;
+    int ModemLines;
+
+    memcpy(&PortSettings, Buf, sizeof(PortSettings));
+    memcpy(&ModemLines, Buf + sizeof(PortSettings), sizeof(ModemLines));
+    tcsetattr(PortFd, TCSANOW, &PortSettings);
+    ModemLines &= TIOCM_DTR | TIOCM_RTS;
+    ioctl(PortFd, TIOCMBIS, &ModemLines);
+    ModemLines ^= TIOCM_DTR | TIOCM_RTS;
+    ioctl(PortFd, TIOCMBIC, &ModemLines);
+}
+
+int
+WatchDeviceNode(const char *DeviceName)
+{
+    char Dir[TmpStrLen];
+    char *Slash;
+    int Fd;
+
+    strncpy(Dir, DeviceName, sizeof(Dir) - 1);
+    Dir[sizeof(Dir) - 1] = '\0';
+    Slash = strrchr(Dir, '/');
+    if (Slash == NULL)
+        return -1;
+    *Slash = '\0';
+
+    Fd = inotify_init();
+    if (Fd < 0)
+        return -1;
+    fcntl(Fd, F_SETFL, O_NONBLOCK);
+    if (inotify_add_watch(Fd, *Dir ? Dir : "/", IN_CREATE | IN_ATTRIB) < 0) {
+        close(Fd);
+        return -1;
+    }
+    return Fd;
+}
+
+Boolean
+DeviceNodeChanged(int WatchFd, const char *DeviceName)
+{
+    char Events[1024];
+    const char *Base = strrchr(DeviceName, '/');
+    struct inotify_event *Ev;
+    Boolean Changed = False;
+    ssize_t Len, Pos;
+
+    if (WatchFd < 0)
+        return False;
+    Base = Base ? Base + 1 : DeviceName;
+
+    while ((Len = read(WatchFd, Events, sizeof(Events))) > 0) {
+        for (Pos = 0; Pos < Len; Pos += sizeof(*Ev) + Ev->len) {
+            Ev = (struct inotify_event *) (Events + Pos);
+            if (Ev->len > 0 && strcmp(Ev->name, Base) == 0)
+                Changed = True;
+        }
+    }
+    return Changed;
+}
+
+/* Stack touched before locking memory, so that the main loop never
+   faults on its stack */
+#define RealTimeStackPrefault (64 * 1024)
+
+static void
+PrefaultStack(void)
+{
+    volatile unsigned char Stack[RealTimeStackPrefault];
+
+    memset((unsigned char *) Stack, 0, sizeof(Stack));
+}
+
+int
+EnterRealTime(int Priority, int Cpu)
+{
+    struct sched_param Param;
+    int Ret = NoError;
+
+    PrefaultStack();
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        LogFormat(LOG_WARNING, "Unable to lock memory: %s", strerror(errno));
+        Ret = Error;
+    }
+
+    memset(&Param, 0, sizeof(Param));
+    Param.sched_priority = Priority;
+    if ((errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &Param)) != 0) {
+        LogFormat(LOG_WARNING, "Unable to set SCHED_FIFO priority %d: %s", Priority,
+                  strerror(errno));
+        Ret = Error;
+    }
+
+    if (Cpu >= 0) {
+#ifdef CPU_SET
+        cpu_set_t Set;
+
+        CPU_ZERO(&Set);
+        CPU_SET(Cpu, &Set);
+        if (sched_setaffinity(0, sizeof(Set), &Set) != 0) {
+            LogFormat(LOG_WARNING, "Unable to pin to CPU %d: %s", Cpu, strerror(errno));
+            Ret = Error;
+        }
+#else
+        LogMsg(LOG_WARNING, "CPU pinning is not supported on this platform.");
+        Ret = Error;
+#endif
+    }
+    return Ret;
+}
+
+long
+GetNetAckWait(SERCD_SOCKET Sock)
+{
+#ifdef TCP_INFO
+    struct tcp_info Info;
+    socklen_t Len = sizeof(Info);
+
+    if (getsockopt(Sock, IPPROTO_TCP, TCP_INFO, &Info, &Len) < 0)
+        return -1;
+    if (Info.tcpi_unacked == 0)
+        return 0;
+    return Info.tcpi_last_ack_recv;
+#else
+    return -1;
+#endif
+}
+
+unsigned long long
+GetTimeMicros(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
 #endif /* WIN32 */
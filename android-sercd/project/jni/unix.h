@@ -12,8 +12,10 @@
 #include <sys/ioctl.h>          /* ioctl */
 #include <netinet/in.h>         /* htonl */
 #include <netinet/ip.h>         /* IPTOS_LOWDELAY */
+#include <netinet/tcp.h>        /* TCP_KEEPIDLE */
 #include <arpa/inet.h>          /* inet_addr */
 #include <sys/socket.h>         /* setsockopt */
+#include <sys/select.h>         /* select */
 
 #define PORTHANDLE int
 
@@ -25,6 +25,26 @@ public class Sercd extends PreferenceActivity {
 	private ListPreference mSerialPort;
 	private ListPreference mNetworkInterfaces;
 	private EditTextPreference mNetworkPort;
+	private ListPreference mLogLevel;
+	private EditTextPreference mHistory;
+	private CheckBoxPreference mWarmPort;
+	private EditTextPreference mSpool;
+	private EditTextPreference mSpoolFile;
+	private CheckBoxPreference mSpoolDropNewest;
+	private EditTextPreference mResume;
+	private EditTextPreference mHandoverPath;
+	private EditTextPreference mControlPath;
+	private EditTextPreference mProfileLimits;
+	private EditTextPreference mRealTime;
+	private EditTextPreference mBusyPoll;
+	private EditTextPreference mSchedQuantum;
+	private EditTextPreference mStatsPath;
+	private EditTextPreference mBridgeDevice;
+	private EditTextPreference mBridgeSettings;
+	private EditTextPreference mCaptureFile;
+	private EditTextPreference mModbusGateway;
+	private EditTextPreference mPollTable;
+	private EditTextPreference mRemotePort;
 
 	private OnPreferenceChangeListener mPreferenceChangeListener = new OnPreferenceChangeListener() {
 		@Override
@@ -47,6 +67,26 @@ public class Sercd extends PreferenceActivity {
     	mSerialPort = (ListPreference)findPreference("serialport");
     	mNetworkInterfaces = (ListPreference)findPreference("netinterface");
     	mNetworkPort = (EditTextPreference)findPreference("portnumber");
+    	mLogLevel = (ListPreference)findPreference("loglevel");
+    	mHistory = (EditTextPreference)findPreference("history");
+    	mWarmPort = (CheckBoxPreference)findPreference("warmport");
+    	mSpool = (EditTextPreference)findPreference("spool");
+    	mSpoolFile = (EditTextPreference)findPreference("spoolfile");
+    	mSpoolDropNewest = (CheckBoxPreference)findPreference("spooldropnewest");
+    	mResume = (EditTextPreference)findPreference("resume");
+    	mHandoverPath = (EditTextPreference)findPreference("handoverpath");
+    	mControlPath = (EditTextPreference)findPreference("controlpath");
+    	mProfileLimits = (EditTextPreference)findPreference("profilelimits");
+    	mRealTime = (EditTextPreference)findPreference("realtime");
+    	mBusyPoll = (EditTextPreference)findPreference("busypoll");
+    	mSchedQuantum = (EditTextPreference)findPreference("schedquantum");
+    	mStatsPath = (EditTextPreference)findPreference("statspath");
+    	mBridgeDevice = (EditTextPreference)findPreference("bridgedevice");
+    	mBridgeSettings = (EditTextPreference)findPreference("bridgesettings");
+    	mCaptureFile = (EditTextPreference)findPreference("capturefile");
+    	mModbusGateway = (EditTextPreference)findPreference("modbusgateway");
+    	mPollTable = (EditTextPreference)findPreference("polltable");
+    	mRemotePort = (EditTextPreference)findPreference("remoteport");
 
     	/* Complete lists, etc */
     	mSerialPort.setOnPreferenceChangeListener(mPreferenceChangeListener);
@@ -55,16 +95,65 @@ public class Sercd extends PreferenceActivity {
     	mNetworkInterfaces.setSummary(mNetworkInterfaces.getValue());
     	mNetworkPort.setOnPreferenceChangeListener(mPreferenceChangeListener);
     	mNetworkPort.setSummary(mNetworkPort.getText());
+    	mHistory.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mHistory.setSummary(mHistory.getText());
+    	mSpool.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mSpool.setSummary(mSpool.getText());
+    	mSpoolFile.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mSpoolFile.setSummary(mSpoolFile.getText());
+    	mResume.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mResume.setSummary(mResume.getText());
+    	mHandoverPath.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mHandoverPath.setSummary(mHandoverPath.getText());
+    	mControlPath.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mControlPath.setSummary(mControlPath.getText());
+    	mProfileLimits.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mProfileLimits.setSummary(mProfileLimits.getText());
+    	mRealTime.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mRealTime.setSummary(mRealTime.getText());
+    	mBusyPoll.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mBusyPoll.setSummary(mBusyPoll.getText());
+    	mSchedQuantum.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mSchedQuantum.setSummary(mSchedQuantum.getText());
+    	mStatsPath.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mStatsPath.setSummary(mStatsPath.getText());
+    	mBridgeDevice.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mBridgeDevice.setSummary(mBridgeDevice.getText());
+    	mBridgeSettings.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mBridgeSettings.setSummary(mBridgeSettings.getText());
+    	mCaptureFile.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mCaptureFile.setSummary(mCaptureFile.getText());
+    	mModbusGateway.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mModbusGateway.setSummary(mModbusGateway.getText());
+    	mPollTable.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mPollTable.setSummary(mPollTable.getText());
+    	mRemotePort.setOnPreferenceChangeListener(mPreferenceChangeListener);
+    	mRemotePort.setSummary(mRemotePort.getText());
+    	mLogLevel.setSummary(mLogLevel.getEntry());
+    	mLogLevel.setOnPreferenceChangeListener(new OnPreferenceChangeListener() {
+			@Override
+			public boolean onPreferenceChange(Preference preference, Object newValue) {
+				int index = mLogLevel.findIndexOfValue((String)newValue);
+				preference.setSummary(mLogLevel.getEntries()[index]);
+				return true;
+			}
+		});
     	mEnabled.setOnPreferenceChangeListener(new OnPreferenceChangeListener() {
 			@Override
 			public boolean onPreferenceChange(Preference preference, Object newValue) {
 				if ((Boolean)newValue) {
 					String serialport = mSerialPort.getValue();
 					String networkinterface = mNetworkInterfaces.getValue();
-					
+					String remoteport = mRemotePort.getText();
+					boolean reverse = remoteport != null && remoteport.length() > 0;
+
+					/* In reverse mode sercd creates the pty link itself */
+					if (reverse)
+						serialport = new File(getFilesDir(), "ttyRemote").getAbsolutePath();
+
 					/* Check access permission */
 					File device = new File(serialport);
-					if (!device.canRead() || !device.canWrite()) {
+					if (!reverse && (!device.canRead() || !device.canWrite())) {
 						try {
 							/* Missing read/write permission, trying to chmod the file */
 							Process su;
@@ -89,6 +178,7 @@ public class Sercd extends PreferenceActivity {
 					}
 
 					int port = Integer.parseInt(mNetworkPort.getText());
+					int loglevel = Integer.parseInt(mLogLevel.getValue());
 							Log.d(TAG, "Starting sercd with parameters "
 									+ serialport + ", " + networkinterface
 									+ ":" + port);
@@ -96,7 +186,27 @@ public class Sercd extends PreferenceActivity {
 							Sercd.this,
 							serialport,
 							networkinterface,
-							port
+							port,
+							loglevel,
+							mHistory.getText(),
+							mWarmPort.isChecked(),
+							mSpool.getText(),
+							mSpoolFile.getText(),
+							mSpoolDropNewest.isChecked(),
+							mResume.getText(),
+							mHandoverPath.getText(),
+							mControlPath.getText(),
+							mProfileLimits.getText(),
+							mRealTime.getText(),
+							mBusyPoll.getText(),
+							mSchedQuantum.getText(),
+							mStatsPath.getText(),
+							mBridgeDevice.getText(),
+							mBridgeSettings.getText(),
+							mCaptureFile.getText(),
+							mModbusGateway.getText(),
+							mPollTable.getText(),
+							mRemotePort.getText()
 					);
 				} else {
 					SercdService.Stop(Sercd.this);
@@ -109,7 +219,7 @@ public class Sercd extends PreferenceActivity {
         feedSerialPortList();
 
         if (mEnabled.isChecked()) {
-//        	SercdService.Start(this, "/dev/ttyMSM2", "127.0.0.1", 30001);
+//        	SercdService.Start(this, "/dev/ttyMSM2", "127.0.0.1", 30001, 6);
         }
     }
 
@@ -13,12 +13,61 @@ public class SercdService extends Service {
 	private static final String SERIALPORT = "serialport";
 	private static final String INTERFACE = "interface";
 	private static final String PORT = "port";
-
-	public static void Start(Context ctxt, String serialport, String netinterface, int port) {
+	private static final String LOGLEVEL = "loglevel";
+	private static final String HISTORY = "history";
+	private static final String WARMPORT = "warmport";
+	private static final String SPOOL = "spool";
+	private static final String SPOOLFILE = "spoolfile";
+	private static final String SPOOLDROPNEWEST = "spooldropnewest";
+	private static final String RESUME = "resume";
+	private static final String HANDOVERPATH = "handoverpath";
+	private static final String CONTROLPATH = "controlpath";
+	private static final String PROFILELIMITS = "profilelimits";
+	private static final String REALTIME = "realtime";
+	private static final String BUSYPOLL = "busypoll";
+	private static final String SCHEDQUANTUM = "schedquantum";
+	private static final String STATSPATH = "statspath";
+	private static final String BRIDGEDEVICE = "bridgedevice";
+	private static final String BRIDGESETTINGS = "bridgesettings";
+	private static final String CAPTUREFILE = "capturefile";
+	private static final String MODBUSGATEWAY = "modbusgateway";
+	private static final String POLLTABLE = "polltable";
+	private static final String REMOTEPORT = "remoteport";
+
+	/* syslog LOG_INFO */
+	private static final int DEFAULT_LOGLEVEL = 6;
+
+	public static void Start(Context ctxt, String serialport, String netinterface, int port,
+			int loglevel, String history, boolean warmport, String spool,
+			String spoolfile, boolean spooldropnewest, String resume, String handoverpath,
+			String controlpath, String profilelimits, String realtime, String busypoll,
+			String schedquantum, String statspath, String bridgedevice,
+			String bridgesettings, String capturefile, String modbusgateway,
+			String polltable, String remoteport) {
 		Intent myself = new Intent(ctxt, SercdService.class);
 		myself.putExtra(SERIALPORT, serialport);
 		myself.putExtra(INTERFACE, netinterface);
 		myself.putExtra(PORT, port);
+		myself.putExtra(LOGLEVEL, loglevel);
+		myself.putExtra(HISTORY, history);
+		myself.putExtra(WARMPORT, warmport);
+		myself.putExtra(SPOOL, spool);
+		myself.putExtra(SPOOLFILE, spoolfile);
+		myself.putExtra(SPOOLDROPNEWEST, spooldropnewest);
+		myself.putExtra(RESUME, resume);
+		myself.putExtra(HANDOVERPATH, handoverpath);
+		myself.putExtra(CONTROLPATH, controlpath);
+		myself.putExtra(PROFILELIMITS, profilelimits);
+		myself.putExtra(REALTIME, realtime);
+		myself.putExtra(BUSYPOLL, busypoll);
+		myself.putExtra(SCHEDQUANTUM, schedquantum);
+		myself.putExtra(STATSPATH, statspath);
+		myself.putExtra(BRIDGEDEVICE, bridgedevice);
+		myself.putExtra(BRIDGESETTINGS, bridgesettings);
+		myself.putExtra(CAPTUREFILE, capturefile);
+		myself.putExtra(MODBUSGATEWAY, modbusgateway);
+		myself.putExtra(POLLTABLE, polltable);
+		myself.putExtra(REMOTEPORT, remoteport);
 		ctxt.startService(myself);
 	}
 
@@ -39,6 +88,26 @@ public class SercdService extends Service {
 	private String mSerialport;
 	private String mInterface;
 	private int mPort;
+	private int mLogLevel;
+	private String mHistory;
+	private boolean mWarmPort;
+	private String mSpool;
+	private String mSpoolFile;
+	private boolean mSpoolDropNewest;
+	private String mResume;
+	private String mHandoverPath;
+	private String mControlPath;
+	private String mProfileLimits;
+	private String mRealTime;
+	private String mBusyPoll;
+	private String mSchedQuantum;
+	private String mStatsPath;
+	private String mBridgeDevice;
+	private String mBridgeSettings;
+	private String mCaptureFile;
+	private String mModbusGateway;
+	private String mPollTable;
+	private String mRemotePort;
 	private NotificationManager mNotificationManager;
 	private Context mContext;
 	private PendingIntent mContentIntent;
@@ -48,7 +117,11 @@ public class SercdService extends Service {
 		@Override
 		public void run() {
 			//ChangeState(ProxyState.STATE_READY);
-			main(mSerialport, mInterface, mPort);
+			main(mSerialport, mInterface, mPort, mLogLevel, mHistory, mWarmPort, mSpool,
+				mSpoolFile, mSpoolDropNewest, mResume, mHandoverPath, mControlPath,
+				mProfileLimits, mRealTime, mBusyPoll, mSchedQuantum, mStatsPath,
+				mBridgeDevice, mBridgeSettings, mCaptureFile, mModbusGateway, mPollTable,
+				mRemotePort);
 			if (mExiting) {
 				ChangeState(ProxyState.STATE_STOPPED);
 			} else {
@@ -74,6 +147,26 @@ public class SercdService extends Service {
 		mSerialport = intent.getStringExtra(SERIALPORT);
 		mInterface = intent.getStringExtra(INTERFACE);
 		mPort = intent.getIntExtra(PORT, 0);
+		mLogLevel = intent.getIntExtra(LOGLEVEL, DEFAULT_LOGLEVEL);
+		mHistory = intent.getStringExtra(HISTORY);
+		mWarmPort = intent.getBooleanExtra(WARMPORT, false);
+		mSpool = intent.getStringExtra(SPOOL);
+		mSpoolFile = intent.getStringExtra(SPOOLFILE);
+		mSpoolDropNewest = intent.getBooleanExtra(SPOOLDROPNEWEST, false);
+		mResume = intent.getStringExtra(RESUME);
+		mHandoverPath = intent.getStringExtra(HANDOVERPATH);
+		mControlPath = intent.getStringExtra(CONTROLPATH);
+		mProfileLimits = intent.getStringExtra(PROFILELIMITS);
+		mRealTime = intent.getStringExtra(REALTIME);
+		mBusyPoll = intent.getStringExtra(BUSYPOLL);
+		mSchedQuantum = intent.getStringExtra(SCHEDQUANTUM);
+		mStatsPath = intent.getStringExtra(STATSPATH);
+		mBridgeDevice = intent.getStringExtra(BRIDGEDEVICE);
+		mBridgeSettings = intent.getStringExtra(BRIDGESETTINGS);
+		mCaptureFile = intent.getStringExtra(CAPTUREFILE);
+		mModbusGateway = intent.getStringExtra(MODBUSGATEWAY);
+		mPollTable = intent.getStringExtra(POLLTABLE);
+		mRemotePort = intent.getStringExtra(REMOTEPORT);
 		mSercdThread.start();
 	}
 
@@ -140,6 +233,22 @@ public class SercdService extends Service {
 		mState = newstate;
 	}
 
-	private native int main(String serialport, String netinterface, int port);
+	/**
+	 * Send a command to the running sercd.
+	 * @param command "stop", "drain", "stats", "kick" or "set <speed> [8N1]".
+	 * @return The reply of sercd.
+	 */
+	public String Control(String command) {
+		return control(command);
+	}
+
+	private native int main(String serialport, String netinterface, int port, int loglevel,
+			String history, boolean warmport, String spool, String spoolfile,
+			boolean spooldropnewest, String resume, String handoverpath,
+			String controlpath, String profilelimits, String realtime, String busypoll,
+			String schedquantum, String statspath, String bridgedevice,
+			String bridgesettings, String capturefile, String modbusgateway,
+			String polltable, String remoteport);
 	private native void exit();
+	private native String control(String command);
 }
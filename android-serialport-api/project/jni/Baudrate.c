@@ -0,0 +1,103 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include "Baudrate.h"
+
+#if defined(TCGETS2) && defined(BOTHER)
+#define HAVE_TERMIOS2
+typedef struct termios2 kernel_termios;
+#define GET_TERMIOS TCGETS2
+#define SET_TERMIOS TCSETS2
+#else
+typedef struct termios kernel_termios;
+#define GET_TERMIOS TCGETS
+#define SET_TERMIOS TCSETS
+#endif
+
+static int getSpeed(unsigned long baudrate)
+{
+	switch(baudrate) {
+	case 0: return B0;
+	case 50: return B50;
+	case 75: return B75;
+	case 110: return B110;
+	case 134: return B134;
+	case 150: return B150;
+	case 200: return B200;
+	case 300: return B300;
+	case 600: return B600;
+	case 1200: return B1200;
+	case 1800: return B1800;
+	case 2400: return B2400;
+	case 4800: return B4800;
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	case 500000: return B500000;
+	case 576000: return B576000;
+	case 921600: return B921600;
+	case 1000000: return B1000000;
+	case 1152000: return B1152000;
+	case 1500000: return B1500000;
+	case 2000000: return B2000000;
+	case 2500000: return B2500000;
+	case 3000000: return B3000000;
+	case 3500000: return B3500000;
+	case 4000000: return B4000000;
+	default: return -1;
+	}
+}
+
+int setBaudrate(int fd, unsigned long baudrate, unsigned long *actual)
+{
+	kernel_termios cfg;
+	int speed = getSpeed(baudrate);
+
+	if (ioctl(fd, GET_TERMIOS, &cfg))
+		return -1;
+
+	/* The input runs at the output rate */
+#ifdef CIBAUD
+	cfg.c_cflag &= ~(CBAUD | CIBAUD);
+#else
+	cfg.c_cflag &= ~CBAUD;
+#endif
+	if (speed != -1)
+		cfg.c_cflag |= speed;
+	else {
+#ifdef HAVE_TERMIOS2
+		cfg.c_cflag |= BOTHER;
+		cfg.c_ispeed = cfg.c_ospeed = baudrate;
+#else
+		return -1;
+#endif
+	}
+	if (ioctl(fd, SET_TERMIOS, &cfg))
+		return -1;
+
+	*actual = baudrate;
+#ifdef HAVE_TERMIOS2
+	/* The driver stores the rate it could really set */
+	if (speed == -1 && ioctl(fd, GET_TERMIOS, &cfg) == 0)
+		*actual = cfg.c_ospeed;
+#endif
+	return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SERIALPORT_BAUDRATE_H
+#define _SERIALPORT_BAUDRATE_H
+
+/*
+ * Set the input and output rate of the port fd to baudrate bps, keeping
+ * its other settings. Rates without a Bxxx constant go through termios2
+ * where the kernel has it. Returns 0 and stores the rate the driver set
+ * in *actual, or -1 if the rate can't be set.
+ *
+ * Only plain types here: the kernel termios used inside can't be mixed
+ * with <termios.h>.
+ */
+int setBaudrate(int fd, unsigned long baudrate, unsigned long *actual);
+
+#endif
@@ -23,6 +23,7 @@
 #include <jni.h>
 
 #include "SerialPort.h"
+#include "Baudrate.h"
 
 #include "android/log.h"
 static const char *TAG="serial_port";
@@ -30,44 +31,6 @@ static const char *TAG="serial_port";
 #define LOGD(fmt, args...) __android_log_print(ANDROID_LOG_DEBUG, TAG, fmt, ##args)
 #define LOGE(fmt, args...) __android_log_print(ANDROID_LOG_ERROR, TAG, fmt, ##args)
 
-static speed_t getBaudrate(jint baudrate)
-{
-	switch(baudrate) {
-	case 0: return B0;
-	case 50: return B50;
-	case 75: return B75;
-	case 110: return B110;
-	case 134: return B134;
-	case 150: return B150;
-	case 200: return B200;
-	case 300: return B300;
-	case 600: return B600;
-	case 1200: return B1200;
-	case 1800: return B1800;
-	case 2400: return B2400;
-	case 4800: return B4800;
-	case 9600: return B9600;
-	case 19200: return B19200;
-	case 38400: return B38400;
-	case 57600: return B57600;
-	case 115200: return B115200;
-	case 230400: return B230400;
-	case 460800: return B460800;
-	case 500000: return B500000;
-	case 576000: return B576000;
-	case 921600: return B921600;
-	case 1000000: return B1000000;
-	case 1152000: return B1152000;
-	case 1500000: return B1500000;
-	case 2000000: return B2000000;
-	case 2500000: return B2500000;
-	case 3000000: return B3000000;
-	case 3500000: return B3500000;
-	case 4000000: return B4000000;
-	default: return -1;
-	}
-}
-
 /*
  * Class:     android_serialport_SerialPort
  * Method:    open
@@ -77,13 +40,12 @@ JNIEXPORT jobject JNICALL Java_android_1serialport_1api_SerialPort_open
   (JNIEnv *env, jclass thiz, jstring path, jint baudrate, jint flags)
 {
 	int fd;
-	speed_t speed;
+	unsigned long speed;
 	jobject mFileDescriptor;
 
 	/* Check arguments */
 	{
-		speed = getBaudrate(baudrate);
-		if (speed == -1) {
+		if (baudrate < 0) {
 			/* TODO: throw an exception */
 			LOGE("Invalid baudrate");
 			return NULL;
@@ -120,8 +82,6 @@ JNIEXPORT jobject JNICALL Java_android_1serialport_1api_SerialPort_open
 		}
 
 		cfmakeraw(&cfg);
-		cfsetispeed(&cfg, speed);
-		cfsetospeed(&cfg, speed);
 
 		if (tcsetattr(fd, TCSANOW, &cfg))
 		{
@@ -130,6 +90,17 @@ JNIEXPORT jobject JNICALL Java_android_1serialport_1api_SerialPort_open
 			/* TODO: throw an exception */
 			return NULL;
 		}
+
+		/* Any rate the driver can do, not only the standard ones */
+		if (setBaudrate(fd, baudrate, &speed))
+		{
+			LOGE("Invalid baudrate");
+			close(fd);
+			/* TODO: throw an exception */
+			return NULL;
+		}
+		if (speed != (unsigned long)baudrate)
+			LOGI("Baudrate %d requested, port runs at %lu", baudrate, speed);
 	}
 
 	/* Create a corresponding file descriptor */